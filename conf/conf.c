@@ -100,6 +100,8 @@ config_alloc(byte *name)
   c->tf_route = c->tf_proto = (struct timeformat){"%T", "%F", 20*3600};
   c->tf_base = c->tf_log = (struct timeformat){"%F %T", NULL, 0};
   c->gr_wait = DEFAULT_GR_WAIT;
+  c->hook_proc_limit = HOOK_PROC_LIMIT;
+  c->hook_queue_limit = HOOK_QUEUE_LIMIT;
 
   return c;
 }
@@ -490,6 +492,7 @@ order_shutdown(void)
 
   hook_run (HOOK_SHUTDOWN, c, NULL, NULL);
 
+  rt_snapshot_shutdown();
   config_commit(c, RECONFIG_HARD, 0);
   shutting_down = 1;
 }
@@ -57,6 +57,8 @@ struct config {
   int shutdown;				/* This is a pseudo-config for daemon shutdown */
   bird_clock_t load_time;		/* When we've got this configuration */
   struct glob_hook hooks[MAX_HOOKS];
+  u32 hook_proc_limit;			/* Maximum number of running asynchronous hooks */
+  u32 hook_queue_limit;			/* Maximum number of asynchronous hooks waiting to run */
 };
 
 /* Please don't use these variables in protocols. Use proto_config->global instead. */
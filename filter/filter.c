@@ -21,6 +21,11 @@
  * arguments (@a1, @a2). Some instructions contain pointer(s) to other
  * instructions in their (@a1, @a2) fields.
  *
+ * Named and inline filters are then compiled by f_compile() to a flat
+ * array of operations on a value stack, which is what f_run() executes.
+ * The tree is kept for comparison of filters on reconfiguration and for
+ * evaluation of standalone expressions.
+ *
  * Filters use a &f_val structure for their data. Each &f_val
  * contains type and value (types are constants prefixed with %T_). Few
  * of the types are special; %T_RETURN can be or-ed with a type to indicate
@@ -39,6 +44,7 @@
 #include "lib/socket.h"
 #include "lib/string.h"
 #include "lib/unaligned.h"
+#include "lib/alloca.h"
 #include "nest/route.h"
 #include "nest/protocol.h"
 #include "nest/iface.h"
@@ -478,6 +484,18 @@ static struct linpool *f_pool;
 static struct buffer f_buf;
 static int f_flags;
 
+/*
+ * Saved reads of extended attributes (see f_optimize()) are valid in one
+ * run of the filter or function body which made them, numbered by f_run()
+ * and by calls.
+ */
+struct f_attr_slot {
+  struct f_val val;
+  u64 run;				/* Body run in which @val was read */
+};
+
+static u64 f_body_run, f_body_runs;
+
 static inline void f_rte_cow(void)
 {
   *f_rte = rte_cow(*f_rte); 
@@ -521,7 +539,7 @@ static struct tbf rl_runtime_err = TBF_DEFAULT_LOG_LIMITS;
   } while(0)
 
 #define ARG(x,y) \
-	x = interpret(what->y); \
+	x = args ? *args++ : interpret(what->y); \
 	if (x.type & T_RETURN) \
 		return x;
 
@@ -534,25 +552,151 @@ static struct tbf rl_runtime_err = TBF_DEFAULT_LOG_LIMITS;
 #define ACCESS_RTE \
   do { if (!f_rte) runtime("No route to access"); } while (0)
 
+static struct f_val interpret(struct f_inst *what);
+
+/*
+ * f_rta_get - read a static attribute of the route
+ * @res: value, with the type of the attribute already set
+ * @sa: attribute, SA_*
+ */
+static void
+f_rta_get(struct f_val *res, uint sa)
+{
+  struct rta *rta = (*f_rte)->attrs;
+
+  switch (sa)
+  {
+  case SA_FROM:		res->val.px.ip = rta->from; break;
+  case SA_GW:		res->val.px.ip = rta->gw; break;
+  case SA_NET:		res->val.px.ip = (*f_rte)->net->n.prefix;
+			res->val.px.len = (*f_rte)->net->n.pxlen; break;
+  case SA_PROTO:	res->val.s = rta->src->proto->name; break;
+  case SA_EXPROTO:	res->val.s = f_eproto ? f_eproto->name : ""; break;
+  case SA_SOURCE:	res->val.i = rta->source; break;
+  case SA_SCOPE:	res->val.i = rta->scope; break;
+  case SA_CAST:		res->val.i = rta->cast; break;
+  case SA_DEST:		res->val.i = rta->dest; break;
+  case SA_IFNAME:	res->val.s = rta->iface ? rta->iface->name : ""; break;
+  case SA_IFINDEX:	res->val.i = rta->iface ? rta->iface->index : 0; break;
+  case SA_LATENCY:	res->val.i = f_eproto ? f_eproto->cf->link_latency : (uint)rta->src->proto->cf->link_latency; break;
+  case SA_BANDWIDTH:	res->val.i = f_eproto ? f_eproto->cf->link_bandwidth : (uint)rta->src->proto->cf->link_bandwidth; break;
+  case SA_SECURITY:	res->val.i = f_eproto ? f_eproto->cf->link_security : (uint)rta->src->proto->cf->link_security; break;
+  case SA_REMOTE_AS:	bgp_proc_sa_ras(res, f_eproto ? f_eproto : rta->src->proto ); break;
+  case SA_LOCAL_AS:	bgp_proc_sa_las(res, f_eproto ? f_eproto : rta->src->proto ); break;
+
+  default:
+    bug("Invalid static attribute access (%x)", sa);
+  }
+}
+
+/*
+ * f_ea_get - read an extended attribute of the route
+ * @res: value
+ * @code: attribute, EA_CODE()
+ * @type: its type, EAF_TYPE_*
+ */
+static void
+f_ea_get(struct f_val *res, u32 code, uint type)
+{
+  eattr *e = NULL;
+
+  if (!(f_flags & FF_FORCE_TMPATTR))
+    e = ea_find( (*f_rte)->attrs->eattrs, code );
+  if (!e)
+    e = ea_find( (*f_tmp_attrs), code );
+  if ((!e) && (f_flags & FF_FORCE_TMPATTR))
+    e = ea_find( (*f_rte)->attrs->eattrs, code );
+
+  if (!e) {
+    /* A special case: undefined int_set looks like empty int_set */
+    if ((type & EAF_TYPE_MASK) == EAF_TYPE_INT_SET) {
+      res->type = T_CLIST;
+      res->val.ad = adata_empty(f_pool, 0);
+      return;
+    }
+    /* The same special case for ec_set */
+    else if ((type & EAF_TYPE_MASK) == EAF_TYPE_EC_SET) {
+      res->type = T_ECLIST;
+      res->val.ad = adata_empty(f_pool, 0);
+      return;
+    }
+
+    /* Undefined value */
+    res->type = T_VOID;
+    return;
+  }
+
+  switch (type & EAF_TYPE_MASK) {
+  case EAF_TYPE_INT:
+    res->type = T_INT;
+    res->val.i = e->u.data;
+    break;
+  case EAF_TYPE_ROUTER_ID:
+    res->type = T_QUAD;
+    res->val.i = e->u.data;
+    break;
+  case EAF_TYPE_OPAQUE:
+    res->type = T_ENUM_EMPTY;
+    res->val.i = 0;
+    break;
+  case EAF_TYPE_IP_ADDRESS:
+    res->type = T_IP;
+    res->val.px.ip = * (ip_addr *) ((struct adata *) e->u.ptr)->data;
+    break;
+  case EAF_TYPE_AS_PATH:
+    res->type = T_PATH;
+    res->val.ad = e->u.ptr;
+    break;
+  case EAF_TYPE_INT_SET:
+    res->type = T_CLIST;
+    res->val.ad = e->u.ptr;
+    break;
+  case EAF_TYPE_EC_SET:
+    res->type = T_ECLIST;
+    res->val.ad = e->u.ptr;
+    break;
+  case EAF_TYPE_UNDEF:
+    res->type = T_VOID;
+    break;
+  default:
+    bug("Unknown type in e,a");
+  }
+}
+
+/* f_ea_get() with the value saved in @s for the rest of the body run */
+static inline void
+f_ea_get_saved(struct f_val *res, struct f_attr_slot *s, u32 code, uint type)
+{
+  if (s->run != f_body_run)
+  {
+    f_ea_get(&s->val, code, type);
+    s->run = f_body_run;
+  }
+  *res = s->val;
+}
+
 /**
- * interpret
- * @what: filter to interpret
+ * interpret_op
+ * @what: instruction to execute
+ * @args: values of its arguments, or %NULL
  *
- * Interpret given tree of filter instructions. This is core function
- * of filter system and does all the hard work.
+ * Execute one filter instruction. This is core function of filter
+ * system and does all the hard work.
  *
  * Each instruction has 4 fields: code (which is instruction code),
  * aux (which is extension to instruction code, typically type),
  * arg1 and arg2 - arguments. Depending on instruction, arguments
  * are either integers, or pointers to instruction trees. Common 
  * instructions like +, that have two expressions as arguments use
- * TWOARGS macro to get both of them evaluated.
+ * TWOARGS macro to get both of them evaluated, either by interpret(),
+ * or taken from @args in the order of evaluation when the instruction
+ * is run by the bytecode interpreter.
  *
  * &f_val structures are copied around, so there are no problems with
  * memory managment.
  */
 static struct f_val
-interpret(struct f_inst *what)
+interpret_op(struct f_inst *what, struct f_val *args)
 {
   struct symbol *sym;
   struct f_val v1, v2, res, *vp;
@@ -561,8 +705,6 @@ interpret(struct f_inst *what)
   u32 as;
 
   res.type = T_VOID;
-  if (!what)
-    return res;
 
   switch(what->code) {
   case ',':
@@ -812,35 +954,9 @@ interpret(struct f_inst *what)
     }
     break;
   case 'a':	/* rta access */
-    {
-      ACCESS_RTE;
-      struct rta *rta = (*f_rte)->attrs;
-      res.type = what->aux;
-
-      switch (what->a2.i)
-      {
-      case SA_FROM:	res.val.px.ip = rta->from; break;
-      case SA_GW:	res.val.px.ip = rta->gw; break;
-      case SA_NET:	res.val.px.ip = (*f_rte)->net->n.prefix;
-			res.val.px.len = (*f_rte)->net->n.pxlen; break;
-      case SA_PROTO:	res.val.s = rta->src->proto->name; break;
-      case SA_EXPROTO:	res.val.s = f_eproto ? f_eproto->name : ""; break;
-      case SA_SOURCE:	res.val.i = rta->source; break;
-      case SA_SCOPE:	res.val.i = rta->scope; break;
-      case SA_CAST:	res.val.i = rta->cast; break;
-      case SA_DEST:	res.val.i = rta->dest; break;
-      case SA_IFNAME:	res.val.s = rta->iface ? rta->iface->name : ""; break;
-      case SA_IFINDEX:	res.val.i = rta->iface ? rta->iface->index : 0; break;
-      case SA_LATENCY:	res.val.i = f_eproto ? f_eproto->cf->link_latency : (uint)rta->src->proto->cf->link_latency; break;
-      case SA_BANDWIDTH:res.val.i = f_eproto ? f_eproto->cf->link_bandwidth : (uint)rta->src->proto->cf->link_bandwidth; break;
-      case SA_SECURITY:	res.val.i = f_eproto ? f_eproto->cf->link_security : (uint)rta->src->proto->cf->link_security; break;
-      case SA_REMOTE_AS:bgp_proc_sa_ras(&res, f_eproto ? f_eproto : rta->src->proto ); break;
-      case SA_LOCAL_AS:	bgp_proc_sa_las(&res, f_eproto ? f_eproto : rta->src->proto ); break;
-
-      default:
-	bug("Invalid static attribute access (%x)", res.type);
-      }
-    }
+    ACCESS_RTE;
+    res.type = what->aux;
+    f_rta_get(&res, what->a2.i);
     break;
   case P('a','S'):
     ACCESS_RTE;
@@ -899,71 +1015,11 @@ interpret(struct f_inst *what)
     break;
   case P('e','a'):	/* Access to extended attributes */
     ACCESS_RTE;
-    {
-      eattr *e = NULL;
-      if (!(f_flags & FF_FORCE_TMPATTR))
-	e = ea_find( (*f_rte)->attrs->eattrs, what->a2.i );
-      if (!e) 
-	e = ea_find( (*f_tmp_attrs), what->a2.i );
-      if ((!e) && (f_flags & FF_FORCE_TMPATTR))
-	e = ea_find( (*f_rte)->attrs->eattrs, what->a2.i );
-
-      if (!e) {
-	/* A special case: undefined int_set looks like empty int_set */
-	if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_INT_SET) {
-	  res.type = T_CLIST;
-	  res.val.ad = adata_empty(f_pool, 0);
-	  break;
-	}
-	/* The same special case for ec_set */
-	else if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_EC_SET) {
-	  res.type = T_ECLIST;
-	  res.val.ad = adata_empty(f_pool, 0);
-	  break;
-	}
-
-	/* Undefined value */
-	res.type = T_VOID;
-	break;
-      }
-
-      switch (what->aux & EAF_TYPE_MASK) {
-      case EAF_TYPE_INT:
-	res.type = T_INT;
-	res.val.i = e->u.data;
-	break;
-      case EAF_TYPE_ROUTER_ID:
-	res.type = T_QUAD;
-	res.val.i = e->u.data;
-	break;
-      case EAF_TYPE_OPAQUE:
-	res.type = T_ENUM_EMPTY;
-	res.val.i = 0;
-	break;
-      case EAF_TYPE_IP_ADDRESS:
-	res.type = T_IP;
-	struct adata * ad = e->u.ptr;
-	res.val.px.ip = * (ip_addr *) ad->data;
-	break;
-      case EAF_TYPE_AS_PATH:
-        res.type = T_PATH;
-	res.val.ad = e->u.ptr;
-	break;
-      case EAF_TYPE_INT_SET:
-	res.type = T_CLIST;
-	res.val.ad = e->u.ptr;
-	break;
-      case EAF_TYPE_EC_SET:
-	res.type = T_ECLIST;
-	res.val.ad = e->u.ptr;
-	break;
-      case EAF_TYPE_UNDEF:
-	res.type = T_VOID;
-	break;
-      default:
-	bug("Unknown type in e,a");
-      }
-    }
+    f_ea_get(&res, what->a2.i, what->aux);
+    break;
+  case P('e','c'):	/* Extended attribute read at most once in a body run */
+    ACCESS_RTE;
+    f_ea_get_saved(&res, what->a1.p, what->a2.i, what->aux);
     break;
   case P('e','S'):
     ACCESS_RTE;
@@ -1107,7 +1163,12 @@ interpret(struct f_inst *what)
     return res;
   case P('c','a'): /* CALL: this is special: if T_RETURN and returning some value, mask it out  */
     ONEARG;
-    res = interpret(what->a2.p);
+    {
+      u64 run = f_body_run;
+      f_body_run = ++f_body_runs;
+      res = interpret(what->a2.p);
+      f_body_run = run;
+    }
     if (res.type == T_RETURN)
       return res;
     res.type &= ~T_RETURN;    
@@ -1325,8 +1386,30 @@ interpret(struct f_inst *what)
   default:
     bug( "Unknown instruction %d (%c)", what->code, what->code & 0xff);
   }
-  if (what->next)
-    return interpret(what->next);
+  return res;
+}
+
+/**
+ * interpret
+ * @what: filter to interpret
+ *
+ * Interpret given tree of filter instructions. The instructions of the
+ * list are executed in sequence, until one of them returns, and the
+ * value of the last one is returned.
+ */
+static struct f_val
+interpret(struct f_inst *what)
+{
+  struct f_val res;
+
+  res.type = T_VOID;
+  for (; what; what = what->next)
+    {
+      res = interpret_op(what, NULL);
+      if (res.type & T_RETURN)
+	break;
+    }
+
   return res;
 }
 
@@ -1430,6 +1513,7 @@ i_same(struct f_inst *f1, struct f_inst *f2)
   case 'P':
   case 'a': A2_SAME; break;
   case P('e','a'): A2_SAME; break;
+  case P('e','c'): A2_SAME; break;
   case P('P','S'):
   case P('a','S'):
   case P('e','S'): ONEARG; A2_SAME; break;
@@ -1463,6 +1547,1269 @@ i_same(struct f_inst *f1, struct f_inst *f2)
   return i_same(f1->next, f2->next);
 }
 
+#define F_PURE_DEPTH 16
+
+static int
+i_rta_pure(struct f_inst *f, int depth)
+{
+  if (depth > F_PURE_DEPTH)
+    return 0;
+
+  for (; f; f = f->next)
+    switch(f->code) {
+    case ',':
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '|':
+    case '&':
+    case P('m','p'):
+    case P('m','c'):
+    case P('!','='):
+    case P('=','='):
+    case '<':
+    case P('<','='):
+    case P('!', '~'):
+    case '~':
+    case '?':
+    case P('i','M'):
+    case P('A','p'):
+    case P('C','a'):
+      if (!i_rta_pure(f->a1.p, depth) || !i_rta_pure(f->a2.p, depth))
+	return 0;
+      break;
+
+    case '!':
+    case P('d','e'):
+    case 'L':
+    case 'r':
+    case P('c','p'):
+    case P('a','f'):
+    case P('a','l'):
+    case P('a','L'):
+      if (!i_rta_pure(f->a1.p, depth))
+	return 0;
+      break;
+
+    case 's':
+      if (!i_rta_pure(f->a2.p, depth))
+	return 0;
+      break;
+
+    case 'c': case 'C': case 'V': case '0': case 'E':
+    case P('c','v'):
+    case P('e','a'):	/* Temporary attributes are checked by the caller */
+    case P('e','c'):
+      break;
+
+    case 'a':
+      if (f->a2.i == SA_NET)
+	return 0;
+      break;
+
+    case P('p',','):	/* Plain accept or reject, nothing printed */
+      if (f->a1.p || ((f->a2.i != F_ACCEPT) && (f->a2.i != F_REJECT)))
+	return 0;
+      break;
+
+    case P('c','a'):
+      if (!i_rta_pure(f->a1.p, depth) || !i_rta_pure(f->a2.p, depth + 1))
+	return 0;
+      break;
+
+    default:		/* Preference, setters, prints, switches, ROA checks */
+      return 0;
+    }
+
+  return 1;
+}
+
+/**
+ * f_rta_pure - check whether a filter depends only on route attributes
+ * @filter: filter to check
+ *
+ * Returns 1 if the verdict of @filter is given by the &rta and the
+ * temporary attributes of a route, so that it may be reused for other
+ * routes sharing them, and if running the filter has no side effects.
+ * Like filter_same(), it rather says 0 on a pure filter than 1 on an
+ * impure one.
+ */
+int
+f_rta_pure(struct filter *filter)
+{
+  if (filter == FILTER_ACCEPT || filter == FILTER_REJECT)
+    return 1;
+  return i_rta_pure(filter->root, 0);
+}
+
+/* Network covering all routes for which @f is true, 0 if not known */
+static int
+i_prefix_cover(struct f_inst *f, ip_addr *px, int *plen)
+{
+  struct f_inst *a, *b;
+  ip_addr px2;
+  int plen2, l, h;
+
+  switch (f->code) {
+  case '&':
+    if (!i_prefix_cover(f->a1.p, px, plen))
+      return i_prefix_cover(f->a2.p, px, plen);
+    if (i_prefix_cover(f->a2.p, &px2, &plen2) && (plen2 > *plen))
+      *px = px2, *plen = plen2;
+    return 1;
+
+  case '|':
+    if (!i_prefix_cover(f->a1.p, px, plen) || !i_prefix_cover(f->a2.p, &px2, &plen2))
+      return 0;
+    *plen = MIN(MIN(*plen, plen2), ipa_pxlen(*px, px2));
+    *px = ipa_and(*px, ipa_mkmask(*plen));
+    return 1;
+
+  case '~':
+    a = f->a1.p;
+    b = f->a2.p;
+    if (a->next || (a->code != 'a') || (a->a2.i != SA_NET) || b->next)
+      return 0;
+
+    if ((b->code == 'c') && (b->aux == T_PREFIX_SET))
+    {
+      trie_cover(b->a2.p, px, plen);
+      return 1;
+    }
+
+    if ((b->code == 'C') && (((struct f_val *) b->a1.p)->type == T_PREFIX_SET))
+    {
+      trie_cover(((struct f_val *) b->a1.p)->val.ti, px, plen);
+      return 1;
+    }
+
+    if ((b->code == 'C') && (((struct f_val *) b->a1.p)->type == T_PREFIX))
+    {
+      struct f_prefix *p = &((struct f_val *) b->a1.p)->val.px;
+      fprefix_get_bounds(p, &l, &h);
+      *plen = MIN(p->len & LEN_MASK, l);
+      *px = ipa_and(p->ip, ipa_mkmask(*plen));
+      return 1;
+    }
+
+    return 0;
+
+  default:
+    return 0;
+  }
+}
+
+/**
+ * f_prefix_cover - find networks a filter may accept
+ * @filter: filter to check
+ * @px: place for the address of the covering network
+ * @plen: place for its length
+ *
+ * Returns 1 if @filter rejects all routes for networks outside of the one
+ * stored to @px and @plen, so that a walk over a routing table may skip
+ * them. Only filters of the form 'if term then ...; reject;' are examined,
+ * as built by the 'where' clause, with the term matching 'net' against
+ * prefix patterns or sets. Returns 0 otherwise.
+ */
+int
+f_prefix_cover(struct filter *filter, ip_addr *px, int *plen)
+{
+  struct f_inst *f;
+
+  if (filter == FILTER_ACCEPT || filter == FILTER_REJECT)
+    return 0;
+
+  f = filter->root;
+  if (!f || (f->code != '?') || !f->next || f->next->next ||
+      (f->next->code != P('p',',')) || (f->next->a2.i != F_REJECT))
+    return 0;
+
+  return i_prefix_cover(f->a1.p, px, plen);
+}
+
+/*
+ *	Filter bytecode
+ *
+ * Filters defined in the configuration are compiled by f_compile() to a
+ * flat array of &f_op, executed by f_exec() on a stack of values. Control
+ * flow of conditions, boolean operators, CASE and function calls is
+ * resolved to jumps, constants and variables are pushed directly and the
+ * common comparisons are done in place. Reads of route attributes, matches
+ * against constant sets and changes of community lists have their own
+ * operations with the attribute, set or operator resolved at compile time.
+ * Other instructions are run by interpret_op() with their arguments
+ * already evaluated on the stack, so the semantics of both interpreters
+ * stay the same. Function bodies are compiled once for each filter, after
+ * its main code.
+ */
+
+#define FO_END		0	/* Return the value on top of stack */
+#define FO_CONST	1	/* Push a constant */
+#define FO_LOAD		2	/* Push the value of a variable */
+#define FO_POP		3	/* Drop the value on top of stack */
+#define FO_INST		4	/* Run an instruction with @argc arguments */
+#define FO_SAME		5	/* Test two values for (in)equality */
+#define FO_COMPARE	6	/* Compare two values */
+#define FO_JUMP		7
+#define FO_IF		8	/* Condition of IF, jump if false */
+#define FO_BOOL		9	/* First operand of & or |, jump if it decides */
+#define FO_BOOL2	10	/* Second operand of & or | */
+#define FO_CALL		11	/* Call a function at @target */
+#define FO_SWITCH	12	/* Jump to the matching branch of CASE */
+#define FO_RTA		13	/* Push static attribute @attr of type @aux */
+#define FO_EA		14	/* Push extended attribute @attr of type @aux, saved in @slot */
+#define FO_MATCH	15	/* Test the value on top of stack against a constant set */
+#define FO_CLIST	16	/* Add to or delete from a (extended) community list */
+
+struct f_op {
+  byte code;				/* FO_* */
+  byte argc;				/* Arguments of FO_INST */
+  u16 aux;				/* Operator of FO_SAME, FO_COMPARE, FO_BOOL, FO_MATCH and FO_CLIST, type of FO_RTA and FO_EA */
+  uint target;				/* Jump target */
+  u32 attr;				/* Attribute of FO_RTA and FO_EA */
+  struct f_inst *inst;			/* Source instruction */
+  union {
+    struct f_val val;			/* FO_CONST, set of FO_MATCH */
+    struct f_val *var;			/* FO_LOAD */
+    struct f_tree *tree;		/* FO_SWITCH, with targets in data */
+    struct f_attr_slot *slot;		/* FO_EA of saved reads, or NULL */
+  } u;
+};
+
+struct f_code {
+  struct f_op *op;
+  uint len;
+  uint depth;				/* Maximal depth of stack */
+};
+
+struct f_compiler {
+  struct f_op *op;
+  uint len, size;
+  uint depth, max_depth;
+  struct f_inst **calls;		/* Called function bodies, compiled later */
+  uint calls_len, calls_size;
+};
+
+static uint
+fc_emit(struct f_compiler *c, uint code, struct f_inst *inst, int pop, int push)
+{
+  struct f_op *op;
+
+  if (c->len == c->size)
+    {
+      c->size = c->size ? 2 * c->size : 64;
+      c->op = xrealloc(c->op, c->size * sizeof(struct f_op));
+    }
+
+  op = &c->op[c->len];
+  memset(op, 0, sizeof(struct f_op));
+  op->code = code;
+  op->inst = inst;
+
+  c->depth += push - pop;
+  c->max_depth = MAX(c->max_depth, c->depth);
+  return c->len++;
+}
+
+static void fc_chain(struct f_compiler *c, struct f_inst *what);
+
+/* Arguments of instructions run by interpret_op(), bit 0 for a1, bit 1 for a2 */
+static int
+fc_args(struct f_inst *what)
+{
+  switch (what->code)
+  {
+  case ',':
+  case '+':
+  case '-':
+  case '*':
+  case '/':
+  case P('m','p'):
+  case P('m','c'):
+  case '~':
+  case P('!','~'):
+  case P('i','M'):
+  case P('A','p'):
+    return 3;
+
+  case '!':
+  case P('d','e'):
+  case 'p':
+  case P('p',','):
+  case P('a','S'):
+  case P('e','S'):
+  case P('P','S'):
+  case 'L':
+  case P('c','p'):
+  case P('a','f'):
+  case P('a','l'):
+  case 'r':
+    return 1;
+
+  case 's':
+    return 2;
+
+  case P('R','C'):
+    return what->arg1 ? 3 : 0;
+
+  default:
+    return 0;
+  }
+}
+
+/* Instruction run by interpret_op() */
+static void
+fc_op(struct f_compiler *c, struct f_inst *what)
+{
+  int args = fc_args(what);
+  uint i, j;
+
+  if (args & 1)
+    fc_chain(c, what->a1.p);
+  if (args & 2)
+    fc_chain(c, what->a2.p);
+
+  j = (args & 1) + !!(args & 2);
+  i = fc_emit(c, FO_INST, what, j, 1);
+  c->op[i].argc = j;
+}
+
+/* Constant prefix set or set of values, tested by FO_MATCH */
+static int
+fc_const_set(struct f_inst *what)
+{
+  return what && !what->next && (what->code == 'c') &&
+    ((what->aux == T_PREFIX_SET) || (what->aux == T_SET));
+}
+
+static struct f_tree *
+fc_switch_tree(struct f_compiler *c, struct f_tree *t, uint base, uint *jumps, uint *jumps_len)
+{
+  struct f_tree *n;
+  uint i;
+
+  if (!t)
+    return NULL;
+
+  n = cfg_alloc(sizeof(struct f_tree));
+  *n = *t;
+  n->left = fc_switch_tree(c, t->left, base, jumps, jumps_len);
+  n->right = fc_switch_tree(c, t->right, base, jumps, jumps_len);
+
+  /* Items of one branch share its commands */
+  for (i = 0; i < *jumps_len; i++)
+    if (c->op[jumps[i]].inst == t->data)
+      {
+	n->data = (void *) (uintptr_t) c->op[jumps[i]].target;
+	return n;
+      }
+
+  c->depth = base;
+  n->data = (void *) (uintptr_t) c->len;
+  fc_chain(c, t->data);
+
+  i = fc_emit(c, FO_JUMP, t->data, 0, 0);
+  c->op[i].target = (uint) (uintptr_t) n->data;	/* Branch entry until patched */
+  jumps[(*jumps_len)++] = i;
+  return n;
+}
+
+static uint
+fc_tree_size(struct f_tree *t)
+{
+  return t ? 1 + fc_tree_size(t->left) + fc_tree_size(t->right) : 0;
+}
+
+static void
+fc_inst(struct f_compiler *c, struct f_inst *what)
+{
+  struct f_val *v;
+  uint i, j, base;
+
+  switch (what->code)
+  {
+  case 'c':
+    i = fc_emit(c, FO_CONST, what, 0, 1);
+    v = &c->op[i].u.val;
+    v->type = what->aux;
+    if (v->type == T_PREFIX_SET)
+      v->val.ti = what->a2.p;
+    else if (v->type == T_SET)
+      v->val.t = what->a2.p;
+    else if (v->type == T_STRING)
+      v->val.s = what->a2.p;
+    else
+      v->val.i = what->a2.i;
+    break;
+
+  case 'C':
+  case 'V':
+    i = fc_emit(c, FO_LOAD, what, 0, 1);
+    c->op[i].u.var = what->a1.p;
+    break;
+
+  case P('=','='):
+  case P('!','='):
+  case '<':
+  case P('<','='):
+    fc_chain(c, what->a1.p);
+    fc_chain(c, what->a2.p);
+    i = fc_emit(c, ((what->code == '<') || (what->code == P('<','='))) ? FO_COMPARE : FO_SAME, what, 2, 1);
+    c->op[i].aux = what->code;
+    break;
+
+  case '&':
+  case '|':
+    fc_chain(c, what->a1.p);
+    i = fc_emit(c, FO_BOOL, what, 1, 0);
+    c->op[i].aux = what->code;
+    fc_chain(c, what->a2.p);
+    fc_emit(c, FO_BOOL2, what, 0, 0);
+    c->op[i].target = c->len;
+    break;
+
+  case '?':
+    fc_chain(c, what->a1.p);
+    i = fc_emit(c, FO_IF, what, 1, 0);
+    fc_chain(c, what->a2.p);
+    fc_emit(c, FO_POP, what, 1, 0);
+    j = fc_emit(c, FO_CONST, what, 0, 1);
+    c->op[j].u.val.type = T_BOOL;
+    c->op[j].u.val.val.i = 0;
+    c->op[i].target = c->len;
+    break;
+
+  case P('c','a'):
+    fc_chain(c, what->a1.p);
+    fc_emit(c, FO_POP, what, 1, 0);
+    for (j = 0; j < c->calls_len; j++)
+      if (c->calls[j] == what->a2.p)
+	break;
+    if (j == c->calls_len)
+      {
+	if (c->calls_len == c->calls_size)
+	  {
+	    c->calls_size = c->calls_size ? 2 * c->calls_size : 8;
+	    c->calls = xrealloc(c->calls, c->calls_size * sizeof(struct f_inst *));
+	  }
+	c->calls[c->calls_len++] = what->a2.p;
+      }
+    i = fc_emit(c, FO_CALL, what, 0, 1);
+    c->op[i].target = j;		/* Index of the body until patched */
+    break;
+
+  case P('S','W'):
+    {
+      uint size = fc_tree_size(what->a2.p);
+      uint *jumps = alloca(size * sizeof(uint));
+      uint jumps_len = 0;
+
+      fc_chain(c, what->a1.p);
+      i = fc_emit(c, FO_SWITCH, what, 1, 0);
+      base = c->depth;
+      c->op[i].u.tree = fc_switch_tree(c, what->a2.p, base, jumps, &jumps_len);
+      c->op[i].target = c->len;
+      for (j = 0; j < jumps_len; j++)
+	c->op[jumps[j]].target = c->len;
+      c->depth = base + 1;
+    }
+    break;
+
+  case 'a':
+  case P('e','a'):
+  case P('e','c'):
+    i = fc_emit(c, (what->code == 'a') ? FO_RTA : FO_EA, what, 0, 1);
+    c->op[i].aux = what->aux;
+    c->op[i].attr = what->a2.i;
+    if (what->code == P('e','c'))
+      c->op[i].u.slot = what->a1.p;
+    break;
+
+  case '~':
+  case P('!','~'):
+    if (!fc_const_set(what->a2.p))
+    {
+      fc_op(c, what);
+      break;
+    }
+    fc_chain(c, what->a1.p);
+    i = fc_emit(c, FO_MATCH, what, 1, 1);
+    c->op[i].aux = what->code;
+    v = &c->op[i].u.val;
+    v->type = ((struct f_inst *) what->a2.p)->aux;
+    if (v->type == T_PREFIX_SET)
+      v->val.ti = ((struct f_inst *) what->a2.p)->a2.p;
+    else
+      v->val.t = ((struct f_inst *) what->a2.p)->a2.p;
+    break;
+
+  case P('C','a'):
+    fc_chain(c, what->a1.p);
+    fc_chain(c, what->a2.p);
+    i = fc_emit(c, FO_CLIST, what, 2, 1);
+    c->op[i].aux = what->aux;
+    break;
+
+  default:
+    fc_op(c, what);
+  }
+}
+
+static void
+fc_chain(struct f_compiler *c, struct f_inst *what)
+{
+  if (!what)
+    {
+      uint i = fc_emit(c, FO_CONST, NULL, 0, 1);
+      c->op[i].u.val.type = T_VOID;
+      return;
+    }
+
+  for (; what; what = what->next)
+    {
+      fc_inst(c, what);
+      if (what->next)
+	fc_emit(c, FO_POP, what, 1, 0);
+    }
+}
+
+/**
+ * f_compile - compile a filter
+ * @root: instructions of the filter
+ *
+ * Lowers the tree of instructions of a filter to bytecode run by f_run().
+ * Called during parsing of the configuration, the result is allocated
+ * from its memory.
+ */
+struct f_code *
+f_compile(struct f_inst *root)
+{
+  struct f_compiler c = {};
+  struct f_code *code;
+  uint *entry, i;
+
+  fc_chain(&c, root);
+  fc_emit(&c, FO_END, NULL, 1, 0);
+
+  /* Function bodies may call other functions, the list grows */
+  entry = NULL;
+  for (i = 0; i < c.calls_len; i++)
+    {
+      entry = xrealloc(entry, c.calls_size * sizeof(uint));
+      entry[i] = c.len;
+      c.depth = 0;
+      fc_chain(&c, c.calls[i]);
+      fc_emit(&c, FO_END, NULL, 1, 0);
+    }
+
+  for (i = 0; i < c.len; i++)
+    if (c.op[i].code == FO_CALL)
+      c.op[i].target = entry[c.op[i].target];
+
+  code = cfg_alloc(sizeof(struct f_code));
+  code->len = c.len;
+  code->depth = c.max_depth;
+  code->op = cfg_alloc(c.len * sizeof(struct f_op));
+  memcpy(code->op, c.op, c.len * sizeof(struct f_op));
+
+  xfree(c.op);
+  xfree(c.calls);
+  xfree(entry);
+  return code;
+}
+
+static struct f_val
+f_exec_error(struct f_op *op, char *msg)
+{
+  struct f_val res;
+
+  log_rl(&rl_runtime_err, L_ERR "filters, line %d: %s", op->inst->lineno, msg);
+  res.type = T_RETURN;
+  res.val.i = F_ERROR;
+  return res;
+}
+
+/*
+ * f_exec - run compiled filter code
+ * @code: compiled filter
+ * @pc: entry point, 0 for the filter itself
+ *
+ * Returns the value of the code, like interpret() does for the source.
+ */
+static struct f_val
+f_exec(struct f_code *code, uint pc)
+{
+  struct f_val *stack = alloca(code->depth * sizeof(struct f_val));
+  struct f_val *sp = stack;		/* First free slot */
+  struct f_val res, *v;
+  struct f_tree *t;
+  struct f_op *op;
+  u64 run;
+  int i;
+
+  for (;;)
+  {
+    op = &code->op[pc++];
+
+    switch (op->code)
+    {
+    case FO_END:
+      return sp[-1];
+
+    case FO_CONST:
+      *sp++ = op->u.val;
+      break;
+
+    case FO_LOAD:
+      *sp++ = *op->u.var;
+      break;
+
+    case FO_POP:
+      sp--;
+      break;
+
+    case FO_INST:
+      sp -= op->argc;
+      res = interpret_op(op->inst, sp);
+      if (res.type & T_RETURN)
+	return res;
+      *sp++ = res;
+      break;
+
+    case FO_SAME:
+      sp--;
+      i = val_same(sp[-1], sp[0]);
+      sp[-1].type = T_BOOL;
+      sp[-1].val.i = (op->aux == P('=','=')) ? i : !i;
+      break;
+
+    case FO_COMPARE:
+      sp--;
+      i = val_compare(sp[-1], sp[0]);
+      if (i == CMP_ERROR)
+	return f_exec_error(op, "Can't compare values of incompatible types");
+      sp[-1].type = T_BOOL;
+      sp[-1].val.i = (op->aux == '<') ? (i == -1) : (i != 1);
+      break;
+
+    case FO_JUMP:
+      pc = op->target;
+      break;
+
+    case FO_IF:
+      sp--;
+      if (sp->type != T_BOOL)
+	return f_exec_error(op, "If requires boolean expression");
+      if (!sp->val.i)
+      {
+	sp->val.i = 1;
+	sp++;
+	pc = op->target;
+      }
+      break;
+
+    case FO_BOOL:
+      if (sp[-1].type != T_BOOL)
+	return f_exec_error(op, "Can't do boolean operation on non-booleans");
+      if (sp[-1].val.i == (op->aux == '|'))
+	pc = op->target;
+      else
+	sp--;
+      break;
+
+    case FO_BOOL2:
+      if (sp[-1].type != T_BOOL)
+	return f_exec_error(op, "Can't do boolean operation on non-booleans");
+      break;
+
+    case FO_CALL:
+      run = f_body_run;
+      f_body_run = ++f_body_runs;
+      res = f_exec(code, op->target);
+      f_body_run = run;
+      if (res.type == T_RETURN)
+	return res;
+      res.type &= ~T_RETURN;
+      *sp++ = res;
+      break;
+
+    case FO_SWITCH:
+      t = find_tree(op->u.tree, sp[-1]);
+      if (!t)
+      {
+	sp[-1].type = T_VOID;
+	t = find_tree(op->u.tree, sp[-1]);
+      }
+      sp--;
+      if (!t)
+      {
+	sp->type = T_VOID;
+	sp++;
+	pc = op->target;
+	break;
+      }
+      pc = (uint) (uintptr_t) t->data;
+      break;
+
+    case FO_RTA:
+      if (!f_rte)
+	return f_exec_error(op, "No route to access");
+      sp->type = op->aux;
+      f_rta_get(sp++, op->attr);
+      break;
+
+    case FO_EA:
+      if (!f_rte)
+	return f_exec_error(op, "No route to access");
+      if (op->u.slot)
+	f_ea_get_saved(sp++, op->u.slot, op->attr, op->aux);
+      else
+	f_ea_get(sp++, op->attr, op->aux);
+      break;
+
+    case FO_MATCH:
+      v = &sp[-1];
+      if ((op->u.val.type == T_PREFIX_SET) && (v->type == T_PREFIX))
+	i = trie_match_fprefix(op->u.val.val.ti, &v->val.px);
+      else if ((op->u.val.type == T_SET) && (v->type == op->u.val.val.t->from.type))
+	i = !!find_tree(op->u.val.val.t, *v);
+      else if ((i = val_in_range(*v, op->u.val)) == CMP_ERROR)
+	return f_exec_error(op, (op->aux == '~') ? "~ applied on unknown type pair" : "!~ applied on unknown type pair");
+      v->type = T_BOOL;
+      v->val.i = (op->aux == '~') ? !!i : !i;
+      break;
+
+    case FO_CLIST:
+      sp--;
+      v = &sp[-1];
+      if ((v->type == T_CLIST) && ((sp->type == T_PAIR) || (sp->type == T_QUAD)) && (op->aux != 'f'))
+	v->val.ad = (op->aux == 'a') ?
+	  int_set_add(f_pool, v->val.ad, sp->val.i) :
+	  int_set_del(f_pool, v->val.ad, sp->val.i);
+      else if ((v->type == T_ECLIST) && (sp->type == T_EC) && (op->aux != 'f'))
+	v->val.ad = (op->aux == 'a') ?
+	  ec_set_add(f_pool, v->val.ad, sp->val.ec) :
+	  ec_set_del(f_pool, v->val.ad, sp->val.ec);
+      else
+      {
+	/* Sets, lists, paths and errors */
+	sp--;
+	res = interpret_op(op->inst, sp);
+	if (res.type & T_RETURN)
+	  return res;
+	*sp++ = res;
+      }
+      break;
+
+    default:
+      bug("Unknown filter operation %u", op->code);
+    }
+  }
+}
+
+/*
+ *	Filter optimization
+ *
+ * f_optimize() simplifies the tree of a filter or a function before it is
+ * compiled. Operations on constants are evaluated, conditions, boolean
+ * operators and CASE with a constant argument are replaced by what they
+ * select, and extended attributes read more than once in a body which does
+ * not set them are saved (%P('e','c')): the first read in a run of the body
+ * looks the attribute up, later ones take the saved value. Paths which do
+ * not read the attribute do not look it up at all. Only operations which
+ * cannot fail are evaluated, so runtime errors are still reported when the
+ * filter runs.
+ */
+
+#define FO_ATTRS_MAX	16
+
+struct f_optimizer {
+  struct fo_attr {
+    int code, aux;
+    uint reads;
+    int written;
+    struct f_attr_slot *slot;
+  } attr[FO_ATTRS_MAX];
+  uint attrs;
+};
+
+static struct f_inst *fo_chain(struct f_optimizer *o, struct f_inst *what);
+
+static int
+fo_const(struct f_inst *what, struct f_val *v)
+{
+  if (!what || what->next)
+    return 0;
+
+  switch (what->code)
+  {
+  case 'c':
+    memset(v, 0, sizeof(struct f_val));
+    v->type = what->aux;
+    if ((v->type == T_PREFIX_SET) || (v->type == T_SET) || (v->type == T_STRING))
+      return 0;
+    v->val.i = what->a2.i;
+    return 1;
+
+  case 'C':
+    *v = * (struct f_val *) what->a1.p;
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
+static struct f_inst *
+fo_new_const(struct f_inst *what, struct f_val v)
+{
+  struct f_inst *i = f_new_inst();
+
+  i->code = 'c';
+  i->aux = v.type;
+  i->a2.i = v.val.i;
+  i->lineno = what->lineno;
+  return i;
+}
+
+/* Whether @what may be evaluated on arguments @v1, @v2 without an error */
+static int
+fo_safe(struct f_inst *what, struct f_val v1, struct f_val v2)
+{
+  switch (what->code)
+  {
+  case '+':
+  case '-':
+  case '*':
+    return (v1.type == T_INT) && (v2.type == T_INT);
+
+  case '/':
+    return (v1.type == T_INT) && (v2.type == T_INT) && v2.val.i;
+
+  case P('m','p'):
+    return (v1.type == T_INT) && (v2.type == T_INT) &&
+      ((uint) v1.val.i <= 0xFFFF) && ((uint) v2.val.i <= 0xFFFF);
+
+  case '!':
+    return v1.type == T_BOOL;
+
+  case P('=','='):
+  case P('!','='):
+    return 1;
+
+  case '<':
+  case P('<','='):
+    return val_compare(v1, v2) != CMP_ERROR;
+
+  case '~':
+  case P('!','~'):
+    return val_in_range(v1, v2) != CMP_ERROR;
+
+  default:
+    return 0;
+  }
+}
+
+static struct f_inst *
+fo_if(struct f_inst *what)
+{
+  struct f_inst *i, *head;
+  struct f_val v;
+
+  /* Commands before a constant condition go before the IF, see IF-ELSE */
+  for (i = what->a1.p; i && i->next && i->next->next; i = i->next)
+    ;
+  if (i && i->next && fo_const(i->next, &v))
+  {
+    head = what->a1.p;
+    what->a1.p = i->next;
+    i->next = fo_if(what);
+    return head;
+  }
+
+  if (!fo_const(what->a1.p, &v) || (v.type != T_BOOL))
+    return what;
+
+  /* Value of IF is false if its commands were run */
+  v.val.i = !v.val.i;
+  if (!what->a2.p || v.val.i)
+    return fo_new_const(what, v);
+
+  for (i = what->a2.p; i->next; i = i->next)
+    ;
+  i->next = fo_new_const(what, v);
+  return what->a2.p;
+}
+
+static void
+fo_tree(struct f_optimizer *o, struct f_tree *t, struct f_inst **from, struct f_inst **to, uint *n)
+{
+  uint i;
+
+  if (!t)
+    return;
+
+  fo_tree(o, t->left, from, to, n);
+  fo_tree(o, t->right, from, to, n);
+
+  /* Items of one branch share its commands */
+  for (i = 0; i < *n; i++)
+    if (from[i] == t->data)
+    {
+      t->data = to[i];
+      return;
+    }
+
+  from[*n] = t->data;
+  t->data = to[*n] = fo_chain(o, t->data);
+  (*n)++;
+}
+
+/* Returns a chain replacing @what */
+static struct f_inst *
+fo_inst(struct f_optimizer *o, struct f_inst *what)
+{
+  struct f_val args[2], v;
+  struct f_tree *t;
+  int argn;
+
+  switch (what->code)
+  {
+  case '?':
+    what->a1.p = fo_chain(o, what->a1.p);
+    what->a2.p = fo_chain(o, what->a2.p);
+    return fo_if(what);
+
+  case '&':
+  case '|':
+    what->a1.p = fo_chain(o, what->a1.p);
+    what->a2.p = fo_chain(o, what->a2.p);
+
+    if (!fo_const(what->a1.p, &v) || (v.type != T_BOOL))
+      return what;
+    if (v.val.i == (what->code == '|'))
+      return fo_new_const(what, v);
+    if (!fo_const(what->a2.p, &v) || (v.type != T_BOOL))
+      return what;
+    return fo_new_const(what, v);
+
+  case P('S','W'):
+    {
+      uint size = fc_tree_size(what->a2.p);
+      struct f_inst **from = alloca(size * sizeof(struct f_inst *));
+      struct f_inst **to = alloca(size * sizeof(struct f_inst *));
+      uint n = 0;
+
+      what->a1.p = fo_chain(o, what->a1.p);
+      fo_tree(o, what->a2.p, from, to, &n);
+
+      if (!fo_const(what->a1.p, &v))
+	return what;
+
+      t = find_tree(what->a2.p, v);
+      if (!t)
+      {
+	v.type = T_VOID;
+	t = find_tree(what->a2.p, v);
+      }
+      if (t && t->data)
+	return t->data;
+
+      /* No matching branch gives void */
+      what->code = '0';
+      return what;
+    }
+
+  case P('c','a'):
+    /* The body has been optimized with the function */
+    what->a1.p = fo_chain(o, what->a1.p);
+    return what;
+
+  case P('=','='):
+  case P('!','='):
+  case '<':
+  case P('<','='):
+    argn = 3;
+    break;
+
+  default:
+    argn = fc_args(what);
+  }
+
+  if (argn & 1)
+    what->a1.p = fo_chain(o, what->a1.p);
+  if (argn & 2)
+    what->a2.p = fo_chain(o, what->a2.p);
+
+  memset(args, 0, sizeof(args));
+  if (((argn & 1) && !fo_const(what->a1.p, &args[0])) ||
+      ((argn & 2) && !fo_const(what->a2.p, &args[1])) ||
+      !fo_safe(what, args[0], args[1]))
+    return what;
+
+  v = interpret_op(what, args);
+  if ((v.type != T_INT) && (v.type != T_BOOL) && (v.type != T_PAIR))
+    return what;
+
+  return fo_new_const(what, v);
+}
+
+static struct f_inst *
+fo_chain(struct f_optimizer *o, struct f_inst *what)
+{
+  struct f_inst *head = NULL, **tail = &head, *next;
+
+  for (; what; what = next)
+  {
+    next = what->next;
+    what->next = NULL;
+
+    *tail = fo_inst(o, what);
+    while (*tail)
+      tail = &(*tail)->next;
+  }
+
+  return head;
+}
+
+static struct fo_attr *
+fo_find_attr(struct f_optimizer *o, struct f_inst *what, int add)
+{
+  uint i;
+
+  for (i = 0; i < o->attrs; i++)
+    if (o->attr[i].code == what->a2.i)
+      return &o->attr[i];
+
+  if (!add || (o->attrs == FO_ATTRS_MAX))
+    return NULL;
+
+  o->attr[o->attrs] = (struct fo_attr) { .code = what->a2.i, .aux = what->aux };
+  return &o->attr[o->attrs++];
+}
+
+/* Instruction arguments, including those evaluated lazily */
+static int
+fo_args(struct f_inst *what)
+{
+  switch (what->code)
+  {
+  case '?':
+  case '&':
+  case '|':
+  case P('=','='):
+  case P('!','='):
+  case '<':
+  case P('<','='):
+    return 3;
+
+  case P('S','W'):
+  case P('c','a'):
+    return 1;
+
+  default:
+    return fc_args(what);
+  }
+}
+
+/*
+ * Walk the instructions under @what. With @replace, saved reads of attributes
+ * are substituted, otherwise reads are counted. Reads done by called
+ * functions (@call) are theirs, but what they set is taken into account.
+ */
+static void
+fo_scan(struct f_optimizer *o, struct f_inst *what, int replace, int call)
+{
+  struct fo_attr *a;
+  int argn;
+
+  for (; what; what = what->next)
+  {
+    switch (what->code)
+    {
+    case P('e','a'):
+      if (call)
+	break;
+      a = fo_find_attr(o, what, !replace);
+      if (!a || (a->aux != what->aux))
+	break;
+      if (!replace)
+	a->reads++;
+      else if (a->slot)
+      {
+	what->code = P('e','c');
+	what->a1.p = a->slot;
+      }
+      break;
+
+    case P('e','S'):
+      if (!replace && (a = fo_find_attr(o, what, 1)))
+	a->written = 1;
+      break;
+
+    case P('S','W'):
+      {
+	uint size = fc_tree_size(what->a2.p);
+	struct f_tree **stack = alloca(size * sizeof(struct f_tree *));
+	struct f_tree *t;
+	uint n = 0;
+
+	if (what->a2.p)
+	  stack[n++] = what->a2.p;
+	while (n)
+	{
+	  t = stack[--n];
+	  fo_scan(o, t->data, replace, call);
+	  if (t->left)
+	    stack[n++] = t->left;
+	  if (t->right)
+	    stack[n++] = t->right;
+	}
+      }
+      break;
+
+    case P('c','a'):
+      if (!replace)
+	fo_scan(o, what->a2.p, 0, 1);
+      break;
+    }
+
+    argn = fo_args(what);
+    if (argn & 1)
+      fo_scan(o, what->a1.p, replace, call);
+    if (argn & 2)
+      fo_scan(o, what->a2.p, replace, call);
+  }
+}
+
+/**
+ * f_optimize - optimize a filter or function body
+ * @root: instructions of the body
+ *
+ * Simplifies the parsed tree and returns its new root. Called on bodies of
+ * functions and filters before their use, as calls are optimized with the
+ * called function and not again with each caller.
+ */
+struct f_inst *
+f_optimize(struct f_inst *root)
+{
+  struct f_optimizer o = {};
+  uint j;
+
+  root = fo_chain(&o, root);
+  fo_scan(&o, root, 0, 0);
+
+  for (j = 0; j < o.attrs; j++)
+    if ((o.attr[j].reads >= 2) && !o.attr[j].written)
+      o.attr[j].slot = cfg_allocz(sizeof(struct f_attr_slot));
+
+  fo_scan(&o, root, 1, 0);
+  return root;
+}
+
+/*
+ * Find an instruction satisfying @match anywhere in the code under @what,
+ * including cases of switches and bodies of called functions.
+ */
+static int
+i_find(struct f_inst *what, int (*match)(struct f_inst *what, void *data), void *data)
+{
+  struct f_tree *t;
+  int argn;
+
+  for (; what; what = what->next)
+  {
+    if (match(what, data))
+      return 1;
+
+    switch (what->code)
+    {
+    case P('S','W'):
+      if (what->a2.p)
+      {
+	uint size = fc_tree_size(what->a2.p);
+	struct f_tree **stack = alloca(size * sizeof(struct f_tree *));
+	uint n = 0;
+
+	stack[n++] = what->a2.p;
+	while (n)
+	{
+	  t = stack[--n];
+	  if (i_find(t->data, match, data))
+	    return 1;
+	  if (t->left)
+	    stack[n++] = t->left;
+	  if (t->right)
+	    stack[n++] = t->right;
+	}
+      }
+      break;
+
+    case P('c','a'):
+      if (i_find(what->a2.p, match, data))
+	return 1;
+      break;
+    }
+
+    argn = fo_args(what);
+    if ((argn & 1) && i_find(what->a1.p, match, data))
+      return 1;
+    if ((argn & 2) && i_find(what->a2.p, match, data))
+      return 1;
+  }
+
+  return 0;
+}
+
+static int
+i_roa_check(struct f_inst *what, void *data)
+{
+  return (what->code == P('R','C')) &&
+    (!data || (((struct f_inst_roa_check *) what)->rtc->table == data));
+}
+
+static int
+i_rte_set(struct f_inst *what, void *data UNUSED)
+{
+  return (what->code == P('a','S')) || (what->code == P('e','S')) ||
+    (what->code == P('P','S'));
+}
+
+/**
+ * f_uses_roa - check whether a filter depends on a ROA table
+ * @filter: filter to check
+ * @t: ROA table
+ *
+ * Returns 1 if a roa_check() against @t, or any ROA table if @t is
+ * %NULL, may be evaluated by @filter, so that its results may change
+ * when @t changes.
+ */
+int
+f_uses_roa(struct filter *filter, struct roa_table *t)
+{
+  if ((filter == FILTER_ACCEPT) || (filter == FILTER_REJECT))
+    return 0;
+
+  return i_find(filter->root, i_roa_check, t);
+}
+
+/**
+ * f_modifies_rte - check whether a filter may change routes
+ * @filter: filter to check
+ *
+ * Returns 1 if @filter contains assignments to route attributes, so
+ * that accepted routes may differ from the routes the filter got.
+ */
+int
+f_modifies_rte(struct filter *filter)
+{
+  if ((filter == FILTER_ACCEPT) || (filter == FILTER_REJECT))
+    return 0;
+
+  return i_find(filter->root, i_rte_set, NULL);
+}
+
 /**
  * f_run - run a filter for a route
  * @filter: filter to run
@@ -1506,10 +2853,11 @@ f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struc
   f_tmp_attrs = tmp_attrs;
   f_pool = tmp_pool;
   f_flags = flags;
+  f_body_run = ++f_body_runs;
 
   LOG_BUFFER_INIT(f_buf);
 
-  struct f_val res = interpret(filter->root);
+  struct f_val res = filter->code ? f_exec(filter->code, 0) : interpret(filter->root);
 
   f_eproto = NULL;
 
@@ -1553,6 +2901,7 @@ f_eval_rte(struct f_inst *expr, struct rte **rte, struct linpool *tmp_pool)
   f_tmp_attrs = &tmp_attrs;
   f_pool = tmp_pool;
   f_flags = 0;
+  f_body_run = ++f_body_runs;
 
   LOG_BUFFER_INIT(f_buf);
 
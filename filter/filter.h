@@ -63,12 +63,17 @@ struct f_val {
   } val;
 };
 
+struct f_code;
+
 struct filter {
   char *name;
   struct f_inst *root;
+  struct f_code *code;			/* Compiled root, or NULL */
 };
 
 struct f_inst *f_new_inst(void);
+struct f_inst *f_optimize(struct f_inst *root);
+struct f_code *f_compile(struct f_inst *root);
 struct f_inst *f_new_dynamic_attr(int type, int f_type, int code);	/* Type as core knows it, type as filters know it, and code of dynamic attribute */
 struct f_tree *f_new_tree(void);
 struct f_inst *f_generate_complex(int operation, int operation_aux, struct f_inst *dyn, struct f_inst *argument);
@@ -83,6 +88,7 @@ void tree_format(struct f_tree *t, buffer *buf);
 struct f_trie *f_new_trie(linpool *lp, uint node_size);
 void *trie_add_prefix(struct f_trie *t, ip_addr px, int plen, int l, int h);
 int trie_match_prefix(struct f_trie *t, ip_addr px, int plen);
+void trie_cover(struct f_trie *t, ip_addr *px, int *plen);
 int trie_same(struct f_trie *t1, struct f_trie *t2);
 void trie_format(struct f_trie *t, buffer *buf);
 
@@ -115,6 +121,10 @@ u32 f_eval_asn(struct f_inst *expr);
 
 char *filter_name(struct filter *filter);
 int filter_same(struct filter *new, struct filter *old);
+int f_rta_pure(struct filter *filter);
+int f_prefix_cover(struct filter *filter, ip_addr *px, int *plen);
+int f_uses_roa(struct filter *filter, struct roa_table *t);
+int f_modifies_rte(struct filter *filter);
 
 int i_same(struct f_inst *f1, struct f_inst *f2);
 
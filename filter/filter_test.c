@@ -0,0 +1,47 @@
+/*
+ *	BIRD -- Tests of the filter bytecode
+ *
+ *	Run by `make check'. Runs a few typical filters with the tree
+ *	interpreter and with the compiled bytecode and checks that both
+ *	accept the expected routes.
+ */
+
+#include "filter/test-filters.h"
+#include "lib/test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int
+main(int argc UNUSED, char **argv)
+{
+  struct test_filter *t;
+  int i;
+
+  test_init();
+  test_filters_init();
+
+  for (t = test_filters; t->name; t++)
+    {
+      struct filter *vm = compile(t->name, t->build());
+      struct filter tree = { .name = t->name, .root = vm->root, .code = NULL };
+
+      for (i = 0; i < ROUTES; i++)
+	{
+	  int v = ((t->accepted >> i) & 1) ? F_ACCEPT : F_REJECT;
+
+	  if (run(&tree, routes[i]) != v)
+	    {
+	      fprintf(stderr, "%s: wrong result of tree for route %d\n", t->name, i);
+	      failed++;
+	    }
+	  if (run(vm, routes[i]) != v)
+	    {
+	      fprintf(stderr, "%s: wrong result of bytecode for route %d\n", t->name, i);
+	      failed++;
+	    }
+	}
+    }
+
+  return test_done(argv[0]);
+}
@@ -0,0 +1,334 @@
+/*
+ *	BIRD -- Filters for Tests of the Filter Interpreter
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_TEST_FILTERS_H_
+#define _BIRD_TEST_FILTERS_H_
+
+#include "nest/bird.h"
+#include "nest/route.h"
+#include "nest/protocol.h"
+#include "nest/attrs.h"
+#include "conf/conf.h"
+#include "filter/filter.h"
+#include "proto/bgp/bgp.h"
+#include "lib/unaligned.h"
+
+/*
+ *	A few typical filters and routes to run them on, shared by
+ *	filter_test, which checks that the tree interpreter and the compiled
+ *	bytecode agree, and filter_bench, which times them.
+ */
+
+#define P(a,b) ((a<<8) | b)
+
+#define ROUTES 4
+
+static rtable tab;
+static struct proto proto;
+static rte *routes[ROUTES];
+static linpool *lp;
+static struct include_file_stack file = { .file_name = "test-filters" };
+
+/*
+ *	Instructions, as built by the grammar in filter/config.Y
+ */
+
+static struct f_inst *
+op(int code, struct f_inst *a1, struct f_inst *a2)
+{
+  struct f_inst *i = f_new_inst();
+  i->code = code;
+  i->a1.p = a1;
+  i->a2.p = a2;
+  return i;
+}
+
+static struct f_inst *
+num(int n)
+{
+  struct f_inst *i = f_new_inst();
+  i->code = 'c';
+  i->aux = T_INT;
+  i->a2.i = n;
+  return i;
+}
+
+static struct f_inst *
+verdict(int v)
+{
+  struct f_inst *i = op(P('p',','), NULL, NULL);
+  i->a2.i = v;
+  return i;
+}
+
+static struct f_inst *
+net_attr(void)
+{
+  struct f_inst *i = op('a', NULL, NULL);
+  i->aux = T_PREFIX;
+  i->a2.i = SA_NET;
+  return i;
+}
+
+static struct f_inst *
+bgp_attr(int type, int code)
+{
+  struct f_inst *i = f_new_dynamic_attr(type, 0, EA_CODE(EAP_BGP, code));
+  i->code = P('e','a');
+  return i;
+}
+
+/* 'where @term' */
+static struct f_inst *
+where(struct f_inst *term)
+{
+  struct f_inst *i = op('?', term, verdict(F_ACCEPT));
+  i->next = verdict(F_REJECT);
+  return i;
+}
+
+static struct f_tree *
+item(struct f_tree *list, int from, int to, struct f_inst *cmds)
+{
+  struct f_tree *t = f_new_tree();
+  t->from.type = t->to.type = from < 0 ? T_VOID : T_INT;
+  t->from.val.i = from;
+  t->to.val.i = to;
+  t->data = cmds;
+  t->left = list;
+  return t;
+}
+
+/* where net ~ [ 10.0.0.0/8{16,24}, 192.168.0.0/16+, 172.16.0.0/12 ] */
+static struct f_inst *
+f_prefix(void)
+{
+  struct f_trie *t = f_new_trie(cfg_mem, sizeof(struct f_trie_node));
+  struct f_inst *s = num(0);
+
+  trie_add_prefix(t, ipa_from_u32(0x0a000000), 8, 16, 24);
+  trie_add_prefix(t, ipa_from_u32(0xc0a80000), 16, 16, MAX_PREFIX_LENGTH);
+  trie_add_prefix(t, ipa_from_u32(0xac100000), 12, 12, 12);
+  s->aux = T_PREFIX_SET;
+  s->a2.p = t;
+
+  return where(op('~', net_attr(), s));
+}
+
+/*
+ * where (bgp_path.len > 3 || bgp_local_pref < 50) && net.len <= 24
+ *   && bgp_path.last != 65535 && bgp_local_pref + 10 * bgp_path.len >= 100
+ */
+static struct f_inst *
+f_expr(void)
+{
+  struct f_inst *len = op('L', bgp_attr(EAF_TYPE_AS_PATH, BA_AS_PATH), NULL);
+  struct f_inst *pref = bgp_attr(EAF_TYPE_INT, BA_LOCAL_PREF);
+  struct f_inst *t;
+
+  t = op('|', op('<', num(3), len), op('<', pref, num(50)));
+  t = op('&', t, op(P('<','='), op('L', net_attr(), NULL), num(24)));
+  t = op('&', t, op(P('!','='), op(P('a','l'), bgp_attr(EAF_TYPE_AS_PATH, BA_AS_PATH), NULL), num(65535)));
+  t = op('&', t, op(P('<','='), num(100),
+		    op('+', bgp_attr(EAF_TYPE_INT, BA_LOCAL_PREF),
+		       op('*', num(10), op('L', bgp_attr(EAF_TYPE_AS_PATH, BA_AS_PATH), NULL)))));
+
+  return where(t);
+}
+
+/*
+ * case bgp_path.last {
+ *   1..100: reject;
+ *   64512..65000: reject;
+ *   65001: if bgp_local_pref > 100 then accept; reject;
+ *   else: accept;
+ * }
+ */
+static struct f_inst *
+f_case(void)
+{
+  struct f_inst *i, *c;
+  struct f_tree *t = NULL;
+
+  c = op('?', op('<', num(100), bgp_attr(EAF_TYPE_INT, BA_LOCAL_PREF)), verdict(F_ACCEPT));
+  c->next = verdict(F_REJECT);
+
+  t = item(t, 1, 100, verdict(F_REJECT));
+  t = item(t, 64512, 65000, verdict(F_REJECT));
+  t = item(t, 65001, 65001, c);
+  t = item(t, -1, -1, verdict(F_ACCEPT));
+
+  i = op(P('S','W'), op(P('a','l'), bgp_attr(EAF_TYPE_AS_PATH, BA_AS_PATH), NULL), NULL);
+  i->a2.p = build_tree(t);
+  return i;
+}
+
+static struct f_inst *
+pair(u32 a, u32 b)
+{
+  struct f_inst *i = num((a << 16) | b);
+  i->aux = T_PAIR;
+  return i;
+}
+
+/*
+ * where (65000,100) ~ bgp_community.add((65000,100)).delete((65000,1))
+ *   && bgp_path.last ~ [1..100, 65001..65010] && !(net ~ [ 172.16.0.0/12 ])
+ */
+static struct f_inst *
+f_clist(void)
+{
+  struct f_trie *tr = f_new_trie(cfg_mem, sizeof(struct f_trie_node));
+  struct f_inst *ints = num(0), *pxs = num(0);
+  struct f_inst *cl, *t;
+
+  ints->aux = T_SET;
+  ints->a2.p = build_tree(item(item(NULL, 1, 100, NULL), 65001, 65010, NULL));
+  trie_add_prefix(tr, ipa_from_u32(0xac100000), 12, 12, 12);
+  pxs->aux = T_PREFIX_SET;
+  pxs->a2.p = tr;
+
+  cl = op(P('C','a'), bgp_attr(EAF_TYPE_INT_SET, BA_COMMUNITY), pair(65000, 100));
+  cl->aux = 'a';
+  cl = op(P('C','a'), cl, pair(65000, 1));
+  cl->aux = 'd';
+
+  t = op('~', pair(65000, 100), cl);
+  t = op('&', t, op('~', op(P('a','l'), bgp_attr(EAF_TYPE_AS_PATH, BA_AS_PATH), NULL), ints));
+  t = op('&', t, op(P('!','~'), net_attr(), pxs));
+
+  return where(t);
+}
+
+/*
+ * function twice() { return bgp_local_pref + bgp_local_pref; }
+ * bgp_local_pref = 10; if twice() != 20 then reject;
+ * bgp_local_pref = 30; if twice() != 60 then reject;
+ * if bgp_path.len > 3 then accept; reject;
+ */
+static struct f_inst *
+f_call(void)
+{
+  struct f_inst *body, *set, *i, *head, **tail = &head;
+  int k;
+
+  body = op('r', op('+', bgp_attr(EAF_TYPE_INT, BA_LOCAL_PREF), bgp_attr(EAF_TYPE_INT, BA_LOCAL_PREF)), NULL);
+  body = f_optimize(body);
+
+  for (k = 1; k <= 3; k += 2)
+    {
+      set = op(P('e','S'), num(10 * k), NULL);
+      set->aux = EAF_TYPE_INT;
+      set->a2.i = EA_CODE(EAP_BGP, BA_LOCAL_PREF);
+
+      i = op(P('c','a'), NULL, NULL);
+      i->a2.p = body;
+      i = op('?', op(P('!','='), i, num(20 * k)), verdict(F_REJECT));
+
+      *tail = set;
+      set->next = i;
+      tail = &i->next;
+    }
+
+  *tail = op('?', op('<', num(3), op('L', bgp_attr(EAF_TYPE_AS_PATH, BA_AS_PATH), NULL)), verdict(F_ACCEPT));
+  (*tail)->next = verdict(F_REJECT);
+  return head;
+}
+
+static struct filter *
+compile(char *name, struct f_inst *root)
+{
+  struct filter *f = cfg_allocz(sizeof(struct filter));
+
+  f->name = name;
+  f->root = f_optimize(root);
+  f->code = f_compile(f->root);
+  return f;
+}
+
+/* A route to @net/@len with AS path of @hops ending with @last */
+static rte *
+route(u32 net, int len, int hops, u32 last, u32 local_pref)
+{
+  struct adata *path = cfg_allocz(sizeof(struct adata) + 2 + 4 * hops);
+  ea_list *eal = cfg_allocz(sizeof(ea_list) + 2 * sizeof(eattr));
+  int i;
+
+  path->length = 2 + 4 * hops;
+  path->data[0] = AS_PATH_SEQUENCE;
+  path->data[1] = hops;
+  for (i = 0; i < hops; i++)
+    put_u32(path->data + 2 + 4 * i, (i == hops - 1) ? last : 65000 + i);
+
+  eal->count = 2;
+  eal->attrs[0] = (eattr) { .id = EA_CODE(EAP_BGP, BA_AS_PATH), .flags = BAF_TRANSITIVE,
+			    .type = EAF_TYPE_AS_PATH, .u.ptr = path };
+  eal->attrs[1] = (eattr) { .id = EA_CODE(EAP_BGP, BA_LOCAL_PREF), .flags = BAF_TRANSITIVE,
+			    .type = EAF_TYPE_INT, .u.data = local_pref };
+
+  rta a = {
+    .src = rt_get_source(&proto, 0),
+    .source = RTS_BGP,
+    .scope = SCOPE_UNIVERSE,
+    .cast = RTC_UNICAST,
+    .dest = RTD_BLACKHOLE,
+    .eattrs = eal,
+  };
+
+  rte *e = rte_get_temp(rta_lookup(&a));
+  e->net = net_get(&tab, ipa_from_u32(net), len);
+  e->pflags = 0;
+  e->flags |= REF_COW;
+  return e;
+}
+
+static int
+run(struct filter *f, rte *e)
+{
+  rte *e0 = e;
+  ea_list *tmpa = NULL;
+  int v = f_run(f, &e, &tmpa, lp, 0, NULL);
+
+  /* A copy made by the filter */
+  if (e != e0)
+    rte_free(e);
+
+  lp_flush(lp);
+  return v;
+}
+
+struct test_filter {
+  char *name;
+  struct f_inst *(*build)(void);
+  uint accepted;			/* Routes accepted, a bit for each */
+};
+
+static struct test_filter test_filters[] = {
+  { "prefix", f_prefix, 0x7 },
+  { "expr", f_expr, 0x1 },
+  { "case", f_case, 0x9 },
+  { "clist", f_clist, 0x1 },
+  { "call", f_call, 0x9 },
+  { NULL, NULL, 0 }
+};
+
+/* Sets up the table and the routes, instructions are allocated as if they were being parsed */
+static void
+test_filters_init(void)
+{
+  cfg_mem = lp_new(&root_pool, 4080);
+  ifs = &file;
+  lp = lp_new(&root_pool, 4080);
+  rt_setup(&root_pool, &tab, "test", NULL);
+  proto.name = "test";
+
+  routes[0] = route(0x0a010200, 24, 4, 65001, 150);
+  routes[1] = route(0xc0a80100, 24, 2, 64600, 40);
+  routes[2] = route(0xac100000, 12, 1, 50, 100);
+  routes[3] = route(0x08080800, 24, 6, 65535, 200);
+}
+
+#endif
@@ -241,6 +241,42 @@ trie_match_prefix(struct f_trie *t, ip_addr px, int plen)
   return 0;
 }
 
+/**
+ * trie_cover
+ * @t: trie
+ * @px: place for the address of the covering prefix
+ * @plen: place for its length
+ *
+ * Finds the longest prefix covering all prefixes matched by trie @t, so
+ * that a walk over prefixes may be restricted to it.
+ */
+void
+trie_cover(struct f_trie *t, ip_addr *px, int *plen)
+{
+  struct f_trie_node *n = t->root;
+  int l;
+
+  if (t->zero)
+    {
+      *px = IPA_NONE;
+      *plen = 0;
+      return;
+    }
+
+  /* Accept masks also hold shorter prefixes accepted in the subtree */
+  while (!ipa_nonzero(n->accept) && (!n->c[0] != !n->c[1]))
+    n = n->c[0] ? : n->c[1];
+
+  for (l = 0; l < n->plen; l++)
+    if (ipa_getbit(n->accept, l))
+      break;
+
+  /* Bit l stands for length l+1 */
+  l = MIN(l + 1, n->plen);
+  *px = ipa_and(n->addr, ipa_mkmask(l));
+  *plen = l;
+}
+
 static int
 trie_node_same(struct f_trie_node *t1, struct f_trie_node *t2)
 {
@@ -457,3 +457,64 @@ buffer_puts(buffer *buf, const char *str)
 
   buf->pos = bp;
 }
+
+/**
+ * buffer_json - append a string as a JSON string literal
+ * @buf: buffer
+ * @str: string to be appended
+ *
+ * Appends @str in double quotes, with quotes, backslashes and control
+ * characters escaped. Like with buffer_print(), the position is left at
+ * the end of @buf if it overflows.
+ */
+void
+buffer_json(buffer *buf, const char *str)
+{
+  static const char hex[] = "0123456789abcdef";
+  byte *bp = buf->pos;
+  byte *be = buf->end;
+  byte c;
+
+  if (bp >= be)
+    return;
+  *bp++ = '"';
+
+  for (; c = *str; str++)
+    {
+      if ((c == '"') || (c == '\\'))
+	{
+	  if (be - bp < 2)
+	    goto overflow;
+	  *bp++ = '\\';
+	  *bp++ = c;
+	}
+      else if ((c < 0x20) || (c == 0x7f))
+	{
+	  if (be - bp < 6)
+	    goto overflow;
+	  memcpy(bp, "\\u00", 4);
+	  bp[4] = hex[c >> 4];
+	  bp[5] = hex[c & 15];
+	  bp += 6;
+	}
+      else
+	{
+	  if (bp >= be)
+	    goto overflow;
+	  *bp++ = c;
+	}
+    }
+
+  if (bp >= be)
+    goto overflow;
+  *bp++ = '"';
+
+  if (bp < be)
+    *bp = 0;
+
+  buf->pos = bp;
+  return;
+
+ overflow:
+  buf->pos = be;
+}
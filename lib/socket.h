@@ -59,6 +59,7 @@ sock *sock_new(pool *);			/* Allocate new socket */
 
 int sk_open(sock *);			/* Open socket */
 int sk_rx_ready(sock *s);
+int sk_write(sock *s);			/* Continue sending queued data, 0=sleep */
 int sk_send(sock *, unsigned len);	/* Send data, <0=err, >0=ok, 0=sleep */
 int sk_send_to(sock *, unsigned len, ip_addr to, unsigned port); /* sk_send to given destination */
 void sk_reallocate(sock *);		/* Free and allocate tbuf & rbuf */
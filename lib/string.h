@@ -21,6 +21,7 @@ int bvsnprintf(char *str, int size, const char *fmt, va_list args);
 int buffer_vprint(buffer *buf, const char *fmt, va_list args);
 int buffer_print(buffer *buf, const char *fmt, ...);
 void buffer_puts(buffer *buf, const char *str);
+void buffer_json(buffer *buf, const char *str);
 
 int patmatch(byte *pat, byte *str);
 
@@ -0,0 +1,42 @@
+/*
+ *	BIRD Library -- Test Programs
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_TEST_H_
+#define _BIRD_TEST_H_
+
+#include <stdio.h>
+
+#include "nest/bird.h"
+#include "nest/route.h"
+#include "lib/resource.h"
+#include "sysdep/unix/unix.h"
+
+/*
+ *	Test programs run by `make check' count failed checks and report
+ *	"<name>: OK" or "<name>: FAILED" on exit.
+ */
+
+static int failed;
+
+#define CHECK(c) do { if (!(c)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); failed++; } } while (0)
+
+static inline void
+test_init(void)
+{
+  log_switch(1, NULL, NULL);
+  resource_init();
+  io_init();
+  rt_init();
+}
+
+static inline int
+test_done(char *name)
+{
+  printf("%s: %s\n", name, failed ? "FAILED" : "OK");
+  return !!failed;
+}
+
+#endif
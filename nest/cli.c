@@ -159,6 +159,46 @@ cli_printf(cli *c, int code, char *msg, ...)
   memcpy(cli_alloc_out(c, size), buf, size);
 }
 
+/**
+ * cli_puts - send a long reply line to a CLI connection
+ * @c: CLI connection
+ * @code: numeric code of the reply, negative for continuation lines
+ * @data: contents of the line, without the terminating newline
+ * @len: length of @data
+ *
+ * Works like cli_printf(), except that @data is copied as it is and its
+ * length is not limited by %CLI_LINE_SIZE. The caller has to ensure
+ * that @data contains no newline.
+ */
+void
+cli_puts(cli *c, int code, const byte *data, uint len)
+{
+  byte buf[8];
+  int cd = (code < 0) ? -code : code;
+  int size;
+
+  if ((code < 0) && (cd == c->last_reply))
+    size = bsprintf(buf, " ");
+  else
+    size = bsprintf(buf, (code < 0) ? "%04d-" : "%04d ", cd);
+  c->last_reply = cd;
+  memcpy(cli_alloc_out(c, size), buf, size);
+
+  while (len)
+    {
+      /* Fill the current output buffer before starting a new one */
+      struct cli_out *o = c->tx_write;
+      uint n = (o && (o->wpos < o->end)) ? (uint) (o->end - o->wpos) : CLI_TX_BUF_SIZE;
+
+      n = MIN(n, len);
+      memcpy(cli_alloc_out(c, n), data, n);
+      data += n;
+      len -= n;
+    }
+
+  memcpy(cli_alloc_out(c, 1), "\n", 1);
+}
+
 static void
 cli_copy_message(cli *c)
 {
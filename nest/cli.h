@@ -54,6 +54,7 @@ extern struct cli *this_cli;		/* Used during parsing */
 /* Functions to be called by command handlers */
 
 void cli_printf(cli *, int, char *, ...);
+void cli_puts(cli *, int, const byte *, uint);
 #define cli_msg(x...) cli_printf(this_cli, x)
 void cli_set_log_echo(cli *, unsigned int mask, unsigned int size);
 
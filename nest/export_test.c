@@ -0,0 +1,142 @@
+/*
+ *	BIRD -- Tests of export coalescing
+ *
+ *	Run by `make check'. Exports the route of a peer to a protocol with
+ *	export delay, removes the peer while its withdrawal waits in the
+ *	queue and checks that the withdrawal is delivered before the peer
+ *	is freed.
+ */
+
+#include "nest/bird.h"
+#include "nest/route.h"
+#include "nest/protocol.h"
+#include "nest/iface.h"
+#include "conf/conf.h"
+#include "lib/event.h"
+#include "sysdep/unix/unix.h"
+#include "lib/test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static struct config cfg;
+static struct rtable_config tab_cf = { .name = "master" };
+static struct proto_config peer_cf = { .global = &cfg }, sink_cf = { .global = &cfg };
+static struct protocol proto_test = { .name = "Test" };
+static struct proto sink;
+static list peers;
+static rtable *tab;
+
+static uint announced, withdrawn;
+
+static void
+sink_notify(struct proto *p UNUSED, rtable *t UNUSED, net *n UNUSED, rte *new, rte *old UNUSED, ea_list *attrs UNUSED)
+{
+  if (new)
+    announced++;
+  else
+    withdrawn++;
+}
+
+/* A peer deleted by reconfiguration, freed when it is flushed */
+static struct proto *
+peer(void)
+{
+  struct proto *p = mb_allocz(&root_pool, sizeof(struct proto));
+
+  p->proto = &proto_test;
+  p->name = "peer";
+  p->cf = &peer_cf;
+  p->pool = rp_new(&root_pool, "peer");
+  p->table = tab;
+  p->proto_state = PS_UP;
+  p->core_state = FS_HAPPY;
+  p->reconfiguring = 1;
+  p->main_source = rt_get_source(p, 0);
+  p->main_ahook = proto_add_announce_hook(p, tab, &p->stats);
+  rt_lock_source(p->main_source);
+  rt_lock_table(tab);
+  add_tail(&active_proto_list, &p->n);
+  add_tail(&peers, &p->glob_node);
+  cfg.obstacle_count++;
+  return p;
+}
+
+static void
+add_route(struct proto *p, u32 prefix)
+{
+  rta a = {
+    .src = p->main_source,
+    .source = RTS_BGP,
+    .scope = SCOPE_UNIVERSE,
+    .cast = RTC_UNICAST,
+    .dest = RTD_BLACKHOLE,
+  };
+  net *n = net_get(tab, ipa_from_u32(prefix), 24);
+  rte *e = rte_get_temp(rta_lookup(&a));
+
+  e->net = n;
+  e->pflags = 0;
+  rte_update(p, n, e);
+}
+
+static void
+run_events(void)
+{
+  while (!EMPTY_LIST(global_event_list))
+    ev_run_list(&global_event_list);
+}
+
+int
+main(int argc UNUSED, char **argv)
+{
+  struct announce_hook *ah;
+  struct proto *p;
+
+  test_init();
+  if_init();
+  protos_build();
+
+  config = new_config = &cfg;
+  cfg_mem = lp_new(&root_pool, 4080);
+  cfg.obstacle_count = 1;
+  init_list(&peers);
+
+  init_list(&cfg.tables);
+  add_tail(&cfg.tables, &tab_cf.n);
+  rt_commit(&cfg, NULL);
+  tab = tab_cf.table;
+
+  sink.proto = &proto_test;
+  sink.name = "sink";
+  sink.cf = &sink_cf;
+  sink.pool = &root_pool;
+  sink.table = tab;
+  sink.rt_notify = sink_notify;
+  sink.accept_ra_types = RA_OPTIMAL;
+  sink.proto_state = PS_UP;
+  sink.core_state = FS_HAPPY;
+  sink.export_state = ES_READY;
+  ah = sink.main_ahook = proto_add_announce_hook(&sink, tab, &sink.stats);
+  ah->export_delay = 10;
+  add_tail(&active_proto_list, &sink.n);
+
+  /* The first change goes out at once, the next one waits for the delay */
+  p = peer();
+  add_route(p, 0x0a010000);
+  run_events();
+  CHECK(announced == 1);
+
+  /* The flush of the peer queues its withdrawal, which is delivered before the peer is gone */
+  proto_notify_state(p, PS_DOWN);
+  run_events();
+  CHECK(EMPTY_LIST(peers));
+  CHECK(withdrawn == 1);
+  CHECK(EMPTY_LIST(ah->export_queue));
+
+  /* Expiry of the delay has nothing left to deliver */
+  ah->export_timer->hook(ah->export_timer);
+  CHECK((announced == 1) && (withdrawn == 1));
+
+  return test_done(argv[0]);
+}
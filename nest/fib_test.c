@@ -0,0 +1,162 @@
+/*
+ *	BIRD -- Tests of ordered walks over FIB tries
+ *
+ *	Run by `make check'. Compares fib_next_in() with a brute force walk
+ *	over the hash and checks the networks trie_cover() finds for prefix
+ *	sets.
+ */
+
+#include "nest/bird.h"
+#include "nest/route.h"
+#include "filter/filter.h"
+#include "lib/resource.h"
+#include "lib/test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NODES 2000
+
+static struct fib fib;
+
+static int
+cmp_node(const void *a, const void *b)
+{
+  const struct fib_node *x = *(const struct fib_node **) a;
+  const struct fib_node *y = *(const struct fib_node **) b;
+
+  return ipa_compare(x->prefix, y->prefix) ? : (int) x->pxlen - (int) y->pxlen;
+}
+
+/* Networks within @a/@len, sorted */
+static int
+brute(ip_addr a, int len, struct fib_node **found)
+{
+  int n = 0;
+
+  FIB_WALK(&fib, e)
+    {
+      if ((e->pxlen >= len) && ipa_in_net(e->prefix, a, len))
+	found[n++] = e;
+    }
+  FIB_WALK_END;
+
+  qsort(found, n, sizeof(struct fib_node *), cmp_node);
+  return n;
+}
+
+static void
+check_walk(ip_addr a, int len)
+{
+  static struct fib_node *found[NODES];
+  struct fib_node *e;
+  ip_addr pos = IPA_NONE;
+  int poslen = -1;
+  int i = 0, n;
+
+  n = brute(a, len, found);
+  while (e = fib_next_in(&fib, a, len, &pos, &poslen))
+    {
+      CHECK((i < n) && (e == found[i]));
+      i++;
+    }
+  CHECK(i == n);
+}
+
+static ip_addr
+random_net(int *len)
+{
+  /* Mostly within 10.0.0.0/8 to get deep subtrees */
+  u32 a = (random() % 4) ? (0x0a000000 | (random() & 0xffffff)) : (u32) random();
+
+  *len = random() % 33;
+  return ipa_and(ipa_from_u32(a), ipa_mkmask(*len));
+}
+
+static void
+t_fib_walk(void)
+{
+  ip_addr a;
+  int i, len;
+
+  fib_init(&fib, &root_pool, sizeof(struct fib_node), 0, NULL);
+  fib_enable_trie(&fib);
+
+  for (i = 0; i < NODES; i++)
+    {
+      a = random_net(&len);
+      fib_get(&fib, &a, len);
+    }
+
+  check_walk(IPA_NONE, 0);
+  check_walk(ipa_from_u32(0x0a000000), 8);
+  check_walk(ipa_from_u32(0x0a800000), 9);
+  for (i = 0; i < 100; i++)
+    {
+      a = random_net(&len);
+      check_walk(a, len);
+    }
+
+  /* Deleting the last position does not disturb the walk */
+  {
+    ip_addr pos = IPA_NONE;
+    int poslen = -1, n = 0;
+    struct fib_node *e;
+
+    while (e = fib_next_in(&fib, IPA_NONE, 0, &pos, &poslen))
+      {
+	if (n++ % 3)
+	  fib_delete(&fib, e);
+      }
+    CHECK(n > NODES / 2);
+  }
+  check_walk(IPA_NONE, 0);
+
+  fib_free(&fib);
+}
+
+static void
+check_cover(struct f_trie *t, u32 a, int len)
+{
+  ip_addr px;
+  int plen;
+
+  trie_cover(t, &px, &plen);
+  CHECK(ipa_equal(px, ipa_from_u32(a)) && (plen == len));
+}
+
+static void
+t_trie_cover(void)
+{
+  linpool *lp = lp_new(&root_pool, 4080);
+  struct f_trie *t;
+
+  /* [10.1.0.0/16+, 10.2.0.0/16+] */
+  t = f_new_trie(lp, sizeof(struct f_trie_node));
+  trie_add_prefix(t, ipa_from_u32(0x0a010000), 16, 16, 32);
+  trie_add_prefix(t, ipa_from_u32(0x0a020000), 16, 16, 32);
+  check_cover(t, 0x0a000000, 14);
+
+  /* [10.1.2.0/24{20,28}] */
+  t = f_new_trie(lp, sizeof(struct f_trie_node));
+  trie_add_prefix(t, ipa_from_u32(0x0a010200), 24, 20, 28);
+  check_cover(t, 0x0a010000, 20);
+
+  /* [10.1.2.0/24, 0.0.0.0/0] */
+  trie_add_prefix(t, IPA_NONE, 0, 0, 0);
+  check_cover(t, 0, 0);
+
+  rfree(lp);
+}
+
+int
+main(int argc UNUSED, char **argv)
+{
+  test_init();
+  srandom(1);
+
+  t_fib_walk();
+  t_trie_cover();
+
+  return test_done(argv[0]);
+}
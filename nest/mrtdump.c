@@ -0,0 +1,411 @@
+/*
+ *	BIRD -- MRT Routing Table Dumps
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: MRT table dumps
+ *
+ * A routing table may be dumped to a file in the MRT TABLE_DUMP_V2
+ * format (RFC 6396), either periodically (see the &mrtdump table
+ * option) or on request from the CLI. The file starts with a
+ * PEER_INDEX_TABLE record listing the BGP protocols connected to the
+ * table, with index 0 standing for all other protocols, followed by one
+ * RIB record per network holding all its valid routes.
+ *
+ * The dump is written by an event walking the table with a &fib_iterator,
+ * a limited number of networks at a time, so that it does not block the
+ * main loop. The table is locked meanwhile. Records go through a stdio
+ * buffer to a temporary file, which is renamed to its final name when
+ * the dump is complete. The file name is passed to strftime(), so that
+ * periodic dumps can go to distinct files.
+ */
+
+#undef LOCAL_DEBUG
+
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "nest/bird.h"
+#include "nest/route.h"
+#include "nest/protocol.h"
+#include "nest/cli.h"
+#include "nest/mrtdump.h"
+#include "lib/resource.h"
+#include "lib/event.h"
+#include "lib/hash.h"
+#include "lib/string.h"
+#include "lib/alloca.h"
+#include "conf/conf.h"
+#include "sysdep/unix/unix.h"
+#include "sysdep/unix/timer.h"
+
+#ifdef CONFIG_BGP
+#include "proto/bgp/bgp.h"
+#endif
+
+#define MRT_DUMP_STEP		256		/* Networks dumped in one event */
+#define MRT_DUMP_BUF_SIZE	(1 << 18)	/* Maximum size of one record */
+#define MRT_DUMP_IO_SIZE	65536		/* Size of the stdio buffer */
+
+struct mrt_peer {
+  struct mrt_peer *next;
+  struct proto *proto;
+  uint index;
+};
+
+struct mrt_table_dump {
+  pool *pool;
+  rtable *table;
+  char *name, *tmp_name;		/* Final and temporary file name */
+  FILE *file;
+  struct fib_iterator fit;
+  struct event *event;
+  HASH(struct mrt_peer) peers;
+  byte *buf;
+  u32 seq;				/* Sequence number of the next RIB record */
+  uint routes, truncated;
+};
+
+#define MPE_KEY(n)		n->proto
+#define MPE_NEXT(n)		n->next
+#define MPE_EQ(a,b)		a == b
+#define MPE_FN(a)		u32_hash((u32) ((uintptr_t) a >> 4))
+
+#define MPE_REHASH		mrt_peer_rehash
+#define MPE_PARAMS		/8, *2, 2, 2, 4, 16
+
+HASH_DEFINE_REHASH_FN(MPE, struct mrt_peer)
+
+static inline byte *
+mrt_put_hdr(byte *buf, u16 type, u16 subtype, u32 len)
+{
+  put_u32(buf+0, now_real);
+  put_u16(buf+4, type);
+  put_u16(buf+6, subtype);
+  put_u32(buf+8, len);
+  return buf + MRTDUMP_HDR_LENGTH;
+}
+
+static inline byte *
+mrt_put_ipa(byte *buf, ip_addr a)
+{
+  ipa_hton(a);
+  memcpy(buf, &a, sizeof(a));
+  return buf + sizeof(a);
+}
+
+static void
+mrt_write_record(struct mrt_table_dump *d, u16 subtype, byte *end)
+{
+  mrt_put_hdr(d->buf, TABLE_DUMP_V2, subtype, end - d->buf - MRTDUMP_HDR_LENGTH);
+  fwrite(d->buf, end - d->buf, 1, d->file);
+}
+
+static byte *
+mrt_put_peer(byte *buf, u32 id, ip_addr ip, u32 as)
+{
+#ifdef IPV6
+  *buf++ = MRT_PEER_IPV6 | MRT_PEER_AS4;
+#else
+  *buf++ = MRT_PEER_AS4;
+#endif
+  put_u32(buf, id);
+  buf = mrt_put_ipa(buf + 4, ip);
+  put_u32(buf, as);
+  return buf + 4;
+}
+
+static void
+mrt_peer_index_table(struct mrt_table_dump *d)
+{
+  byte *buf = d->buf + MRTDUMP_HDR_LENGTH;
+  byte *cnt;
+  uint len = strlen(d->table->name);
+  uint n = 1;
+  struct proto_config *pc;
+
+  put_u32(buf, config->router_id);
+  put_u16(buf+4, len);
+  memcpy(buf+6, d->table->name, len);
+  buf += 6 + len;
+  cnt = buf;
+  buf += 2;
+
+  /* Index 0 stands for the router itself, i.e. all non-BGP routes */
+  buf = mrt_put_peer(buf, config->router_id, IPA_NONE, 0);
+
+#ifdef CONFIG_BGP
+  WALK_LIST(pc, config->protos)
+    {
+      struct bgp_proto *p = (struct bgp_proto *) pc->proto;
+
+      if ((pc->protocol != &proto_bgp) || !p || (p->p.table != d->table) || (n == 0xffff))
+	continue;
+
+      struct mrt_peer *pe = mb_alloc(d->pool, sizeof(struct mrt_peer));
+      pe->proto = &p->p;
+      pe->index = n++;
+      HASH_INSERT2(d->peers, MPE, d->pool, pe);
+
+      buf = mrt_put_peer(buf, p->remote_id, p->cf->remote_ip, p->remote_as);
+    }
+#endif
+
+  put_u16(cnt, n);
+  mrt_write_record(d, MRT_PEER_INDEX_TABLE, buf);
+}
+
+static int
+mrt_put_attrs(byte *buf, rte *e, int remains)
+{
+  rta *a = e->attrs;
+  ea_list *eal;
+  int i, j, len = 0;
+
+  if (!a->eattrs)
+    return 0;
+
+  /* Merge the attributes and keep just the BGP ones */
+  eal = alloca(ea_scan(a->eattrs));
+  ea_merge(a->eattrs, eal);
+  ea_sort(eal);
+
+  for (i = j = 0; i < eal->count; i++)
+    if (EA_PROTO(eal->attrs[i].id) == EAP_BGP)
+      eal->attrs[j++] = eal->attrs[i];
+  eal->count = j;
+
+  if (!eal->count)
+    return 0;
+
+#ifdef CONFIG_BGP
+  len = bgp_encode_mrt_attrs(buf, eal, remains);
+  if (len < 0)
+    return -1;
+
+#ifdef IPV6
+  /* Next hop goes to an abbreviated MP_REACH_NLRI, RFC 6396 4.3.4 */
+  eattr *nh = ea_find(eal, EA_CODE(EAP_BGP, BA_NEXT_HOP));
+  if (nh)
+    {
+      ip_addr *ip = (ip_addr *) nh->u.ptr->data;
+      int n = (nh->u.ptr->length > (int) sizeof(ip_addr)) && ipa_nonzero(ip[1]) ? 2 : 1;
+
+      if (remains - len < 4 + n * (int) sizeof(ip_addr))
+	return -1;
+
+      buf += len;
+      buf[0] = BAF_OPTIONAL;
+      buf[1] = BA_MP_REACH_NLRI;
+      buf[2] = 1 + n * sizeof(ip_addr);
+      buf[3] = n * sizeof(ip_addr);
+      for (i = 0; i < n; i++)
+	mrt_put_ipa(buf + 4 + i * sizeof(ip_addr), ip[i]);
+      len += 4 + n * sizeof(ip_addr);
+    }
+#endif
+#endif
+
+  return len;
+}
+
+static void
+mrt_rib_record(struct mrt_table_dump *d, net *n)
+{
+  byte *buf = d->buf + MRTDUMP_HDR_LENGTH;
+  byte *end = d->buf + MRT_DUMP_BUF_SIZE;
+  byte *cnt;
+  uint count = 0;
+  ip_addr px = n->n.prefix;
+  rte *e;
+
+  if (!n->routes)
+    return;
+
+  put_u32(buf, d->seq);
+  buf[4] = n->n.pxlen;
+  ipa_hton(px);
+  memcpy(buf+5, &px, (n->n.pxlen + 7) / 8);
+  buf += 5 + (n->n.pxlen + 7) / 8;
+  cnt = buf;
+  buf += 2;
+
+  for (e = n->routes; e; e = e->next)
+    {
+      struct mrt_peer *pe;
+      int len;
+
+      if (!rte_is_valid(e))
+	continue;
+
+      if ((count == 0xffff) || (end - buf < 8) ||
+	  ((len = mrt_put_attrs(buf + 8, e, end - buf - 8)) < 0))
+	{
+	  d->truncated++;
+	  break;
+	}
+
+      pe = HASH_FIND(d->peers, MPE, e->attrs->src->proto);
+      put_u16(buf, pe ? pe->index : 0);
+      put_u32(buf+2, now_real - (now - e->lastmod));
+      put_u16(buf+6, len);
+      buf += 8 + len;
+      count++;
+    }
+
+  if (!count)
+    return;
+
+  put_u16(cnt, count);
+#ifdef IPV6
+  mrt_write_record(d, MRT_RIB_IPV6_UNICAST, buf);
+#else
+  mrt_write_record(d, MRT_RIB_IPV4_UNICAST, buf);
+#endif
+  d->seq++;
+  d->routes += count;
+}
+
+static void
+mrt_table_dump_done(struct mrt_table_dump *d)
+{
+  rtable *t = d->table;
+  int err = fflush(d->file) || ferror(d->file);
+
+  if (err)
+    log(L_ERR "Dump of table %s to %s failed: %m", t->name, d->name);
+  else if (rename(d->tmp_name, d->name) < 0)
+    log(L_ERR "Dump of table %s: Cannot rename %s: %m", t->name, d->tmp_name);
+  else
+    log(L_INFO "Table %s dumped to %s: %u networks, %u routes%s", t->name, d->name,
+	d->seq, d->routes, d->truncated ? " (some networks truncated)" : "");
+
+  if (err)
+    unlink(d->tmp_name);
+
+  t->mrt_dump = NULL;
+  rfree(d->pool);			/* Closes the file as well */
+  rt_unlock_table(t);
+}
+
+static void
+mrt_table_dump_step(void *data)
+{
+  struct mrt_table_dump *d = data;
+  struct fib *fib = &d->table->fib;
+  int max = MRT_DUMP_STEP;
+
+  if (ferror(d->file))
+    {
+      fit_get(fib, &d->fit);
+      mrt_table_dump_done(d);
+      return;
+    }
+
+  FIB_ITERATE_START(fib, &d->fit, f)
+    {
+      if (!max--)
+	{
+	  FIB_ITERATE_PUT(&d->fit, f);
+	  ev_schedule(d->event);
+	  return;
+	}
+      mrt_rib_record(d, (net *) f);
+    }
+  FIB_ITERATE_END(f);
+
+  mrt_table_dump_done(d);
+}
+
+/**
+ * mrt_table_dump - start an MRT dump of a routing table
+ * @t: routing table
+ * @name: file name, formatted by strftime()
+ *
+ * This function opens the file and starts a dump of @t to it, which is
+ * then written in the background. Returns 0 on success, or -1 with
+ * errno set when the file cannot be created, or with errno zero when
+ * another dump of @t is in progress.
+ */
+int
+mrt_table_dump(rtable *t, char *name)
+{
+  struct mrt_table_dump *d;
+  time_t tt = now_real;
+  char fn[PATH_MAX];
+  pool *p;
+
+  errno = 0;
+  if (t->mrt_dump)
+    return -1;
+
+  if (!strftime(fn, sizeof(fn) - 8, name, localtime(&tt)))
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+  p = rp_new(&root_pool, "MRT table dump");
+  d = mb_allocz(p, sizeof(struct mrt_table_dump));
+  d->pool = p;
+  d->table = t;
+  d->name = mb_alloc(p, strlen(fn) + 1);
+  strcpy(d->name, fn);
+  d->tmp_name = mb_alloc(p, strlen(fn) + 5);
+  bsprintf(d->tmp_name, "%s.tmp", fn);
+
+  d->file = tracked_fopen(p, d->tmp_name, "w");
+  if (!d->file)
+    {
+      int e = errno;
+      rfree(p);
+      errno = e;
+      return -1;
+    }
+  setvbuf(d->file, mb_alloc(p, MRT_DUMP_IO_SIZE), _IOFBF, MRT_DUMP_IO_SIZE);
+
+  d->buf = mb_alloc(p, MRT_DUMP_BUF_SIZE);
+  HASH_INIT(d->peers, p, 4);
+  d->event = ev_new(p);
+  d->event->hook = mrt_table_dump_step;
+  d->event->data = d;
+
+  rt_lock_table(t);
+  t->mrt_dump = d;
+
+  mrt_peer_index_table(d);
+  FIB_ITERATE_INIT(&d->fit, &t->fib);
+  ev_schedule(d->event);
+  return 0;
+}
+
+void
+mrt_table_dump_cmd(rtable *t, char *name)
+{
+  if (cli_access_restricted())
+    return;
+
+  if (!name)
+    name = t->config->mrt_file;
+  if (!name)
+    {
+      cli_msg(8009, "No MRT dump file configured for table %s", t->name);
+      return;
+    }
+
+  if (mrt_table_dump(t, name) < 0)
+    {
+      if (errno)
+	cli_msg(8009, "Cannot create %s: %m", name);
+      else
+	cli_msg(8009, "Dump of table %s already in progress", t->name);
+      return;
+    }
+
+  cli_msg(0, "Dumping table %s", t->name);
+}
@@ -8,6 +8,7 @@
 #ifndef MRTDUMP_H
 #define MRTDUMP_H
 #include "nest/protocol.h"
+#include "nest/route.h"
 
 /* MRTDump values */
 
@@ -15,6 +16,7 @@
 
 /* MRTdump types */
 
+#define TABLE_DUMP_V2		13
 #define BGP4MP			16
 
 /* MRTdump subtypes */
@@ -23,6 +25,18 @@
 #define BGP4MP_MESSAGE_AS4	4
 #define BGP4MP_STATE_CHANGE_AS4	5
 
+#define MRT_PEER_INDEX_TABLE	1
+#define MRT_RIB_IPV4_UNICAST	2
+#define MRT_RIB_IPV6_UNICAST	4
+
+/* Peer types in PEER_INDEX_TABLE */
+
+#define MRT_PEER_IPV6		0x01
+#define MRT_PEER_AS4		0x02
+
+/* mrtdump.c */
+int mrt_table_dump(rtable *t, char *name);
+void mrt_table_dump_cmd(rtable *t, char *name);
 
 /* implemented in sysdep */
 void mrt_dump_message(struct proto *p, u16 type, u16 subtype, byte *buf, u32 len);
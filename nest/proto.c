@@ -178,6 +178,8 @@ proto_add_announce_hook(struct proto *p, struct rtable *t, struct proto_stats *s
   h->table = t;
   h->proto = p;
   h->stats = stats;
+  h->export_delay = -1;
+  init_list(&h->export_queue);
 
   h->next = p->ahooks;
   p->ahooks = h;
@@ -223,7 +225,10 @@ proto_unlink_ahooks(struct proto *p)
 
   if (p->rt_notify)
     for(h=p->ahooks; h; h=h->next)
+    {
       rem_node(&h->n);
+      rt_export_cancel(h);
+    }
 }
 
 static void
@@ -273,6 +278,7 @@ proto_config_new(struct protocol *pr, int class)
   c->preference = pr->preference;
   c->class = class;
   c->out_filter = FILTER_REJECT;
+  c->export_delay = -1;
   c->table = c->global->master_rtc;
   c->debug = new_config->proto_default_debug;
   c->mrtdump = new_config->proto_default_mrtdump;
@@ -442,6 +448,7 @@ proto_reconfigure(struct proto *p, struct proto_config *oc, struct proto_config
       ah->in_limit = nc->in_limit;
       ah->out_limit = nc->out_limit;
       ah->in_keep_filtered = nc->in_keep_filtered;
+      ah->export_delay = nc->export_delay;
       proto_verify_limits(ah);
     }
 
@@ -525,6 +532,14 @@ protos_commit(struct config *new, struct config *old, int force_reconfig, int ty
   struct symbol *sym;
 
   DBG("protos_commit:\n");
+
+  /* ROA revalidation finds networks in the trie, see rt_roa_changed() */
+  WALK_LIST(nc, new->protos)
+    if (nc->table && !nc->table->fib_trie && nc->in_keep_filtered &&
+	f_uses_roa(nc->in_filter, NULL) && !f_modifies_rte(nc->in_filter))
+      log(L_WARN "Table %s has no trie, ROA revalidation of protocol %s walks all its networks",
+	  nc->table->name, nc->name);
+
   if (old)
     {
       WALK_LIST(oc, old->protos)
@@ -928,6 +943,9 @@ protos_build(void)
   proto_build(&proto_bfd);
   bfd_init_all();
 #endif
+#ifdef CONFIG_RPKI
+  proto_build(&proto_rpki);
+#endif
 
   proto_pool = rp_new(&root_pool, "Protocols");
   proto_flush_event = ev_new(proto_pool);
@@ -1015,7 +1033,10 @@ proto_schedule_flush_loop(void)
   {
     p->flushing = 1;
     for (h=p->ahooks; h; h=h->next)
+    {
+      rt_import_cancel(h);
       rt_mark_for_prune(h->table);
+    }
   }
 
   ev_schedule(proto_flush_event);
@@ -1033,6 +1054,7 @@ proto_flush_loop(void *unused UNUSED)
       return;
     }
 
+  rt_export_flush();
   rt_prune_sources();
 
  again:
@@ -1239,6 +1261,7 @@ proto_want_core_up(struct proto *p)
       p->main_ahook->in_limit = p->cf->in_limit;
       p->main_ahook->out_limit = p->cf->out_limit;
       p->main_ahook->in_keep_filtered = p->cf->in_keep_filtered;
+      p->main_ahook->export_delay = p->cf->export_delay;
 
       proto_reset_limit(p->main_ahook->rx_limit);
       proto_reset_limit(p->main_ahook->in_limit);
@@ -1295,6 +1318,7 @@ proto_falling_down(struct proto *p)
 {
   p->gr_recovery = 0;
   p->gr_wait = 0;
+  rt_snapshot_cancel(p);
   if (p->gr_lock)
     proto_graceful_restart_unlock(p);
 }
@@ -1464,6 +1488,8 @@ proto_show_stats(struct proto_stats *s, int in_keep_filtered)
 	  s->exp_updates_filtered, s->exp_updates_accepted);
   cli_msg(-1006, "    Export withdraws:   %10u        ---        ---        --- %10u",
 	  s->exp_withdraws_received, s->exp_withdraws_accepted);
+  if (s->exp_updates_coalesced)
+    cli_msg(-1006, "    Export coalesced:   %10u", s->exp_updates_coalesced);
 }
 
 void
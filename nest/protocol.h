@@ -76,7 +76,7 @@ void protos_dump_all(void);
 
 extern struct protocol
   proto_device, proto_radv, proto_rip, proto_static,
-  proto_ospf, proto_pipe, proto_bgp, proto_bfd;
+  proto_ospf, proto_pipe, proto_bgp, proto_bfd, proto_rpki;
 
 /*
  *	Routing Protocol Instance
@@ -93,6 +93,7 @@ struct proto_config {
   u32 debug, mrtdump;			/* Debugging bitfields, both use D_* constants */
   unsigned preference, disabled;	/* Generic parameters */
   int in_keep_filtered;			/* Routes rejected in import filter are kept */
+  int roa_reload;			/* Reload and refeed after changes of ROA tables */
   u32 router_id;			/* Protocol specific router ID */
   struct rtable_config *table;		/* Table we're attached to */
   struct filter *in_filter, *out_filter; /* Attached filters */
@@ -100,6 +101,7 @@ struct proto_config {
 					   (relevant when in_keep_filtered is active) */
   struct proto_limit *in_limit;		/* Limit for importing routes from protocol */
   struct proto_limit *out_limit;	/* Limit for exporting routes to protocol */
+  int export_delay;			/* Coalesce exports for this many seconds, -1 if not */
 
   byte link_latency;
   byte link_bandwidth;
@@ -134,6 +136,7 @@ struct proto_stats {
   u32 exp_updates_accepted;	/* Number of route updates accepted and exported */
   u32 exp_withdraws_received;	/* Number of route withdraws received */
   u32 exp_withdraws_accepted;	/* Number of route withdraws accepted and processed */
+  u32 exp_updates_coalesced;	/* Number of route changes superseded before export */
 };
 
 struct proto {
@@ -158,8 +161,10 @@ struct proto {
   byte refeeding;			/* We are refeeding (valid only if export_state == ES_FEEDING) */
   byte flushing;			/* Protocol is flushed in current flush loop round */
   byte gr_recovery;			/* Protocol should participate in graceful restart recovery */
+  byte roa_warned;			/* Missing roa reload has been reported */
   byte gr_lock;				/* Graceful restart mechanism should wait for this proto */
   byte gr_wait;				/* Route export to protocol is postponed until graceful restart */
+  byte snap_restored;			/* Routes restored from a table snapshot are waiting for refresh */
   byte down_sched;			/* Shutdown is scheduled for later (PDS_*) */
   byte down_code;			/* Reason for shutdown (PDC_* codes) */
   u32 hash_key;				/* Random key used for hashing of neighbors */
@@ -456,8 +461,17 @@ struct announce_hook {
   struct proto_stats *stats;		/* Per-table protocol statistics */
   struct announce_hook *next;		/* Next hook for the same protocol */
   int in_keep_filtered;			/* Routes rejected in import filter are kept */
+  byte roa_reval;			/* Routes wait for ROA revalidation (AHR_*) */
+  int export_delay;			/* Coalesce exports for this many seconds, -1 if not */
+  list export_queue;			/* Coalesced exports waiting for delivery */
+  struct event *export_event;		/* Delivers export_queue */
+  struct timer *export_timer;		/* Delays export_event by export_delay */
+  bird_clock_t export_last;		/* Last delivery of export_queue */
 };
 
+#define AHR_NEXT	1		/* In the next revalidation pass of the table */
+#define AHR_NOW		2		/* In the current revalidation pass */
+
 struct announce_hook *proto_add_announce_hook(struct proto *p, struct rtable *t, struct proto_stats *stats);
 struct announce_hook *proto_find_announce_hook(struct proto *p, struct rtable *t);
 
@@ -0,0 +1,208 @@
+/*
+ *	BIRD -- Tests of ROA revalidation
+ *
+ *	Run by `make check'. Imports routes through a filter rejecting
+ *	ROA invalid ones, changes the ROA table and checks that just the
+ *	routes whose verdict changed are updated, without importing them
+ *	again. Tables with and without the trie option are walked in
+ *	different ways, both are checked.
+ */
+
+#include "nest/bird.h"
+#include "nest/route.h"
+#include "nest/protocol.h"
+#include "nest/attrs.h"
+#include "conf/conf.h"
+#include "filter/filter.h"
+#include "lib/event.h"
+#include "lib/unaligned.h"
+#include "sysdep/unix/unix.h"
+#include "lib/test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define P(a,b) ((a<<8) | b)
+
+static struct config cfg;
+static struct rtable_config tab_cf[2] = { { .name = "master" }, { .name = "trie", .fib_trie = 1 } };
+static struct proto_config proto_cf;
+static struct roa_table_config roa_cf = { .name = "roa" };
+static struct include_file_stack file = { .file_name = "roa_test" };
+static struct protocol proto_test = { .name = "Test" };
+static struct proto protos[2], *proto;
+static struct roa_table *roa;
+static rtable *tab;
+
+/* if roa_check(roa) = ROA_INVALID then reject; accept; */
+static struct filter *
+roa_filter(void)
+{
+  struct f_inst_roa_check *rc = cfg_allocz(sizeof(struct f_inst_roa_check));
+  struct f_inst *inv = f_new_inst(), *eq = f_new_inst(), *i = f_new_inst();
+  struct f_inst *rej = f_new_inst(), *acc = f_new_inst();
+  struct filter *f = cfg_allocz(sizeof(struct filter));
+
+  rc->i.code = P('R','C');
+  rc->rtc = &roa_cf;
+
+  inv->code = 'c';
+  inv->aux = T_ENUM_ROA;
+  inv->a2.i = ROA_INVALID;
+
+  eq->code = P('=','=');
+  eq->a1.p = &rc->i;
+  eq->a2.p = inv;
+
+  rej->code = acc->code = P('p',',');
+  rej->a2.i = F_REJECT;
+  acc->a2.i = F_ACCEPT;
+
+  i->code = '?';
+  i->a1.p = eq;
+  i->a2.p = rej;
+  i->next = acc;
+
+  f->name = "roa";
+  f->root = i;
+  return f;
+}
+
+static void
+add_route(u32 prefix, u32 asn)
+{
+  struct adata *path = cfg_allocz(sizeof(struct adata) + 6);
+  ea_list *eal = cfg_allocz(sizeof(ea_list) + sizeof(eattr));
+
+  path->length = 6;
+  path->data[0] = AS_PATH_SEQUENCE;
+  path->data[1] = 1;
+  put_u32(path->data + 2, asn);
+
+  /* 0x02 is BA_AS_PATH, as in roa_check() */
+  eal->count = 1;
+  eal->attrs[0] = (eattr) { .id = EA_CODE(EAP_BGP, 0x02), .type = EAF_TYPE_AS_PATH, .u.ptr = path };
+
+  rta a = {
+    .src = proto->main_source,
+    .source = RTS_BGP,
+    .scope = SCOPE_UNIVERSE,
+    .cast = RTC_UNICAST,
+    .dest = RTD_BLACKHOLE,
+    .eattrs = eal,
+  };
+  net *n = net_get(tab, ipa_from_u32(prefix), 24);
+  rte *e = rte_get_temp(rta_lookup(&a));
+
+  e->net = n;
+  e->pflags = 0;
+  rte_update(proto, n, e);
+}
+
+static int
+filtered(u32 prefix)
+{
+  net *n = net_find(tab, ipa_from_u32(prefix), 24);
+  return n && n->routes && (n->routes->flags & REF_FILTERED);
+}
+
+/* Verdicts applied so far, accepted or filtered */
+static u32
+updates(void)
+{
+  return proto->stats.imp_updates_accepted + proto->stats.imp_updates_filtered;
+}
+
+static void
+run_events(void)
+{
+  while (!EMPTY_LIST(global_event_list))
+    ev_run_list(&global_event_list);
+}
+
+/* Revalidation in table @k, walked in subtrees with a trie or whole without it */
+static void
+t_reval(int k)
+{
+  struct proto_stats *s;
+  u32 u;
+  int i;
+
+  tab = tab_cf[k].table;
+  proto = &protos[k];
+  s = &proto->stats;
+
+  proto->proto = &proto_test;
+  proto->name = "peer";
+  proto->cf = &proto_cf;
+  proto->pool = &root_pool;
+  proto->table = tab;
+  proto->proto_state = PS_UP;
+  proto->main_source = rt_get_source(proto, 0);
+  proto->main_ahook = proto_add_announce_hook(proto, tab, &proto->stats);
+  proto->main_ahook->in_filter = roa_filter();
+  proto->main_ahook->in_keep_filtered = 1;
+  add_tail(&active_proto_list, &proto->n);
+
+  /* 10.1.i.0/24 from AS 65001 or 65002, 10.2.i.0/24 from AS 65002 */
+  for (i = 0; i < 100; i++)
+    {
+      add_route(0x0a010000 + (i << 8), (i % 2) ? 65002 : 65001);
+      add_route(0x0a020000 + (i << 8), 65002);
+    }
+  run_events();
+  CHECK(s->imp_updates_received == 200);
+  CHECK(!filtered(0x0a010100) && !filtered(0x0a020100));
+
+  /* Routes of AS 65002 in 10.1.0.0/16 become invalid, others are kept */
+  u = updates();
+  roa_add_item(roa, ipa_from_u32(0x0a010000), 16, 24, 65001, ROA_SRC_DYNAMIC);
+  run_events();
+  CHECK(updates() - u == 50);
+  CHECK(!filtered(0x0a010000) && filtered(0x0a010100) && !filtered(0x0a020100));
+
+  /* A ROA of AS 65002 makes them valid again, ROA of 10.3.0.0/16 changes nothing */
+  u = updates();
+  roa_add_item(roa, ipa_from_u32(0x0a010000), 16, 24, 65002, ROA_SRC_DYNAMIC);
+  roa_add_item(roa, ipa_from_u32(0x0a030000), 16, 24, 65002, ROA_SRC_DYNAMIC);
+  run_events();
+  CHECK(updates() - u == 50);
+  CHECK(!filtered(0x0a010000) && !filtered(0x0a010100));
+
+  /* Without any ROA, all routes are unknown and none is updated */
+  u = updates();
+  roa_flush(roa, ROA_SRC_DYNAMIC);
+  run_events();
+  CHECK(updates() - u == 0);
+  CHECK(s->imp_updates_received == 200);
+  CHECK(!filtered(0x0a010100) && !filtered(0x0a020100));
+
+  CHECK(!!tab->fib.trie_slab == k);
+}
+
+int
+main(int argc UNUSED, char **argv)
+{
+  test_init();
+  roa_init();
+  protos_build();
+
+  config = new_config = &cfg;
+  cfg_mem = lp_new(&root_pool, 4080);
+  ifs = &file;
+
+  roa_preconfig(&cfg);
+  add_tail(&cfg.roa_tables, &roa_cf.n);
+  roa_commit(&cfg, NULL);
+  roa = roa_cf.table;
+
+  init_list(&cfg.tables);
+  add_tail(&cfg.tables, &tab_cf[0].n);
+  add_tail(&cfg.tables, &tab_cf[1].n);
+  rt_commit(&cfg, NULL);
+
+  t_reval(0);
+  t_reval(1);
+
+  return test_done(argv[0]);
+}
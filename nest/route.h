@@ -12,6 +12,7 @@
 #include "lib/lists.h"
 #include "lib/resource.h"
 #include "lib/timer.h"
+#include "lib/hash.h"
 #include "nest/protocol.h"
 
 struct protocol;
@@ -62,12 +63,18 @@ struct fib {
   unsigned int entries;			/* Number of entries */
   unsigned int entries_min, entries_max;/* Entry count limits (else start rehashing) */
   fib_init_func init;			/* Constructor */
+  struct fib_trie *trie;		/* Longest-match index, if enabled */
+  slab *trie_slab;
 };
 
 void fib_init(struct fib *, pool *, unsigned node_size, unsigned hash_order, fib_init_func init);
 void *fib_find(struct fib *, ip_addr *, int);	/* Find or return NULL if doesn't exist */
 void *fib_get(struct fib *, ip_addr *, int); 	/* Find or create new if nonexistent */
 void *fib_route(struct fib *, ip_addr, int);	/* Longest-match routing lookup */
+void *fib_route_match(struct fib *, ip_addr, int, int (*)(struct fib_node *)); /* The same, for nodes accepted by a predicate */
+int fib_covering(struct fib *, ip_addr, int, struct fib_node **); /* All nodes covering a network */
+void fib_enable_trie(struct fib *);	/* Index nodes for faster longest-match lookups */
+void *fib_next_in(struct fib *, ip_addr, int, ip_addr *, int *); /* Walk nodes within a network, in prefix order */
 void fib_delete(struct fib *, void *);	/* Remove fib entry */
 void fib_free(struct fib *);		/* Destroy the fib */
 void fib_check(struct fib *);		/* Consistency check for debugging */
@@ -122,6 +129,12 @@ struct rtable_config {
   int gc_max_ops;			/* Maximum number of operations before GC is run */
   int gc_min_time;			/* Minimum time between two consecutive GC runs */
   byte sorted;				/* Routes of network are sorted according to rte_better() */
+  uint import_batch;			/* Updates applied at once from the import queue, 0 if not queued */
+  byte fib_trie;			/* Longest-match lookups use a trie */
+  char *mrt_file;			/* MRT dump file name, formatted by strftime() */
+  uint mrt_period;			/* Time between periodic MRT dumps, 0 for none */
+  char *snap_file;			/* Table snapshot file name */
+  uint snap_period;			/* Time between periodic snapshots, 0 for none */
 };
 
 typedef struct rtable {
@@ -143,9 +156,22 @@ typedef struct rtable {
   byte gc_scheduled;			/* GC is scheduled */
   byte prune_state;			/* Table prune state, 1 -> scheduled, 2-> running */
   byte hcu_scheduled;			/* Hostcache update is scheduled */
-  byte nhu_state;			/* Next Hop Update state */
   struct fib_iterator prune_fit;	/* Rtable prune FIB iterator */
-  struct fib_iterator nhu_fit;		/* Next Hop Update FIB iterator */
+  list nhu_list;			/* Changed hostentries waiting for Next Hop Update */
+  list import_queue;			/* Updates waiting to be applied (struct rt_import) */
+  HASH(struct rt_import) import_hash;	/* The same, by hook, prefix and source */
+  slab *import_slab;
+  struct event *import_event;
+  HASH(struct rt_export) export_hash;	/* Coalesced exports, by hook and prefix */
+  slab *export_slab;
+  byte export_batch;			/* Exports are queued for rte_update_batch() */
+  struct mrt_table_dump *mrt_dump;	/* MRT dump in progress */
+  struct timer *mrt_timer;		/* Periodic MRT dumps */
+  struct snap_writer *snap_writer;	/* Snapshot being written */
+  struct snap_map *snap_map;		/* Snapshot loaded at startup */
+  struct timer *snap_timer;		/* Periodic snapshots */
+  struct rt_reval *reval;		/* ROA revalidation in progress */
+  struct rt_reval *reval_next;		/* Networks waiting for the next revalidation */
 } rtable;
 
 #define RPS_NONE	0
@@ -169,6 +195,12 @@ struct hostcache {
   byte update_hostcache;
 };
 
+struct hostdep {
+  struct hostdep *next;			/* Next in hash chain or in update list */
+  ip_addr prefix;			/* Network of the dependent table */
+  int pxlen;
+};
+
 struct hostentry {
   node ln;
   ip_addr addr;				/* IP address of host, part of key */
@@ -182,6 +214,9 @@ struct hostentry {
   ip_addr gw;				/* Chosen next hop */
   byte dest;				/* Chosen route destination type (RTD_...) */
   u32 igp_metric;			/* Chosen route IGP metric */
+  HASH(struct hostdep) deps;		/* Networks of dependent table with routes using this entry */
+  struct hostdep *nhu_deps;		/* Networks waiting for Next Hop Update */
+  node nhu_node;			/* In nhu_list of dependent table if nhu_deps is set */
 };
 
 typedef struct rte {
@@ -196,10 +231,9 @@ typedef struct rte {
   union {				/* Protocol-dependent data (metrics etc.) */
 #ifdef CONFIG_RIP
     struct {
-      node garbage;			/* List for garbage collection */
-      byte metric;			/* RIP metric */
+      struct rip_rte_link *link;	/* Garbage collection data, kept out of line */
       u16 tag;				/* External route tag */
-      struct rip_entry *entry;
+      byte metric;			/* RIP metric */
     } rip;
 #endif
 #ifdef CONFIG_OSPF
@@ -260,11 +294,26 @@ static inline net *net_get(rtable *tab, ip_addr addr, unsigned len) { return (ne
 rte *rte_find(net *net, struct rte_src *src);
 rte *rte_get_temp(struct rta *);
 void rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src);
+
+#define RTE_BATCH_SIZE 256
+
+struct rte_batch {			/* Networks for rte_update_batch() */
+  uint count;
+  ip_addr prefix[RTE_BATCH_SIZE];
+  byte pxlen[RTE_BATCH_SIZE];
+};
+
+void rte_update_batch(struct announce_hook *ah, struct rte_src *src, rte *tmpl, struct rte_batch *b);
 static inline void rte_update(struct proto *p, net *net, rte *new) { rte_update2(p->main_ahook, net, new, p->main_source); }
+void rte_update_verdict(struct announce_hook *ah, rte *new, struct rte_src *src, int accept);
+void rt_import_cancel(struct announce_hook *ah);
+void rt_export_cancel(struct announce_hook *ah);
+void rt_export_flush(void);
 void rte_discard(rtable *tab, rte *old);
 int rt_examine(rtable *t, ip_addr prefix, int pxlen, struct proto *p, struct filter *filter);
 void rt_refresh_begin(rtable *t, struct announce_hook *ah);
 void rt_refresh_end(rtable *t, struct announce_hook *ah);
+void rte_restore(struct announce_hook *ah, net *net, rte *new);
 void rte_dump(rte *);
 void rte_free(rte *);
 rte *rte_do_cow(rte *);
@@ -273,6 +322,9 @@ void rt_dump(rtable *);
 void rt_dump_all(void);
 int rt_feed_baby(struct proto *p);
 void rt_feed_baby_abort(struct proto *p);
+void rt_feed_net(struct announce_hook *ah, net *n, rte *old);
+struct roa_table;
+void rt_roa_changed(struct roa_table *t);
 int rt_prune_loop(void);
 struct rtable_config *rt_new_table(struct symbol *s);
 
@@ -292,12 +344,18 @@ struct rt_show_data {
   struct filter *filter;
   int verbose;
   struct fib_iterator fit;
+  int walk_trie;			/* Walk the trie within walk_prefix instead */
+  ip_addr walk_prefix, walk_pos;
+  int walk_pxlen, walk_poslen;
   struct proto *show_protocol;
   struct proto *export_protocol;
   int export_mode, primary_only, filtered;
   struct config *running_on_config;
   int net_counter, rt_counter, show_counter;
-  int stats, show_for;
+  int stats, show_for, json;
+  uint work;				/* Filter runs and shown routes in this step */
+  pool *memo_pool;			/* Set when filter verdicts may be reused */
+  HASH(struct rt_show_memo) memo;	/* Filter verdicts by rta */
 };
 void rt_show(struct rt_show_data *);
 
@@ -307,6 +365,15 @@ void rt_show(struct rt_show_data *);
 #define RSEM_EXPORT	2		/* Routes accepted by export filter */
 #define RSEM_NOEXPORT	3		/* Routes rejected by export filter */
 
+/* Table snapshots, rt-snap.c */
+int rt_snapshot_write(rtable *t);
+void rt_snapshot_shutdown(void);
+void rt_snapshot_open(rtable *t);
+void rt_snapshot_close(rtable *t);
+void rt_snapshot_restore(struct proto *p);
+void rt_snapshot_end(struct proto *p);
+void rt_snapshot_cancel(struct proto *p);
+
 /*
  *	Route Attributes
  *
@@ -332,24 +399,36 @@ struct rte_src {
 };
 
 
+/*
+ * Fields used by route selection and the attribute cache lookup come
+ * first, so that they share a cache line; the hash chain, which is
+ * only walked when looking up or freeing a cached rta, is kept last.
+ *
+ * The colder next hop fields (from, iface, hostentry, nexthops) and the
+ * hash chain stay inline: all of them but the chain are part of the key
+ * compared by rta_same() on each cache lookup, and cached rtas are shared
+ * by all routes with the same attributes, so moving them out of line
+ * would add an allocation and a dereference to each lookup while saving
+ * almost no memory per route (see the fill test in nest/route_test.c).
+ */
 typedef struct rta {
-  struct rta *next, **pprev;		/* Hash chain */
   struct rte_src *src;			/* Route source that created the route */
+  struct ea_list *eattrs;		/* Extended Attribute chain */
   unsigned uc;				/* Use count */
+  u32 hash_key;				/* Hash over important fields */
   byte source;				/* Route source (RTS_...) */
   byte scope;				/* Route scope (SCOPE_... -- see ip.h) */
   byte cast;				/* Casting type (RTC_...) */
   byte dest;				/* Route destination type (RTD_...) */
   byte flags;				/* Route flags (RTF_...), now unused */
   byte aflags;				/* Attribute cache flags (RTAF_...) */
-  u16 hash_key;				/* Hash over important fields */
   u32 igp_metric;			/* IGP metric to next hop (for iBGP routes) */
   ip_addr gw;				/* Next hop */
   ip_addr from;				/* Advertising router */
-  struct hostentry *hostentry;		/* Hostentry for recursive next-hops */
   struct iface *iface;			/* Outgoing interface */
+  struct hostentry *hostentry;		/* Hostentry for recursive next-hops */
   struct mpnh *nexthops;		/* Next-hops for multipath routes */
-  struct ea_list *eattrs;		/* Extended Attribute chain */
+  struct rta *next;			/* Hash chain */
 } rta;
 
 #define RTS_DUMMY 0			/* Dummy route to be removed soon */
@@ -482,7 +561,9 @@ void rta__free(rta *r);
 static inline void rta_free(rta *r) { if (r && !--r->uc) rta__free(r); }
 void rta_dump(rta *);
 void rta_dump_all(void);
+void rta_show_stats(void);
 void rta_show(struct cli *, rta *, ea_list *);
+void rta_format_json(buffer *b, rta *a, ea_list *eal);
 void rta_set_recursive_next_hop(rtable *dep, rta *a, rtable *tab, ip_addr *gw, ip_addr *ll);
 
 /*
@@ -534,7 +615,26 @@ struct roa_item {
 struct roa_node {
   struct fib_node n;
   struct roa_item *items;
-  // u32 cached_asn;
+};
+
+struct roa_cache_entry {
+  ip_addr prefix;
+  u32 asn;
+  u32 gen;				/* Valid if equal to cache_gen of the table */
+  byte pxlen;
+  byte result;				/* ROA_* value */
+};
+
+struct roa_change {
+  ip_addr prefix;
+  byte pxlen;
+};
+
+struct roa_stats {
+  u32 checks;				/* Calls of roa_check() */
+  u32 cache_hits;			/* Checks answered from the cache */
+  u32 nodes;				/* Covering nodes examined by other checks */
+  u32 invalidations;			/* Changes of ROA entries flushing the cache */
 };
 
 struct roa_table {
@@ -542,6 +642,14 @@ struct roa_table {
   struct fib fib;
   char *name;				/* Name of this ROA table */
   struct roa_table_config *cf;		/* Configuration of this ROA table */
+  struct roa_cache_entry *cache;	/* Validation results, ROA_CACHE_SIZE entries */
+  u32 cache_gen;			/* Current generation of the cache */
+  u32 items;				/* Number of ROA entries */
+  struct roa_stats stats;
+  struct roa_change *changes;		/* Changed prefixes, ROA_CHANGES_MAX entries */
+  u32 changes_count;
+  int changes_all;			/* Too many changes to be listed */
+  struct event *reval_event;		/* Revalidation of dependent routes */
 };
 
 struct roa_item_config {
@@ -579,16 +687,23 @@ struct roa_show_data {
 #define ROA_SRC_ANY	0
 #define ROA_SRC_CONFIG	1
 #define ROA_SRC_DYNAMIC	2
+#define ROA_SRC_RECONF	3	/* Configured entries during reconfiguration */
+#define ROA_SRC_RPKI	4	/* First of sources of RPKI protocols */
 
 #define ROA_SHOW_ALL	0
 #define ROA_SHOW_PX	1
 #define ROA_SHOW_IN	2
 #define ROA_SHOW_FOR	3
+#define ROA_SHOW_STATS	4
+
+#define ROA_CACHE_ORDER	12		/* Entries of validation cache per table */
+#define ROA_CACHE_SIZE	(1 << ROA_CACHE_ORDER)
+#define ROA_CHANGES_MAX	1024		/* Changed prefixes kept for revalidation */
 
 extern struct roa_table *roa_table_default;
 
 void roa_add_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src);
-void roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src);
+int roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src);
 void roa_flush(struct roa_table *t, byte src);
 byte roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn);
 struct roa_table_config * roa_new_table_config(struct symbol *s);
@@ -0,0 +1,128 @@
+/*
+ *	BIRD -- Size report of route structures
+ *
+ *	Run by `make check'. Prints the sizes of the structures kept per
+ *	route and fails if struct rte no longer fits a 64-byte cache line
+ *	on 64-bit builds. It took 80 bytes there while RIP kept its garbage
+ *	list node inline in the protocol-dependent union. Then fills a table
+ *	with routes sharing a few sets of attributes and reports the memory
+ *	of tables and attributes before and after.
+ */
+
+#include "nest/bird.h"
+#include "nest/route.h"
+#include "nest/protocol.h"
+#include "conf/conf.h"
+#include "lib/event.h"
+#include "lib/test.h"
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define SHOW(t) printf("  %-24s %3u bytes\n", #t, (uint) sizeof(t))
+#define SHOW_AT(t, f) printf("  %-24s at %3u\n", #t "." #f, (uint) offsetof(t, f))
+
+#define ROUTES 10000
+#define VARIANTS 16
+
+extern pool *rt_table_pool, *rta_pool;
+
+static struct config cfg;
+static struct rtable_config tab_cf = { .name = "master" };
+static struct proto_config proto_cf;
+static struct protocol proto_test = { .name = "Test" };
+static struct proto proto;
+
+static void
+t_sizes(void)
+{
+  rte e;
+
+  SHOW(rte);
+  SHOW(e.u);
+#ifdef CONFIG_RIP
+  SHOW(e.u.rip);
+#endif
+#ifdef CONFIG_OSPF
+  SHOW(e.u.ospf);
+#endif
+  SHOW(e.u.krt);
+  SHOW(rta);
+  SHOW_AT(rta, eattrs);
+  SHOW_AT(rta, next);
+  SHOW(net);
+
+  /* struct rte is larger than a cache line */
+  CHECK((sizeof(void *) != 8) || (sizeof(rte) <= 64));
+}
+
+/* Routes 10.x.y.0/24 with VARIANTS different IGP metrics */
+static void
+t_fill(void)
+{
+  rtable *tab = tab_cf.table;
+  size_t tab0 = rmemsize(rt_table_pool), rta0 = rmemsize(rta_pool);
+  size_t tab1, rta1;
+  uint i;
+
+  proto.proto = &proto_test;
+  proto.name = "fill";
+  proto.cf = &proto_cf;
+  proto.pool = &root_pool;
+  proto.table = tab;
+  proto.proto_state = PS_UP;
+  proto.main_source = rt_get_source(&proto, 0);
+  proto.main_ahook = proto_add_announce_hook(&proto, tab, &proto.stats);
+  add_tail(&active_proto_list, &proto.n);
+
+  for (i = 0; i < ROUTES; i++)
+    {
+      rta a = {
+	.src = proto.main_source,
+	.source = RTS_STATIC,
+	.scope = SCOPE_UNIVERSE,
+	.cast = RTC_UNICAST,
+	.dest = RTD_BLACKHOLE,
+	.igp_metric = i % VARIANTS,
+      };
+      net *n = net_get(tab, ipa_from_u32(0x0a000000 + (i << 8)), 24);
+      rte *e = rte_get_temp(rta_lookup(&a));
+
+      e->net = n;
+      e->pflags = 0;
+      rte_update(&proto, n, e);
+    }
+
+  while (!EMPTY_LIST(global_event_list))
+    ev_run_list(&global_event_list);
+
+  CHECK(proto.stats.imp_routes == ROUTES);
+
+  tab1 = rmemsize(rt_table_pool);
+  rta1 = rmemsize(rta_pool);
+  printf("  %u routes, %u sets of attributes\n", ROUTES, VARIANTS);
+  printf("  %-24s %8zu -> %8zu bytes, %zu per route\n", "Routing tables:", tab0, tab1, (tab1 - tab0) / ROUTES);
+  printf("  %-24s %8zu -> %8zu bytes, %zu per route\n", "Route attributes:", rta0, rta1, (rta1 - rta0) / ROUTES);
+
+  /* Attributes are shared, routes do not take their own */
+  CHECK(rta1 - rta0 < (tab1 - tab0) / 8);
+}
+
+int
+main(int argc UNUSED, char **argv)
+{
+  test_init();
+  protos_build();
+
+  config = new_config = &cfg;
+  cfg_mem = lp_new(&root_pool, 4080);
+  init_list(&cfg.tables);
+  add_tail(&cfg.tables, &tab_cf.n);
+  rt_commit(&cfg, NULL);
+
+  printf("%s:\n", argv[0]);
+  t_sizes();
+  t_fill();
+
+  return test_done(argv[0]);
+}
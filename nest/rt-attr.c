@@ -54,6 +54,7 @@
 #include "lib/hash.h"
 #include "lib/resource.h"
 #include "lib/string.h"
+#include "lib/unaligned.h"
 
 pool *rta_pool;
 
@@ -500,17 +501,169 @@ ea_same(ea_list *x, ea_list *y)
       if (a->id != b->id ||
 	  a->flags != b->flags ||
 	  a->type != b->type ||
-	  ((a->type & EAF_EMBEDDED) ? a->u.data != b->u.data : !adata_same(a->u.ptr, b->u.ptr)))
+	  ((a->type & EAF_EMBEDDED) ? a->u.data != b->u.data :
+	   (a->u.ptr != b->u.ptr) && !adata_same(a->u.ptr, b->u.ptr)))
 	return 0;
     }
   return 1;
 }
 
+/*
+ *	Interned attribute data
+ *
+ *	Non-embedded attribute values of cached &ea_list's (AS paths,
+ *	community lists and the like) are shared between all cached
+ *	&rta's carrying the same value. Each distinct value is stored
+ *	once with a use count in a hash table keyed by its contents,
+ *	so that the cache can compare and hash them by pointer.
+ */
+
+struct adata_intern {
+  struct adata_intern *next;		/* Next in hash chain */
+  u32 hash;				/* Hash of the contents */
+  u32 uc;				/* Use count */
+  struct adata ad;			/* Must be last */
+};
+
+#define ADH_KEY(n)		&n->ad, n->hash
+#define ADH_NEXT(n)		n->next
+#define ADH_EQ(a1,h1,a2,h2)	h1 == h2 && adata_same(a1, a2)
+#define ADH_FN(a,h)		h
+
+#define ADH_REHASH		adata_rehash
+#define ADH_PARAMS		/8, *2, 2, 2, 8, 24
+#define ADH_INIT_ORDER		8
+
+static HASH(struct adata_intern) adata_hash;
+
+HASH_DEFINE_REHASH_FN(ADH, struct adata_intern)
+
+static inline u32
+adata_hash_fn(struct adata *d)
+{
+  u32 h = d->length;
+  int size = d->length;
+  byte *z = d->data;
+
+  while (size >= 4)
+    {
+      h = (h * 0x9e3779b9) ^ get_u32(z);
+      z += 4;
+      size -= 4;
+    }
+  while (size--)
+    h = (h * 0x9e3779b9) ^ *z++;
+  return u32_hash(h);
+}
+
+/*
+ * Returns the interned copy of @d with its use count incremented,
+ * creating it if needed. @d itself is left untouched.
+ */
+static struct adata *
+adata_intern(struct adata *d)
+{
+  u32 h = adata_hash_fn(d);
+  struct adata_intern *n = HASH_FIND(adata_hash, ADH, d, h);
+
+  if (n)
+    {
+      n->uc++;
+      return &n->ad;
+    }
+
+  n = mb_alloc(rta_pool, sizeof(struct adata_intern) + d->length);
+  n->hash = h;
+  n->uc = 1;
+  memcpy(&n->ad, d, sizeof(struct adata) + d->length);
+  HASH_INSERT2(adata_hash, ADH, rta_pool, n);
+  return &n->ad;
+}
+
+static void
+adata_release(struct adata *d)
+{
+  struct adata_intern *n = SKIP_BACK(struct adata_intern, ad, d);
+
+  ASSERT(n->uc);
+  if (--n->uc)
+    return;
+
+  HASH_REMOVE2(adata_hash, ADH, rta_pool, n);
+  mb_free(n);
+}
+
+/* Replaces all non-embedded values of a normalized list by interned ones */
+static inline void
+ea_intern(ea_list *e)
+{
+  int i;
+
+  for(i=0; i<e->count; i++)
+    if (!(e->attrs[i].type & EAF_EMBEDDED))
+      e->attrs[i].u.ptr = adata_intern(e->attrs[i].u.ptr);
+}
+
+static inline void
+ea_release(ea_list *e)
+{
+  int i;
+
+  for(i=0; i<e->count; i++)
+    if (!(e->attrs[i].type & EAF_EMBEDDED))
+      adata_release(e->attrs[i].u.ptr);
+}
+
+/* Both lists normalized and interned, values can be compared by pointer */
+static inline int
+ea_same_interned(ea_list *x, ea_list *y)
+{
+  int c;
+
+  if (!x || !y)
+    return x == y;
+  if (x->count != y->count)
+    return 0;
+  for(c=0; c<x->count; c++)
+    {
+      eattr *a = &x->attrs[c];
+      eattr *b = &y->attrs[c];
+
+      if (a->id != b->id ||
+	  a->flags != b->flags ||
+	  a->type != b->type ||
+	  ((a->type & EAF_EMBEDDED) ? a->u.data != b->u.data : a->u.ptr != b->u.ptr))
+	return 0;
+    }
+  return 1;
+}
+
+static inline u32
+ea_hash_interned(ea_list *e)
+{
+  u32 h = 0;
+  int i;
+
+  if (e)
+    for(i=0; i<e->count; i++)
+      {
+	struct eattr *a = &e->attrs[i];
+	h ^= a->id;
+	if (a->type & EAF_EMBEDDED)
+	  h ^= a->u.data;
+	else
+	  h ^= SKIP_BACK(struct adata_intern, ad, a->u.ptr)->hash;
+	h = u32_hash(h);
+      }
+  return h ^ (h >> 16);
+}
+
+/* The values of @o are already interned, their references are taken over */
 static inline ea_list *
 ea_list_copy(ea_list *o)
 {
   ea_list *n;
-  unsigned i, len;
+  unsigned len;
 
   if (!o)
     return NULL;
@@ -519,34 +672,16 @@ ea_list_copy(ea_list *o)
   n = mb_alloc(rta_pool, len);
   memcpy(n, o, len);
   n->flags |= EALF_CACHED;
-  for(i=0; i<o->count; i++)
-    {
-      eattr *a = &n->attrs[i];
-      if (!(a->type & EAF_EMBEDDED))
-	{
-	  unsigned size = sizeof(struct adata) + a->u.ptr->length;
-	  struct adata *d = mb_alloc(rta_pool, size);
-	  memcpy(d, a->u.ptr, size);
-	  a->u.ptr = d;
-	}
-    }
   return n;
 }
 
 static inline void
 ea_free(ea_list *o)
 {
-  int i;
-
   if (o)
     {
       ASSERT(!o->next);
-      for(i=0; i<o->count; i++)
-	{
-	  eattr *a = &o->attrs[i];
-	  if (!(a->type & EAF_EMBEDDED))
-	    mb_free(a->u.ptr);
-	}
+      ea_release(o);
       mb_free(o);
     }
 }
@@ -795,28 +930,47 @@ ea_append(ea_list *to, ea_list *what)
  *	rta's
  */
 
+/*
+ * The cache grows incrementally: when the table is to be doubled, the
+ * old one is kept and a few of its chains are moved to the new one on
+ * every rta_lookup() and rta__free(), until it is empty. Until then,
+ * entries whose old chain has not been moved yet are found in the old
+ * table.
+ */
+
+#define RTA_REHASH_STEP		8	/* Old chains moved per cache operation */
+#define RTA_CACHE_MAX_ORDER	26
+
 static unsigned int rta_cache_count;
 static unsigned int rta_cache_size = 32;
 static unsigned int rta_cache_limit;
 static unsigned int rta_cache_mask;
 static rta **rta_hash_table;
 
+static rta **rta_old_table;		/* Table being emptied, if any */
+static unsigned int rta_old_size;
+static unsigned int rta_old_mask;
+static unsigned int rta_old_pos;	/* Chains below have been moved */
+
 static void
 rta_alloc_hash(void)
 {
   rta_hash_table = mb_allocz(rta_pool, sizeof(rta *) * rta_cache_size);
-  if (rta_cache_size < 32768)
+  if (rta_cache_size < (1 << RTA_CACHE_MAX_ORDER))
     rta_cache_limit = rta_cache_size * 2;
   else
     rta_cache_limit = ~0;
   rta_cache_mask = rta_cache_size - 1;
 }
 
-static inline unsigned int
+static inline u32
 rta_hash(rta *a)
 {
-  return (((uint) (uintptr_t) a->src) ^ ipa_hash(a->gw) ^
-	  mpnh_hash(a->nexthops) ^ ea_hash(a->eattrs)) & 0xffff;
+  u32 h = u32_hash(((uint) (uintptr_t) a->src) ^ ipa_hash32(a->gw)) ^
+    mpnh_hash(a->nexthops) ^ ea_hash_interned(a->eattrs);
+
+  h = u32_hash(h);
+  return h ^ (h >> 16);
 }
 
 static inline int
@@ -834,7 +988,7 @@ rta_same(rta *x, rta *y)
 	  x->iface == y->iface &&
 	  x->hostentry == y->hostentry &&
 	  mpnh_same(x->nexthops, y->nexthops) &&
-	  ea_same(x->eattrs, y->eattrs));
+	  ea_same_interned(x->eattrs, y->eattrs));
 }
 
 static rta *
@@ -849,35 +1003,57 @@ rta_copy(rta *o)
   return r;
 }
 
+/* Returns the chain holding entries with hash @h */
+static inline rta **
+rta_chain(u32 h)
+{
+  if (rta_old_table && ((h & rta_old_mask) >= rta_old_pos))
+    return &rta_old_table[h & rta_old_mask];
+
+  return &rta_hash_table[h & rta_cache_mask];
+}
+
 static inline void
-rta_insert(rta *r)
+rta_insert(rta **chain, rta *r)
 {
-  unsigned int h = r->hash_key & rta_cache_mask;
-  r->next = rta_hash_table[h];
-  if (r->next)
-    r->next->pprev = &r->next;
-  r->pprev = &rta_hash_table[h];
-  rta_hash_table[h] = r;
+  r->next = *chain;
+  *chain = r;
 }
 
 static void
-rta_rehash(void)
+rta_rehash_step(unsigned int steps)
 {
-  unsigned int ohs = rta_cache_size;
-  unsigned int h;
   rta *r, *n;
-  rta **oht = rta_hash_table;
 
-  rta_cache_size = 2*rta_cache_size;
-  DBG("Rehashing rta cache from %d to %d entries.\n", ohs, rta_cache_size);
-  rta_alloc_hash();
-  for(h=0; h<ohs; h++)
-    for(r=oht[h]; r; r=n)
+  for (; steps && (rta_old_pos < rta_old_size); steps--, rta_old_pos++)
+    for(r=rta_old_table[rta_old_pos]; r; r=n)
       {
 	n = r->next;
-	rta_insert(r);
+	rta_insert(&rta_hash_table[r->hash_key & rta_cache_mask], r);
       }
-  mb_free(oht);
+
+  if (rta_old_pos == rta_old_size)
+    {
+      mb_free(rta_old_table);
+      rta_old_table = NULL;
+    }
+}
+
+static void
+rta_rehash(void)
+{
+  /* Still moving the previous table, finish it first */
+  if (rta_old_table)
+    rta_rehash_step(~0);
+
+  rta_old_table = rta_hash_table;
+  rta_old_size = rta_cache_size;
+  rta_old_mask = rta_cache_mask;
+  rta_old_pos = 0;
+
+  rta_cache_size = 2*rta_cache_size;
+  DBG("Rehashing rta cache from %d to %d entries.\n", rta_old_size, rta_cache_size);
+  rta_alloc_hash();
 }
 
 /**
@@ -897,7 +1073,8 @@ rta *
 rta_lookup(rta *o)
 {
   rta *r;
-  unsigned int h;
+  ea_list *oe, *ie;
+  u32 h;
 
   ASSERT(!(o->aflags & RTAF_CACHED));
   if (o->eattrs)
@@ -911,17 +1088,37 @@ rta_lookup(rta *o)
       ea_sort(o->eattrs);
     }
 
+  /* Look up the interned values in a private copy, @o stays intact */
+  oe = o->eattrs;
+  if (oe)
+    {
+      unsigned len = sizeof(ea_list) + sizeof(eattr) * oe->count;
+      ie = alloca(len);
+      memcpy(ie, oe, len);
+      ea_intern(ie);
+      o->eattrs = ie;
+    }
+
+  if (rta_old_table)
+    rta_rehash_step(RTA_REHASH_STEP);
+
   h = rta_hash(o);
-  for(r=rta_hash_table[h & rta_cache_mask]; r; r=r->next)
+  for(r=*rta_chain(h); r; r=r->next)
     if (r->hash_key == h && rta_same(r, o))
-      return rta_clone(r);
+      {
+	if (oe)
+	  ea_release(o->eattrs);
+	o->eattrs = oe;
+	return rta_clone(r);
+      }
 
   r = rta_copy(o);
+  o->eattrs = oe;
   r->hash_key = h;
   r->aflags = RTAF_CACHED;
   rt_lock_source(r->src);
   rt_lock_hostentry(r->hostentry);
-  rta_insert(r);
+  rta_insert(rta_chain(h), r);
 
   if (++rta_cache_count > rta_cache_limit)
     rta_rehash();
@@ -932,11 +1129,15 @@ rta_lookup(rta *o)
 void
 rta__free(rta *a)
 {
+  rta **rp;
+
   ASSERT(rta_cache_count && (a->aflags & RTAF_CACHED));
   rta_cache_count--;
-  *a->pprev = a->next;
-  if (a->next)
-    a->next->pprev = a->pprev;
+  for(rp=rta_chain(a->hash_key); *rp != a; rp=&(*rp)->next)
+    ASSERT(*rp);
+  *rp = a->next;
+  if (rta_old_table)
+    rta_rehash_step(RTA_REHASH_STEP);
   a->aflags = 0;		/* Poison the entry */
   rt_unlock_hostentry(a->hostentry);
   rt_unlock_source(a->src);
@@ -961,7 +1162,7 @@ rta_dump(rta *a)
   static char *rtc[] = { "", " BC", " MC", " AC" };
   static char *rtd[] = { "", " DEV", " HOLE", " UNREACH", " PROHIBIT" };
 
-  debug("p=%s uc=%d %s %s%s%s h=%04x",
+  debug("p=%s uc=%d %s %s%s%s h=%08x",
 	a->src->proto->name, a->uc, rts[a->source], ip_scope_text(a->scope), rtc[a->cast],
 	rtd[a->dest], a->hash_key);
   if (!(a->aflags & RTAF_CACHED))
@@ -990,7 +1191,8 @@ rta_dump_all(void)
   rta *a;
   unsigned int h;
 
-  debug("Route attribute cache (%d entries, rehash at %d):\n", rta_cache_count, rta_cache_limit);
+  debug("Route attribute cache (%d entries, rehash at %d, %d shared values):\n",
+	rta_cache_count, rta_cache_limit, adata_hash.count);
   for(h=0; h<rta_cache_size; h++)
     for(a=rta_hash_table[h]; a; a=a->next)
       {
@@ -998,18 +1200,69 @@ rta_dump_all(void)
 	rta_dump(a);
 	debug("\n");
       }
+  if (rta_old_table)
+    for(h=rta_old_pos; h<rta_old_size; h++)
+      for(a=rta_old_table[h]; a; a=a->next)
+	{
+	  debug("%p ", a);
+	  rta_dump(a);
+	  debug("\n");
+	}
   debug("\n");
 }
 
+static void
+rta_chain_stats(rta **tab, uint from, uint to, uint *used, uint *longest)
+{
+  rta *a;
+  uint h, len;
+
+  for(h=from; h<to; h++)
+    {
+      for(len=0, a=tab[h]; a; a=a->next)
+	len++;
+      if (len)
+	(*used)++;
+      if (len > *longest)
+	*longest = len;
+    }
+}
+
+/**
+ * rta_show_stats - show attribute cache statistics
+ *
+ * This function prints occupancy of the route attribute cache to the CLI,
+ * as a part of the output of the `show memory' command.
+ */
+void
+rta_show_stats(void)
+{
+  uint used = 0, longest = 0;
+
+  rta_chain_stats(rta_hash_table, 0, rta_cache_size, &used, &longest);
+  if (rta_old_table)
+    rta_chain_stats(rta_old_table, rta_old_pos, rta_old_size, &used, &longest);
+
+  cli_msg(-1018, "Attribute cache:  %u entries in %u chains of %u, longest %u",
+	  rta_cache_count, used, rta_cache_size, longest);
+  if (rta_old_table)
+    cli_msg(-1018, "                  rehashing, %u of %u old chains left",
+	    rta_old_size - rta_old_pos, rta_old_size);
+  cli_msg(-1018, "Shared values:    %u", adata_hash.count);
+}
+
+static char *rta_src_names[] = { "dummy", "static", "inherit", "device", "static-device", "redirect",
+				 "RIP", "OSPF", "OSPF-IA", "OSPF-E1", "OSPF-E2", "BGP", "pipe" };
+static char *rta_cast_names[] = { "unicast", "broadcast", "multicast", "anycast" };
+static char *rta_dest_names[] = { "router", "device", "blackhole", "unreachable", "prohibited",
+				  "multipath", "none" };
+
 void
 rta_show(struct cli *c, rta *a, ea_list *eal)
 {
-  static char *src_names[] = { "dummy", "static", "inherit", "device", "static-device", "redirect",
-			       "RIP", "OSPF", "OSPF-IA", "OSPF-E1", "OSPF-E2", "BGP", "pipe" };
-  static char *cast_names[] = { "unicast", "broadcast", "multicast", "anycast" };
   int i;
 
-  cli_printf(c, -1008, "\tType: %s %s %s", src_names[a->source], cast_names[a->cast], ip_scope_text(a->scope));
+  cli_printf(c, -1008, "\tType: %s %s %s", rta_src_names[a->source], rta_cast_names[a->cast], ip_scope_text(a->scope));
   if (!eal)
     eal = a->eattrs;
   for(; eal; eal=eal->next)
@@ -1017,6 +1270,113 @@ rta_show(struct cli *c, rta *a, ea_list *eal)
       ea_show(c, &eal->attrs[i]);
 }
 
+static void
+buffer_hex(buffer *b, const byte *data, uint len)
+{
+  static const char hex[] = "0123456789abcdef";
+
+  if ((uint) (b->end - b->pos) < 2*len)
+    {
+      b->pos = b->end;
+      return;
+    }
+
+  for (; len; len--, data++)
+    {
+      *b->pos++ = hex[*data >> 4];
+      *b->pos++ = hex[*data & 15];
+    }
+}
+
+/* Appends ,"@key":"@val" with @val escaped */
+static void
+json_member(buffer *b, const char *key, const char *val)
+{
+  buffer_print(b, ",\"%s\":", key);
+  buffer_json(b, val);
+}
+
+static void
+json_member_ip(buffer *b, const char *key, ip_addr ip)
+{
+  char buf[STD_ADDRESS_P_LENGTH + 1];
+
+  bsprintf(buf, "%I", ip);
+  json_member(b, key, buf);
+}
+
+/**
+ * rta_format_json - format route attributes as JSON
+ * @b: buffer to write to
+ * @a: attributes to be formatted
+ * @eal: normalized extended attributes to be used instead of those of @a
+ *
+ * This function appends the members of a JSON object describing @a to
+ * @b, without the enclosing braces. Extended attributes are given
+ * as they are stored, with the values of attributes not embedded in
+ * &eattr in hexadecimal. Strings are escaped by buffer_json(). If @b
+ * overflows, its position is left at its end.
+ */
+void
+rta_format_json(buffer *b, rta *a, ea_list *eal)
+{
+  struct mpnh *nh;
+  int i, first = 1;
+
+  buffer_puts(b, "\"source\":");
+  buffer_json(b, rta_src_names[a->source]);
+  json_member(b, "cast", rta_cast_names[a->cast]);
+  json_member(b, "scope", ip_scope_text(a->scope));
+  json_member(b, "dest", rta_dest_names[MIN(a->dest, RTD_NONE)]);
+
+  if (a->dest == RTD_ROUTER)
+    json_member_ip(b, "gw", a->gw);
+  if (ipa_nonzero(a->from))
+    json_member_ip(b, "from", a->from);
+  if (a->iface)
+    json_member(b, "iface", a->iface->name);
+
+  if (a->nexthops)
+    {
+      buffer_puts(b, ",\"nexthops\":[");
+      for (nh = a->nexthops; nh; nh = nh->next)
+	{
+	  buffer_print(b, "%s{\"weight\":%d", (nh == a->nexthops) ? "" : ",", nh->weight + 1);
+	  json_member_ip(b, "gw", nh->gw);
+	  json_member(b, "iface", nh->iface->name);
+	  buffer_puts(b, "}");
+	}
+      buffer_puts(b, "]");
+    }
+
+  if (!eal)
+    eal = a->eattrs;
+
+  buffer_puts(b, ",\"attrs\":[");
+  for (; eal; eal = eal->next)
+    for (i = 0; i < eal->count; i++)
+      {
+	eattr *e = &eal->attrs[i];
+
+	if ((e->type & EAF_TYPE_MASK) == EAF_TYPE_UNDEF)
+	  continue;
+
+	buffer_print(b, "%s{\"id\":%u,\"flags\":%u,\"type\":%u,\"value\":",
+		     first ? "" : ",", e->id, e->flags, e->type & EAF_TYPE_MASK);
+	first = 0;
+
+	if (e->type & EAF_EMBEDDED)
+	  buffer_print(b, "%u}", e->u.data);
+	else
+	  {
+	    buffer_puts(b, "\"");
+	    buffer_hex(b, e->u.ptr->data, e->u.ptr->length);
+	    buffer_puts(b, "\"}");
+	  }
+      }
+  buffer_puts(b, "]");
+}
+
 /**
  * rta_init - initialize route attribute cache
  *
@@ -1030,6 +1390,7 @@ rta_init(void)
   rta_slab = sl_new(rta_pool, sizeof(rta));
   mpnh_slab = sl_new(rta_pool, sizeof(struct mpnh));
   rta_alloc_hash();
+  HASH_INIT(adata_hash, rta_pool, ADH_INIT_ORDER);
   rte_src_init();
 }
 
@@ -32,6 +32,14 @@
  * Basic FIB operations are performed by functions defined by this module,
  * enumerating of FIB contents is accomplished by using the FIB_WALK() macro
  * or FIB_ITERATE_START() if you want to do it asynchronously.
+ *
+ * Longest-match lookups probe the hash for every prefix length, which is
+ * slow for long (IPv6) addresses. A FIB may therefore additionally keep
+ * a path-compressed binary trie of its nodes (see fib_enable_trie()),
+ * whose depth is bounded by the number of branching points on the path
+ * instead of the address length. The trie only indexes the nodes, the
+ * hash stays the primary storage, so the reading order and asynchronous
+ * readers are not affected.
  */
 
 #undef LOCAL_DEBUG
@@ -83,6 +91,123 @@ fib_dummy_init(struct fib_node *dummy UNUSED)
 {
 }
 
+struct fib_trie {
+  struct fib_trie *c[2];
+  struct fib_node *node;		/* FIB node of exactly this prefix, NULL for glue */
+  ip_addr prefix;
+  byte pxlen;
+};
+
+static struct fib_trie *
+fib_trie_new(struct fib *f, ip_addr prefix, int pxlen, struct fib_node *node)
+{
+  struct fib_trie *t = sl_alloc(f->trie_slab);
+
+  t->c[0] = t->c[1] = NULL;
+  t->node = node;
+  t->prefix = prefix;
+  t->pxlen = pxlen;
+  return t;
+}
+
+static void
+fib_trie_insert(struct fib *f, struct fib_node *e)
+{
+  struct fib_trie **tp = &f->trie;
+  struct fib_trie *t, *n;
+  ip_addr px = e->prefix;
+  int len = e->pxlen;
+
+  while (t = *tp)
+    {
+      int l = MIN(t->pxlen, len);
+
+      if (!ipa_in_net(px, t->prefix, l))
+	{
+	  /* Paths diverge above both, add a glue node */
+	  int cl = ipa_pxlen(px, t->prefix);
+	  struct fib_trie *g = fib_trie_new(f, ipa_and(px, ipa_mkmask(cl)), cl, NULL);
+
+	  g->c[!!ipa_getbit(t->prefix, cl)] = t;
+	  g->c[!!ipa_getbit(px, cl)] = fib_trie_new(f, px, len, e);
+	  *tp = g;
+	  return;
+	}
+
+      if (t->pxlen == len)
+	{
+	  t->node = e;
+	  return;
+	}
+
+      if (t->pxlen > len)
+	{
+	  /* New node above t */
+	  n = fib_trie_new(f, px, len, e);
+	  n->c[!!ipa_getbit(t->prefix, len)] = t;
+	  *tp = n;
+	  return;
+	}
+
+      tp = &t->c[!!ipa_getbit(px, t->pxlen)];
+    }
+
+  *tp = fib_trie_new(f, px, len, e);
+}
+
+static void
+fib_trie_remove(struct fib *f, struct fib_node *e)
+{
+  struct fib_trie **tp = &f->trie, **pp = NULL;
+  struct fib_trie *t, *p;
+
+  while ((t = *tp) && (t->pxlen < e->pxlen))
+    {
+      pp = tp;
+      tp = &t->c[!!ipa_getbit(e->prefix, t->pxlen)];
+    }
+
+  if (!t || t->node != e)
+    bug("fib_trie_remove() called for unindexed node");
+
+  t->node = NULL;
+  if (t->c[0] && t->c[1])
+    return;
+
+  *tp = t->c[0] ? : t->c[1];
+  sl_free(f->trie_slab, t);
+
+  /* The parent may have become a glue node with a single child */
+  if (pp && (p = *pp) && !p->node && !(p->c[0] && p->c[1]))
+    {
+      *pp = p->c[0] ? : p->c[1];
+      sl_free(f->trie_slab, p);
+    }
+}
+
+/**
+ * fib_enable_trie - index a FIB for longest-match lookups
+ * @f: the FIB
+ *
+ * Makes fib_route() and fib_route_match() use a trie of the nodes
+ * instead of probing the hash for each prefix length. The trie costs
+ * at most two small nodes per FIB node and is kept until fib_free().
+ */
+void
+fib_enable_trie(struct fib *f)
+{
+  if (f->trie_slab)
+    return;
+
+  f->trie_slab = sl_new(f->fib_pool, sizeof(struct fib_trie));
+
+  FIB_WALK(f, e)
+    {
+      fib_trie_insert(f, e);
+    }
+  FIB_WALK_END;
+}
+
 /**
  * fib_init - initialize a new FIB
  * @f: the FIB to be initialized (the structure itself being allocated by the caller)
@@ -108,6 +233,8 @@ fib_init(struct fib *f, pool *p, unsigned node_size, unsigned hash_order, fib_in
   f->entries = 0;
   f->entries_min = 0;
   f->init = init ? : fib_dummy_init;
+  f->trie = NULL;
+  f->trie_slab = NULL;
 }
 
 static void
@@ -241,6 +368,8 @@ fib_get(struct fib *f, ip_addr *a, int len)
   *ee = e;
   e->readers = NULL;
   f->init(e);
+  if (f->trie_slab)
+    fib_trie_insert(f, e);
   if (f->entries++ > f->entries_max)
     fib_rehash(f, HASH_HI_STEP);
 
@@ -248,32 +377,168 @@ fib_get(struct fib *f, ip_addr *a, int len)
 }
 
 /**
- * fib_route - CIDR routing lookup
+ * fib_covering - find all nodes covering a network
+ * @f: FIB to search in
+ * @a: IP address of the prefix
+ * @len: prefix length
+ * @found: array of %BITS_PER_IP_ADDRESS + 1 entries for the nodes
+ *
+ * Stores FIB nodes whose prefixes contain the given network to @found,
+ * from the shortest one, and returns their number. With a trie index,
+ * they are all found in a single walk.
+ */
+int
+fib_covering(struct fib *f, ip_addr a, int len, struct fib_node **found)
+{
+  struct fib_node *e;
+  ip_addr a0;
+  int l, n = 0;
+
+  if (f->trie_slab)
+    {
+      struct fib_trie *t = f->trie;
+
+      while (t && (t->pxlen <= len) && ipa_in_net(a, t->prefix, t->pxlen))
+	{
+	  if (t->node)
+	    found[n++] = t->node;
+	  if (t->pxlen == len)
+	    break;
+	  t = t->c[!!ipa_getbit(a, t->pxlen)];
+	}
+
+      return n;
+    }
+
+  for (l = 0; l <= len; l++)
+    {
+      a0 = ipa_and(a, ipa_mkmask(l));
+      e = fib_find(f, &a0, l);
+      if (e)
+	found[n++] = e;
+    }
+  return n;
+}
+
+static struct fib_node *
+fib_trie_first(struct fib_trie *t)
+{
+  /* Glue nodes always have both children */
+  while (t && !t->node)
+    t = t->c[0];
+  return t ? t->node : NULL;
+}
+
+/* The first node of @t after (or at, with @incl) @a/@len in prefix order */
+static struct fib_node *
+fib_trie_next(struct fib_trie *t, ip_addr a, int len, int incl)
+{
+  struct fib_node *e;
+  int c;
+
+  if (!t)
+    return NULL;
+
+  c = ipa_compare(t->prefix, a) ? : (int) t->pxlen - len;
+  if ((c > 0) || (incl && !c))
+    return t->node ? : fib_trie_first(t->c[0]);
+
+  /* The whole subtree is ordered before @a */
+  if ((c < 0) && !ipa_in_net(a, t->prefix, t->pxlen))
+    return NULL;
+
+  e = fib_trie_next(t->c[0], a, len, incl);
+  return e ? : fib_trie_next(t->c[1], a, len, incl);
+}
+
+/**
+ * fib_next_in - walk nodes of a FIB within a network
+ * @f: FIB with a trie index
+ * @a: IP address of the network
+ * @len: prefix length of the network
+ * @pos: position of the walk
+ * @poslen: prefix length of the position, -1 to start
+ *
+ * Returns the next FIB node whose prefix lies within @a/@len, in the order
+ * of prefix addresses and then lengths, or %NULL at the end. The walk is
+ * resumed from the key stored in @pos and @poslen, which is updated to the
+ * returned node, so the FIB may change freely between calls. Must be used
+ * only when fib_enable_trie() has been called for @f.
+ */
+void *
+fib_next_in(struct fib *f, ip_addr a, int len, ip_addr *pos, int *poslen)
+{
+  struct fib_node *e;
+
+  ASSERT(f->trie_slab);
+
+  if (*poslen < 0)
+    e = fib_trie_next(f->trie, a, len, 1);
+  else
+    e = fib_trie_next(f->trie, *pos, *poslen, 0);
+
+  if (!e || (e->pxlen < len) || !ipa_in_net(e->prefix, a, len))
+    return NULL;
+
+  *pos = e->prefix;
+  *poslen = e->pxlen;
+  return e;
+}
+
+/**
+ * fib_route_match - CIDR routing lookup with a predicate
  * @f: FIB to search in
  * @a: pointer to IP address of the prefix
  * @len: prefix length
+ * @match: predicate the node must satisfy, %NULL to accept any
  *
  * Search for a FIB node with longest prefix matching the given
- * network, that is a node which a CIDR router would use for routing
- * that network.
+ * network and accepted by @match.
  */
 void *
-fib_route(struct fib *f, ip_addr a, int len)
+fib_route_match(struct fib *f, ip_addr a, int len, int (*match)(struct fib_node *))
 {
   ip_addr a0;
-  void *t;
+  struct fib_node *e;
+
+  if (f->trie_slab)
+    {
+      struct fib_node *found[BITS_PER_IP_ADDRESS + 1];
+      int n = fib_covering(f, a, len, found);
+
+      while (n--)
+	if (!match || match(found[n]))
+	  return found[n];
+      return NULL;
+    }
 
   while (len >= 0)
     {
       a0 = ipa_and(a, ipa_mkmask(len));
-      t = fib_find(f, &a0, len);
-      if (t)
-	return t;
+      e = fib_find(f, &a0, len);
+      if (e && (!match || match(e)))
+	return e;
       len--;
     }
   return NULL;
 }
 
+/**
+ * fib_route - CIDR routing lookup
+ * @f: FIB to search in
+ * @a: pointer to IP address of the prefix
+ * @len: prefix length
+ *
+ * Search for a FIB node with longest prefix matching the given
+ * network, that is a node which a CIDR router would use for routing
+ * that network.
+ */
+void *
+fib_route(struct fib *f, ip_addr a, int len)
+{
+  return fib_route_match(f, a, len, NULL);
+}
+
 static inline void
 fib_merge_readers(struct fib_iterator *i, struct fib_node *to)
 {
@@ -330,6 +595,8 @@ fib_delete(struct fib *f, void *E)
       if (*ee == e)
 	{
 	  *ee = e->next;
+	  if (f->trie_slab)
+	    fib_trie_remove(f, e);
 	  if (it = e->readers)
 	    {
 	      struct fib_node *l = e->next;
@@ -365,6 +632,8 @@ fib_free(struct fib *f)
 {
   fib_ht_free(f->hash_table);
   rfree(f->fib_slab);
+  if (f->trie_slab)
+    rfree(f->trie_slab);
 }
 
 void
@@ -26,6 +26,62 @@ static inline int
 src_match(struct roa_item *it, byte src)
 { return !src || it->src == src; }
 
+/*
+ * Results of roa_check() are kept in a direct-mapped cache of each table.
+ * Any change of the ROA entries starts a new generation, which invalidates
+ * the whole cache at once.
+ */
+
+static inline void
+roa_invalidate(struct roa_table *t)
+{
+  t->stats.invalidations++;
+  if (++t->cache_gen)
+    return;
+
+  /* Wrapped around, old entries could match again */
+  memset(t->cache, 0, ROA_CACHE_SIZE * sizeof(struct roa_cache_entry));
+  t->cache_gen = 1;
+}
+
+/*
+ * Prefixes of changed ROA entries are collected until the revalidation
+ * event of the table runs. Then routes covered by them are revalidated
+ * in routing tables which use the ROA table in their filters, see
+ * rt_roa_changed().
+ */
+
+static void
+roa_changed(struct roa_table *t, ip_addr prefix, byte pxlen)
+{
+  if (t->changes_all)
+    return;
+
+  if (t->changes_count < ROA_CHANGES_MAX)
+    t->changes[t->changes_count++] = (struct roa_change) { .prefix = prefix, .pxlen = pxlen };
+  else
+    t->changes_all = 1;
+
+  ev_schedule(t->reval_event);
+}
+
+static void
+roa_reval(void *data)
+{
+  struct roa_table *t = data;
+
+  rt_roa_changed(t);
+  t->changes_count = 0;
+  t->changes_all = 0;
+}
+
+static inline struct roa_cache_entry *
+roa_cache_find(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
+{
+  u32 h = u32_hash(ipa_hash32(prefix) ^ asn ^ pxlen);
+  return &t->cache[h >> (32 - ROA_CACHE_ORDER)];
+}
+
 /**
  * roa_add_item - add a ROA entry
  * @t: ROA table
@@ -44,9 +100,6 @@ roa_add_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 a
 {
   struct roa_node *n = fib_get(&t->fib, &prefix, pxlen);
 
-  // if ((n->items == NULL) && (n->n.x0 != ROA_INVALID))
-  // t->cached_items--;
-
   struct roa_item *it;
   for (it = n->items; it; it = it->next)
     if ((it->maxlen == maxlen) && (it->asn == asn) && src_match(it, src))
@@ -58,6 +111,10 @@ roa_add_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 a
   it->src = src;
   it->next = n->items;
   n->items = it;
+
+  t->items++;
+  roa_invalidate(t);
+  roa_changed(t, prefix, pxlen);
 }
 
 /**
@@ -71,15 +128,15 @@ roa_add_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 a
  *
  * The function removes a specified ROA entry from the ROA table and
  * frees it. If @src field is not ROA_SRC_ANY, only entries from
- * that source are considered.
+ * that source are considered. Returns 0 if there is no such entry.
  */
-void
+int
 roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src)
 {
   struct roa_node *n = fib_find(&t->fib, &prefix, pxlen);
 
   if (!n)
-    return;
+    return 0;
 
   struct roa_item *it, **itp;
   for (itp = &n->items; it = *itp; itp = &it->next)
@@ -87,13 +144,15 @@ roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u3
       break;
 
   if (!it)
-    return;
+    return 0;
 
   *itp = it->next;
   sl_free(roa_slab, it);
 
-  // if ((n->items == NULL) && (n->n.x0 != ROA_INVALID))
-  // t->cached_items++;
+  t->items--;
+  roa_invalidate(t);
+  roa_changed(t, prefix, pxlen);
+  return 1;
 }
 
 
@@ -111,10 +170,13 @@ roa_flush(struct roa_table *t, byte src)
 {
   struct roa_item *it, **itp;
   struct roa_node *n;
+  u32 items = t->items;
+  u32 before;
 
   FIB_WALK(&t->fib, fn)
     {
       n = (struct roa_node *) fn;
+      before = t->items;
 
       itp = &n->items;
       while (it = *itp)
@@ -122,47 +184,44 @@ roa_flush(struct roa_table *t, byte src)
 	  {
 	    *itp = it->next;
 	    sl_free(roa_slab, it);
+	    t->items--;
 	  }
 	else
 	  itp = &it->next;
+
+      if (t->items != before)
+	roa_changed(t, n->n.prefix, n->n.pxlen);
     }
   FIB_WALK_END;
 
+  if (t->items != items)
+    roa_invalidate(t);
+
   // TODO add cleanup of roa_nodes
 }
 
 
-
-/*
-byte
-roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
+static byte
+roa_match(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
 {
-  struct roa_node *n = fib_find(&t->fib, &prefix, pxlen);
-
-  if (n && n->n.x0 == ROA_UNKNOWN)
-    return ROA_UNKNOWN;
-
-  if (n && n->n.x0 == ROA_VALID && asn == n->cached_asn)
-    return ROA_VALID;
-
-  byte rv = roa_match(t, n, prefix, pxlen, asn);
+  struct fib_node *found[BITS_PER_IP_ADDRESS + 1];
+  struct roa_item *it;
+  byte anything = 0;
+  int n;
 
-  if (rv != ROA_INVALID)
-    {
-      if (!n)
-	{
-	  if (t->cached_items >= t->cached_items_max)
-	  n = fib_get(&t->fib, &prefix, pxlen);
-	  t->cached_items++;
-	}
+  n = fib_covering(&t->fib, prefix, pxlen, found);
+  t->stats.nodes += n;
 
-      n->cached_asn = asn;
-      n->n.x0 = rv;
-    }
+  while (n--)
+    for (it = ((struct roa_node *) found[n])->items; it; it = it->next)
+      {
+	anything = 1;
+	if ((it->maxlen >= pxlen) && (it->asn == asn) && asn)
+	  return ROA_VALID;
+      }
 
-  return rv;
+  return anything ? ROA_INVALID : ROA_UNKNOWN;
 }
-*/
 
 /**
  * roa_check - check validity of route origination in a ROA table 
@@ -179,33 +238,30 @@ roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
  * length, return ROA_VALID. Otherwise return ROA_INVALID. If caller
  * cannot determine origin AS, 0 could be used (in that case ROA_VALID
  * cannot happen).
+ *
+ * Candidate ROAs are found in one walk of the trie index of the table
+ * and the result is cached until the ROA entries change.
  */
 byte
 roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
 {
-  struct roa_node *n;
-  ip_addr px;
-  byte anything = 0;
-
-  int len;
-  for (len = pxlen; len >= 0; len--)
-    {
-      px = ipa_and(prefix, ipa_mkmask(len));
-      n = fib_find(&t->fib, &px, len);
+  struct roa_cache_entry *c = roa_cache_find(t, prefix, pxlen, asn);
 
-      if (!n)
-	continue;
+  t->stats.checks++;
 
-      struct roa_item *it;
-      for (it = n->items; it; it = it->next)
-	{
-	  anything = 1;
-	  if ((it->maxlen >= pxlen) && (it->asn == asn) && asn)
-	    return ROA_VALID;
-	}
+  if ((c->gen == t->cache_gen) && ipa_equal(c->prefix, prefix) &&
+      (c->pxlen == pxlen) && (c->asn == asn))
+    {
+      t->stats.cache_hits++;
+      return c->result;
     }
 
-  return anything ? ROA_INVALID : ROA_UNKNOWN;
+  c->prefix = prefix;
+  c->pxlen = pxlen;
+  c->asn = asn;
+  c->gen = t->cache_gen;
+  c->result = roa_match(t, prefix, pxlen, asn);
+  return c->result;
 }
 
 static void
@@ -223,6 +279,46 @@ roa_populate(struct roa_table *t)
     roa_add_item(t, ric->prefix, ric->pxlen, ric->maxlen, ric->asn, ROA_SRC_CONFIG);
 }
 
+/*
+ * Updates the configured entries of @t from @old to those of its current
+ * config. Entries kept in both are not touched, so just the differences
+ * count as changes for revalidation.
+ */
+static void
+roa_reconfigure(struct roa_table *t, struct roa_table_config *old)
+{
+  struct roa_item_config *ric;
+  struct roa_node *n;
+  struct roa_item *it;
+
+  /* Mark the old entries */
+  for (ric = old->roa_items; ric; ric = ric->next)
+    if (n = fib_find(&t->fib, &ric->prefix, ric->pxlen))
+      for (it = n->items; it; it = it->next)
+	if ((it->maxlen == ric->maxlen) && (it->asn == ric->asn) && (it->src == ROA_SRC_CONFIG))
+	  it->src = ROA_SRC_RECONF;
+
+  /* Keep the marked ones still configured, add the new ones */
+  for (ric = t->cf->roa_items; ric; ric = ric->next)
+    {
+      n = fib_find(&t->fib, &ric->prefix, ric->pxlen);
+
+      for (it = n ? n->items : NULL; it; it = it->next)
+	if ((it->maxlen == ric->maxlen) && (it->asn == ric->asn) && (it->src == ROA_SRC_RECONF))
+	  {
+	    it->src = ROA_SRC_CONFIG;
+	    break;
+	  }
+
+      if (!it)
+	roa_add_item(t, ric->prefix, ric->pxlen, ric->maxlen, ric->asn, ROA_SRC_CONFIG);
+    }
+
+  /* Remove the rest */
+  for (ric = old->roa_items; ric; ric = ric->next)
+    roa_delete_item(t, ric->prefix, ric->pxlen, ric->maxlen, ric->asn, ROA_SRC_RECONF);
+}
+
 static void
 roa_new_table(struct roa_table_config *cf)
 {
@@ -230,6 +326,13 @@ roa_new_table(struct roa_table_config *cf)
 
   t = mb_allocz(roa_pool, sizeof(struct roa_table));
   fib_init(&t->fib, roa_pool, sizeof(struct roa_node), 0, roa_node_init);
+  fib_enable_trie(&t->fib);
+  t->cache = mb_allocz(roa_pool, ROA_CACHE_SIZE * sizeof(struct roa_cache_entry));
+  t->cache_gen = 1;
+  t->changes = mb_alloc(roa_pool, ROA_CHANGES_MAX * sizeof(struct roa_change));
+  t->reval_event = ev_new(roa_pool);
+  t->reval_event->hook = roa_reval;
+  t->reval_event->data = t;
   t->name = cf->name;
   t->cf = cf;
 
@@ -315,14 +418,14 @@ roa_commit(struct config *new, struct config *old)
 	if (sym && sym->class == SYM_ROA)
 	  {
 	    /* Found old table in new config */
+	    struct roa_table_config *ocf = t->cf;
 	    cf = sym->def;
 	    cf->table = t;
 	    t->name = cf->name;
 	    t->cf = cf;
 
 	    /* Reconfigure it */
-	    roa_flush(t, ROA_SRC_CONFIG);
-	    roa_populate(t);
+	    roa_reconfigure(t, ocf);
 	  }
 	else
 	  {
@@ -332,6 +435,9 @@ roa_commit(struct config *new, struct config *old)
 	    roa_flush(t, ROA_SRC_ANY);
 	    rem_node(&t->n);
 	    fib_free(&t->fib);
+	    mb_free(t->cache);
+	    mb_free(t->changes);
+	    rfree(t->reval_event);
 	    mb_free(t);
 	  }
       }
@@ -395,12 +501,24 @@ roa_show_cleanup(struct cli *c)
   fit_get(&d->table->fib, &d->fit);
 }
 
+static void
+roa_show_stats(struct roa_table *t)
+{
+  struct roa_stats *s = &t->stats;
+
+  cli_msg(-1023, "%s:", t->name);
+  cli_msg(-1023, "  Entries:        %10u", t->items);
+  cli_msg(-1023, "  Prefixes:       %10u", t->fib.entries);
+  cli_msg(-1023, "  Checks:         %10u", s->checks);
+  cli_msg(-1023, "  Cache hits:     %10u", s->cache_hits);
+  cli_msg(-1023, "  Nodes examined: %10u", s->nodes);
+  cli_msg(-1023, "  Invalidations:  %10u", s->invalidations);
+}
+
 void
 roa_show(struct roa_show_data *d)
 {
   struct roa_node *rn;
-  ip_addr px;
-  int len;
 
   switch (d->mode)
     {
@@ -424,16 +542,18 @@ roa_show(struct roa_show_data *d)
       break;
 
     case ROA_SHOW_FOR:
-      for (len = d->pxlen; len >= 0; len--)
-	{
-	  px = ipa_and(d->prefix, ipa_mkmask(len));
-	  rn = fib_find(&d->table->fib, &px, len);
+      {
+	struct fib_node *found[BITS_PER_IP_ADDRESS + 1];
+	int n = fib_covering(&d->table->fib, d->prefix, d->pxlen, found);
 
-	  if (!rn)
-	    continue;
+	while (n--)
+	  roa_show_node(this_cli, (struct roa_node *) found[n], 0, d->asn);
+      }
+      cli_msg(0, "");
+      break;
 
-	  roa_show_node(this_cli, rn, 0, d->asn);
-	}
+    case ROA_SHOW_STATS:
+      roa_show_stats(d->table);
       cli_msg(0, "");
       break;
     }
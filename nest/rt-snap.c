@@ -0,0 +1,1010 @@
+/*
+ *	BIRD -- Routing Table Snapshots
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Routing table snapshots
+ *
+ * To shorten convergence after a restart, the contents of a routing table
+ * may be saved to a snapshot file, periodically and when BIRD shuts down,
+ * and restored from it after the next start (see the &snapshot table
+ * option).
+ *
+ * The snapshot is a sequence of 4-byte aligned records in host byte order,
+ * preceded by a &snap_hdr. A PROTO record names a protocol, a RTA record
+ * describes a cached &rta with its extended attributes and next hops,
+ * and a NET record lists the routes of one network as references to RTA
+ * records and their preferences. Each &rta and protocol is written once,
+ * before its first use. The snapshot is written in the background by an
+ * event walking the table, like MRT dumps, and into a temporary file
+ * renamed when complete. At shutdown, it is written at once.
+ *
+ * When the table is created during startup, the snapshot is mapped into
+ * memory and indexed by protocol, the routes are left in the file. They
+ * are restored for a protocol when it announces with rt_snapshot_restore()
+ * that it is going to resend all its routes and to tell when it is done.
+ * The routes are entered by an event in steps of %SNAP_STEP, routes the
+ * protocol has sent again meanwhile are not overwritten and the rest is
+ * dropped if the protocol is done first.
+ * Restored routes bypass the import filters, which they have already
+ * passed, and are marked stale, so that the rt_refresh_end() called from
+ * rt_snapshot_end() removes those not refreshed by the protocol. BGP does
+ * that for neighbors sending End-of-RIB. Routes whose interfaces are
+ * missing are not restored. The mapping is released when all protocols
+ * have been restored, or after the graceful restart wait time.
+ */
+
+#undef LOCAL_DEBUG
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nest/bird.h"
+#include "nest/route.h"
+#include "nest/protocol.h"
+#include "nest/iface.h"
+#include "lib/resource.h"
+#include "lib/event.h"
+#include "lib/hash.h"
+#include "lib/string.h"
+#include "lib/alloca.h"
+#include "conf/conf.h"
+#include "sysdep/unix/unix.h"
+#include "sysdep/unix/timer.h"
+
+#define SNAP_MAGIC		"BIRDSNP1"
+#define SNAP_ORDER		0x01020304
+
+#define SNAP_STEP		256		/* Networks written or routes restored in one event */
+#define SNAP_IO_SIZE		65536		/* Size of the stdio buffer */
+
+#define SNAP_ALIGN(x)		(((x) + 3) & ~3)
+
+struct snap_hdr {
+  char magic[8];
+  u32 order;				/* SNAP_ORDER in byte order of the writer */
+  u32 ip_size;				/* sizeof(ip_addr) of the writer */
+  u32 time;				/* When the snapshot was finished */
+  u32 protos, rtas, nets, routes;
+};
+
+#define SNAP_R_PROTO		1
+#define SNAP_R_RTA		2
+#define SNAP_R_NET		3
+
+struct snap_rec {
+  u16 type;
+  u16 pad;
+  u32 len;				/* Including this header, a multiple of 4 */
+};
+
+struct snap_proto {
+  struct snap_rec r;
+  u32 index;
+  char name[0];				/* NUL-terminated */
+};
+
+struct snap_rta {
+  struct snap_rec r;
+  u32 index;
+  u32 proto;				/* Index of the PROTO record */
+  u32 src_id;				/* Private ID of the route source */
+  byte source, scope, cast, dest;
+  u32 igp_metric;
+  ip_addr gw, from;
+  char iface[16];
+  u32 nexthops, eattrs;			/* Followed by struct snap_nh[], then struct snap_ea[] */
+};
+
+struct snap_nh {
+  ip_addr gw;
+  char iface[16];
+  u32 weight;
+};
+
+struct snap_ea {
+  u16 id;
+  byte flags, type;
+  u32 data;				/* Value, or length of the data following */
+};
+
+struct snap_rte {
+  u32 rta;				/* Index of the RTA record */
+  u16 pref;
+  byte pflags, pad;
+};
+
+struct snap_net {
+  struct snap_rec r;
+  ip_addr prefix;
+  u32 pxlen;
+  u32 count;
+  struct snap_rte rte[0];
+};
+
+
+/*
+ *	Writing
+ */
+
+struct snap_ref {
+  struct snap_ref *next;
+  void *ptr;				/* Locked rta or protocol */
+  u32 index;
+};
+
+#define SNR_KEY(n)		n->ptr
+#define SNR_NEXT(n)		n->next
+#define SNR_EQ(a,b)		a == b
+#define SNR_FN(a)		u32_hash((u32) ((uintptr_t) a >> 4))
+
+#define SNR_REHASH		snap_ref_rehash
+#define SNR_PARAMS		/8, *2, 2, 2, 8, 24
+
+HASH_DEFINE_REHASH_FN(SNR, struct snap_ref)
+
+struct snap_writer {
+  pool *pool;
+  rtable *table;
+  char *name, *tmp_name;		/* Final and temporary file name */
+  FILE *file;
+  struct fib_iterator fit;
+  struct event *event;
+  HASH(struct snap_ref) rtas;
+  HASH(struct snap_ref) protos;
+  struct snap_hdr hdr;
+  byte *buf, *nbuf;			/* Buffers for RTA and NET records */
+  uint buf_size, nbuf_size;
+};
+
+static void *
+snap_grow(struct snap_writer *w, byte **buf, uint *size, uint len)
+{
+  if (len > *size)
+    {
+      *size = MAX(len, 2 * *size);
+      *buf = mb_realloc(*buf, *size);
+    }
+
+  memset(*buf, 0, len);
+  return *buf;
+}
+
+static u32
+snap_proto_index(struct snap_writer *w, struct proto *p)
+{
+  struct snap_ref *r = HASH_FIND(w->protos, SNR, p);
+  struct snap_proto *sp;
+  uint nl, len;
+
+  if (r)
+    return r->index;
+
+  r = mb_alloc(w->pool, sizeof(struct snap_ref));
+  r->ptr = p;
+  r->index = w->hdr.protos++;
+  HASH_INSERT2(w->protos, SNR, w->pool, r);
+
+  nl = strlen(p->name) + 1;
+  len = SNAP_ALIGN(sizeof(struct snap_proto) + nl);
+  sp = snap_grow(w, &w->buf, &w->buf_size, len);
+  sp->r.type = SNAP_R_PROTO;
+  sp->r.len = len;
+  sp->index = r->index;
+  memcpy(sp->name, p->name, nl);
+  fwrite(sp, len, 1, w->file);
+
+  return r->index;
+}
+
+static u32
+snap_rta_index(struct snap_writer *w, rta *a)
+{
+  struct snap_ref *r = HASH_FIND(w->rtas, SNR, a);
+  struct snap_rta *sr;
+  struct snap_nh *sn;
+  struct snap_ea *se;
+  struct mpnh *nh;
+  ea_list *eal = NULL;
+  uint nhs = 0, len;
+  int i;
+
+  if (r)
+    return r->index;
+
+  u32 pi = snap_proto_index(w, a->src->proto);
+
+  if (a->eattrs)
+    {
+      eal = alloca(ea_scan(a->eattrs));
+      ea_merge(a->eattrs, eal);
+      ea_sort(eal);
+    }
+
+  for (nh = a->nexthops; nh; nh = nh->next)
+    nhs++;
+
+  len = sizeof(struct snap_rta) + nhs * sizeof(struct snap_nh);
+  for (i = 0; eal && (i < eal->count); i++)
+    len += sizeof(struct snap_ea) +
+      ((eal->attrs[i].type & EAF_EMBEDDED) ? 0 : SNAP_ALIGN(eal->attrs[i].u.ptr->length));
+
+  sr = snap_grow(w, &w->buf, &w->buf_size, len);
+  sr->r.type = SNAP_R_RTA;
+  sr->r.len = len;
+  sr->index = w->hdr.rtas;
+  sr->proto = pi;
+  sr->src_id = a->src->private_id;
+  sr->source = a->source;
+  sr->scope = a->scope;
+  sr->cast = a->cast;
+  sr->dest = a->dest;
+  sr->igp_metric = a->igp_metric;
+  sr->gw = a->gw;
+  sr->from = a->from;
+  if (a->iface)
+    strcpy(sr->iface, a->iface->name);
+  sr->nexthops = nhs;
+  sr->eattrs = eal ? eal->count : 0;
+
+  sn = (struct snap_nh *) (sr + 1);
+  for (nh = a->nexthops; nh; nh = nh->next, sn++)
+    {
+      sn->gw = nh->gw;
+      strcpy(sn->iface, nh->iface->name);
+      sn->weight = nh->weight;
+    }
+
+  se = (struct snap_ea *) sn;
+  for (i = 0; eal && (i < eal->count); i++)
+    {
+      eattr *e = &eal->attrs[i];
+
+      se->id = e->id;
+      se->flags = e->flags;
+      se->type = e->type;
+      if (e->type & EAF_EMBEDDED)
+	se->data = e->u.data;
+      else
+	{
+	  se->data = e->u.ptr->length;
+	  memcpy(se + 1, e->u.ptr->data, se->data);
+	}
+      se = (struct snap_ea *) ((byte *) (se + 1) + ((e->type & EAF_EMBEDDED) ? 0 : SNAP_ALIGN(se->data)));
+    }
+
+  fwrite(sr, len, 1, w->file);
+
+  r = mb_alloc(w->pool, sizeof(struct snap_ref));
+  r->ptr = rta_clone(a);
+  r->index = w->hdr.rtas++;
+  HASH_INSERT2(w->rtas, SNR, w->pool, r);
+
+  return r->index;
+}
+
+static void
+snap_write_net(struct snap_writer *w, net *n)
+{
+  struct snap_net *sn;
+  uint count = 0, len;
+  rte *e;
+
+  for (e = n->routes; e; e = e->next)
+    if (rte_is_valid(e))
+      count++;
+
+  if (!count)
+    return;
+
+  len = sizeof(struct snap_net) + count * sizeof(struct snap_rte);
+  sn = snap_grow(w, &w->nbuf, &w->nbuf_size, len);
+  sn->r.type = SNAP_R_NET;
+  sn->r.len = len;
+  sn->prefix = n->n.prefix;
+  sn->pxlen = n->n.pxlen;
+  sn->count = count;
+
+  /* Referenced RTA and PROTO records are written first */
+  for (count = 0, e = n->routes; e; e = e->next)
+    if (rte_is_valid(e))
+      {
+	struct snap_rte *sr = &sn->rte[count++];
+	sr->rta = snap_rta_index(w, e->attrs);
+	sr->pref = e->pref;
+	sr->pflags = e->pflags;
+      }
+
+  fwrite(sn, len, 1, w->file);
+  w->hdr.nets++;
+  w->hdr.routes += count;
+}
+
+static void
+snap_write_done(struct snap_writer *w)
+{
+  rtable *t = w->table;
+  int err;
+
+  w->hdr.time = now_real;
+  err = fflush(w->file) || fseek(w->file, 0, SEEK_SET) ||
+    (fwrite(&w->hdr, sizeof(w->hdr), 1, w->file) != 1) || fflush(w->file) || ferror(w->file);
+
+  if (err)
+    log(L_ERR "Snapshot of table %s to %s failed: %m", t->name, w->name);
+  else if (rename(w->tmp_name, w->name) < 0)
+    log(L_ERR "Snapshot of table %s: Cannot rename %s: %m", t->name, w->tmp_name);
+  else
+    log(L_INFO "Snapshot of table %s written: %u networks, %u routes", t->name,
+	w->hdr.nets, w->hdr.routes);
+
+  if (err)
+    unlink(w->tmp_name);
+
+  HASH_WALK(w->rtas, next, r)
+    rta_free(r->ptr);
+  HASH_WALK_END;
+
+  t->snap_writer = NULL;
+  rfree(w->pool);			/* Closes the file as well */
+  rt_unlock_table(t);
+}
+
+static int
+snap_write_step(struct snap_writer *w, uint max)
+{
+  struct fib *fib = &w->table->fib;
+
+  if (ferror(w->file))
+    {
+      fit_get(fib, &w->fit);
+      snap_write_done(w);
+      return 1;
+    }
+
+  FIB_ITERATE_START(fib, &w->fit, f)
+    {
+      if (!max--)
+	{
+	  FIB_ITERATE_PUT(&w->fit, f);
+	  return 0;
+	}
+      snap_write_net(w, (net *) f);
+    }
+  FIB_ITERATE_END(f);
+
+  snap_write_done(w);
+  return 1;
+}
+
+static void
+snap_write_event(void *data)
+{
+  struct snap_writer *w = data;
+
+  if (!snap_write_step(w, SNAP_STEP))
+    ev_schedule(w->event);
+}
+
+/**
+ * rt_snapshot_write - start writing a snapshot of a routing table
+ * @t: routing table with a configured snapshot file
+ *
+ * The snapshot is written in the background. Returns 0 on success, or -1
+ * with errno set when the file cannot be created, or with errno zero when
+ * the previous snapshot is still being written.
+ */
+int
+rt_snapshot_write(rtable *t)
+{
+  struct snap_writer *w;
+  char *name = t->config->snap_file;
+  pool *p;
+
+  errno = 0;
+  if (t->snap_writer)
+    return -1;
+
+  p = rp_new(&root_pool, "Table snapshot");
+  w = mb_allocz(p, sizeof(struct snap_writer));
+  w->pool = p;
+  w->table = t;
+  w->name = mb_alloc(p, strlen(name) + 1);
+  strcpy(w->name, name);
+  w->tmp_name = mb_alloc(p, strlen(name) + 5);
+  bsprintf(w->tmp_name, "%s.tmp", name);
+
+  w->file = tracked_fopen(p, w->tmp_name, "w");
+  if (!w->file)
+    {
+      int e = errno;
+      rfree(p);
+      errno = e;
+      return -1;
+    }
+  setvbuf(w->file, mb_alloc(p, SNAP_IO_SIZE), _IOFBF, SNAP_IO_SIZE);
+
+  w->buf_size = w->nbuf_size = 1024;
+  w->buf = mb_alloc(p, w->buf_size);
+  w->nbuf = mb_alloc(p, w->nbuf_size);
+  HASH_INIT(w->rtas, p, 10);
+  HASH_INIT(w->protos, p, 4);
+  w->event = ev_new(p);
+  w->event->hook = snap_write_event;
+  w->event->data = w;
+
+  /* The header is rewritten with final counts when the snapshot is done */
+  memcpy(w->hdr.magic, SNAP_MAGIC, sizeof(w->hdr.magic));
+  w->hdr.order = SNAP_ORDER;
+  w->hdr.ip_size = sizeof(ip_addr);
+  fwrite(&w->hdr, sizeof(w->hdr), 1, w->file);
+
+  rt_lock_table(t);
+  t->snap_writer = w;
+
+  FIB_ITERATE_INIT(&w->fit, &t->fib);
+  ev_schedule(w->event);
+  return 0;
+}
+
+/**
+ * rt_snapshot_shutdown - write snapshots of all tables
+ *
+ * Called when BIRD is shutting down, before the protocols are stopped.
+ * Snapshots being written are finished and the others are written at
+ * once.
+ */
+void
+rt_snapshot_shutdown(void)
+{
+  struct rtable_config *cf;
+
+  WALK_LIST(cf, config->tables)
+    {
+      rtable *t = cf->table;
+
+      if (!t || !cf->snap_file)
+	continue;
+
+      if (!t->snap_writer && (rt_snapshot_write(t) < 0))
+	{
+	  log(L_ERR "Snapshot of table %s: Cannot create %s: %m", t->name, cf->snap_file);
+	  continue;
+	}
+
+      ev_postpone(t->snap_writer->event);
+      snap_write_step(t->snap_writer, ~0U);
+    }
+}
+
+
+/*
+ *	Restoring
+ */
+
+struct snap_list {
+  u32 *ent;				/* Pairs of NET record offset and route index */
+  u32 count, size;
+};
+
+struct snap_map {
+  pool *pool;
+  rtable *table;
+  byte *data;
+  size_t size;
+  u32 protos, rtas;
+  char **proto_name;
+  u32 *rta_off;				/* Offsets of RTA records by index */
+  u32 *rta_proto;			/* Their protocols */
+  struct snap_list *lists;		/* Routes by protocol */
+  uint pending;				/* Protocols not restored yet */
+  list restores;			/* Restores in progress (struct snap_restore) */
+  event *event;				/* Runs snap_restore_step() */
+  timer *expire;
+};
+
+struct snap_restore {
+  node n;
+  struct proto *proto;
+  struct snap_list *list;
+  u32 pos;				/* Next entry of list */
+  rta **cache;				/* Restored rtas by index */
+  uint restored, skipped;
+};
+
+static void snap_restore_free(struct snap_map *m, struct snap_restore *r);
+
+static void
+snap_map_free(struct snap_map *m)
+{
+  while (!EMPTY_LIST(m->restores))
+    snap_restore_free(m, HEAD(m->restores));
+
+  m->table->snap_map = NULL;
+  munmap(m->data, m->size);
+  rfree(m->pool);
+}
+
+static void
+snap_map_expire(timer *tm)
+{
+  struct snap_map *m = tm->data;
+
+  log(L_INFO "Snapshot of table %s expired, %u protocols not restored", m->table->name, m->pending);
+  snap_map_free(m);
+}
+
+static void
+snap_list_add(struct snap_map *m, struct snap_list *l, u32 off, u32 i)
+{
+  if (l->count == l->size)
+    {
+      l->size = l->size ? 2 * l->size : 64;
+      l->ent = l->ent ? mb_realloc(l->ent, 2 * l->size * sizeof(u32)) :
+	mb_alloc(m->pool, 2 * l->size * sizeof(u32));
+    }
+
+  l->ent[2 * l->count] = off;
+  l->ent[2 * l->count + 1] = i;
+  if (!l->count++)
+    m->pending++;
+}
+
+static int
+snap_index(struct snap_map *m)
+{
+  struct snap_hdr *h = (struct snap_hdr *) m->data;
+  byte *pos = m->data + sizeof(struct snap_hdr);
+  byte *end = m->data + m->size;
+  u32 protos = 0, rtas = 0;
+  uint i;
+
+  if ((m->size < sizeof(struct snap_hdr)) || memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) ||
+      (h->order != SNAP_ORDER) || (h->ip_size != sizeof(ip_addr)))
+    return 0;
+
+  /* Each of them needs a record, which also keeps the allocations below sane */
+  if ((h->protos > (m->size - sizeof(struct snap_hdr)) / SNAP_ALIGN(sizeof(struct snap_proto) + 1)) ||
+      (h->rtas > (m->size - sizeof(struct snap_hdr)) / sizeof(struct snap_rta)))
+    return 0;
+
+  m->protos = h->protos;
+  m->rtas = h->rtas;
+  m->proto_name = mb_allocz(m->pool, (m->protos + 1) * sizeof(char *));
+  m->lists = mb_allocz(m->pool, (m->protos + 1) * sizeof(struct snap_list));
+  m->rta_off = mb_alloc(m->pool, (m->rtas + 1) * sizeof(u32));
+  m->rta_proto = mb_alloc(m->pool, (m->rtas + 1) * sizeof(u32));
+
+  while (pos < end)
+    {
+      struct snap_rec *r = (struct snap_rec *) pos;
+
+      if (((uint) (end - pos) < sizeof(struct snap_rec)) || (r->len < sizeof(struct snap_rec)) ||
+	  (r->len & 3) || (r->len > (uint) (end - pos)))
+	return 0;
+
+      switch (r->type)
+	{
+	case SNAP_R_PROTO:
+	  {
+	    struct snap_proto *sp = (void *) r;
+	    if ((r->len < sizeof(struct snap_proto) + 1) || (sp->index != protos) ||
+		(protos >= m->protos) || !memchr(sp->name, 0, r->len - sizeof(struct snap_proto)))
+	      return 0;
+	    m->proto_name[protos++] = sp->name;
+	    break;
+	  }
+
+	case SNAP_R_RTA:
+	  {
+	    struct snap_rta *sr = (void *) r;
+	    if ((r->len < sizeof(struct snap_rta)) || (sr->index != rtas) ||
+		(rtas >= m->rtas) || (sr->proto >= protos))
+	      return 0;
+	    m->rta_off[rtas] = pos - m->data;
+	    m->rta_proto[rtas++] = sr->proto;
+	    break;
+	  }
+
+	case SNAP_R_NET:
+	  {
+	    struct snap_net *sn = (void *) r;
+	    if ((r->len < sizeof(struct snap_net)) ||
+		(sn->count > (r->len - sizeof(struct snap_net)) / sizeof(struct snap_rte)) ||
+		(sn->pxlen > MAX_PREFIX_LENGTH) ||
+		!ipa_equal(sn->prefix, ipa_and(sn->prefix, ipa_mkmask(sn->pxlen))))
+	      return 0;
+	    for (i = 0; i < sn->count; i++)
+	      {
+		if (sn->rte[i].rta >= rtas)
+		  return 0;
+		snap_list_add(m, &m->lists[m->rta_proto[sn->rte[i].rta]], pos - m->data, i);
+	      }
+	    break;
+	  }
+
+	default:
+	  return 0;
+	}
+
+      pos += r->len;
+    }
+
+  return 1;
+}
+
+/**
+ * rt_snapshot_open - load a snapshot of a routing table
+ * @t: routing table with a configured snapshot file
+ *
+ * Maps and indexes the snapshot, so that routes may be restored for the
+ * protocols connected to @t when they start. Called when @t is created
+ * during startup.
+ */
+void
+rt_snapshot_open(rtable *t)
+{
+  char *name = t->config->snap_file;
+  struct snap_map *m;
+  struct stat st;
+  void *data;
+  int fd;
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0)
+    {
+      if (errno != ENOENT)
+	log(L_ERR "Snapshot of table %s: Cannot open %s: %m", t->name, name);
+      return;
+    }
+
+  if ((fstat(fd, &st) < 0) || !st.st_size ||
+      ((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+    {
+      log(L_ERR "Snapshot of table %s: Cannot map %s: %m", t->name, name);
+      close(fd);
+      return;
+    }
+  close(fd);
+
+  pool *p = rp_new(&root_pool, "Table snapshot");
+  m = mb_allocz(p, sizeof(struct snap_map));
+  m->pool = p;
+  m->table = t;
+  m->data = data;
+  m->size = st.st_size;
+  init_list(&m->restores);
+  t->snap_map = m;
+
+  if (!snap_index(m))
+    {
+      log(L_ERR "Snapshot of table %s: %s is damaged or from another build", t->name, name);
+      snap_map_free(m);
+      return;
+    }
+
+  if (!m->pending)
+    {
+      snap_map_free(m);
+      return;
+    }
+
+  log(L_INFO "Snapshot of table %s loaded, %u protocols to restore", t->name, m->pending);
+  m->expire = tm_new_set(p, snap_map_expire, m, 0, 0);
+  tm_start(m->expire, config->gr_wait ?: 240);
+}
+
+/**
+ * rt_snapshot_close - release a loaded snapshot
+ * @t: routing table
+ */
+void
+rt_snapshot_close(rtable *t)
+{
+  if (t->snap_map)
+    snap_map_free(t->snap_map);
+}
+
+static rta *
+snap_rta_restore(struct snap_map *m, u32 idx, struct proto *p)
+{
+  struct snap_rta *sr = (struct snap_rta *) (m->data + m->rta_off[idx]);
+  struct snap_nh *sn = (struct snap_nh *) (sr + 1);
+  byte *end = (byte *) sr + sr->r.len;
+  struct mpnh *nhs = NULL, **nhp = &nhs;
+  struct snap_ea *se;
+  ea_list *eal = NULL;
+  rta a = {};
+  uint i;
+
+  if ((sr->nexthops > (uint) (end - (byte *) sn) / sizeof(struct snap_nh)) ||
+      (sr->eattrs > (uint) (end - (byte *) (sn + sr->nexthops)) / sizeof(struct snap_ea)))
+    return NULL;
+
+  a.src = rt_get_source(p, sr->src_id);
+  a.source = sr->source;
+  a.scope = sr->scope;
+  a.cast = sr->cast;
+  a.dest = sr->dest;
+  a.igp_metric = sr->igp_metric;
+  a.gw = sr->gw;
+  a.from = sr->from;
+
+  if (sr->iface[0])
+    {
+      char name[sizeof(sr->iface) + 1];
+      memcpy(name, sr->iface, sizeof(sr->iface));
+      name[sizeof(sr->iface)] = 0;
+
+      a.iface = if_find_by_name(name);
+      if (!a.iface || !(a.iface->flags & IF_UP))
+	return NULL;
+    }
+  else if ((a.dest == RTD_ROUTER) || (a.dest == RTD_DEVICE))
+    return NULL;
+
+  for (i = 0; i < sr->nexthops; i++, sn++)
+    {
+      struct mpnh *nh = alloca(sizeof(struct mpnh));
+      char name[sizeof(sn->iface) + 1];
+
+      memcpy(name, sn->iface, sizeof(sn->iface));
+      name[sizeof(sn->iface)] = 0;
+
+      nh->gw = sn->gw;
+      nh->iface = if_find_by_name(name);
+      nh->weight = sn->weight;
+      nh->next = NULL;
+      if (!nh->iface || !(nh->iface->flags & IF_UP))
+	return NULL;
+
+      *nhp = nh;
+      nhp = &nh->next;
+    }
+  a.nexthops = nhs;
+
+  if (sr->eattrs)
+    {
+      eal = alloca(sizeof(ea_list) + sr->eattrs * sizeof(eattr));
+      eal->next = NULL;
+      eal->flags = 0;
+      eal->count = sr->eattrs;
+
+      /* Stored data have the layout of struct adata, they are copied by rta_lookup() */
+      se = (struct snap_ea *) sn;
+      for (i = 0; i < sr->eattrs; i++)
+	{
+	  eattr *e = &eal->attrs[i];
+
+	  if ((byte *) (se + 1) > end)
+	    return NULL;
+
+	  e->id = se->id;
+	  e->flags = se->flags;
+	  e->type = se->type;
+	  if (se->type & EAF_EMBEDDED)
+	    {
+	      e->u.data = se->data;
+	      se++;
+	    }
+	  else
+	    {
+	      if (se->data > (uint) (end - (byte *) (se + 1)))
+		return NULL;
+	      e->u.ptr = (struct adata *) &se->data;
+	      se = (struct snap_ea *) ((byte *) (se + 1) + SNAP_ALIGN(se->data));
+	    }
+	}
+      a.eattrs = eal;
+    }
+
+  return rta_lookup(&a);
+}
+
+static void
+snap_restore_free(struct snap_map *m, struct snap_restore *r)
+{
+  uint i;
+
+  for (i = 0; i < m->rtas; i++)
+    if (r->cache[i] && (r->cache[i] != (rta *) m))
+      rta_free(r->cache[i]);
+
+  rem_node(&r->n);
+  mb_free(r->cache);
+  mb_free(r);
+}
+
+/* Finishes the restore, returns 1 if the map has been freed */
+static int
+snap_restore_done(struct snap_map *m, struct snap_restore *r)
+{
+  struct snap_list *l = r->list;
+
+  log(L_INFO "%s: %u routes restored from snapshot%s%s", r->proto->name, r->restored,
+      r->skipped ? ", some skipped for missing interfaces" : "",
+      (r->pos < l->count) ? ", the rest dropped" : "");
+
+  snap_restore_free(m, r);
+  mb_free(l->ent);
+  l->ent = NULL;
+  l->count = 0;
+
+  if (--m->pending)
+    return 0;
+
+  snap_map_free(m);
+  return 1;
+}
+
+static struct snap_restore *
+snap_restore_find(struct snap_map *m, struct proto *p)
+{
+  struct snap_restore *r;
+
+  WALK_LIST(r, m->restores)
+    if (r->proto == p)
+      return r;
+
+  return NULL;
+}
+
+static void
+snap_restore_route(struct snap_map *m, struct snap_restore *r)
+{
+  struct proto *p = r->proto;
+  struct announce_hook *ah = p->main_ahook;
+  struct snap_net *sn = (struct snap_net *) (m->data + r->list->ent[2 * r->pos]);
+  struct snap_rte *sr = &sn->rte[r->list->ent[2 * r->pos + 1]];
+  rta *a = r->cache[sr->rta];
+  net *n;
+  rte *e;
+
+  r->pos++;
+
+  if (!a)
+    a = r->cache[sr->rta] = snap_rta_restore(m, sr->rta, p) ?: (rta *) m;
+
+  if (a == (rta *) m)			/* Not restorable */
+    {
+      r->skipped++;
+      return;
+    }
+
+  /* The protocol may have sent the route again already */
+  n = net_get(ah->table, sn->prefix, sn->pxlen);
+  for (e = n->routes; e; e = e->next)
+    if ((e->sender == ah) && (e->attrs->src == a->src))
+      return;
+
+  e = rte_get_temp(rta_clone(a));
+  e->net = n;
+  e->pref = sr->pref;
+  e->pflags = sr->pflags;
+  memset(&e->u, 0, sizeof(e->u));
+  rte_restore(ah, n, e);
+  r->restored++;
+}
+
+static void
+snap_restore_step(void *data)
+{
+  struct snap_map *m = data;
+  struct snap_restore *r;
+  uint max = SNAP_STEP;
+
+  while (!EMPTY_LIST(m->restores))
+    {
+      r = HEAD(m->restores);
+
+      while (max && (r->pos < r->list->count))
+	{
+	  snap_restore_route(m, r);
+	  max--;
+	}
+
+      if (!max)
+	{
+	  ev_schedule(m->event);
+	  return;
+	}
+
+      if (snap_restore_done(m, r))
+	return;
+    }
+}
+
+/**
+ * rt_snapshot_restore - restore routes of a protocol from a snapshot
+ * @p: protocol instance
+ *
+ * The routes of @p found in the snapshot of its table are entered into the
+ * table as stale routes, unless they were already restored. That is done
+ * in the background, the protocol may send its routes meanwhile. It has to
+ * call rt_snapshot_end() after it has sent all of them.
+ */
+void
+rt_snapshot_restore(struct proto *p)
+{
+  struct announce_hook *ah = p->main_ahook;
+  struct snap_map *m = ah ? ah->table->snap_map : NULL;
+  struct snap_restore *r;
+  struct snap_list *l = NULL;
+  uint i;
+
+  if (!m || snap_restore_find(m, p))
+    return;
+
+  for (i = 0; i < m->protos; i++)
+    if (!strcmp(m->proto_name[i], p->name))
+      {
+	l = &m->lists[i];
+	break;
+      }
+
+  if (!l || !l->count)
+    return;
+
+  r = mb_allocz(m->pool, sizeof(struct snap_restore));
+  r->proto = p;
+  r->list = l;
+  r->cache = mb_allocz(m->pool, m->rtas * sizeof(rta *));
+  add_tail(&m->restores, &r->n);
+  p->snap_restored = 1;
+
+  if (!m->event)
+    {
+      m->event = ev_new(m->pool);
+      m->event->hook = snap_restore_step;
+      m->event->data = m;
+    }
+  ev_schedule(m->event);
+}
+
+/* Stops the restore for @p, if there is one in progress */
+static void
+snap_restore_stop(struct proto *p)
+{
+  struct announce_hook *ah = p->main_ahook;
+  struct snap_map *m = ah ? ah->table->snap_map : NULL;
+  struct snap_restore *r = m ? snap_restore_find(m, p) : NULL;
+
+  if (r)
+    snap_restore_done(m, r);
+}
+
+/**
+ * rt_snapshot_end - end of restored routes
+ * @p: protocol instance
+ *
+ * The protocol has sent all its routes after rt_snapshot_restore(), so
+ * the restored routes it has not sent again are removed and those not
+ * restored yet are dropped.
+ */
+void
+rt_snapshot_end(struct proto *p)
+{
+  if (!p->snap_restored)
+    return;
+
+  snap_restore_stop(p);
+  p->snap_restored = 0;
+  rt_refresh_end(p->main_ahook->table, p->main_ahook);
+}
+
+/**
+ * rt_snapshot_cancel - stop restoring routes of a protocol
+ * @p: protocol instance going down
+ */
+void
+rt_snapshot_cancel(struct proto *p)
+{
+  snap_restore_stop(p);
+  p->snap_restored = 0;
+}
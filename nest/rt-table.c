@@ -35,6 +35,7 @@
 #include "nest/protocol.h"
 #include "nest/cli.h"
 #include "nest/iface.h"
+#include "nest/mrtdump.h"
 #include "lib/resource.h"
 #include "lib/event.h"
 #include "lib/string.h"
@@ -48,6 +49,7 @@
 pool *rt_table_pool;
 
 static slab *rte_slab;
+static slab *hostdep_slab;
 static linpool *rte_update_pool;
 
 static list routing_tables;
@@ -57,6 +59,7 @@ static void rt_free_hostcache(rtable *tab);
 static void rt_notify_hostcache(rtable *tab, net *net);
 static void rt_update_hostcache(rtable *tab);
 static void rt_next_hop_update(rtable *tab);
+static void rt_depend_hostentry(rtable *tab, net *n, struct hostentry *he);
 static inline int rt_prune_table(rtable *tab);
 static inline void rt_schedule_gc(rtable *tab);
 static inline void rt_schedule_prune(rtable *tab);
@@ -70,22 +73,17 @@ make_tmp_attrs(struct rte *rt, struct linpool *pool)
   return mta ? mta(rt, rte_update_pool) : NULL;
 }
 
+static int
+net_route_valid(struct fib_node *n)
+{
+  return rte_is_valid(((net *) n)->routes);
+}
+
 /* Like fib_route(), but skips empty net entries */
 static net *
 net_route(rtable *tab, ip_addr a, int len)
 {
-  ip_addr a0;
-  net *n;
-
-  while (len >= 0)
-    {
-      a0 = ipa_and(a, ipa_mkmask(len));
-      n = fib_find(&tab->fib, &a0, len);
-      if (n && rte_is_valid(n->routes))
-	return n;
-      len--;
-    }
-  return NULL;
+  return fib_route_match(&tab->fib, a, len, net_route_valid);
 }
 
 static void
@@ -195,7 +193,7 @@ rte_trace_out(unsigned int flag, struct proto *p, rte *e, char *msg)
 }
 
 static rte *
-export_filter(struct announce_hook *ah, rte *rt0, rte **rt_free, ea_list **tmpa, int silent)
+export_filter(struct announce_hook *ah, rte *rt0, rte **rt_free, ea_list **tmpa, int silent, int *deferred)
 {
   struct proto *p = ah->proto;
   struct filter *filter = ah->out_filter;
@@ -243,7 +241,19 @@ export_filter(struct announce_hook *ah, rte *rt0, rte **rt_free, ea_list **tmpa,
       goto reject;
     }
 
-  if ( filter_hook_dispatcher(BGP_HOOK_EXPORT, p, rt) & HOOK_STATUS_BAD )
+  v = filter_hook_dispatcher(BGP_HOOK_EXPORT, p, rt, silent ? HOOK_FILTER_F_SILENT : 0);
+
+  if (v & HOOK_STATUS_DEFERRED)
+    {
+      /* Withheld until the verdict arrives, see rt_feed_net() */
+      if (!silent)
+	rte_trace_out(D_FILTERS, p, rt, "deferred");
+      if (deferred)
+	*deferred = 1;
+      goto reject;
+    }
+
+  if (v & HOOK_STATUS_BAD)
     {
       goto reject;
     }
@@ -360,6 +370,7 @@ rt_notify_basic(struct announce_hook *ah, net *net, rte *new0, rte *old0, int re
   rte *new_free = NULL;
   rte *old_free = NULL;
   ea_list *tmpa = NULL;
+  int deferred = 0;
 
   if (new)
     stats->exp_updates_received++;
@@ -387,10 +398,26 @@ rt_notify_basic(struct announce_hook *ah, net *net, rte *new0, rte *old0, int re
    */
 
   if (new)
-    new = export_filter(ah, new, &new_free, &tmpa, 0);
+    new = export_filter(ah, new, &new_free, &tmpa, 0, &deferred);
 
   if (old && !refeed)
-    old = export_filter(ah, old, &old_free, NULL, 1);
+    old = export_filter(ah, old, &old_free, NULL, 1, NULL);
+
+  /*
+   * A route hook has not decided about the new route yet. Rather than
+   * withdrawing the old one and announcing the new one later, the old
+   * route stays exported and the hook keeps it to be replaced or
+   * withdrawn once the verdict arrives, see rt_feed_net().
+   */
+  if (deferred)
+  {
+    if (old)
+      filter_hook_dispatcher(BGP_HOOK_EXPORT, p, old0, HOOK_FILTER_F_KEEP);
+
+    if (old_free)
+      rte_free(old_free);
+    return;
+  }
 
   if (!new && !old)
   {
@@ -434,6 +461,7 @@ rt_notify_accepted(struct announce_hook *ah, net *net, rte *new_changed, rte *ol
   rte *new_free = NULL;
   rte *old_free = NULL;
   ea_list *tmpa = NULL;
+  int deferred = 0;
 
   /* Used to track whether we met old_changed position. If before_old is NULL
      old_changed was the first and we met it implicitly before current best route. */
@@ -451,9 +479,13 @@ rt_notify_accepted(struct announce_hook *ah, net *net, rte *new_changed, rte *ol
   /* First, find the new_best route - first accepted by filters */
   for (r=net->routes; rte_is_valid(r); r=r->next)
     {
-      if (new_best = export_filter(ah, r, &new_free, &tmpa, 0))
+      if (new_best = export_filter(ah, r, &new_free, &tmpa, 0, &deferred))
 	break;
 
+      /* Whatever was exported stays until the verdict, see rt_feed_net() */
+      if (deferred)
+	return;
+
       /* Note if we walked around the position of old_changed route */
       if (r == before_old)
 	old_meet = 1;
@@ -502,7 +534,7 @@ rt_notify_accepted(struct announce_hook *ah, net *net, rte *new_changed, rte *ol
 
   /* First case */
   if (old_meet)
-    if (old_best = export_filter(ah, old_changed, &old_free, NULL, 1))
+    if (old_best = export_filter(ah, old_changed, &old_free, NULL, 1, NULL))
       goto found;
 
   /* Second case */
@@ -520,11 +552,11 @@ rt_notify_accepted(struct announce_hook *ah, net *net, rte *new_changed, rte *ol
   /* Fourth case */
   for (r=r->next; rte_is_valid(r); r=r->next)
     {
-      if (old_best = export_filter(ah, r, &old_free, NULL, 1))
+      if (old_best = export_filter(ah, r, &old_free, NULL, 1, NULL))
 	goto found;
 
       if (r == before_old)
-	if (old_best = export_filter(ah, old_changed, &old_free, NULL, 1))
+	if (old_best = export_filter(ah, old_changed, &old_free, NULL, 1, NULL))
 	  goto found;
     }
 
@@ -568,6 +600,9 @@ rt_notify_accepted(struct announce_hook *ah, net *net, rte *new_changed, rte *ol
  * export filter and if it accepts the route, the rt_notify() hook of
  * the protocol gets called.
  */
+static int rt_export_enqueue(struct announce_hook *ah, net *net, rte *old);
+static void rt_export_event(void *ptr);
+
 static void
 rte_announce(rtable *tab, unsigned type, net *net, rte *new, rte *old, rte *before_old)
 {
@@ -598,7 +633,7 @@ rte_announce(rtable *tab, unsigned type, net *net, rte *new, rte *old, rte *befo
       if (a->proto->accept_ra_types == type)
 	if (type == RA_ACCEPTED)
 	  rt_notify_accepted(a, net, new, old, before_old, 0);
-	else
+	else if ((type != RA_OPTIMAL) || !rt_export_enqueue(a, net, old))
 	  rt_notify_basic(a, net, new, old, 0);
     }
 }
@@ -886,6 +921,9 @@ rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *sr
   if (new)
     new->lastmod = now;
 
+  if (new && new->attrs->hostentry)
+    rt_depend_hostentry(table, net, new->attrs->hostentry);
+
   /* Log the route change */
   if (p->debug & D_ROUTES)
     {
@@ -925,6 +963,8 @@ rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *sr
 
 static int rte_update_nest_cnt;		/* Nesting counter to allow recursive updates */
 
+static int rt_import_enqueue(struct announce_hook *ah, net *net, rte *new, struct rte_src *src);
+
 static inline void
 rte_update_lock(void)
 {
@@ -1000,8 +1040,8 @@ rte_unhide_dummy_routes(net *net, rte **dummy)
  * finishes.
  */
 
-void
-rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
+static void
+rte_do_update(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
 {
   struct proto *p = ah->proto;
   struct proto_stats *stats = ah->stats;
@@ -1009,7 +1049,6 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
   ea_list *tmpa = NULL;
   rte *dummy = NULL;
 
-  rte_update_lock();
   if (new)
     {
       new->sender = ah;
@@ -1059,16 +1098,27 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
 	new->attrs = rta_lookup(new->attrs);
       new->flags |= REF_COW;
 
-      if ( !(new->flags & REF_FILTERED) &&
-	  (filter_hook_dispatcher(BGP_HOOK_IMPORT, p, new) & HOOK_STATUS_BAD) )
+      if (!(new->flags & REF_FILTERED))
 	{
-	  stats->imp_updates_filtered++;
-	  rte_trace_in(D_FILTERS, p, new, "filtered out");
+	  int hs = filter_hook_dispatcher(BGP_HOOK_IMPORT, p, new, 0);
 
-	  if (! ah->in_keep_filtered)
-	    goto drop;
+	  if (hs & HOOK_STATUS_DEFERRED)
+	    {
+	      /* The hook owns the route now, it comes back via rte_update_verdict() */
+	      rte_trace_in(D_FILTERS, p, new, "deferred");
+	      return;
+	    }
 
-	  new->flags |= REF_FILTERED;
+	  if (hs & HOOK_STATUS_BAD)
+	    {
+	      stats->imp_updates_filtered++;
+	      rte_trace_in(D_FILTERS, p, new, "filtered out");
+
+	      if (! ah->in_keep_filtered)
+		goto drop;
+
+	      new->flags |= REF_FILTERED;
+	    }
 	}
     }
   else
@@ -1078,17 +1128,20 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
       if (!net || !src)
 	{
 	  stats->imp_withdraws_ignored++;
-	  rte_update_unlock();
 	  return;
 	}
 
     }
 
  recalc:
+  if (rt_import_enqueue(ah, net, new, src))
+    {
+      return;
+    }
+
   rte_hide_dummy_routes(net, &dummy);
   rte_recalculate(ah, net, new, src);
   rte_unhide_dummy_routes(net, &dummy);
-  rte_update_unlock();
   return;
 
  drop:
@@ -1097,218 +1150,769 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
   goto recalc;
 }
 
-/* Independent call to rte_announce(), used from next hop
-   recalculation, outside of rte_update(). new must be non-NULL */
-static inline void 
-rte_announce_i(rtable *tab, unsigned type, net *n, rte *new, rte *old)
+void
+rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
 {
   rte_update_lock();
-  rte_announce(tab, type, n, new, old, NULL);
+  rte_do_update(ah, net, new, src);
   rte_update_unlock();
 }
 
+/**
+ * rte_update_batch - enter updates of many networks with the same attributes
+ * @ah: pointer to table announce hook
+ * @src: protocol originating the updates
+ * @tmpl: template of the new routes
+ * @b: networks to be updated
+ *
+ * This function is equivalent to calling rte_update2() with a copy of
+ * @tmpl for each network of @b, but it is cheaper for protocols which
+ * receive many networks sharing the same attributes at once, like BGP
+ * does in a large UPDATE message. The networks are looked up or created
+ * first and all updates are done under a single update lock, so the
+ * temporary memory of the whole batch is freed at once.
+ *
+ * Exports are coalesced per announce hook for the duration of the batch.
+ * Changes of the optimal route are queued on the hooks of the table as
+ * if they had `export delay' set to zero and each hook gets its queue
+ * delivered in one go after the last update of the batch, so a protocol
+ * handles all its exports together and a network changed more than once
+ * by the batch is exported only once. Hooks with their own export delay
+ * keep their timing, hooks accepting other announcement types and pipes
+ * are notified immediately as usual.
+ *
+ * @tmpl->attrs must be cached, each route holds its own reference to it.
+ * Protocol-dependent data and @pflags are copied from @tmpl to each of
+ * the routes, the other fields of @tmpl are ignored. Neither @tmpl nor
+ * @b is modified or used after the function returns.
+ */
 void
-rte_discard(rtable *t, rte *old)	/* Non-filtered route deletion, used during garbage collection */
+rte_update_batch(struct announce_hook *ah, struct rte_src *src, rte *tmpl, struct rte_batch *b)
 {
-  rte_update_lock();
-  rte_recalculate(old->sender, old->net, NULL, old->attrs->src);
-  rte_update_unlock();
-}
+  rtable *tab = ah->table;
+  net *nets[RTE_BATCH_SIZE];
+  struct announce_hook *a;
+  byte batch = tab->export_batch;
+  uint i;
 
-/* Check rtable for best route to given net whether it would be exported do p */
-int
-rt_examine(rtable *t, ip_addr prefix, int pxlen, struct proto *p, struct filter *filter)
-{
-  net *n = net_find(t, prefix, pxlen);
-  rte *rt = n ? n->routes : NULL;
+  ASSERT(rta_is_cached(tmpl->attrs) && (b->count <= RTE_BATCH_SIZE));
 
-  if (!rte_is_valid(rt))
-    return 0;
+  for (i = 0; i < b->count; i++)
+    nets[i] = net_get(tab, b->prefix[i], b->pxlen[i]);
 
   rte_update_lock();
-
-  /* Rest is stripped down export_filter() */
-  ea_list *tmpa = make_tmp_attrs(rt, rte_update_pool);
-  int v = p->import_control ? p->import_control(p, &rt, &tmpa, rte_update_pool) : 0;
-  if (v == RIC_PROCESS)
-    v = (f_run(filter, &rt, &tmpa, rte_update_pool, FF_FORCE_TMPATTR, NULL) <= F_ACCEPT);
-
-   /* Discard temporary rte */
-  if (rt != n->routes)
-    rte_free(rt);
-
+  tab->export_batch = 1;
+  for (i = 0; i < b->count; i++)
+    {
+      rte *e = rte_get_temp(rta_clone(tmpl->attrs));
+      e->net = nets[i];
+      e->pflags = tmpl->pflags;
+      e->u = tmpl->u;
+      rte_do_update(ah, nets[i], e, src);
+    }
+  tab->export_batch = batch;
   rte_update_unlock();
 
-  return v > 0;
-}
+  if (batch)
+    return;
 
+  /* Deliver what the batch has queued, hook by hook */
+  WALK_LIST(a, tab->hooks)
+    if ((a->export_delay < 0) && !EMPTY_LIST(a->export_queue))
+      rt_export_event(a);
+}
 
 /**
- * rt_refresh_begin - start a refresh cycle
- * @t: related routing table
- * @ah: related announce hook 
+ * rte_update_verdict - finish a deferred route update
+ * @ah: announce hook the update was submitted through
+ * @new: the route parked by the import hook
+ * @src: route source the update was submitted with
+ * @accept: verdict of the hook
  *
- * This function starts a refresh cycle for given routing table and announce
- * hook. The refresh cycle is a sequence where the protocol sends all its valid
- * routes to the routing table (by rte_update()). After that, all protocol
- * routes (more precisely routes with @ah as @sender) not sent during the
- * refresh cycle but still in the table from the past are pruned. This is
- * implemented by marking all related routes as stale by REF_STALE flag in
- * rt_refresh_begin(), then marking all related stale routes with REF_DISCARD
- * flag in rt_refresh_end() and then removing such routes in the prune loop.
+ * Completes an update that rte_update2() handed over to an asynchronous
+ * import hook. The route has already passed validation and import filters,
+ * so only the verdict is applied here. @new->net must point to a valid
+ * network, the caller is responsible for looking it up again as the one
+ * seen by rte_update2() may have been pruned in the meantime.
  */
 void
-rt_refresh_begin(rtable *t, struct announce_hook *ah)
+rte_update_verdict(struct announce_hook *ah, rte *new, struct rte_src *src, int accept)
 {
-  net *n;
-  rte *e;
+  struct proto *p = ah->proto;
+  struct proto_stats *stats = ah->stats;
+  net *net = new->net;
+  rte *dummy = NULL;
 
-  FIB_WALK(&t->fib, fn)
+  rte_update_lock();
+  if (!accept)
     {
-      n = (net *) fn;
-      for (e = n->routes; e; e = e->next)
-	if (e->sender == ah)
-	  e->flags |= REF_STALE;
+      stats->imp_updates_filtered++;
+      rte_trace_in(D_FILTERS, p, new, "filtered out");
+
+      if (! ah->in_keep_filtered)
+	{
+	  rte_free(new);
+	  new = NULL;
+	}
+      else
+	new->flags |= REF_FILTERED;
     }
-  FIB_WALK_END;
+
+  rte_hide_dummy_routes(net, &dummy);
+  rte_recalculate(ah, net, new, src);
+  rte_unhide_dummy_routes(net, &dummy);
+  rte_update_unlock();
 }
 
-/**
- * rt_refresh_end - end a refresh cycle
- * @t: related routing table
- * @ah: related announce hook 
+
+/*
+ *	Import queue
  *
- * This function starts a refresh cycle for given routing table and announce
- * hook. See rt_refresh_begin() for description of refresh cycles.
+ * With `import queue' set for a table, updates which passed the import
+ * filters are not applied by rte_update() right away but queued and
+ * applied from an event, a batch at a time. Other events and sockets get
+ * their turn between batches, so a flood of updates from many peers at
+ * once does not stall e.g. keepalives. An update replaced by a newer one
+ * for the same network, hook and source before its turn is never applied.
+ * To keep the queue bounded, a batch is applied inline once it grows over
+ * RT_IMPORT_MAX_BATCHES batches.
+ *
+ * Networks are not pruned while updates are queued, so that a withdrawal
+ * always finds the network created for the update it cancels.
  */
-void
-rt_refresh_end(rtable *t, struct announce_hook *ah)
-{
-  int prune = 0;
-  net *n;
-  rte *e;
 
-  FIB_WALK(&t->fib, fn)
-    {
-      n = (net *) fn;
-      for (e = n->routes; e; e = e->next)
-	if ((e->sender == ah) && (e->flags & REF_STALE))
-	  {
-	    e->flags |= REF_DISCARD;
-	    prune = 1;
-	  }
-    }
-  FIB_WALK_END;
+#define RT_IMPORT_MAX_BATCHES	16
 
-  if (prune)
-    rt_schedule_prune(t);
-}
+struct rt_import {
+  node n;
+  struct rt_import *next;		/* Next in import_hash */
+  struct announce_hook *ah;
+  ip_addr prefix;
+  int pxlen;
+  struct rte_src *src;			/* Locked while queued */
+  rte *new;				/* NULL for withdrawals */
+};
 
+#define RIQ_KEY(i)		i->ah, i->prefix, i->pxlen, i->src
+#define RIQ_NEXT(i)		i->next
+#define RIQ_EQ(a1,p1,l1,s1,a2,p2,l2,s2) \
+  a1 == a2 && ipa_equal(p1, p2) && l1 == l2 && s1 == s2
+#define RIQ_FN(a,p,l,s) \
+  ipa_hash32(p) ^ u32_hash((l << 24) ^ s->global_id ^ (u32) (uintptr_t) a)
 
-/**
- * rte_dump - dump a route
- * @e: &rte to be dumped
- *
- * This functions dumps contents of a &rte to debug output.
- */
-void
-rte_dump(rte *e)
+#define RIQ_REHASH		rt_import_rehash
+#define RIQ_PARAMS		/8, *2, 2, 2, 8, 20
+
+HASH_DEFINE_REHASH_FN(RIQ, struct rt_import)
+
+static void rt_import_event(void *ptr);
+static void rt_import_flush(rtable *t);
+
+static void
+rt_import_remove(rtable *t, struct rt_import *i)
 {
-  net *n = e->net;
-  debug("%-1I/%2d ", n->n.prefix, n->n.pxlen);
-  debug("KF=%02x PF=%02x pref=%d lm=%d ", n->n.flags, e->pflags, e->pref, now-e->lastmod);
-  rta_dump(e->attrs);
-  if (e->attrs->src->proto->proto->dump_attrs)
-    e->attrs->src->proto->proto->dump_attrs(e);
-  debug("\n");
+  rem_node(&i->n);
+  HASH_REMOVE2(t->import_hash, RIQ, rt_table_pool, i);
+  rt_unlock_source(i->src);
+  sl_free(t->import_slab, i);
 }
 
-/**
- * rt_dump - dump a routing table
- * @t: routing table to be dumped
- *
- * This function dumps contents of a given routing table to debug output.
- */
-void
-rt_dump(rtable *t)
+static void
+rt_import_apply(rtable *t, struct rt_import *i)
 {
-  rte *e;
-  net *n;
-  struct announce_hook *a;
+  struct announce_hook *ah = i->ah;
+  struct rte_src *src = i->src;
+  rte *new = i->new;
+  rte *dummy = NULL;
 
-  debug("Dump of routing table <%s>\n", t->name);
-#ifdef DEBUGGING
-  fib_check(&t->fib);
-#endif
-  FIB_WALK(&t->fib, fn)
+  /* The network may have been pruned before we queued, but not since */
+  net *n = new ? net_get(t, i->prefix, i->pxlen) : net_find(t, i->prefix, i->pxlen);
+
+  rt_lock_source(src);
+  rt_import_remove(t, i);
+
+  if (new)
+    new->net = n;
+
+  if (n)
     {
-      n = (net *) fn;
-      for(e=n->routes; e; e=e->next)
-	rte_dump(e);
+      rte_update_lock();
+      rte_hide_dummy_routes(n, &dummy);
+      rte_recalculate(ah, n, new, src);
+      rte_unhide_dummy_routes(n, &dummy);
+      rte_update_unlock();
     }
-  FIB_WALK_END;
-  WALK_LIST(a, t->hooks)
-    debug("\tAnnounces routes to protocol %s\n", a->proto->name);
-  debug("\n");
+  else
+    ah->stats->imp_withdraws_ignored++;
+
+  rt_unlock_source(src);
 }
 
-/**
- * rt_dump_all - dump all routing tables
- *
- * This function dumps contents of all routing tables to debug output.
- */
-void
-rt_dump_all(void)
+static void
+rt_import_run(rtable *t, uint max)
 {
-  rtable *t;
-
-  WALK_LIST(t, routing_tables)
-    rt_dump(t);
+  while (max-- && !EMPTY_LIST(t->import_queue))
+    rt_import_apply(t, HEAD(t->import_queue));
 }
 
-static inline void
-rt_schedule_prune(rtable *tab)
+static inline uint
+rt_import_batch(rtable *t)
 {
-  rt_mark_for_prune(tab);
-  ev_schedule(tab->rt_event);
+  return (t->config && t->config->import_batch) ? t->config->import_batch : 1;
 }
 
-static inline void
-rt_schedule_gc(rtable *tab)
+static void
+rt_import_event(void *ptr)
 {
-  if (tab->gc_scheduled)
-    return;
+  rtable *t = ptr;
 
-  tab->gc_scheduled = 1;
-  ev_schedule(tab->rt_event);
+  rt_import_run(t, rt_import_batch(t));
+
+  if (!EMPTY_LIST(t->import_queue))
+    ev_schedule(t->import_event);
+  else if (t->gc_scheduled)
+    ev_schedule(t->rt_event);
 }
 
-static inline void
-rt_schedule_hcu(rtable *tab)
+/* Queues the update if the table wants it, returns 1 if it was queued */
+static int
+rt_import_enqueue(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
 {
-  if (tab->hcu_scheduled)
-    return;
+  rtable *t = ah->table;
+  struct rt_import *i;
 
-  tab->hcu_scheduled = 1;
-  ev_schedule(tab->rt_event);
-}
+  if (!t->config || !t->config->import_batch)
+    {
+      /* Queueing may have just been switched off, do not overtake what is left */
+      rt_import_flush(t);
+      return 0;
+    }
 
-static inline void
-rt_schedule_nhu(rtable *tab)
-{
-  if (tab->nhu_state == 0)
-    ev_schedule(tab->rt_event);
+  if (!t->import_slab)
+    {
+      t->import_slab = sl_new(rt_table_pool, sizeof(struct rt_import));
+      HASH_INIT(t->import_hash, rt_table_pool, 8);
+      t->import_event = ev_new(rt_table_pool);
+      t->import_event->hook = rt_import_event;
+      t->import_event->data = t;
+    }
 
-  /* state change 0->1, 2->3 */
-  tab->nhu_state |= 1;
-}
+  uint batch = rt_import_batch(t);
+  if (t->import_hash.count >= batch * RT_IMPORT_MAX_BATCHES)
+    rt_import_run(t, batch);
 
+  i = HASH_FIND(t->import_hash, RIQ, ah, net->n.prefix, net->n.pxlen, src);
+  if (i)
+    {
+      /* Superseded, the new one takes over the place in the queue */
+      if (i->new)
+	rte_free(i->new);
+      i->new = new;
+      return 1;
+    }
 
-static void
-rt_prune_nets(rtable *tab)
-{
-  struct fib_iterator fit;
-  int ncnt = 0, ndel = 0;
+  i = sl_alloc(t->import_slab);
+  i->ah = ah;
+  i->prefix = net->n.prefix;
+  i->pxlen = net->n.pxlen;
+  i->src = src;
+  i->new = new;
+  rt_lock_source(src);
+
+  add_tail(&t->import_queue, &i->n);
+  HASH_INSERT2(t->import_hash, RIQ, rt_table_pool, i);
+  ev_schedule(t->import_event);
+
+  return 1;
+}
+
+/* Applies all queued updates of the table */
+static void
+rt_import_flush(rtable *t)
+{
+  if (t->import_slab)
+    rt_import_run(t, ~0U);
+}
+
+/**
+ * rt_import_cancel - drop queued updates of an announce hook
+ * @ah: announce hook going away
+ *
+ * Called when a protocol is being flushed from its tables, the updates
+ * it submitted but which are still queued are forgotten.
+ */
+void
+rt_import_cancel(struct announce_hook *ah)
+{
+  rtable *t = ah->table;
+  struct rt_import *i;
+  node *nxt;
+
+  if (!t->import_slab)
+    return;
+
+  WALK_LIST_DELSAFE(i, nxt, t->import_queue)
+    if (i->ah == ah)
+      {
+	if (i->new)
+	  rte_free(i->new);
+	rt_import_remove(t, i);
+      }
+}
+
+
+/*
+ *	Export coalescing
+ *
+ * With `export delay' set for a protocol, changes of the optimal route
+ * are not exported to it right away. The network is queued on the
+ * announce hook with a private copy of the route the protocol has seen
+ * last, and further changes of the same network only update the
+ * counter of coalesced changes. The queue is delivered from an event,
+ * at most once per the delay, similarly to BGP MRAI. The protocol then
+ * gets just the difference between the route it has seen and the
+ * current one, or nothing if a flap ended where it started.
+ *
+ * Only protocols accepting RA_OPTIMAL announcements are coalesced, and
+ * not pipes, which have to propagate withdrawals of flushed protocols
+ * as they happen. Queued copies of routes of flushed protocols are
+ * delivered when the flush is done, see rt_export_flush().
+ *
+ * The same queue holds exports of rte_update_batch() for protocols
+ * without export delay. They are queued while the table has @export_batch
+ * set and delivered directly by rte_update_batch() when it is done.
+ */
+
+struct rt_export {
+  node n;				/* In export_queue of the hook */
+  struct rt_export *next;		/* Next in export_hash */
+  struct announce_hook *ah;
+  ip_addr prefix;
+  int pxlen;
+  rte *old;				/* Copy of the route last exported, or NULL */
+};
+
+#define RXQ_KEY(e)		e->ah, e->prefix, e->pxlen
+#define RXQ_NEXT(e)		e->next
+#define RXQ_EQ(a1,p1,l1,a2,p2,l2) \
+  a1 == a2 && ipa_equal(p1, p2) && l1 == l2
+#define RXQ_FN(a,p,l) \
+  ipa_hash32(p) ^ u32_hash((l << 24) ^ (u32) (uintptr_t) a)
+
+#define RXQ_REHASH		rt_export_rehash
+#define RXQ_PARAMS		/8, *2, 2, 2, 8, 20
+
+HASH_DEFINE_REHASH_FN(RXQ, struct rt_export)
+
+static void
+rt_export_remove(rtable *t, struct rt_export *e)
+{
+  rem_node(&e->n);
+  HASH_REMOVE2(t->export_hash, RXQ, rt_table_pool, e);
+  if (e->old)
+    rte_free(e->old);
+  sl_free(t->export_slab, e);
+}
+
+static void
+rt_export_deliver(struct announce_hook *ah, struct rt_export *e)
+{
+  rtable *t = ah->table;
+  rte *new, *old = e->old;
+  net *n;
+
+  /* The network may have been pruned meanwhile */
+  n = net_find(t, e->prefix, e->pxlen);
+  if (!n && old)
+    n = net_get(t, e->prefix, e->pxlen);
+
+  new = (n && rte_is_valid(n->routes)) ? n->routes : NULL;
+
+  if (!new && !old)
+    goto done;
+
+  if (new && old && rte_same(new, old))
+    {
+      ah->stats->exp_updates_coalesced++;
+      goto done;
+    }
+
+  if (old)
+    old->net = n;
+
+  rte_update_lock();
+  rt_notify_basic(ah, n, new, old, 0);
+  rte_update_unlock();
+
+ done:
+  rt_export_remove(t, e);
+}
+
+static void
+rt_export_event(void *ptr)
+{
+  struct announce_hook *ah = ptr;
+
+  ah->export_last = now;
+  while (!EMPTY_LIST(ah->export_queue))
+    rt_export_deliver(ah, HEAD(ah->export_queue));
+}
+
+static void
+rt_export_timer(timer *tm)
+{
+  rt_export_event(tm->data);
+}
+
+/* Queues the change if the hook wants it, returns 1 if it was queued */
+static int
+rt_export_enqueue(struct announce_hook *ah, net *net, rte *old)
+{
+  rtable *t = ah->table;
+  struct rt_export *e;
+
+#ifdef CONFIG_PIPE
+  if (ah->proto->proto == &proto_pipe)
+    return 0;
+#endif
+
+  /* With delay switched off, only wait for what is already queued */
+  if ((ah->export_delay < 0) && !t->export_batch && EMPTY_LIST(ah->export_queue))
+    return 0;
+
+  if (!t->export_slab)
+    {
+      t->export_slab = sl_new(rt_table_pool, sizeof(struct rt_export));
+      HASH_INIT(t->export_hash, rt_table_pool, 8);
+    }
+
+  e = HASH_FIND(t->export_hash, RXQ, ah, net->n.prefix, net->n.pxlen);
+  if (e)
+    {
+      ah->stats->exp_updates_coalesced++;
+      return 1;
+    }
+
+  e = sl_alloc(t->export_slab);
+  e->ah = ah;
+  e->prefix = net->n.prefix;
+  e->pxlen = net->n.pxlen;
+  e->old = NULL;
+  if (old)
+    {
+      e->old = rte_do_cow(old);
+      e->old->flags = old->flags;
+      e->old->sender = NULL;	/* May be gone when the copy is exported */
+    }
+
+  add_tail(&ah->export_queue, &e->n);
+  HASH_INSERT2(t->export_hash, RXQ, rt_table_pool, e);
+
+  /* Delivered at the end of rte_update_batch() */
+  if ((ah->export_delay < 0) && t->export_batch)
+    return 1;
+
+  if (!ah->export_event)
+    {
+      ah->export_event = ev_new(rt_table_pool);
+      ah->export_event->hook = rt_export_event;
+      ah->export_event->data = ah;
+      ah->export_timer = tm_new(rt_table_pool);
+      ah->export_timer->hook = rt_export_timer;
+      ah->export_timer->data = ah;
+    }
+
+  if (!ev_active(ah->export_event) && !tm_active(ah->export_timer))
+    {
+      int delay = MAX(ah->export_delay, 0);
+      bird_clock_t next = ah->export_last + delay;
+
+      if (next > now)
+	tm_start(ah->export_timer, next - now);
+      else
+	ev_schedule(ah->export_event);
+    }
+
+  return 1;
+}
+
+/**
+ * rt_export_cancel - drop coalesced exports of an announce hook
+ * @ah: announce hook going away
+ *
+ * Called when a protocol stops accepting routes, the changes queued for
+ * it are forgotten.
+ */
+void
+rt_export_cancel(struct announce_hook *ah)
+{
+  rtable *t = ah->table;
+
+  while (!EMPTY_LIST(ah->export_queue))
+    rt_export_remove(t, HEAD(ah->export_queue));
+
+  if (ah->export_event)
+    {
+      rfree(ah->export_event);
+      rfree(ah->export_timer);
+      ah->export_event = NULL;
+      ah->export_timer = NULL;
+    }
+}
+
+/**
+ * rt_export_flush - deliver coalesced exports of flushed protocols
+ *
+ * Called from the protocol flushing loop when routing tables are pruned.
+ * The queued copies of routes of flushing protocols still refer to them,
+ * so they are delivered now, before the protocols may be freed.
+ */
+void
+rt_export_flush(void)
+{
+  struct announce_hook *ah;
+  struct rt_export *e, *ex;
+  rtable *t;
+
+  WALK_LIST(t, routing_tables)
+    if (t->export_slab)
+      WALK_LIST(ah, t->hooks)
+	WALK_LIST_DELSAFE(e, ex, ah->export_queue)
+	  if (e->old && e->old->attrs->src->proto->flushing)
+	    rt_export_deliver(ah, e);
+}
+
+/* Independent call to rte_announce(), used from next hop
+   recalculation, outside of rte_update(). new must be non-NULL */
+static inline void 
+rte_announce_i(rtable *tab, unsigned type, net *n, rte *new, rte *old)
+{
+  rte_update_lock();
+  rte_announce(tab, type, n, new, old, NULL);
+  rte_update_unlock();
+}
+
+void
+rte_discard(rtable *t, rte *old)	/* Non-filtered route deletion, used during garbage collection */
+{
+  rte_update_lock();
+  rte_recalculate(old->sender, old->net, NULL, old->attrs->src);
+  rte_update_unlock();
+}
+
+/**
+ * rte_restore - enter a saved route into the table
+ * @ah: pointer to table announce hook
+ * @net: network node
+ * @new: the route, with cached attributes
+ *
+ * Used for routes restored from a table snapshot (see rt_snapshot_restore()).
+ * They already passed the import filters when they were saved, so they are
+ * entered as they are, marked stale for the refresh cycle of the protocol.
+ */
+void
+rte_restore(struct announce_hook *ah, net *net, rte *new)
+{
+  rte *dummy = NULL;
+
+  new->sender = ah;
+  new->flags |= REF_COW | REF_STALE;
+
+  rte_update_lock();
+  rte_hide_dummy_routes(net, &dummy);
+  rte_recalculate(ah, net, new, new->attrs->src);
+  rte_unhide_dummy_routes(net, &dummy);
+  rte_update_unlock();
+}
+
+/* Check rtable for best route to given net whether it would be exported do p */
+int
+rt_examine(rtable *t, ip_addr prefix, int pxlen, struct proto *p, struct filter *filter)
+{
+  net *n = net_find(t, prefix, pxlen);
+  rte *rt = n ? n->routes : NULL;
+
+  if (!rte_is_valid(rt))
+    return 0;
+
+  rte_update_lock();
+
+  /* Rest is stripped down export_filter() */
+  ea_list *tmpa = make_tmp_attrs(rt, rte_update_pool);
+  int v = p->import_control ? p->import_control(p, &rt, &tmpa, rte_update_pool) : 0;
+  if (v == RIC_PROCESS)
+    v = (f_run(filter, &rt, &tmpa, rte_update_pool, FF_FORCE_TMPATTR, NULL) <= F_ACCEPT);
+
+   /* Discard temporary rte */
+  if (rt != n->routes)
+    rte_free(rt);
+
+  rte_update_unlock();
+
+  return v > 0;
+}
+
+
+/**
+ * rt_refresh_begin - start a refresh cycle
+ * @t: related routing table
+ * @ah: related announce hook 
+ *
+ * This function starts a refresh cycle for given routing table and announce
+ * hook. The refresh cycle is a sequence where the protocol sends all its valid
+ * routes to the routing table (by rte_update()). After that, all protocol
+ * routes (more precisely routes with @ah as @sender) not sent during the
+ * refresh cycle but still in the table from the past are pruned. This is
+ * implemented by marking all related routes as stale by REF_STALE flag in
+ * rt_refresh_begin(), then marking all related stale routes with REF_DISCARD
+ * flag in rt_refresh_end() and then removing such routes in the prune loop.
+ */
+void
+rt_refresh_begin(rtable *t, struct announce_hook *ah)
+{
+  net *n;
+  rte *e;
+
+  rt_import_flush(t);
+
+  FIB_WALK(&t->fib, fn)
+    {
+      n = (net *) fn;
+      for (e = n->routes; e; e = e->next)
+	if (e->sender == ah)
+	  e->flags |= REF_STALE;
+    }
+  FIB_WALK_END;
+}
+
+/**
+ * rt_refresh_end - end a refresh cycle
+ * @t: related routing table
+ * @ah: related announce hook 
+ *
+ * This function starts a refresh cycle for given routing table and announce
+ * hook. See rt_refresh_begin() for description of refresh cycles.
+ */
+void
+rt_refresh_end(rtable *t, struct announce_hook *ah)
+{
+  int prune = 0;
+  net *n;
+  rte *e;
+
+  rt_import_flush(t);
+
+  FIB_WALK(&t->fib, fn)
+    {
+      n = (net *) fn;
+      for (e = n->routes; e; e = e->next)
+	if ((e->sender == ah) && (e->flags & REF_STALE))
+	  {
+	    e->flags |= REF_DISCARD;
+	    prune = 1;
+	  }
+    }
+  FIB_WALK_END;
+
+  if (prune)
+    rt_schedule_prune(t);
+}
+
+
+/**
+ * rte_dump - dump a route
+ * @e: &rte to be dumped
+ *
+ * This functions dumps contents of a &rte to debug output.
+ */
+void
+rte_dump(rte *e)
+{
+  net *n = e->net;
+  debug("%-1I/%2d ", n->n.prefix, n->n.pxlen);
+  debug("KF=%02x PF=%02x pref=%d lm=%d ", n->n.flags, e->pflags, e->pref, now-e->lastmod);
+  rta_dump(e->attrs);
+  if (e->attrs->src->proto->proto->dump_attrs)
+    e->attrs->src->proto->proto->dump_attrs(e);
+  debug("\n");
+}
+
+/**
+ * rt_dump - dump a routing table
+ * @t: routing table to be dumped
+ *
+ * This function dumps contents of a given routing table to debug output.
+ */
+void
+rt_dump(rtable *t)
+{
+  rte *e;
+  net *n;
+  struct announce_hook *a;
+
+  debug("Dump of routing table <%s>\n", t->name);
+#ifdef DEBUGGING
+  fib_check(&t->fib);
+#endif
+  FIB_WALK(&t->fib, fn)
+    {
+      n = (net *) fn;
+      for(e=n->routes; e; e=e->next)
+	rte_dump(e);
+    }
+  FIB_WALK_END;
+  WALK_LIST(a, t->hooks)
+    debug("\tAnnounces routes to protocol %s\n", a->proto->name);
+  debug("\n");
+}
+
+/**
+ * rt_dump_all - dump all routing tables
+ *
+ * This function dumps contents of all routing tables to debug output.
+ */
+void
+rt_dump_all(void)
+{
+  rtable *t;
+
+  WALK_LIST(t, routing_tables)
+    rt_dump(t);
+}
+
+static inline void
+rt_schedule_prune(rtable *tab)
+{
+  rt_mark_for_prune(tab);
+  ev_schedule(tab->rt_event);
+}
+
+static inline void
+rt_schedule_gc(rtable *tab)
+{
+  if (tab->gc_scheduled)
+    return;
+
+  tab->gc_scheduled = 1;
+  ev_schedule(tab->rt_event);
+}
+
+static inline void
+rt_schedule_hcu(rtable *tab)
+{
+  if (tab->hcu_scheduled)
+    return;
+
+  tab->hcu_scheduled = 1;
+  ev_schedule(tab->rt_event);
+}
+
+
+static void
+rt_prune_nets(rtable *tab)
+{
+  struct fib_iterator fit;
+  int ncnt = 0, ndel = 0;
 
 #ifdef DEBUGGING
   fib_check(&tab->fib);
@@ -1328,37 +1932,500 @@ again:
 	  goto again;
 	}
     }
-  FIB_ITERATE_END(f);
-  DBG("Pruned %d of %d networks\n", ndel, ncnt);
+  FIB_ITERATE_END(f);
+  DBG("Pruned %d of %d networks\n", ndel, ncnt);
+
+  tab->gc_counter = 0;
+  tab->gc_time = now;
+  tab->gc_scheduled = 0;
+}
+
+/*
+ *	ROA revalidation
+ *
+ * When entries of a ROA table change, rt_roa_changed() looks for announce
+ * hooks whose filters call roa_check() on that table. Routes kept by an
+ * import filter which does not modify them are run through the filter
+ * again, but only in networks covered by the changed ROA prefixes. The
+ * prefixes are collected in &rt_reval and their subtrees are walked in
+ * the FIB trie of the routing table by rt_event() in chunks. Tables
+ * without the trie option are walked whole, skipping networks outside
+ * the prefixes. A route is updated only when the filter changes its
+ * verdict. Routes of other
+ * importing protocols are reloaded and exporting protocols are refed
+ * only when the protocol has the roa reload option, as the table keeps
+ * neither unfiltered routes nor the export decisions.
+ */
+
+struct rt_reval {
+  struct roa_change *px;		/* Changed ROA prefixes */
+  uint count, size;
+  uint cur;				/* Prefix being walked */
+  ip_addr pos;				/* Last network visited in it */
+  int poslen;				/* Its length, -1 before the first one */
+  int all;				/* All networks are to be revalidated */
+  int walk;				/* No trie, the whole table is walked */
+  struct fib_iterator fit;		/* Position of that walk */
+};
+
+static inline int
+rt_reval_hook(struct announce_hook *ah)
+{
+  return ah->in_keep_filtered && !f_modifies_rte(ah->in_filter);
+}
+
+static void
+rt_free_reval(struct rt_reval *rv)
+{
+  if (!rv)
+    return;
+
+  mb_free(rv->px);
+  mb_free(rv);
+}
+
+static void
+rt_schedule_reval(rtable *tab, struct roa_table *t)
+{
+  struct rt_reval *rv = tab->reval_next;
+
+  if (!rv)
+    rv = tab->reval_next = mb_allocz(rt_table_pool, sizeof(struct rt_reval));
+
+  if (t->changes_all || (rv->count + t->changes_count > ROA_CHANGES_MAX))
+    rv->all = 1;
+
+  if (!rv->all && t->changes_count)
+    {
+      if (rv->count + t->changes_count > rv->size)
+	{
+	  rv->size = MAX(2 * rv->size, rv->count + t->changes_count);
+	  rv->px = rv->px ?
+	    mb_realloc(rv->px, rv->size * sizeof(struct roa_change)) :
+	    mb_alloc(rt_table_pool, rv->size * sizeof(struct roa_change));
+	}
+
+      memcpy(rv->px + rv->count, t->changes, t->changes_count * sizeof(struct roa_change));
+      rv->count += t->changes_count;
+    }
+
+  ev_schedule(tab->rt_event);
+}
+
+/**
+ * rt_roa_changed - revalidate routes after a change of a ROA table
+ * @t: ROA table
+ *
+ * Called from the revalidation event of @t with prefixes of the ROA
+ * entries changed since the last call. Routes which may get a different
+ * verdict from filters using @t are revalidated. Protocols keeping no
+ * filtered routes are reloaded and refed only with the roa reload
+ * option, otherwise their routes keep the old verdict.
+ */
+void
+rt_roa_changed(struct roa_table *t)
+{
+  struct announce_hook *ah;
+  struct proto *p;
+  rtable *tab;
+  int reload, refeed, reval;
+
+  WALK_LIST(p, active_proto_list)
+    {
+      if (p->proto_state != PS_UP)
+	continue;
+
+      reload = refeed = 0;
+      for (ah = p->ahooks; ah; ah = ah->next)
+	{
+	  if (f_uses_roa(ah->out_filter, t))
+	    refeed = 1;
+
+	  if (f_uses_roa(ah->in_filter, t) && !rt_reval_hook(ah))
+	    reload = 1;
+	}
+
+      if (!reload && !refeed)
+	continue;
+
+      if (!p->cf->roa_reload)
+	{
+	  if (!p->roa_warned)
+	    log(L_WARN "Protocol %s is not revalidated after change of ROA table %s, "
+		"use import keep filtered or roa reload", p->name, t->name);
+	  p->roa_warned = 1;
+	  continue;
+	}
+
+      if (reload)
+	{
+	  log(L_INFO "Reloading protocol %s after change of ROA table %s", p->name, t->name);
+	  if (!(p->reload_routes && p->reload_routes(p)))
+	    log(L_WARN "Protocol %s cannot reload routes", p->name);
+	}
+
+      if (refeed)
+	{
+	  log(L_INFO "Refeeding protocol %s after change of ROA table %s", p->name, t->name);
+	  proto_request_feeding(p);
+	}
+    }
+
+  WALK_LIST(tab, routing_tables)
+    {
+      reval = 0;
+      WALK_LIST(p, active_proto_list)
+	if (p->proto_state == PS_UP)
+	  for (ah = p->ahooks; ah; ah = ah->next)
+	    if ((ah->table == tab) && f_uses_roa(ah->in_filter, t) && rt_reval_hook(ah))
+	      {
+		ah->roa_reval |= AHR_NEXT;
+		reval = 1;
+	      }
+
+      if (reval)
+	rt_schedule_reval(tab, t);
+    }
+}
+
+/* Would the import filter of @ah reject @e now? */
+static int
+rt_reval_filtered(struct announce_hook *ah, rte *e)
+{
+  struct filter *filter = ah->in_filter;
+  ea_list *tmpa;
+
+  if (filter == FILTER_REJECT)
+    return 1;
+
+  if (filter == FILTER_ACCEPT)
+    return 0;
+
+  /* The filter does not modify routes, so @e stays as it is */
+  tmpa = make_tmp_attrs(e, rte_update_pool);
+  return f_run(filter, &e, &tmpa, rte_update_pool, 0, NULL) > F_ACCEPT;
+}
+
+static void
+rt_reval_net(net *n)
+{
+  rte **routes, *e;
+  uint i, cnt = 0;
+
+  for (e = n->routes; e; e = e->next)
+    cnt++;
+
+  routes = alloca(cnt * sizeof(rte *));
+  cnt = 0;
+
+  rte_update_lock();
+
+  /* Stale routes are to be refreshed or flushed by their protocol */
+  for (e = n->routes; e; e = e->next)
+    if ((e->sender->roa_reval & AHR_NOW) &&
+	(e->sender->proto->proto_state == PS_UP) &&
+	!(e->flags & (REF_STALE | REF_DISCARD)) &&
+	(rt_reval_filtered(e->sender, e) != !!(e->flags & REF_FILTERED)))
+      routes[cnt++] = e;
+
+  /*
+   * Just the verdict changes, so the route is not imported again. Each
+   * copy replaces the route of its source, as in rte_update_verdict().
+   */
+  for (i = 0; i < cnt; i++)
+    {
+      struct announce_hook *ah = routes[i]->sender;
+      rte *new = rte_do_cow(routes[i]), *dummy = NULL;
+
+      if (!(routes[i]->flags & REF_FILTERED))
+	{
+	  ah->stats->imp_updates_filtered++;
+	  rte_trace_in(D_FILTERS, ah->proto, new, "filtered out");
+	  new->flags |= REF_FILTERED;
+	}
+
+      rte_hide_dummy_routes(n, &dummy);
+      rte_recalculate(ah, n, new, new->attrs->src);
+      rte_unhide_dummy_routes(n, &dummy);
+    }
+  rte_update_unlock();
+}
+
+static void
+rt_reval_hooks(rtable *tab, int start)
+{
+  struct announce_hook *ah;
+  struct proto *p;
+
+  WALK_LIST(p, active_proto_list)
+    for (ah = p->ahooks; ah; ah = ah->next)
+      if (ah->table == tab)
+	{
+	  if (!start)
+	    ah->roa_reval &= ~AHR_NOW;
+	  else if ((ah->roa_reval & AHR_NEXT) && rt_reval_hook(ah))
+	    ah->roa_reval = AHR_NOW;
+	  else
+	    ah->roa_reval = 0;
+	}
+}
+
+static int
+rt_reval_cmp(const void *a, const void *b)
+{
+  const struct roa_change *x = a, *y = b;
+
+  return ipa_compare(x->prefix, y->prefix) ? : (int) x->pxlen - (int) y->pxlen;
+}
+
+/*
+ * Sort the prefixes of @rv and drop those covered by others, so that
+ * no network is walked twice. In the sorted order, a prefix follows the
+ * prefix covering it with only other prefixes covered by it in between.
+ */
+static void
+rt_reval_prepare(struct rt_reval *rv)
+{
+  struct roa_change *last = NULL;
+  uint i, j;
+
+  if (rv->all)
+    {
+      if (!rv->size)
+	rv->px = mb_alloc(rt_table_pool, sizeof(struct roa_change));
+
+      rv->px[0] = (struct roa_change) { .prefix = IPA_NONE, .pxlen = 0 };
+      rv->count = 1;
+    }
+
+  qsort(rv->px, rv->count, sizeof(struct roa_change), rt_reval_cmp);
+
+  for (i = j = 0; i < rv->count; i++)
+    if (!last || (rv->px[i].pxlen < last->pxlen) ||
+	!ipa_in_net(rv->px[i].prefix, last->prefix, last->pxlen))
+      {
+	rv->px[j] = rv->px[i];
+	last = &rv->px[j++];
+      }
+
+  rv->count = j;
+  rv->cur = 0;
+  rv->poslen = -1;
+}
+
+/* Is @n covered by a prefix of @rv, sorted and without covered ones? */
+static int
+rt_reval_covered(struct rt_reval *rv, net *n)
+{
+  int l = 0, r = rv->count - 1, m;
+
+  /* Find the last prefix not after the network, only it may cover it */
+  while (l <= r)
+    {
+      m = (l + r) / 2;
+      if (ipa_compare(rv->px[m].prefix, n->n.prefix) <= 0)
+	l = m + 1;
+      else
+	r = m - 1;
+    }
+
+  return (r >= 0) && (rv->px[r].pxlen <= n->n.pxlen) &&
+    ipa_in_net(n->n.prefix, rv->px[r].prefix, rv->px[r].pxlen);
+}
+
+/* Walk of the subtrees in the trie, returns 1 when it is done */
+static int
+rt_reval_subtrees(rtable *tab, struct rt_reval *rv)
+{
+  struct roa_change *c;
+  int limit = 4096;
+  net *n;
+
+  while (rv->cur < rv->count)
+    {
+      if (limit <= 0)
+	return 0;
+
+      c = &rv->px[rv->cur];
+      n = fib_next_in(&tab->fib, c->prefix, c->pxlen, &rv->pos, &rv->poslen);
+      if (!n)
+	{
+	  rv->cur++;
+	  rv->poslen = -1;
+	  continue;
+	}
+
+      limit--;
+      if (n->routes)
+	{
+	  rt_reval_net(n);
+	  limit -= 8;
+	}
+    }
+
+  return 1;
+}
+
+/* Walk of the whole table without the trie, returns 1 when it is done */
+static int
+rt_reval_walk(rtable *tab, struct rt_reval *rv)
+{
+  int limit = 4096;
+
+  FIB_ITERATE_START(&tab->fib, &rv->fit, fn)
+    {
+      net *n = (net *) fn;
+
+      if (limit <= 0)
+	{
+	  FIB_ITERATE_PUT(&rv->fit, fn);
+	  return 0;
+	}
+
+      limit--;
+      if (n->routes && rt_reval_covered(rv, n))
+	{
+	  rt_reval_net(n);
+	  limit -= 8;
+	}
+    }
+  FIB_ITERATE_END(fn);
+
+  return 1;
+}
+
+/*
+ * Do one step of the revalidation of @tab. Returns 1 when there is
+ * nothing more to revalidate.
+ */
+static int
+rt_reval_step(rtable *tab)
+{
+  struct rt_reval *rv;
+
+  if (!tab->reval)
+    {
+      tab->reval = tab->reval_next;
+      tab->reval_next = NULL;
+      rt_reval_hooks(tab, 1);
+      rt_reval_prepare(tab->reval);
+
+      /* Kept for the whole pass, reconfiguration may enable the trie */
+      if (tab->reval->walk = !tab->fib.trie_slab)
+	FIB_ITERATE_INIT(&tab->reval->fit, &tab->fib);
+    }
+
+  rv = tab->reval;
+  if (!(rv->walk ? rt_reval_walk(tab, rv) : rt_reval_subtrees(tab, rv)))
+    return 0;
+
+  rt_reval_hooks(tab, 0);
+  rt_free_reval(tab->reval);
+  tab->reval = NULL;
+
+  return !tab->reval_next;
+}
+
+static void
+rt_event(void *ptr)
+{
+  rtable *tab = ptr;
+
+  if (tab->hcu_scheduled)
+    rt_update_hostcache(tab);
+
+  if (!EMPTY_LIST(tab->nhu_list))
+    rt_next_hop_update(tab);
+
+  if (tab->prune_state)
+    if (!rt_prune_table(tab))
+      {
+	/* Table prune unfinished */
+	ev_schedule(tab->rt_event);
+	return;
+      }
+
+  if (tab->reval || tab->reval_next)
+    if (!rt_reval_step(tab))
+      ev_schedule(tab->rt_event);
+
+  /* Resumed by rt_import_event() once the queue is empty */
+  if (tab->gc_scheduled && (!tab->import_slab || EMPTY_LIST(tab->import_queue)))
+    {
+      rt_prune_nets(tab);
+      rt_prune_sources(); // FIXME this should be moved to independent event
+    }
+}
+
+static void
+rt_mrt_timer(timer *tm)
+{
+  rtable *t = tm->data;
+
+  if (mrt_table_dump(t, t->config->mrt_file) < 0)
+    {
+      if (errno)
+	log(L_ERR "Table %s: Cannot create MRT dump file %s: %m", t->name, t->config->mrt_file);
+      else
+	log(L_WARN "Table %s: Previous MRT dump still in progress", t->name);
+    }
+}
+
+static void
+rt_mrt_configure(rtable *t)
+{
+  struct rtable_config *cf = t->config;
+
+  if (!cf->mrt_file || !cf->mrt_period)
+    {
+      if (t->mrt_timer)
+	tm_stop(t->mrt_timer);
+      return;
+    }
 
-  tab->gc_counter = 0;
-  tab->gc_time = now;
-  tab->gc_scheduled = 0;
+  if (!t->mrt_timer)
+    t->mrt_timer = tm_new_set(rt_table_pool, rt_mrt_timer, t, 0, 0);
+
+  if (!tm_active(t->mrt_timer) || (t->mrt_timer->recurrent != cf->mrt_period))
+    {
+      t->mrt_timer->recurrent = cf->mrt_period;
+      tm_start(t->mrt_timer, cf->mrt_period);
+    }
 }
 
 static void
-rt_event(void *ptr)
+rt_snap_timer(timer *tm)
 {
-  rtable *tab = ptr;
+  rtable *t = tm->data;
 
-  if (tab->hcu_scheduled)
-    rt_update_hostcache(tab);
+  if (rt_snapshot_write(t) < 0)
+    {
+      if (errno)
+	log(L_ERR "Table %s: Cannot create snapshot file %s: %m", t->name, t->config->snap_file);
+      else
+	log(L_WARN "Table %s: Previous snapshot still being written", t->name);
+    }
+}
 
-  if (tab->nhu_state)
-    rt_next_hop_update(tab);
+static void
+rt_snap_configure(rtable *t)
+{
+  struct rtable_config *cf = t->config;
 
-  if (tab->prune_state)
-    if (!rt_prune_table(tab))
-      {
-	/* Table prune unfinished */
-	ev_schedule(tab->rt_event);
-	return;
-      }
+  if (!cf->snap_file || !cf->snap_period)
+    {
+      if (t->snap_timer)
+	tm_stop(t->snap_timer);
+      return;
+    }
 
-  if (tab->gc_scheduled)
+  if (!t->snap_timer)
+    t->snap_timer = tm_new_set(rt_table_pool, rt_snap_timer, t, 0, 0);
+
+  if (!tm_active(t->snap_timer) || (t->snap_timer->recurrent != cf->snap_period))
     {
-      rt_prune_nets(tab);
-      rt_prune_sources(); // FIXME this should be moved to independent event
+      t->snap_timer->recurrent = cf->snap_period;
+      tm_start(t->snap_timer, cf->snap_period);
     }
 }
 
@@ -1370,8 +2437,12 @@ rt_setup(pool *p, rtable *t, char *name, struct rtable_config *cf)
   t->name = name;
   t->config = cf;
   init_list(&t->hooks);
+  init_list(&t->import_queue);
+  init_list(&t->nhu_list);
   if (cf)
     {
+      if (cf->fib_trie)
+	fib_enable_trie(&t->fib);
       t->rt_event = ev_new(p);
       t->rt_event->hook = rt_event;
       t->rt_event->data = t;
@@ -1392,6 +2463,7 @@ rt_init(void)
   rt_table_pool = rp_new(&root_pool, "Routing tables");
   rte_update_pool = lp_new(rt_table_pool, 4080);
   rte_slab = sl_new(rt_table_pool, sizeof(rte));
+  hostdep_slab = sl_new(rt_table_pool, sizeof(struct hostdep));
   init_list(&routing_tables);
 }
 
@@ -1506,8 +2578,107 @@ rt_preconfig(struct config *c)
 /* 
  * Some functions for handing internal next hop updates
  * triggered by rt_schedule_nhu().
+ *
+ * Each hostentry keeps the networks of its dependent table which have
+ * routes using it, so that a change of the hostentry touches only these
+ * networks instead of the whole table. Networks are added when such a
+ * route is entered by rte_recalculate() and they are removed lazily, when
+ * the next hop update finds no such route anymore.
  */
 
+#define HD_KEY(d)		d->prefix, d->pxlen
+#define HD_NEXT(d)		d->next
+#define HD_EQ(p1,l1,p2,l2)	ipa_equal(p1, p2) && l1 == l2
+#define HD_FN(p,l)		ipa_hash32(p) ^ u32_hash(l)
+
+#define HD_REHASH		hostdep_rehash
+#define HD_PARAMS		/8, *2, 2, 2, 4, 24
+
+#define HD_INIT_ORDER		4
+
+HASH_DEFINE_REHASH_FN(HD, struct hostdep)
+
+static void
+rt_depend_hostentry(rtable *tab, net *n, struct hostentry *he)
+{
+  struct hostdep *d;
+
+  /* Routes passed through pipes are updated through the original ones */
+  if (he->tab != tab)
+    return;
+
+  if (!he->deps.data)
+    HASH_INIT(he->deps, rt_table_pool, HD_INIT_ORDER);
+  else if (HASH_FIND(he->deps, HD, n->n.prefix, n->n.pxlen))
+    return;
+
+  d = sl_alloc(hostdep_slab);
+  d->prefix = n->n.prefix;
+  d->pxlen = n->n.pxlen;
+  HASH_INSERT2(he->deps, HD, rt_table_pool, d);
+}
+
+static void
+rt_free_hostdeps(struct hostentry *he)
+{
+  struct hostdep *d;
+
+  if (he->deps.data)
+    {
+      HASH_WALK_DELSAFE(he->deps, next, n)
+	sl_free(hostdep_slab, n);
+      HASH_WALK_DELSAFE_END;
+      HASH_FREE(he->deps);
+    }
+
+  if (he->nhu_deps)
+    {
+      while (d = he->nhu_deps)
+	{
+	  he->nhu_deps = d->next;
+	  sl_free(hostdep_slab, d);
+	}
+      rem_node(&he->nhu_node);
+    }
+}
+
+/* Queue all networks depending on a changed hostentry for Next Hop Update */
+static void
+rt_schedule_nhu(struct hostentry *he)
+{
+  rtable *tab = he->tab;
+  int queued = !!he->nhu_deps;
+
+  if (!he->deps.count)
+    return;
+
+  HASH_WALK_DELSAFE(he->deps, next, n)
+    {
+      n->next = he->nhu_deps;
+      he->nhu_deps = n;
+    }
+  HASH_WALK_DELSAFE_END;
+  HASH_FREE(he->deps);
+
+  if (!queued)
+    {
+      add_tail(&tab->nhu_list, &he->nhu_node);
+      ev_schedule(tab->rt_event);
+    }
+}
+
+static inline int
+net_uses_hostentry(net *n, struct hostentry *he)
+{
+  rte *e;
+
+  for (e = n->routes; e; e = e->next)
+    if (e->attrs->hostentry == he)
+      return 1;
+
+  return 0;
+}
+
 static inline int
 rta_next_hop_outdated(rta *a)
 {
@@ -1620,35 +2791,41 @@ rt_next_hop_update_net(rtable *tab, net *n)
 static void
 rt_next_hop_update(rtable *tab)
 {
-  struct fib_iterator *fit = &tab->nhu_fit;
-  int max_feed = 32;
-
-  if (tab->nhu_state == 0)
-    return;
+  struct hostentry *he;
+  struct hostdep *d;
+  int max_feed = 64;
+  net *n;
 
-  if (tab->nhu_state == 1)
+  while (!EMPTY_LIST(tab->nhu_list))
     {
-      FIB_ITERATE_INIT(fit, &tab->fib);
-      tab->nhu_state = 2;
-    }
+      he = SKIP_BACK(struct hostentry, nhu_node, HEAD(tab->nhu_list));
 
-  FIB_ITERATE_START(&tab->fib, fit, fn)
-    {
-      if (max_feed <= 0)
+      while (d = he->nhu_deps)
 	{
-	  FIB_ITERATE_PUT(fit, fn);
-	  ev_schedule(tab->rt_event);
-	  return;
-	}
-      max_feed -= rt_next_hop_update_net(tab, (net *) fn);
-    }
-  FIB_ITERATE_END(fn);
+	  if (max_feed <= 0)
+	    {
+	      ev_schedule(tab->rt_event);
+	      return;
+	    }
+
+	  he->nhu_deps = d->next;
+	  n = net_find(tab, d->prefix, d->pxlen);
+	  max_feed -= n ? 1 + rt_next_hop_update_net(tab, n) : 1;
 
-  /* state change 2->0, 3->1 */
-  tab->nhu_state &= 1;
+	  /* Keep the network if it still depends on the hostentry */
+	  if (n && net_uses_hostentry(n, he) &&
+	      !(he->deps.data && HASH_FIND(he->deps, HD, d->prefix, d->pxlen)))
+	    {
+	      if (!he->deps.data)
+		HASH_INIT(he->deps, rt_table_pool, HD_INIT_ORDER);
+	      HASH_INSERT2(he->deps, HD, rt_table_pool, d);
+	    }
+	  else
+	    sl_free(hostdep_slab, d);
+	}
 
-  if (tab->nhu_state > 0)
-    ev_schedule(tab->rt_event);
+      rem_node(&he->nhu_node);
+    }
 }
 
 
@@ -1700,9 +2877,40 @@ rt_unlock_table(rtable *r)
       DBG("Deleting routing table %s\n", r->name);
       if (r->hostcache)
 	rt_free_hostcache(r);
+      /* Hostentries of other tables may still wait for Next Hop Update */
+      while (!EMPTY_LIST(r->nhu_list))
+	{
+	  struct hostentry *he = SKIP_BACK(struct hostentry, nhu_node, HEAD(r->nhu_list));
+	  struct hostdep *d;
+
+	  while (d = he->nhu_deps)
+	    {
+	      he->nhu_deps = d->next;
+	      sl_free(hostdep_slab, d);
+	    }
+	  rem_node(&he->nhu_node);
+	}
       rem_node(&r->n);
       fib_free(&r->fib);
       rfree(r->rt_event);
+      if (r->import_slab)
+	{
+	  rfree(r->import_event);
+	  rfree(r->import_slab);
+	  HASH_FREE(r->import_hash);
+	}
+      if (r->export_slab)
+	{
+	  rfree(r->export_slab);
+	  HASH_FREE(r->export_hash);
+	}
+      if (r->mrt_timer)
+	rfree(r->mrt_timer);
+      if (r->snap_timer)
+	rfree(r->snap_timer);
+      rt_snapshot_close(r);
+      rt_free_reval(r->reval);
+      rt_free_reval(r->reval_next);
       mb_free(r);
       config_del_obstacle(conf);
     }
@@ -1743,11 +2951,19 @@ rt_commit(struct config *new, struct config *old)
 		  ot->config = r;
 		  if (o->sorted != r->sorted)
 		    log(L_WARN "Reconfiguration of rtable sorted flag not implemented");
+		  if (r->fib_trie)
+		    fib_enable_trie(&ot->fib);
+		  rt_mrt_configure(ot);
+		  rt_snap_configure(ot);
 		}
 	      else
 		{
 		  DBG("\t%s: deleted\n", o->name);
 		  ot->deleted = old;
+		  if (ot->mrt_timer)
+		    tm_stop(ot->mrt_timer);
+		  if (ot->snap_timer)
+		    tm_stop(ot->snap_timer);
 		  config_add_obstacle(old);
 		  rt_lock_table(ot);
 		  rt_unlock_table(ot);
@@ -1764,6 +2980,10 @@ rt_commit(struct config *new, struct config *old)
 	rt_setup(rt_table_pool, t, r->name, r);
 	add_tail(&routing_tables, &t->n);
 	r->table = t;
+	rt_mrt_configure(t);
+	rt_snap_configure(t);
+	if (!old && r->snap_file)
+	  rt_snapshot_open(t);
       }
   DBG("\tdone\n");
 }
@@ -1779,6 +2999,63 @@ do_feed_baby(struct proto *p, int type, struct announce_hook *h, net *n, rte *e)
   rte_update_unlock();
 }
 
+/**
+ * rt_feed_net - re-announce one network to a protocol
+ * @ah: announce hook of the protocol
+ * @n: network
+ * @old: route still exported to the protocol, or %NULL
+ *
+ * Offers current routes of @n to the protocol again, as if it was being
+ * fed. Used when the export decision for @n changed outside of regular
+ * route propagation, e.g. when a deferred export verdict arrived. If
+ * @old is given, it was kept exported meanwhile and is replaced by the
+ * route now exported, or withdrawn if there is none. In %RA_ANY mode
+ * only routes of the same source as @old are offered then.
+ */
+void
+rt_feed_net(struct announce_hook *ah, net *n, rte *old)
+{
+  struct proto *p = ah->proto;
+  rte *e;
+
+  if ((p->export_state != ES_FEEDING) && (p->export_state != ES_READY))
+    return;
+
+  if (!old)
+  {
+    if (p->accept_ra_types == RA_ANY)
+    {
+      for (e = n->routes; e; e = e->next)
+	if (rte_is_valid(e))
+	  do_feed_baby(p, RA_ANY, ah, n, e);
+    }
+    else if (rte_is_valid(n->routes))
+      do_feed_baby(p, p->accept_ra_types, ah, n, n->routes);
+
+    return;
+  }
+
+  rte_update_lock();
+  switch (p->accept_ra_types)
+  {
+  case RA_ACCEPTED:
+    /* Refeed, so that a withdraw is sent if nothing is accepted */
+    rt_notify_accepted(ah, n, n->routes, NULL, NULL, 2);
+    break;
+
+  case RA_ANY:
+    for (e = n->routes; e; e = e->next)
+      if (rte_is_valid(e) && (e->attrs->src == old->attrs->src))
+	break;
+    rt_notify_basic(ah, n, e, old, 0);
+    break;
+
+  default:
+    rt_notify_basic(ah, n, rte_is_valid(n->routes) ? n->routes : NULL, old, 0);
+  }
+  rte_update_unlock();
+}
+
 /**
  * rt_feed_baby - advertise routes to a new protocol
  * @p: protocol to be fed
@@ -1959,6 +3236,8 @@ hc_new_hostentry(struct hostcache *hc, ip_addr a, ip_addr ll, rtable *dep, unsig
   he->hash_key = k;
   he->uc = 0;
   he->src = NULL;
+  he->deps = (typeof(he->deps)) { };
+  he->nhu_deps = NULL;
 
   add_tail(&hc->hostentries, &he->ln);
   hc_insert(hc, he);
@@ -1974,6 +3253,7 @@ static void
 hc_delete_hostentry(struct hostcache *hc, struct hostentry *he)
 {
   rta_free(he->src);
+  rt_free_hostdeps(he);
 
   rem_node(&he->ln);
   hc_remove(hc, he);
@@ -2010,6 +3290,7 @@ rt_free_hostcache(rtable *tab)
     {
       struct hostentry *he = SKIP_BACK(struct hostentry, ln, n);
       rta_free(he->src);
+      rt_free_hostdeps(he);
 
       if (he->uc)
 	log(L_ERR "Hostcache is not empty in table %s", tab->name);
@@ -2155,7 +3436,7 @@ rt_update_hostcache(rtable *tab)
 	}
 
       if (rt_update_hostentry(tab, he))
-	rt_schedule_nhu(he->tab);
+	rt_schedule_nhu(he);
     }
 
   tab->hcu_scheduled = 0;
@@ -2251,6 +3532,139 @@ rt_show_rte(struct cli *c, byte *ia, rte *e, struct rt_show_data *d, ea_list *tm
     rta_show(c, a, tmpa);
 }
 
+#define RT_SHOW_JSON_SIZE	32768
+
+/*
+ * Machine-readable variant of rt_show_rte(), one JSON object per route
+ * on a single reply line, see rta_format_json(). All strings go through
+ * buffer_json(), names of protocols and interfaces are not restricted.
+ */
+static void
+rt_show_rte_json(struct cli *c, rte *e, ea_list *tmpa)
+{
+  static byte json[RT_SHOW_JSON_SIZE];
+  buffer b = { .start = json, .pos = json, .end = json + sizeof(json) };
+  char px[STD_ADDRESS_P_LENGTH + 5];
+  rta *a = e->attrs;
+  net *n = e->net;
+  ea_list *t;
+
+  /* Need to normalize the extended attributes */
+  t = ea_append(tmpa, a->eattrs);
+  tmpa = alloca(ea_scan(t));
+  ea_merge(t, tmpa);
+  ea_sort(tmpa);
+
+  bsprintf(px, "%I/%d", n->n.prefix, n->n.pxlen);
+  buffer_puts(&b, "{\"net\":");
+  buffer_json(&b, px);
+  buffer_puts(&b, ",\"proto\":");
+  buffer_json(&b, a->src->proto->name);
+  buffer_print(&b, ",\"primary\":%s,\"age\":%d,\"pref\":%d,",
+	       (n->routes == e) ? "true" : "false", (int) (now - e->lastmod), e->pref);
+  rta_format_json(&b, a, tmpa);
+  buffer_puts(&b, "}");
+
+  if (b.pos == b.end)
+    {
+      b.pos = json;
+      buffer_puts(&b, "{\"net\":");
+      buffer_json(&b, px);
+      buffer_puts(&b, ",\"proto\":");
+      buffer_json(&b, a->src->proto->name);
+      buffer_puts(&b, ",\"error\":\"too long\"}");
+    }
+
+  cli_puts(c, -1022, json, b.pos - json);
+}
+
+/*
+ * When the show filter depends only on route attributes (see
+ * f_rta_pure()), its verdict is the same for all routes sharing a cached
+ * &rta, and a full table walk only has to run it once per rta. Verdicts
+ * are kept for the whole walk, the rtas are locked meanwhile so that
+ * their addresses are not reused.
+ */
+
+struct rt_show_memo {
+  struct rt_show_memo *next;
+  rta *attrs;
+  int verdict;
+};
+
+#define RSM_KEY(m)		m->attrs
+#define RSM_NEXT(m)		m->next
+#define RSM_EQ(a,b)		a == b
+#define RSM_FN(a)		u32_hash((u32) ((uintptr_t) a >> 4))
+
+#define RSM_REHASH		rt_show_memo_rehash
+#define RSM_PARAMS		/8, *2, 2, 2, 8, 20
+
+#define RT_SHOW_MEMO_MAX	65536
+
+HASH_DEFINE_REHASH_FN(RSM, struct rt_show_memo)
+
+static void
+rt_show_memo_init(struct cli *c, struct rt_show_data *d)
+{
+  if (d->export_mode || !f_rta_pure(d->filter))
+    return;
+
+  d->memo_pool = c->pool;
+  HASH_INIT(d->memo, d->memo_pool, 8);
+}
+
+static void
+rt_show_memo_free(struct rt_show_data *d)
+{
+  if (!d->memo_pool)
+    return;
+
+  HASH_WALK_DELSAFE(d->memo, next, m)
+    {
+      rta_free(m->attrs);
+      mb_free(m);
+    }
+  HASH_WALK_DELSAFE_END;
+
+  HASH_FREE(d->memo);
+  d->memo_pool = NULL;
+}
+
+static inline int
+rt_show_memo_usable(struct rt_show_data *d, rte *e)
+{
+  /* Temporary attributes are made from the route itself */
+  return d->memo_pool && !e->attrs->src->proto->make_tmp_attrs;
+}
+
+static int
+rt_show_filter(struct rt_show_data *d, rte **e, ea_list **tmpa)
+{
+  struct rt_show_memo *m = NULL;
+  int v;
+
+  if (rt_show_memo_usable(d, *e))
+    {
+      m = HASH_FIND(d->memo, RSM, (*e)->attrs);
+      if (m)
+	return m->verdict;
+    }
+
+  v = f_run(d->filter, e, tmpa, rte_update_pool, FF_FORCE_TMPATTR, NULL);
+  d->work++;
+
+  if (rt_show_memo_usable(d, *e) && (d->memo.count < RT_SHOW_MEMO_MAX))
+    {
+      m = mb_alloc(d->memo_pool, sizeof(struct rt_show_memo));
+      m->attrs = rta_clone((*e)->attrs);
+      m->verdict = v;
+      HASH_INSERT2(d->memo, RSM, d->memo_pool, m);
+    }
+
+  return v;
+}
+
 static void
 rt_show_net(struct cli *c, net *n, struct rt_show_data *d)
 {
@@ -2285,6 +3699,21 @@ rt_show_net(struct cli *c, net *n, struct rt_show_data *d)
       if (pass)
 	continue;
 
+      /* Cheap checks, they need neither temporary attributes nor the update buffer */
+      if (!d->export_mode)
+	{
+	  struct rt_show_memo *m;
+
+	  if ((d->show_protocol && (d->show_protocol != e->attrs->src->proto)) ||
+	      (rt_show_memo_usable(d, e) &&
+	       (m = HASH_FIND(d->memo, RSM, e->attrs)) && (m->verdict > F_ACCEPT)))
+	    {
+	      if (d->primary_only)
+		break;
+	      continue;
+	    }
+	}
+
       ee = e;
       rte_update_lock();		/* We use the update buffer for filtering */
       tmpa = make_tmp_attrs(e, rte_update_pool);
@@ -2321,12 +3750,18 @@ rt_show_net(struct cli *c, net *n, struct rt_show_data *d)
       if (d->show_protocol && (d->show_protocol != e->attrs->src->proto))
 	goto skip;
 
-      if (f_run(d->filter, &e, &tmpa, rte_update_pool, FF_FORCE_TMPATTR, NULL) > F_ACCEPT)
+      if (rt_show_filter(d, &e, &tmpa) > F_ACCEPT)
 	goto skip;
 
+      d->work++;
       d->show_counter++;
       if (d->stats < 2)
-	rt_show_rte(c, ia, e, d, tmpa);
+	{
+	  if (d->json)
+	    rt_show_rte_json(c, e, tmpa);
+	  else
+	    rt_show_rte(c, ia, e, d, tmpa);
+	}
       ia[0] = 0;
 
     skip:
@@ -2342,6 +3777,32 @@ rt_show_net(struct cli *c, net *n, struct rt_show_data *d)
     }
 }
 
+/* Returns 0 if the listing cannot go on */
+static int
+rt_show_check(struct cli *c, struct rt_show_data *d)
+{
+  if (d->running_on_config && d->running_on_config != config)
+    {
+      cli_printf(c, 8004, "Stopped due to reconfiguration");
+      return 0;
+    }
+  if (d->export_protocol && (d->export_protocol->export_state == ES_DOWN))
+    {
+      cli_printf(c, 8005, "Protocol is down");
+      return 0;
+    }
+  return 1;
+}
+
+static void
+rt_show_done(struct cli *c, struct rt_show_data *d)
+{
+  if (d->stats)
+    cli_printf(c, 14, "%d of %d routes for %d networks", d->show_counter, d->rt_counter, d->net_counter);
+  else
+    cli_printf(c, 0, "");
+}
+
 static void
 rt_show_cont(struct cli *c)
 {
@@ -2351,35 +3812,63 @@ rt_show_cont(struct cli *c)
 #else
   unsigned max = 64;
 #endif
+  unsigned visit = max * 16;
   struct fib *fib = &d->table->fib;
   struct fib_iterator *it = &d->fit;
 
   FIB_ITERATE_START(fib, it, f)
     {
       net *n = (net *) f;
-      if (d->running_on_config && d->running_on_config != config)
-	{
-	  cli_printf(c, 8004, "Stopped due to reconfiguration");
-	  goto done;
-	}
-      if (d->export_protocol && (d->export_protocol->export_state == ES_DOWN))
-	{
-	  cli_printf(c, 8005, "Protocol is down");
-	  goto done;
-	}
-      if (!max--)
+      if (!rt_show_check(c, d))
+	goto done;
+      /* Bound both the nets walked and the filter runs and output per step */
+      if (!visit-- || (d->work >= max))
 	{
 	  FIB_ITERATE_PUT(it, f);
+	  d->work = 0;
 	  return;
 	}
       rt_show_net(c, n, d);
     }
   FIB_ITERATE_END(f);
-  if (d->stats)
-    cli_printf(c, 14, "%d of %d routes for %d networks", d->show_counter, d->rt_counter, d->net_counter);
-  else
-    cli_printf(c, 0, "");
+  rt_show_done(c, d);
+done:
+  rt_show_memo_free(d);
+  c->cont = c->cleanup = NULL;
+}
+
+/*
+ * With a trie index and a filter accepting only networks within some prefix,
+ * just the subtree of that prefix is walked. The walk is resumed from the
+ * last network shown, so it is not disturbed by changes of the table.
+ */
+static void
+rt_show_cont_trie(struct cli *c)
+{
+  struct rt_show_data *d = c->rover;
+#ifdef DEBUGGING
+  unsigned max = 4;
+#else
+  unsigned max = 64;
+#endif
+  unsigned visit = max * 16;
+  net *n;
+
+  if (!rt_show_check(c, d))
+    goto done;
+
+  while (n = fib_next_in(&d->table->fib, d->walk_prefix, d->walk_pxlen, &d->walk_pos, &d->walk_poslen))
+    {
+      rt_show_net(c, n, d);
+      if (!--visit || (d->work >= max))
+	{
+	  d->work = 0;
+	  return;
+	}
+    }
+  rt_show_done(c, d);
 done:
+  rt_show_memo_free(d);
   c->cont = c->cleanup = NULL;
 }
 
@@ -2389,7 +3878,9 @@ rt_show_cleanup(struct cli *c)
   struct rt_show_data *d = c->rover;
 
   /* Unlink the iterator */
-  fit_get(&d->table->fib, &d->fit);
+  if (!d->walk_trie)
+    fit_get(&d->table->fib, &d->fit);
+  rt_show_memo_free(d);
 }
 
 void
@@ -2408,8 +3899,13 @@ rt_show(struct rt_show_data *d)
 
   if (d->pxlen == 256)
     {
-      FIB_ITERATE_INIT(&d->fit, &d->table->fib);
-      this_cli->cont = rt_show_cont;
+      d->walk_trie = d->table->fib.trie_slab &&
+	f_prefix_cover(d->filter, &d->walk_prefix, &d->walk_pxlen);
+      d->walk_poslen = -1;
+      if (!d->walk_trie)
+	FIB_ITERATE_INIT(&d->fit, &d->table->fib);
+      rt_show_memo_init(this_cli, d);
+      this_cli->cont = d->walk_trie ? rt_show_cont_trie : rt_show_cont;
       this_cli->cleanup = rt_show_cleanup;
       this_cli->rover = d;
     }
@@ -0,0 +1,166 @@
+/*
+ *	BIRD -- Tests of routing table snapshots
+ *
+ *	Run by `make check'. Writes a snapshot of one table, restores it
+ *	into another and checks that damaged snapshots are refused.
+ */
+
+#include "nest/bird.h"
+#include "nest/route.h"
+#include "nest/protocol.h"
+#include "conf/conf.h"
+#include "lib/event.h"
+#include "sysdep/unix/unix.h"
+#include "lib/test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ROUTES 1000
+#define SNAP_FILE "snap_test.tmp"
+
+static struct config cfg;
+static struct rtable_config tab_cf;
+static pool *pool_;
+
+static struct proto *
+peer(rtable *t)
+{
+  struct proto *p = mb_allocz(pool_, sizeof(struct proto));
+
+  p->name = "peer";
+  p->pool = pool_;
+  p->table = t;
+  p->main_ahook = proto_add_announce_hook(p, t, &p->stats);
+  return p;
+}
+
+static void
+add_route(struct proto *p, u32 prefix, int pref)
+{
+  rta a = {
+    .src = rt_get_source(p, 0),
+    .source = RTS_BGP,
+    .scope = SCOPE_UNIVERSE,
+    .cast = RTC_UNICAST,
+    .dest = RTD_BLACKHOLE,
+  };
+  net *n = net_get(p->table, ipa_from_u32(prefix), 24);
+  rte *e = rte_get_temp(rta_lookup(&a));
+
+  e->net = n;
+  e->pref = pref;
+  e->pflags = 0;
+  rte_restore(p->main_ahook, n, e);
+}
+
+static uint
+count_routes(struct proto *p, int pref)
+{
+  uint n = 0;
+
+  FIB_WALK(&p->table->fib, f)
+    {
+      rte *e;
+      for (e = ((net *) f)->routes; e; e = e->next)
+	if ((e->sender == p->main_ahook) && (!pref || (e->pref == pref)))
+	  n++;
+    }
+  FIB_WALK_END;
+
+  return n;
+}
+
+static void
+t_restore(void)
+{
+  static rtable ta, tb;
+  struct proto *pa, *pb;
+  uint i;
+
+  rt_setup(pool_, &ta, "a", &tab_cf);
+  pa = peer(&ta);
+  for (i = 0; i < ROUTES; i++)
+    add_route(pa, 0x0a000000 + (i << 8), 100);
+
+  CHECK(rt_snapshot_write(&ta) == 0);
+  while (ta.snap_writer)
+    ev_run_list(&global_event_list);
+
+  rt_setup(pool_, &tb, "b", &tab_cf);
+  rt_snapshot_open(&tb);
+  CHECK(tb.snap_map != NULL);
+
+  /* Nothing is restored before the event runs */
+  pb = peer(&tb);
+  rt_snapshot_restore(pb);
+  CHECK(pb->snap_restored);
+  CHECK(count_routes(pb, 0) == 0);
+
+  /* A route sent by the protocol meanwhile is kept */
+  add_route(pb, 0x0a000000 + ((ROUTES - 1) << 8), 200);
+
+  ev_run_list(&global_event_list);
+  i = count_routes(pb, 0);
+  CHECK((i > 1) && (i < ROUTES));
+
+  while (tb.snap_map)
+    ev_run_list(&global_event_list);
+
+  CHECK(count_routes(pb, 0) == ROUTES);
+  CHECK(count_routes(pb, 200) == 1);
+
+  rt_snapshot_end(pb);
+  CHECK(!pb->snap_restored);
+}
+
+/* Writes a header with @protos and @rtas, followed by nothing */
+static void
+write_header(u32 protos, u32 rtas)
+{
+  struct {
+    char magic[8];
+    u32 order, ip_size, time;
+    u32 protos, rtas, nets, routes;
+  } h = { "BIRDSNP1", 0x01020304, sizeof(ip_addr), 0, protos, rtas, 0, 0 };
+  FILE *f = fopen(SNAP_FILE, "w");
+
+  fwrite(&h, sizeof(h), 1, f);
+  fwrite(&h, sizeof(h), 1, f);		/* Some garbage to index */
+  fclose(f);
+}
+
+static void
+t_damaged(void)
+{
+  static rtable tc;
+
+  rt_setup(pool_, &tc, "c", &tab_cf);
+
+  /* Too many records for the file size */
+  write_header(1, 0xffffffff);
+  rt_snapshot_open(&tc);
+  CHECK(tc.snap_map == NULL);
+
+  write_header(0x40000000, 1);
+  rt_snapshot_open(&tc);
+  CHECK(tc.snap_map == NULL);
+}
+
+int
+main(int argc UNUSED, char **argv)
+{
+  test_init();
+
+  pool_ = rp_new(&root_pool, "Test");
+  config = &cfg;
+  tab_cf.snap_file = SNAP_FILE;
+
+  t_restore();
+  t_damaged();
+  unlink(SNAP_FILE);
+
+  return test_done(argv[0]);
+}
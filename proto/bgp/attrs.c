@@ -463,6 +463,8 @@ bgp_get_attr_len(eattr *a)
 
 #define ADVANCE(w, r, l) do { r -= l; w += l; } while (0)
 
+static int bgp_encode_attr_list(int as4_session, byte *w, ea_list *attrs, int remains);
+
 /**
  * bgp_encode_attrs - encode BGP attributes
  * @p: BGP instance
@@ -477,6 +479,30 @@ bgp_get_attr_len(eattr *a)
  */
 unsigned int
 bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains)
+{
+  return bgp_encode_attr_list(p->as4_session, w, attrs, remains);
+}
+
+/**
+ * bgp_encode_mrt_attrs - encode BGP attributes of an MRT RIB entry
+ * @w: buffer
+ * @attrs: a list of extended attributes
+ * @remains: remaining space in the buffer
+ *
+ * Works like bgp_encode_attrs(), except that AS_PATH and AGGREGATOR are
+ * always encoded with 4-byte AS numbers, as required by RFC 6396 for
+ * TABLE_DUMP_V2 RIB entries.
+ *
+ * Result: Length of the attribute block generated or -1 if not enough space.
+ */
+int
+bgp_encode_mrt_attrs(byte *w, ea_list *attrs, int remains)
+{
+  return bgp_encode_attr_list(1, w, attrs, remains);
+}
+
+static int
+bgp_encode_attr_list(int as4_session, byte *w, ea_list *attrs, int remains)
 {
   unsigned int i, code, type, flags;
   byte *start = w;
@@ -498,7 +524,7 @@ bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains)
        * we have to convert our 4B AS_PATH to 2B AS_PATH and send our AS_PATH 
        * as optional AS4_PATH attribute.
        */
-      if ((code == BA_AS_PATH) && (! p->as4_session))
+      if ((code == BA_AS_PATH) && !as4_session)
 	{
 	  len = a->u.ptr->length;
 
@@ -540,7 +566,7 @@ bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains)
 	}
 
       /* The same issue with AGGREGATOR attribute */
-      if ((code == BA_AGGREGATOR) && (! p->as4_session))
+      if ((code == BA_AGGREGATOR) && !as4_session)
 	{
 	  int new_used;
 
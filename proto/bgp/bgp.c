@@ -392,6 +392,8 @@ bgp_conn_enter_established_state(struct bgp_conn *conn)
   p->load_state = BFS_NONE;
   bgp_init_bucket_table(p);
   bgp_init_prefix_table(p, 8);
+  bgp_init_verdicts(p);
+  bgp_init_route_events(p);
 
   int peer_gr_ready = conn->peer_gr_aware && !(conn->peer_gr_flags & BGP_GRF_RESTART);
 
@@ -416,6 +418,10 @@ bgp_conn_enter_established_state(struct bgp_conn *conn)
   bgp_conn_set_state(conn, BS_ESTABLISHED);
   proto_notify_state(&p->p, PS_UP);
 
+  /* Routes saved in a table snapshot are kept until End-of-RIB */
+  if (conn->peer_gr_aware && !p->gr_active)
+    rt_snapshot_restore(&p->p);
+
   if (bgp_hook_run (BGP_HOOK_ENTER_ESTABLISHED, p, NULL, NULL) & HOOK_STATUS_BAD)
     bgp_stop(p, 0);
 
@@ -430,6 +436,8 @@ bgp_conn_leave_established_state(struct bgp_proto *p)
 
   p->conn = NULL;
 
+  bgp_free_route_events(p);
+  bgp_free_verdicts(p);
   bgp_free_prefix_table(p);
   bgp_free_bucket_table(p);
 
@@ -1292,6 +1300,14 @@ bgp_cleanup(struct proto *P)
 {
   struct bgp_proto *p = (struct bgp_proto *) P;
   rt_unlock_table(p->igp_table);
+  bgp_release_hooks(p);
+
+  /* The protocol instance is going away */
+  if (P->reconfiguring)
+  {
+    bgp_flush_hook_cache(p);
+    hook_stats_release(p->hook_stats, MAX_HOOKS);
+  }
 }
 
 static rtable *
@@ -1436,6 +1452,7 @@ bgp_reconfigure(struct proto *P, struct proto_config *C)
     p->cf = new;
 
   bgp_parse_hooks (p);
+  bgp_flush_hook_cache (p);
 
   if (bgp_hook_run (BGP_HOOK_RECONFIGURE, p, NULL, NULL) & HOOK_STATUS_BAD)
       bgp_stop(p, 0);
@@ -1628,6 +1645,10 @@ bgp_show_proto_info(struct proto *P)
 	      tm_remains(c->keepalive_timer), c->keepalive_time);
     }
 
+  if (p->cf->hook_cache_limit)
+    cli_msg(-1006, "    Hook cache:       %u entries, %u hits, %u misses",
+	    p->hook_cache.count, p->hook_cache_hits, p->hook_cache_misses);
+
   if ((p->last_error_class != BE_NONE) &&
       (p->last_error_class != BE_MAN_DOWN))
     {
@@ -70,6 +70,14 @@ struct bgp_config {
   int bfd;				/* Use BFD for liveness detection */
 
   bgp_hook_config hc;
+  u32 verdict_limit;			/* Maximum number of pending route hook verdicts */
+  u32 verdict_batch;			/* Number of queries sent to the worker at once */
+  unsigned verdict_timeout;		/* Time to wait for a verdict */
+  int verdict_default;			/* Verdict used on timeout (HOOK_STATUS_*) */
+  u32 hook_cache_limit;			/* Maximum number of cached route hook verdicts, 0 if disabled */
+  unsigned hook_cache_ttl;		/* How long a cached verdict is valid */
+  int route_batch;			/* Route update/withdraw hook batching, BGP_RB_* */
+  unsigned route_batch_window;		/* Batching period for BGP_RB_WINDOW */
 };
 
 #define MLL_SELF 1
@@ -83,6 +91,10 @@ struct bgp_config {
 #define ADD_PATH_TX 2
 #define ADD_PATH_FULL 3
 
+#define BGP_RB_NONE 0			/* Run route event hooks for each prefix */
+#define BGP_RB_UPDATE 1			/* Once per received UPDATE message */
+#define BGP_RB_WINDOW 2			/* Once per route_batch_window */
+
 #define BGP_GR_ABLE 1
 #define BGP_GR_AWARE 2
 
@@ -119,6 +131,12 @@ struct bgp_conn {
   unsigned hold_time, keepalive_time;	/* Times calculated from my and neighbor's requirements */
 };
 
+struct bgp_route_batch {
+  byte *buf;				/* Records, one per line, NUL-terminated */
+  uint len, size;
+  uint count;				/* Number of records */
+};
+
 struct bgp_proto {
   struct proto p;
   struct bgp_config *cf;		/* Shortcut to BGP configuration */
@@ -161,6 +179,26 @@ struct bgp_proto {
   u32 last_error_code;			/* Error code of last error. BGP protocol errors
 					   are encoded as (bgp_err_code << 16 | bgp_err_subcode) */
   struct glob_hook hooks[MAX_HOOKS];
+  struct hook_worker *hook_workers[MAX_HOOKS];	/* Workers of persistent hooks */
+  struct tbf hook_rate[MAX_HOOKS];	/* Rate limits of asynchronous hooks */
+  struct hook_stats hook_stats[MAX_HOOKS];
+  HASH(struct bgp_verdict) verdict_hash;	/* Sent queries by sequence number */
+  HASH(struct bgp_verdict) verdict_key_hash;	/* Pending verdicts by route */
+  slab *verdict_slab;			/* Slab holding verdict nodes */
+  list verdict_queue;			/* Sent queries, oldest first */
+  list verdict_wait;			/* Queries over the limit, not sent yet */
+  list verdict_done;			/* Answered queries, applied by verdict_event */
+  struct timer *verdict_timer;		/* Applies default verdict to expired queries */
+  struct event *verdict_event;		/* Applies verdicts and sends out batched queries */
+  u32 verdict_unsent;			/* Queries queued but not yet sent */
+  u8 verdict_paused;			/* Reading from the session paused by waiting imports */
+  pool *hook_cache_pool;		/* Verdict cache, survives session restarts */
+  HASH(struct bgp_cache_entry) hook_cache;
+  list hook_cache_lru;			/* Cached verdicts, least recently used first */
+  u32 hook_cache_hits, hook_cache_misses;
+  struct bgp_route_batch update_batch;	/* Pending route update hook records */
+  struct bgp_route_batch withdraw_batch;	/* Pending route withdraw hook records */
+  struct timer *route_batch_timer;	/* Delivers batches in BGP_RB_WINDOW mode */
 #ifdef IPV6
   byte *mp_reach_start, *mp_unreach_start; /* Multiprotocol BGP attribute notes */
   unsigned mp_reach_len, mp_unreach_len;
@@ -178,6 +216,29 @@ struct bgp_prefix {
   node bucket_node;			/* Node in per-bucket list */
 };
 
+struct bgp_verdict {
+  node n;				/* Node in verdict_queue, verdict_wait or verdict_done */
+  struct bgp_verdict *next;		/* Node in hash by sequence number, if sent */
+  struct bgp_verdict *next_key;		/* Node in hash by route */
+  u32 index;				/* BGP_HOOK_IMPORT or BGP_HOOK_EXPORT */
+  u32 seq;				/* Sequence number of the query */
+  ip_addr prefix;
+  int pxlen;
+  struct rte_src *src;			/* Source of the route, NULL for export without ADD-PATH */
+  rte *e;				/* Import: the route waiting for the verdict */
+  ip_addr gw, from;			/* Export: route the query was about */
+  struct adata *path;
+  rte *old;				/* Export: route still exported meanwhile, if any */
+  bird_clock_t sent;			/* When the query was queued */
+  u8 state;				/* BGP_VS_* */
+  u8 replaced;				/* Export: superseded a query, nothing else to keep */
+  int status;				/* Verdict, valid in BGP_VS_ANSWERED */
+};
+
+#define BGP_VS_WAITING		0	/* Over the limit, query not sent yet */
+#define BGP_VS_SENT		1	/* Waiting for the reply */
+#define BGP_VS_ANSWERED		2	/* Verdict known, to be applied */
+
 struct bgp_bucket {
   node send_node;			/* Node in send queue */
   struct bgp_bucket *hash_next, *hash_prev;	/* Node in bucket hash table */
@@ -263,6 +324,7 @@ void bgp_init_prefix_table(struct bgp_proto *p, u32 order);
 void bgp_free_prefix_table(struct bgp_proto *p);
 void bgp_free_prefix(struct bgp_proto *p, struct bgp_prefix *bp);
 unsigned int bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains);
+int bgp_encode_mrt_attrs(byte *w, ea_list *attrs, int remains);
 void bgp_get_route_info(struct rte *, byte *buf, struct ea_list *attrs);
 
 inline static void bgp_attach_attr_ip(struct ea_list **to, struct linpool *pool, unsigned attr, ip_addr a)
@@ -6,7 +6,10 @@
 #include "bgp.h"
 #include "filter/filter.h"
 #include "lib/socket.h"
+#include "lib/event.h"
+#include "lib/timer.h"
 #include "nest/attrs.h"
+#include "nest/cli.h"
 
 #include "hook.h"
 
@@ -68,11 +71,53 @@ bgp_parse_hooks (void *P)
 	{
 	  bgp_create_hook (index, p);
 	}
+
+      if (!(p->hooks[index].ac & HOOK_F_COPROC))
+	{
+	  hook_worker_release (&p->hook_workers[index]);
+	}
     }
 
   return 0;
 }
 
+void
+bgp_release_hooks (void *P)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  int index;
+  for (index = 1; index < MAX_HOOKS; index++)
+    {
+      hook_worker_release (&p->hook_workers[index]);
+    }
+}
+
+void
+bgp_show_hooks (void *P)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+  int index, shown = 0;
+
+  for (index = 1; index < MAX_HOOKS; index++)
+    {
+      if (p->hooks[index].exec == NULL && !p->hook_stats[index].invocations)
+	continue;
+
+      if (!shown++)
+	{
+	  cli_msg (-1021, "%s:", p->p.name);
+
+	  if (p->verdict_hash.data != NULL)
+	    cli_msg (-1021, "  Pending verdicts: %u (limit %u)",
+		     p->verdict_hash.count, p->cf->verdict_limit);
+	}
+
+      hook_show_stats (GET_HS(index), p->hooks[index].exec,
+		       &p->hook_stats[index]);
+    }
+}
+
 int
 bgp_check_hooks (void *C)
 {
@@ -89,6 +134,13 @@ bgp_check_hooks (void *C)
 	  continue;
 	}
 
+      /* Loads the plugin once, complains if it cannot */
+      if (h->ac & HOOK_F_PLUGIN)
+	{
+	  hook_plugin_check (h->exec, h->symbol);
+	  continue;
+	}
+
       t = access (h->exec, R_OK | X_OK);
 
       if (t == -1)
@@ -109,7 +161,7 @@ bgp_build_hook_envvars (u32 index, void *P)
 
   char b[MAX_ENV_SIZE];
 
-  setenv ("EVENT", GET_HS(index), 1);
+  hook_setenv ("EVENT", GET_HS(index));
   SETENV_INT("%u", b, "EVENT_INDEX", index);
 
   SETENV_INT("%hhu", b, "LAST_ERROR_CLASS", p->last_error_class);
@@ -156,11 +208,11 @@ bgp_build_hook_envvars (u32 index, void *P)
 
   if (p->cf->c.dsc != NULL)
     {
-      setenv ("PROTO_DESC", p->cf->c.dsc, 1);
+      hook_setenv ("PROTO_DESC", p->cf->c.dsc);
     }
 
-  setenv ("PROTO_NAME", p->cf->c.name, 1);
-  setenv ("TABLE_NAME", p->p.table->name, 1);
+  hook_setenv ("PROTO_NAME", p->cf->c.name);
+  hook_setenv ("TABLE_NAME", p->p.table->name);
 
   SETENV_IPTOSTR("SOURCE_IP", &p->source_addr);
 
@@ -170,10 +222,96 @@ bgp_build_hook_envvars (u32 index, void *P)
     }
   else
     {
-      setenv ("CONN_STATE", "0", 1);
+      hook_setenv ("CONN_STATE", "0");
     }
 }
 
+/*
+ *	In-process plugins
+ *
+ * Plugins get the values the environment builders above would set as
+ * a struct hook_plugin_event, see sysdep/unix/hook-plugin.h. Variables
+ * added for particular events (e.g. the inbound connection addresses)
+ * are not available to them.
+ */
+
+static void
+bgp_plugin_fill (struct hook_plugin_bgp *b, struct bgp_proto *p)
+{
+  memset (b, 0, sizeof(struct hook_plugin_bgp));
+
+#ifdef IPV6
+  b->af = HOOK_PLUGIN_AF_IPV6;
+#else
+  b->af = HOOK_PLUGIN_AF_IPV4;
+#endif
+  hook_plugin_ip (b->remote_ip, p->cf->remote_ip);
+  hook_plugin_ip (b->source_ip, p->cf->source_addr);
+  b->remote_port = p->cf->remote_port;
+  b->remote_as = p->cf->remote_as;
+  b->local_id = p->local_id;
+  b->remote_id = p->remote_id;
+  b->last_error_code = p->last_error_code;
+  b->startup_delay = p->startup_delay;
+  b->last_error_class = p->last_error_class;
+  b->proto_state = p->p.proto_state;
+  b->core_state = p->p.core_state;
+  b->start_state = p->start_state;
+  b->load_state = p->load_state;
+  b->feed_state = p->feed_state;
+  b->down_code = p->p.down_code;
+  b->is_internal = p->is_internal;
+  b->as4_session = p->as4_session;
+  b->gr_ready = p->gr_ready;
+  b->gr_active = p->gr_active;
+  b->rr_client = p->rr_client;
+  b->rs_client = p->rs_client;
+}
+
+static void
+bgp_plugin_route (struct hook_plugin_route *r, ip_addr prefix, int pxlen,
+		  u32 path_id, rta *a)
+{
+  memset (r, 0, sizeof(struct hook_plugin_route));
+
+  hook_plugin_ip (r->prefix, prefix);
+  r->pxlen = pxlen;
+  r->path_id = path_id;
+
+  if (a == NULL)
+    return;
+
+  eattr *ad = ea_find (a->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
+
+  r->has_attrs = 1;
+  hook_plugin_ip (r->next_hop, a->gw);
+  hook_plugin_ip (r->from, a->from);
+
+  if (ad)
+    {
+      r->as_path = ad->u.ptr->data;
+      r->as_path_len = ad->u.ptr->length;
+    }
+}
+
+static int
+bgp_plugin_run (struct bgp_proto *p, u32 index, struct hook_plugin_route *r)
+{
+  bgp_hook *h = &p->hooks[index];
+  struct hook_plugin_bgp b;
+
+  bgp_plugin_fill (&b, p);
+
+  struct hook_execv_data data = hook_execv_mkdata (h->ac, NULL, NULL,
+						   GET_HS(index),
+						   p->cf->c.name, NULL, NULL,
+						   NULL);
+
+  data.stats = &p->hook_stats[index];
+
+  return hook_plugin_run (h->exec, h->symbol, index, &data, &b, r);
+}
+
 int
 bgp_hook_run (u32 index, void *P, execv_callback add, void *add_data)
 {
@@ -186,6 +324,11 @@ bgp_hook_run (u32 index, void *P, execv_callback add, void *add_data)
 
   bgp_hook *h = &p->hooks[index];
 
+  if (h->exec != NULL && (h->ac & HOOK_F_PLUGIN))
+    {
+      return bgp_plugin_run (p, index, NULL);
+    }
+
   if (h->exec != NULL)
     {
 
@@ -195,6 +338,10 @@ bgp_hook_run (u32 index, void *P, execv_callback add, void *add_data)
 						       p->cf->c.name, add,
 						       add_data, NULL);
 
+      data.worker = &p->hook_workers[index];
+      data.rate = hook_rate_limit (&p->hook_rate[index], h);
+      data.stats = &p->hook_stats[index];
+
       return do_execv (h->exec, index, &data);
 
     }
@@ -248,18 +395,991 @@ bgp_build_route_envvars (u32 index, void *RT)
       if (ad)
 	{
 	  as_path_format (ad->u.ptr, buf, sizeof(buf));
-	  setenv ("BGP_PATH", buf, 1);
+	  hook_setenv ("BGP_PATH", buf);
+	}
+    }
+}
+
+/*
+ *	Route hook verdict cache
+ *
+ * Verdicts of route import/export hooks are remembered for `hook cache
+ * ttl' seconds, keyed on the route properties the hook gets to see, so
+ * that refeeds and session restarts do not consult the hook again. At
+ * most `hook cache limit' verdicts are kept, the least recently used one
+ * is evicted first. The cache is flushed on reconfiguration.
+ */
+
+struct bgp_cache_entry
+{
+  node n;			/* Node in hook_cache_lru */
+  struct bgp_cache_entry *next;	/* Node in hook_cache */
+  u32 index;
+  ip_addr prefix;
+  int pxlen;
+  ip_addr gw, from;
+  struct adata *path;		/* Points to path_data, NULL if no AS_PATH */
+  int status;
+  bird_clock_t expires;
+  struct adata path_data;	/* Must be last */
+};
+
+static inline struct adata *
+bgp_route_path (rte *e)
+{
+  eattr *a = ea_find (e->attrs->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
+  return a ? a->u.ptr : NULL;
+}
+
+static inline int
+bgp_path_same (struct adata *a, struct adata *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+
+  return adata_same (a, b);
+}
+
+static u32
+bgp_path_hash (struct adata *a)
+{
+  u32 h = 0;
+  uint i;
+
+  if (a == NULL)
+    return 0;
+
+  for (i = 0; i < a->length; i++)
+    h = (h * 31) + a->data[i];
+
+  return u32_hash (h);
+}
+
+#define VCH_KEY(c)		c->index, c->prefix, c->pxlen, c->gw, c->from, c->path
+#define VCH_NEXT(c)		c->next
+#define VCH_EQ(i1,p1,l1,g1,f1,a1,i2,p2,l2,g2,f2,a2) \
+  i1 == i2 && ipa_equal(p1, p2) && l1 == l2 && ipa_equal(g1, g2) && \
+  ipa_equal(f1, f2) && bgp_path_same(a1, a2)
+#define VCH_FN(i,p,l,g,f,a)	ipa_hash32(p) ^ ipa_hash32(g) ^ \
+  u32_hash((l << 16) ^ i) ^ bgp_path_hash(a)
+
+#define VCH_REHASH		bgp_vch_rehash
+#define VCH_PARAMS		/8, *2, 2, 2, 8, 24
+
+HASH_DEFINE_REHASH_FN(VCH, struct bgp_cache_entry)
+
+static void
+bgp_cache_remove (struct bgp_proto *p, struct bgp_cache_entry *c)
+{
+  rem_node (&c->n);
+  HASH_REMOVE2(p->hook_cache, VCH, p->hook_cache_pool, c);
+  mb_free (c);
+}
+
+/* Returns the cached verdict for @e or -1 if there is none */
+static int
+bgp_cache_lookup (struct bgp_proto *p, u32 index, rte *e)
+{
+  struct bgp_cache_entry *c;
+  net *n = e->net;
+
+  if (!p->cf->hook_cache_limit)
+    return -1;
+
+  if (p->hook_cache_pool == NULL)
+    {
+      p->hook_cache_misses++;
+      return -1;
+    }
+
+  c = HASH_FIND(p->hook_cache, VCH, index, n->n.prefix, n->n.pxlen,
+		e->attrs->gw, e->attrs->from, bgp_route_path (e));
+
+  if (c != NULL && c->expires <= now)
+    {
+      bgp_cache_remove (p, c);
+      c = NULL;
+    }
+
+  if (c == NULL)
+    {
+      p->hook_cache_misses++;
+      return -1;
+    }
+
+  p->hook_cache_hits++;
+  rem_node (&c->n);
+  add_tail (&p->hook_cache_lru, &c->n);
+
+  return c->status;
+}
+
+static void
+bgp_cache_store (struct bgp_proto *p, u32 index, ip_addr prefix, int pxlen,
+		 ip_addr gw, ip_addr from, struct adata *path, int status)
+{
+  struct bgp_cache_entry *c;
+  uint plen = path ? path->length : 0;
+
+  if (!p->cf->hook_cache_limit)
+    return;
+
+  /* Failure to run the hook, not a verdict */
+  if (status & ~(HOOK_STATUS_BAD | HOOK_STATUS_RECONFIGURE))
+    return;
+
+  if (p->hook_cache_pool == NULL)
+    {
+      p->hook_cache_pool = rp_new (&root_pool, "BGP hook cache");
+      HASH_INIT(p->hook_cache, p->hook_cache_pool, 8);
+      init_list (&p->hook_cache_lru);
+    }
+
+  c = HASH_FIND(p->hook_cache, VCH, index, prefix, pxlen, gw, from, path);
+  if (c != NULL)
+    bgp_cache_remove (p, c);
+
+  while (p->hook_cache.count >= p->cf->hook_cache_limit)
+    bgp_cache_remove (p, HEAD(p->hook_cache_lru));
+
+  c = mb_alloc (p->hook_cache_pool, sizeof(struct bgp_cache_entry) + plen);
+  c->index = index;
+  c->prefix = prefix;
+  c->pxlen = pxlen;
+  c->gw = gw;
+  c->from = from;
+  c->path = NULL;
+  c->status = status & HOOK_STATUS_BAD;
+  c->expires = now + p->cf->hook_cache_ttl;
+
+  if (path != NULL)
+    {
+      memcpy (&c->path_data, path, sizeof(struct adata) + plen);
+      c->path = &c->path_data;
+    }
+
+  HASH_INSERT2(p->hook_cache, VCH, p->hook_cache_pool, c);
+  add_tail (&p->hook_cache_lru, &c->n);
+}
+
+static inline void
+bgp_cache_store_rte (struct bgp_proto *p, u32 index, rte *e, int status)
+{
+  bgp_cache_store (p, index, e->net->n.prefix, e->net->n.pxlen, e->attrs->gw,
+		   e->attrs->from, bgp_route_path (e), status);
+}
+
+void
+bgp_flush_hook_cache (void *P)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  if (p->hook_cache_pool == NULL)
+    return;
+
+  rfree (p->hook_cache_pool);
+  p->hook_cache_pool = NULL;
+  memset (&p->hook_cache, 0, sizeof(p->hook_cache));
+}
+
+/*
+ *	Deferred route hook verdicts
+ *
+ * An `ahook route import' or `ahook route export' hook served by a
+ * persistent worker does not hold up route processing. Imported routes
+ * are parked and enter the table once the worker accepts them. Exported
+ * routes are withheld until then while the route exported before, if
+ * any, stays announced; the net is offered again when the verdict is
+ * known, so that the old route is replaced or withdrawn. Replies are
+ * collected from the worker socket and applied from an event, never
+ * from within route processing.
+ *
+ * Queries are sent to the worker in batches, those not answered within
+ * `hook verdict timeout' get the default verdict. At most `hook verdict
+ * limit' of them may be pending; further ones wait unsent and, while
+ * imports are waiting, no more updates are read from the session. A
+ * newer update of the same route supersedes a pending query.
+ */
+
+static inline u32 bgp_src_id (struct rte_src *src)
+{ return src ? src->global_id : 0; }
+
+#define VSH_KEY(v)		v->index, v->seq
+#define VSH_NEXT(v)		v->next
+#define VSH_EQ(i1,s1,i2,s2)	i1 == i2 && s1 == s2
+#define VSH_FN(i,s)		u32_hash((i << 24) ^ s)
+
+#define VSH_REHASH		bgp_vsh_rehash
+#define VSH_PARAMS		/8, *2, 2, 2, 6, 20
+
+#define VKH_KEY(v)		v->index, v->prefix, v->pxlen, v->src
+#define VKH_NEXT(v)		v->next_key
+#define VKH_EQ(i1,p1,l1,s1,i2,p2,l2,s2) \
+  i1 == i2 && ipa_equal(p1, p2) && l1 == l2 && s1 == s2
+#define VKH_FN(i,p,l,s)		ipa_hash32(p) ^ u32_hash((l << 16) ^ i ^ bgp_src_id(s))
+
+#define VKH_REHASH		bgp_vkh_rehash
+#define VKH_PARAMS		/8, *2, 2, 2, 6, 20
+
+HASH_DEFINE_REHASH_FN(VSH, struct bgp_verdict)
+HASH_DEFINE_REHASH_FN(VKH, struct bgp_verdict)
+
+static inline int
+bgp_verdict_deferred (struct bgp_proto *p, bgp_hook *h)
+{
+  return ((h->ac & (HOOK_F_ASYNC | HOOK_F_COPROC))
+      == (HOOK_F_ASYNC | HOOK_F_COPROC)) && (p->verdict_hash.data != NULL);
+}
+
+/* Exports of different sources are told apart only with ADD-PATH */
+static inline struct rte_src *
+bgp_verdict_src (struct bgp_proto *p, u32 index, rte *e)
+{
+  return ((index == BGP_HOOK_IMPORT) || p->add_path_tx) ? e->attrs->src : NULL;
+}
+
+/* The query pending for the route of @e, if any */
+static inline struct bgp_verdict *
+bgp_verdict_find (struct bgp_proto *p, u32 index, rte *e)
+{
+  net *n = e->net;
+
+  return HASH_FIND(p->verdict_key_hash, VKH, index, n->n.prefix, n->n.pxlen,
+		   bgp_verdict_src (p, index, e));
+}
+
+/* Whether @e is the route export query @v was made for */
+static int
+bgp_verdict_match (struct bgp_verdict *v, rte *e)
+{
+  struct adata *path = bgp_route_path (e);
+
+  if (!ipa_equal (v->gw, e->attrs->gw) || !ipa_equal (v->from, e->attrs->from))
+    return 0;
+
+  if (v->path == NULL || path == NULL)
+    return v->path == path;
+
+  return adata_same (v->path, path);
+}
+
+static void
+bgp_verdict_drop (struct bgp_proto *p, struct bgp_verdict *v)
+{
+  rem_node (&v->n);
+
+  if (v->state == BGP_VS_SENT)
+    HASH_REMOVE2(p->verdict_hash, VSH, p->p.pool, v);
+
+  HASH_REMOVE2(p->verdict_key_hash, VKH, p->p.pool, v);
+
+  if (v->e != NULL)
+    rte_free (v->e);
+
+  if (v->old != NULL)
+    rte_free (v->old);
+
+  if (v->path != NULL)
+    mb_free (v->path);
+
+  sl_free (p->verdict_slab, v);
+}
+
+/* Stops reading updates while parked imports wait for a free slot */
+static void
+bgp_verdict_pause (struct bgp_proto *p)
+{
+  if (p->verdict_paused || p->conn == NULL || p->conn->sk == NULL)
+    return;
+
+  BGP_TRACE(D_FILTERS, "%d route verdicts pending, pausing input",
+	    p->verdict_hash.count);
+
+  p->conn->sk->rx_hook = NULL;
+  p->verdict_paused = 1;
+}
+
+static void
+bgp_verdict_unpause (struct bgp_proto *p)
+{
+  if (!p->verdict_paused)
+    return;
+
+  p->verdict_paused = 0;
+
+  if (p->conn == NULL || p->conn->sk == NULL)
+    return;
+
+  BGP_TRACE(D_FILTERS, "Resuming input");
+  p->conn->sk->rx_hook = bgp_rx;
+}
+
+/* The verdict is applied later by bgp_verdict_event() */
+static void
+bgp_verdict_answer (struct bgp_proto *p, struct bgp_verdict *v, int status)
+{
+  if (v->state == BGP_VS_SENT)
+    HASH_REMOVE2(p->verdict_hash, VSH, p->p.pool, v);
+
+  v->state = BGP_VS_ANSWERED;
+  v->status = status;
+
+  rem_node (&v->n);
+  add_tail (&p->verdict_done, &v->n);
+  ev_schedule (p->verdict_event);
+}
+
+/* Offers the net to the peer again, replacing or withdrawing @old */
+static void
+bgp_verdict_feed (struct bgp_proto *p, ip_addr prefix, int pxlen, rte *old)
+{
+  net *n = net_find (p->p.table, prefix, pxlen);
+
+  if (n != NULL)
+    {
+      if (old != NULL)
+	old->net = n;
+
+      rt_feed_net (p->p.main_ahook, n, old);
+    }
+
+  if (old != NULL)
+    rte_free (old);
+}
+
+static void
+bgp_verdict_apply (struct bgp_proto *p, struct bgp_verdict *v)
+{
+  ip_addr prefix = v->prefix;
+  int pxlen = v->pxlen;
+  struct rte_src *src = v->src;
+
+  if (v->index == BGP_HOOK_IMPORT)
+    {
+      rte *e = v->e;
+      int accept = !(v->status & HOOK_STATUS_BAD);
+
+      v->e = NULL;
+      bgp_verdict_drop (p, v);
+
+      /* The network seen at query time may have been pruned since */
+      e->net = net_get (p->p.table, prefix, pxlen);
+      rte_update_verdict (p->p.main_ahook, e, src, accept);
+      return;
+    }
+
+  /* The verdict is consumed by bgp_verdict_query() during the refeed */
+  rte *old = v->old;
+  v->old = NULL;
+  bgp_verdict_feed (p, prefix, pxlen, old);
+
+  if (p->verdict_hash.data == NULL)
+    return;
+
+  v = HASH_FIND(p->verdict_key_hash, VKH, BGP_HOOK_EXPORT, prefix, pxlen, src);
+  if (v != NULL && v->state == BGP_VS_ANSWERED)
+    bgp_verdict_drop (p, v);
+}
+
+static void
+bgp_verdict_reply (void *P, u32 index, u32 seq, int status)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  if (p->verdict_hash.data == NULL)
+    return;
+
+  struct bgp_verdict *v = HASH_FIND(p->verdict_hash, VSH, index, seq);
+
+  /* Superseded or expired query */
+  if (v == NULL)
+    return;
+
+  if (v->index == BGP_HOOK_IMPORT)
+    bgp_cache_store (p, index, v->prefix, v->pxlen, v->e->attrs->gw,
+		     v->e->attrs->from, bgp_route_path (v->e), status);
+  else
+    bgp_cache_store (p, index, v->prefix, v->pxlen, v->gw, v->from, v->path,
+		     status);
+
+  bgp_verdict_answer (p, v, status);
+}
+
+static void
+bgp_verdict_flush (struct bgp_proto *p)
+{
+  p->verdict_unsent = 0;
+
+  if (p->hook_workers[BGP_HOOK_IMPORT] != NULL)
+    hook_worker_flush (p->hook_workers[BGP_HOOK_IMPORT]);
+
+  if (p->hook_workers[BGP_HOOK_EXPORT] != NULL)
+    hook_worker_flush (p->hook_workers[BGP_HOOK_EXPORT]);
+}
+
+/* Queues the query of @v about @e, returns 0 if the worker is unavailable */
+static int
+bgp_verdict_send (struct bgp_proto *p, struct bgp_verdict *v, rte *e)
+{
+  bgp_hook *h = &p->hooks[v->index];
+  struct bgp_filter_build_params par =
+    { .p = p, .e = e };
+
+  struct hook_execv_data data = hook_execv_mkdata (h->ac,
+						   bgp_build_hook_envvars,
+						   p, GET_HS(v->index),
+						   p->cf->c.name,
+						   bgp_build_route_envvars,
+						   &par, NULL);
+
+  data.worker = &p->hook_workers[v->index];
+  data.stats = &p->hook_stats[v->index];
+  data.reply = bgp_verdict_reply;
+  data.reply_data = p;
+
+  u32 seq = hook_worker_queue (h->exec, v->index, &data);
+
+  if (!seq)
+    return 0;
+
+  v->seq = seq;
+  v->sent = now;
+  v->state = BGP_VS_SENT;
+
+  rem_node (&v->n);
+  add_tail (&p->verdict_queue, &v->n);
+  HASH_INSERT2(p->verdict_hash, VSH, p->p.pool, v);
+
+  if (++p->verdict_unsent >= p->cf->verdict_batch)
+    bgp_verdict_flush (p);
+  else
+    ev_schedule (p->verdict_event);
+
+  if (!tm_active (p->verdict_timer))
+    tm_start (p->verdict_timer, p->cf->verdict_timeout);
+
+  return 1;
+}
+
+/* Sends the waiting queries as far as the limit allows */
+static void
+bgp_verdict_resume (struct bgp_proto *p)
+{
+  while (p->verdict_hash.data != NULL && !EMPTY_LIST(p->verdict_wait)
+	 && p->verdict_hash.count < p->cf->verdict_limit)
+    {
+      struct bgp_verdict *v = HEAD(p->verdict_wait);
+
+      if (v->index == BGP_HOOK_IMPORT)
+	{
+	  v->e->net = net_get (p->p.table, v->prefix, v->pxlen);
+
+	  if (!bgp_verdict_send (p, v, v->e))
+	    bgp_verdict_answer (p, v, p->cf->verdict_default);
+
+	  continue;
+	}
+
+      /* The export is queried again, for the route best by now */
+      ip_addr prefix = v->prefix;
+      int pxlen = v->pxlen;
+      rte *old = v->old;
+
+      v->old = NULL;
+      bgp_verdict_drop (p, v);
+      bgp_verdict_feed (p, prefix, pxlen, old);
+    }
+
+  if (p->verdict_hash.data != NULL && EMPTY_LIST(p->verdict_wait))
+    bgp_verdict_unpause (p);
+}
+
+static void
+bgp_verdict_event (void *P)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  while (p->verdict_hash.data != NULL && !EMPTY_LIST(p->verdict_done))
+    bgp_verdict_apply (p, HEAD(p->verdict_done));
+
+  bgp_verdict_resume (p);
+
+  if (p->verdict_hash.data != NULL)
+    bgp_verdict_flush (p);
+}
+
+static void
+bgp_verdict_timeout (timer *t)
+{
+  struct bgp_proto *p = t->data;
+
+  while (!EMPTY_LIST(p->verdict_queue))
+    {
+      struct bgp_verdict *v = HEAD(p->verdict_queue);
+      bird_clock_t expires = v->sent + p->cf->verdict_timeout;
+
+      if (expires > now)
+	{
+	  tm_start (t, expires - now);
+	  return;
+	}
+
+      BGP_TRACE(D_FILTERS, "%s: no verdict for %I/%d, using default",
+		GET_HS(v->index), v->prefix, v->pxlen);
+
+      bgp_verdict_answer (p, v, p->cf->verdict_default);
+    }
+}
+
+/* Records that @e stays exported until the pending query is answered */
+static void
+bgp_verdict_keep (struct bgp_proto *p, rte *e)
+{
+  struct bgp_verdict *v = bgp_verdict_find (p, BGP_HOOK_EXPORT, e);
+
+  /* A superseded route was never exported */
+  if (v != NULL && v->old == NULL && !v->replaced && v->state != BGP_VS_ANSWERED)
+    v->old = rte_do_cow (e);
+}
+
+static int
+bgp_verdict_query (struct bgp_proto *p, u32 index, rte *e, u32 flags)
+{
+  net *n = e->net;
+  struct bgp_verdict *v = bgp_verdict_find (p, index, e);
+  rte *old = NULL;
+
+  if (index == BGP_HOOK_EXPORT)
+    {
+      if (v != NULL && bgp_verdict_match (v, e))
+	{
+	  if (!(flags & HOOK_FILTER_F_SILENT))
+	    return (v->state == BGP_VS_ANSWERED) ? v->status : HOOK_STATUS_DEFERRED;
+
+	  /* The pending route is leaving, its withdrawal removes the kept one */
+	  if (v->old != NULL)
+	    {
+	      rte_free (v->old);
+	      v->old = NULL;
+	      return HOOK_STATUS_NONE;
+	    }
+
+	  return (v->state == BGP_VS_ANSWERED) ? HOOK_STATUS_NONE : HOOK_STATUS_DEFERRED;
 	}
+
+      /* Old route, no query was pending for it so it was exported */
+      if (flags & HOOK_FILTER_F_SILENT)
+	return HOOK_STATUS_NONE;
+
+      /* A superseded query leaves the route exported before in place */
+      if (v != NULL)
+	{
+	  old = v->old;
+	  v->old = NULL;
+	}
+    }
+
+  int replaced = (v != NULL);
+
+  if (v != NULL)
+    bgp_verdict_drop (p, v);
+
+  v = sl_alloc (p->verdict_slab);
+  memset (v, 0, sizeof(struct bgp_verdict));
+  v->index = index;
+  v->prefix = n->n.prefix;
+  v->pxlen = n->n.pxlen;
+  v->src = bgp_verdict_src (p, index, e);
+  v->state = BGP_VS_WAITING;
+  v->old = old;
+  v->replaced = replaced;
+
+  if (index == BGP_HOOK_IMPORT)
+    {
+      v->e = e;
+    }
+  else
+    {
+      struct adata *path = bgp_route_path (e);
+
+      v->gw = e->attrs->gw;
+      v->from = e->attrs->from;
+
+      if (path != NULL)
+	{
+	  v->path = mb_alloc (p->p.pool, sizeof(struct adata) + path->length);
+	  memcpy (v->path, path, sizeof(struct adata) + path->length);
+	}
+    }
+
+  HASH_INSERT2(p->verdict_key_hash, VKH, p->p.pool, v);
+  add_tail (&p->verdict_wait, &v->n);
+
+  /* Sent by bgp_verdict_resume() once replies make room */
+  if (p->verdict_hash.count >= p->cf->verdict_limit)
+    {
+      if (index == BGP_HOOK_IMPORT)
+	bgp_verdict_pause (p);
+
+      return HOOK_STATUS_DEFERRED;
     }
+
+  if (bgp_verdict_send (p, v, e))
+    return HOOK_STATUS_DEFERRED;
+
+  /* The caller keeps the route */
+  v->e = NULL;
+  bgp_verdict_drop (p, v);
+  return p->cf->verdict_default;
+}
+
+void
+bgp_init_verdicts (void *P)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  HASH_INIT(p->verdict_hash, p->p.pool, 6);
+  HASH_INIT(p->verdict_key_hash, p->p.pool, 6);
+  p->verdict_slab = sl_new (p->p.pool, sizeof(struct bgp_verdict));
+  init_list (&p->verdict_queue);
+  init_list (&p->verdict_wait);
+  init_list (&p->verdict_done);
+  p->verdict_timer = tm_new_set (p->p.pool, bgp_verdict_timeout, p, 0, 0);
+  p->verdict_event = ev_new (p->p.pool);
+  p->verdict_event->hook = bgp_verdict_event;
+  p->verdict_event->data = p;
+  p->verdict_unsent = 0;
+  p->verdict_paused = 0;
+}
+
+/* Drops all pending queries, parked routes are discarded */
+void
+bgp_free_verdicts (void *P)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+  struct bgp_verdict *v, *v2;
+
+  if (p->verdict_hash.data == NULL)
+    return;
+
+  WALK_LIST_DELSAFE(v, v2, p->verdict_queue)
+    bgp_verdict_drop (p, v);
+
+  WALK_LIST_DELSAFE(v, v2, p->verdict_wait)
+    bgp_verdict_drop (p, v);
+
+  WALK_LIST_DELSAFE(v, v2, p->verdict_done)
+    bgp_verdict_drop (p, v);
+
+  HASH_FREE(p->verdict_hash);
+  HASH_FREE(p->verdict_key_hash);
+
+  rfree (p->verdict_slab);
+  rfree (p->verdict_timer);
+  rfree (p->verdict_event);
+  p->verdict_slab = NULL;
+  p->verdict_timer = NULL;
+  p->verdict_event = NULL;
+  p->verdict_paused = 0;
+}
+
+/* Called when a route is withdrawn, its pending import query is moot */
+void
+bgp_verdict_cancel (void *P, ip_addr prefix, int pxlen, struct rte_src *src)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  if (p->verdict_hash.data == NULL || src == NULL)
+    return;
+
+  struct bgp_verdict *v = HASH_FIND(p->verdict_key_hash, VKH, BGP_HOOK_IMPORT,
+				    prefix, pxlen, src);
+
+  if (v != NULL)
+    bgp_verdict_drop (p, v);
 }
 
 int
-bgp_hook_filter (u32 index, void *P, void *RT)
+bgp_hook_filter (u32 index, void *P, void *RT, u32 flags)
 {
+  struct bgp_proto *bp = (struct bgp_proto *) P;
   struct bgp_filter_build_params p =
-    { .p = (struct bgp_proto *) P, .e = (struct rte*) RT };
+    { .p = bp, .e = (struct rte*) RT };
+
+  bgp_hook *h = &bp->hooks[index];
+
+  if (h->exec == NULL)
+    return HOOK_STATUS_NONE;
+
+  if (flags & HOOK_FILTER_F_KEEP)
+    {
+      if (bgp_verdict_deferred (bp, h))
+	bgp_verdict_keep (bp, p.e);
+
+      return HOOK_STATUS_NONE;
+    }
+
+  /* Plugins are cheaper to call than the cache is to consult */
+  if (h->ac & HOOK_F_PLUGIN)
+    {
+      struct hook_plugin_route r;
+      net *n = p.e->net;
+
+      bgp_plugin_route (&r, n ? n->n.prefix : IPA_NONE, n ? n->n.pxlen : 0,
+			0, p.e->attrs);
+      return bgp_plugin_run (bp, index, &r);
+    }
+
+  /* Plain asynchronous hooks do not deliver a verdict */
+  int deferred = bgp_verdict_deferred (bp, h);
+
+  int cacheable = deferred || !(h->ac & HOOK_F_ASYNC);
+  struct bgp_verdict *v = deferred ? bgp_verdict_find (bp, index, p.e) : NULL;
+  int r;
+
+  /* A pending export query also decides about the route kept meanwhile */
+  if (v != NULL && index == BGP_HOOK_EXPORT)
+    return bgp_verdict_query (bp, index, p.e, flags);
+
+  if (cacheable && (r = bgp_cache_lookup (bp, index, p.e)) >= 0)
+    {
+      /* Superseded, the route parked for the query must not come back */
+      if (v != NULL)
+	bgp_verdict_drop (bp, v);
+
+      return r;
+    }
+
+  if (deferred)
+    return bgp_verdict_query (bp, index, p.e, flags);
+
+  r = bgp_hook_run (index, P, bgp_build_route_envvars, &p);
+
+  if (cacheable)
+    bgp_cache_store_rte (bp, index, p.e, r);
+
+  return r;
+}
+
+/*
+ *	Route update/withdraw events
+ *
+ * By default the route update and withdraw hooks run once per prefix,
+ * with PREFIX, PREFIX_LEN, PATH_ID and, for updates, BGP_NEXT_HOP,
+ * BGP_FROM and BGP_PATH set. With `hook batch update' they run once per
+ * received UPDATE message, with `hook batch <n>' once per n seconds. A
+ * batch is passed in ROUTES as one record per line
+ *
+ *	<prefix>/<len> <path id> <next hop> <as path>	(updates)
+ *	<prefix>/<len> <path id>			(withdrawals)
+ *
+ * and ROUTE_COUNT holds the number of records. Withdrawals are delivered
+ * before updates. A batch is also delivered early once it grows over
+ * BGP_ROUTE_BATCH_MAX bytes and when the session goes down.
+ */
+
+struct bgp_nlri_params
+{
+  ip_addr prefix;
+  int pxlen;
+  u32 path_id;
+  rta *a;
+};
+
+static void
+bgp_build_nlri_envvars (u32 index, void *N)
+{
+  struct bgp_nlri_params *n = (struct bgp_nlri_params *) N;
+
+  char b[MAX_ENV_SIZE];
+
+  SETENV_IPTOSTR("PREFIX", &n->prefix);
+  SETENV_INT("%d", b, "PREFIX_LEN", n->pxlen);
+  SETENV_INT("%u", b, "PATH_ID", (unsigned int )n->path_id);
+
+  if (n->a)
+    {
+      SETENV_IPTOSTR("BGP_NEXT_HOP", &n->a->gw);
+      SETENV_IPTOSTR("BGP_FROM", &n->a->from);
+
+      eattr *ad = ea_find (n->a->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
+      if (ad)
+	{
+	  as_path_format (ad->u.ptr, b, sizeof(b));
+	  hook_setenv ("BGP_PATH", b);
+	}
+    }
+}
+
+static void
+bgp_build_batch_envvars (u32 index, void *B)
+{
+  struct bgp_route_batch *rb = (struct bgp_route_batch *) B;
+
+  char b[MAX_ENV_SIZE];
+
+  SETENV_INT("%u", b, "ROUTE_COUNT", rb->count);
+  hook_setenv ("ROUTES", (char *) rb->buf);
+}
+
+static inline struct bgp_route_batch *
+bgp_route_batch (struct bgp_proto *p, u32 index)
+{
+  return (index == BGP_HOOK_UPDATE) ? &p->update_batch : &p->withdraw_batch;
+}
+
+static void
+bgp_deliver_route_batch (struct bgp_proto *p, u32 index)
+{
+  struct bgp_route_batch *rb = bgp_route_batch (p, index);
+
+  if (!rb->count)
+    return;
+
+  bgp_hook_run (index, p, bgp_build_batch_envvars, rb);
+
+  rb->len = 0;
+  rb->count = 0;
+}
+
+static void
+bgp_deliver_route_batches (struct bgp_proto *p)
+{
+  bgp_deliver_route_batch (p, BGP_HOOK_WITHDRAW);
+  bgp_deliver_route_batch (p, BGP_HOOK_UPDATE);
+}
+
+static void
+bgp_route_batch_timeout (timer *t)
+{
+  bgp_deliver_route_batches (t->data);
+}
+
+static void
+bgp_route_batch_add (struct bgp_proto *p, u32 index, ip_addr prefix,
+		     int pxlen, u32 path_id, rta *a)
+{
+  struct bgp_route_batch *rb = bgp_route_batch (p, index);
+  byte rec[BGP_ROUTE_RECORD_MAX];
+  int l;
+
+  if (a)
+    {
+      eattr *ad = ea_find (a->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
+
+      l = bsnprintf (rec, sizeof(rec) - 1, "%I/%d %u %I ", prefix, pxlen,
+		     path_id, a->gw);
+      rec[l] = 0;
+
+      if (ad)
+	as_path_format (ad->u.ptr, rec + l, sizeof(rec) - l - 1);
+
+      l += strlen (rec + l);
+      rec[l++] = '\n';
+    }
+  else
+    l = bsnprintf (rec, sizeof(rec), "%I/%d %u\n", prefix, pxlen, path_id);
+
+  if (rb->len + l + 1 > rb->size)
+    {
+      rb->size = MAX(MAX(rb->len + l + 1, 2 * rb->size), 4096);
+      rb->buf = rb->buf ? mb_realloc (rb->buf, rb->size)
+	  : mb_alloc (p->p.pool, rb->size);
+    }
+
+  memcpy (rb->buf + rb->len, rec, l);
+  rb->len += l;
+  rb->buf[rb->len] = 0;
+  rb->count++;
+
+  if (rb->len >= BGP_ROUTE_BATCH_MAX)
+    {
+      /* Keep withdrawals ahead of updates */
+      if (index == BGP_HOOK_UPDATE)
+	bgp_deliver_route_batch (p, BGP_HOOK_WITHDRAW);
+
+      bgp_deliver_route_batch (p, index);
+    }
+
+  if ((p->cf->route_batch == BGP_RB_WINDOW) && rb->count
+      && !tm_active (p->route_batch_timer))
+    tm_start (p->route_batch_timer, p->cf->route_batch_window);
+}
+
+/*
+ * Reports a route received (@A is its rta) or withdrawn (@A is NULL)
+ * by the neighbor to the route update/withdraw hook.
+ */
+void
+bgp_route_event (void *P, u32 index, ip_addr prefix, int pxlen, u32 path_id,
+		 void *A)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  if (p->hooks[index].exec == NULL)
+    return;
+
+  /* Plugins see each route on its own, there is nothing to save */
+  if (p->hooks[index].ac & HOOK_F_PLUGIN)
+    {
+      struct hook_plugin_route r;
+
+      bgp_plugin_route (&r, prefix, pxlen, path_id, A);
+      bgp_plugin_run (p, index, &r);
+      return;
+    }
+
+  if (p->cf->route_batch == BGP_RB_NONE)
+    {
+      struct bgp_nlri_params n =
+	{ .prefix = prefix, .pxlen = pxlen, .path_id = path_id, .a = A };
+
+      bgp_hook_run (index, P, bgp_build_nlri_envvars, &n);
+      return;
+    }
+
+  bgp_route_batch_add (p, index, prefix, pxlen, path_id, A);
+}
+
+/* Called after each received UPDATE message */
+void
+bgp_end_route_events (void *P)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  if (p->cf->route_batch == BGP_RB_UPDATE)
+    bgp_deliver_route_batches (p);
+}
+
+void
+bgp_init_route_events (void *P)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  memset (&p->update_batch, 0, sizeof(struct bgp_route_batch));
+  memset (&p->withdraw_batch, 0, sizeof(struct bgp_route_batch));
+  p->route_batch_timer = tm_new_set (p->p.pool, bgp_route_batch_timeout, p,
+				     0, 0);
+}
+
+/* Delivers what is left and releases the buffers */
+void
+bgp_free_route_events (void *P)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  if (p->route_batch_timer == NULL)
+    return;
+
+  bgp_deliver_route_batches (p);
+
+  rfree (p->route_batch_timer);
+  p->route_batch_timer = NULL;
 
-  return bgp_hook_run (index, P, bgp_build_route_envvars, &p);
+  mb_free (p->update_batch.buf);
+  mb_free (p->withdraw_batch.buf);
+  memset (&p->update_batch, 0, sizeof(struct bgp_route_batch));
+  memset (&p->withdraw_batch, 0, sizeof(struct bgp_route_batch));
 }
 
 void
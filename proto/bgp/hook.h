@@ -7,6 +7,8 @@
 
 int
 bgp_parse_hooks (void *p);
+void
+bgp_release_hooks (void *p);
 
 #include "sysdep/unix/hook.h"
 
@@ -15,6 +17,34 @@ bgp_hook_run (unsigned int flags, void *pp, execv_callback add, void *add_data);
 int
 bgp_check_hooks (void *pp);
 
+struct rte_src;
+
+void
+bgp_init_verdicts (void *P);
+void
+bgp_free_verdicts (void *P);
+void
+bgp_verdict_cancel (void *P, ip_addr prefix, int pxlen, struct rte_src *src);
+void
+bgp_flush_hook_cache (void *P);
+
+void
+bgp_init_route_events (void *P);
+void
+bgp_free_route_events (void *P);
+void
+bgp_route_event (void *P, u32 index, ip_addr prefix, int pxlen, u32 path_id,
+		 void *A);
+void
+bgp_end_route_events (void *P);
+
+#define BGP_VERDICT_LIMIT		4096
+#define BGP_VERDICT_BATCH		64
+#define BGP_VERDICT_TIMEOUT		10
+#define BGP_HOOK_CACHE_TTL		300
+#define BGP_ROUTE_BATCH_MAX		65536	/* Deliver a batch once it grows over this */
+#define BGP_ROUTE_RECORD_MAX		1200
+
 typedef struct glob_hook bgp_hook;
 typedef struct glob_hook_config bgp_hook_config;
 
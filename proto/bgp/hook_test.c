@@ -0,0 +1,177 @@
+/*
+ *	BIRD -- Tests of BGP route hook verdicts
+ *
+ *	Run by `make check'. The test binary doubles as the persistent hook
+ *	worker, which it becomes when started with HOOK_TEST_WORKER set.
+ */
+
+#include "proto/bgp/bgp.h"
+#include "proto/bgp/hook.h"
+#include "nest/attrs.h"
+#include "lib/event.h"
+#include "lib/unaligned.h"
+#include "sysdep/unix/unix.h"
+#include "lib/test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Accepts every record as soon as it is read */
+static int
+worker(void)
+{
+  struct hook_frame f;
+  struct hook_reply r;
+  char buf[65536];
+
+  while (read(0, &f, sizeof(f)) == sizeof(f))
+  {
+    if ((f.len > sizeof(buf)) || (read(0, buf, f.len) != (ssize_t) f.len))
+      return 1;
+
+    if (f.flags & HOOK_FRAME_F_ASYNC)
+      continue;
+
+    r.seq = f.seq;
+    r.status = HOOK_STATUS_NONE;
+    if (write(1, &r, sizeof(r)) != sizeof(r))
+      return 1;
+  }
+
+  return 0;
+}
+
+static rtable tab;
+static struct bgp_config cf;
+static struct bgp_proto *bgp;
+
+static void
+setup(char *exec)
+{
+  pool *p = rp_new(&root_pool, "Test");
+
+  rt_setup(p, &tab, "master", NULL);
+
+  cf.c.name = "test";
+  cf.verdict_limit = BGP_VERDICT_LIMIT;
+  cf.verdict_batch = 1;
+  cf.verdict_timeout = BGP_VERDICT_TIMEOUT;
+  cf.verdict_default = HOOK_STATUS_NONE;
+  cf.hook_cache_limit = 16;
+  cf.hook_cache_ttl = BGP_HOOK_CACHE_TTL;
+
+  bgp = mb_allocz(p, sizeof(struct bgp_proto));
+  bgp->p.pool = p;
+  bgp->p.name = "test";
+  bgp->p.table = &tab;
+  bgp->p.proto = &proto_bgp;
+  bgp->cf = &cf;
+  bgp->hooks[BGP_HOOK_IMPORT].exec = exec;
+  bgp_init_verdicts(bgp);
+}
+
+/* A route to 10.0.@net.0/24 with AS path (@as) */
+static rte *
+route(int net, u32 as)
+{
+  struct {
+    ea_list l;
+    eattr a;
+  } ea = {};
+  struct {
+    struct adata d;
+    byte data[6];
+  } path = { .d.length = 6, .data = { AS_PATH_SEQUENCE, 1 } };
+  rta a = {
+    .src = rt_get_source(&bgp->p, 0),
+    .source = RTS_BGP,
+    .scope = SCOPE_UNIVERSE,
+    .cast = RTC_UNICAST,
+    .dest = RTD_ROUTER,
+    .gw = ipa_from_u32(0xc0000201),
+    .from = ipa_from_u32(0xc0000201),
+    .eattrs = &ea.l,
+  };
+
+  put_u32(path.data + 2, as);
+  ea.l.count = 1;
+  ea.a.id = EA_CODE(EAP_BGP, BA_AS_PATH);
+  ea.a.flags = BAF_TRANSITIVE;
+  ea.a.type = EAF_TYPE_AS_PATH;
+  ea.a.u.ptr = &path.d;
+
+  rte *e = rte_get_temp(rta_lookup(&a));
+  e->net = net_get(&tab, ipa_from_u32(0x0a000000 | (net << 8)), 24);
+  e->pflags = 0;
+  return e;
+}
+
+/* Runs the hook synchronously, which also dispatches late replies */
+static int
+filter_sync(rte *e)
+{
+  bgp->hooks[BGP_HOOK_IMPORT].ac = HOOK_F_COPROC;
+  return bgp_hook_filter(BGP_HOOK_IMPORT, bgp, e, 0);
+}
+
+static int
+filter_deferred(rte *e)
+{
+  bgp->hooks[BGP_HOOK_IMPORT].ac = HOOK_F_ASYNC | HOOK_F_COPROC;
+  return bgp_hook_filter(BGP_HOOK_IMPORT, bgp, e, 0);
+}
+
+/*
+ * A cached verdict arrives while an older deferred query for the same
+ * prefix and source is pending. The parked route of the older query is
+ * discarded and the late reply to it is ignored.
+ */
+static void
+t_cache_hit_supersedes(void)
+{
+  rte *e;
+
+  /* Verdict for path (65001) is cached */
+  e = route(1, 65001);
+  CHECK(filter_sync(e) == HOOK_STATUS_NONE);
+  rte_free(e);
+
+  /* Path (65002) is not cached, the route is parked */
+  CHECK(filter_deferred(route(1, 65002)) == HOOK_STATUS_DEFERRED);
+  CHECK(bgp->verdict_key_hash.count == 1);
+
+  /* Back to path (65001), answered from the cache */
+  e = route(1, 65001);
+  CHECK(filter_deferred(e) == HOOK_STATUS_NONE);
+  CHECK(bgp->verdict_key_hash.count == 0);
+  rte_free(e);
+
+  /* The reply to the parked route is read and must be dropped */
+  e = route(2, 65001);
+  CHECK(filter_sync(e) == HOOK_STATUS_NONE);
+  rte_free(e);
+
+  CHECK(bgp->verdict_hash.count == 0);
+  CHECK(EMPTY_LIST(bgp->verdict_done));
+  ev_run_list(&global_event_list);
+}
+
+int
+main(int argc UNUSED, char **argv)
+{
+  if (getenv("HOOK_TEST_WORKER"))
+    return worker();
+
+  setenv("HOOK_TEST_WORKER", "1", 1);
+  test_init();
+
+  setup(argv[0]);
+
+  t_cache_hit_supersedes();
+
+  bgp_free_verdicts(bgp);
+  bgp_release_hooks(bgp);
+
+  return test_done(argv[0]);
+}
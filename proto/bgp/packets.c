@@ -1066,6 +1066,8 @@ bgp_rx_end_mark(struct bgp_proto *p)
 
   if (p->gr_active)
     bgp_graceful_restart_done(p);
+
+  rt_snapshot_end(&p->p);
 }
 
 
@@ -1092,21 +1094,42 @@ bgp_rx_end_mark(struct bgp_proto *p)
 } while (0)
 
 
-#define RTE_UPDATE_ENVVARS()  \
-   char b[MAX_ENV_SIZE]; \
-   SETENV_IPTOSTR("PREFIX", &prefix); \
-   SETENV_INT("%d",b,"PREFIX_LEN", pxlen); \
-   SETENV_INT("%u",b,"PATH_ID", (unsigned int)path_id); \
+/*
+ * Announced networks sharing the same attributes and path ID are collected
+ * and entered into the table at once by rte_update_batch(). The batch is
+ * flushed when the path ID changes, when it is full and at the end of the
+ * UPDATE message.
+ */
+static struct rte_batch bgp_rx_batch;
+
+static void
+bgp_rte_flush(struct bgp_proto *p, u32 path_id, struct rte_src *src, rta *a)
+{
+  struct rte_batch *b = &bgp_rx_batch;
+  rte e0 = { .attrs = a };
+  uint i;
+
+  if (!b->count)
+    return;
+
+  rte_update_batch(p->p.main_ahook, src, &e0, b);
 
+  for (i = 0; i < b->count; i++)
+    bgp_route_event(p, BGP_HOOK_UPDATE, b->prefix[i], b->pxlen[i], path_id, a);
+
+  b->count = 0;
+}
 
 static inline void
 bgp_rte_update(struct bgp_proto *p, ip_addr prefix, int pxlen,
 	       u32 path_id, u32 *last_id, struct rte_src **src,
 	       rta *a0, rta **a)
 {
+  struct rte_batch *b = &bgp_rx_batch;
 
   if (path_id != *last_id)
     {
+      bgp_rte_flush(p, *last_id, *src, *a);
       *src = rt_get_source(&p->p, path_id);
       *last_id = path_id;
 
@@ -1128,26 +1151,10 @@ bgp_rte_update(struct bgp_proto *p, ip_addr prefix, int pxlen,
       a0->eattrs = ea;
     }
 
-  net *n = net_get(p->p.table, prefix, pxlen);
-  rte *e = rte_get_temp(rta_clone(*a));
-  e->net = n;
-  e->pflags = 0;
-  e->u.bgp.suppressed = 0;
-  rte_update2(p->p.main_ahook, n, e, *src);
-
-  /*RTE_UPDATE_ENVVARS();
-  SETENV_IPTOSTR("BGP_NEXT_HOP", &(*a)->gw);
-  SETENV_IPTOSTR("BGP_FROM", &(*a)->from);
-
-  byte buf[1000];
-
-  eattr *ad = ea_find(e->attrs->eattrs, EA_CODE(EAP_BGP, BA_AS_PATH));
-  as_path_format(ad->u.ptr, buf, sizeof(buf));
-
-  setenv("BGP_PATH",buf, 1);
-
-  bgp_hook_run (BGP_HOOK_UPDATE, p, NULL);*/
-
+  b->prefix[b->count] = prefix;
+  b->pxlen[b->count] = pxlen;
+  if (++b->count == RTE_BATCH_SIZE)
+    bgp_rte_flush(p, path_id, *src, *a);
 }
 
 static inline void
@@ -1160,9 +1167,9 @@ bgp_rte_withdraw(struct bgp_proto *p, ip_addr prefix, int pxlen,
       *last_id = path_id;
     }
 
-  RTE_UPDATE_ENVVARS();
+  bgp_route_event(p, BGP_HOOK_WITHDRAW, prefix, pxlen, path_id, NULL);
 
-  bgp_hook_run (BGP_HOOK_WITHDRAW, p, NULL, NULL);
+  bgp_verdict_cancel(p, prefix, pxlen, *src);
 
   net *n = net_find(p->p.table, prefix, pxlen);
   rte_update2( p->p.main_ahook, n, NULL, *src);
@@ -1275,6 +1282,7 @@ bgp_do_rx_update(struct bgp_conn *conn,
     }
 
  done:
+  bgp_rte_flush(p, last_id, src, a);
   if (a)
     rta_free(a);
 
@@ -1394,6 +1402,7 @@ bgp_do_rx_update(struct bgp_conn *conn,
     }
 
  done:
+  bgp_rte_flush(p, last_id, src, a);
   if (a)
     rta_free(a);
 
@@ -1445,6 +1454,7 @@ bgp_rx_update(struct bgp_conn *conn, byte *pkt, int len)
   lp_flush(bgp_linpool);
 
   bgp_do_rx_update(conn, withdrawn, withdrawn_len, nlri, nlri_len, attrs, attr_len);
+  bgp_end_route_events(p);
   return;
 
 malformed:
@@ -346,7 +346,7 @@ advertise_entry( struct proto *p, struct rip_block *b, ip_addr whotoldme, struct
   r->u.rip.metric = b->metric + rif->metric;
 #endif
 
-  r->u.rip.entry = NULL;
+  r->u.rip.link = NULL;
   if (r->u.rip.metric > P_CF->infinity) r->u.rip.metric = P_CF->infinity;
   r->u.rip.tag = ntohl(b->tag);
   r->net = n;
@@ -535,14 +535,14 @@ static void
 rip_timer(timer *t)
 {
   struct proto *p = t->data;
-  struct fib_node *e, *et;
+  struct rip_rte_link *l, *lt;
 
   CHK_MAGIC;
   DBG( "RIP: tick tock\n" );
   
-  WALK_LIST_DELSAFE( e, et, P->garbage ) {
+  WALK_LIST_DELSAFE( l, lt, P->garbage ) {
     rte *rte;
-    rte = SKIP_BACK( struct rte, u.rip.garbage, e );
+    rte = l->rte;
 
     CHK_MAGIC;
 
@@ -550,8 +550,8 @@ rip_timer(timer *t)
 
     if (now - rte->lastmod > P_CF->timeout_time) {
       TRACE(D_EVENTS, "entry is too old: %I", rte->net->n.prefix );
-      if (rte->u.rip.entry) {
-	rte->u.rip.entry->metric = P_CF->infinity;
+      if (l->entry) {
+	l->entry->metric = P_CF->infinity;
 	rte->u.rip.metric = P_CF->infinity;
       }
     }
@@ -606,6 +606,7 @@ rip_start(struct proto *p)
   fib_init( &P->rtable, p->pool, sizeof( struct rip_entry ), 0, NULL );
   init_list( &P->connections );
   init_list( &P->garbage );
+  P->link_slab = sl_new( p->pool, sizeof( struct rip_rte_link ));
   init_list( &P->interfaces );
   P->timer = tm_new( p->pool );
   P->timer->data = p;
@@ -871,6 +872,45 @@ rip_store_tmp_attrs(struct rte *rt, struct ea_list *attrs)
   rt->u.rip.metric = ea_get_int(attrs, EA_RIP_METRIC, 1);
 }
 
+/*
+ * rip_rte_get_link - find or create the out-of-line data of a route
+ * in a routing table which was imported by a RIP instance. The link
+ * is listed in the garbage list once the route is inserted.
+ */
+static struct rip_rte_link *
+rip_rte_get_link(rte *rte)
+{
+  struct rip_proto *rp = (struct rip_proto *) rte->attrs->src->proto;
+  struct rip_rte_link *l = rte->u.rip.link;
+
+  if (l && (l->rte == rte))
+    return l;
+
+  l = sl_alloc( rp->link_slab );
+  l->n.next = l->n.prev = NULL;
+  l->rte = rte;
+  l->entry = NULL;
+  rte->u.rip.link = l;
+  return l;
+}
+
+/*
+ * rip_rte_set_entry - remember the entry exported for a RIP route, so
+ * that it is poisoned when the route times out. Only routes of a RIP
+ * instance in its own table carry RIP data. They got their link in
+ * rip_rte_insert(), copies made by export filters share it.
+ */
+static void
+rip_rte_set_entry(rte *rte, struct rip_entry *e)
+{
+  if ((rte->attrs->source != RTS_RIP) ||
+      (rte->sender->proto != rte->attrs->src->proto))
+    return;
+
+  if (rte->u.rip.link)
+    rte->u.rip.link->entry = e;
+}
+
 /*
  * rip_rt_notify - core tells us about new route (possibly our
  * own), so store it into our data structures. 
@@ -892,7 +932,7 @@ rip_rt_notify(struct proto *p, struct rtable *table UNUSED, struct network *net,
     e->nexthop = new->attrs->gw;
     e->metric = 0;
     e->whotoldme = IPA_NONE;
-    new->u.rip.entry = e;
+    rip_rte_set_entry(new, e);
 
     e->tag = ea_get_int(attrs, EA_RIP_TAG, 0);
     e->metric = ea_get_int(attrs, EA_RIP_METRIC, 1);
@@ -951,7 +991,7 @@ rip_rte_insert(net *net UNUSED, rte *rte)
   struct proto *p = rte->attrs->src->proto;
   CHK_MAGIC;
   DBG( "rip_rte_insert: %p\n", rte );
-  add_head( &P->garbage, &rte->u.rip.garbage );
+  add_head( &P->garbage, &rip_rte_get_link(rte)->n );
 }
 
 /*
@@ -965,7 +1005,12 @@ rip_rte_remove(net *net UNUSED, rte *rte)
   CHK_MAGIC;
   DBG( "rip_rte_remove: %p\n", rte );
 #endif
-  rem_node( &rte->u.rip.garbage );
+  struct rip_rte_link *l = rte->u.rip.link;
+  struct rip_proto *rp = (struct rip_proto *) rte->attrs->src->proto;
+
+  rem_node( &l->n );
+  sl_free( rp->link_slab, l );
+  rte->u.rip.link = NULL;
 }
 
 static struct proto *
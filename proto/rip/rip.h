@@ -155,12 +155,24 @@ struct rip_proto_config {
 #define HO_ALWAYS 2
 };
 
+/*
+ * Per-route data of RIP routes in the routing table. It used to live in
+ * the rte itself, but it made the protocol-dependent part of every rte
+ * twice as large as other protocols need.
+ */
+struct rip_rte_link {
+  node n;			/* In garbage list of the owning instance */
+  struct rte *rte;		/* Route owning the link */
+  struct rip_entry *entry;	/* Entry exported for the route, if any */
+};
+
 struct rip_proto {
   struct proto inherited;
   timer *timer;
   list connections;
   struct fib rtable;
-  list garbage;
+  list garbage;			/* Our routes, as struct rip_rte_link */
+  slab *link_slab;
   list interfaces;	/* Interfaces we really know about */
 #ifdef LOCAL_DEBUG
   int magic;
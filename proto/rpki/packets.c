@@ -0,0 +1,446 @@
+/*
+ *	BIRD -- The Resource Public Key Infrastructure (RPKI) to Router Protocol
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#undef LOCAL_DEBUG
+
+#include "rpki.h"
+#include "lib/unaligned.h"
+
+static const char *rpki_error_names[] = {
+  [RPKI_ERR_CORRUPT] = "Corrupt data",
+  [RPKI_ERR_INTERNAL] = "Internal error",
+  [RPKI_ERR_NO_DATA] = "No data available",
+  [RPKI_ERR_INVALID] = "Invalid request",
+  [RPKI_ERR_VERSION] = "Unsupported protocol version",
+  [RPKI_ERR_PDU_TYPE] = "Unsupported PDU type",
+  [RPKI_ERR_UNKNOWN_WITHDRAW] = "Withdrawal of unknown record",
+  [RPKI_ERR_DUP_ANNOUNCE] = "Duplicate announcement",
+  [RPKI_ERR_UNEXPECTED_VERSION] = "Unexpected protocol version"
+};
+
+const char *
+rpki_error_name(uint code)
+{
+  return (code < ARRAY_SIZE(rpki_error_names)) ? rpki_error_names[code] : "Unknown error";
+}
+
+static byte *
+rpki_put_header(struct rpki_proto *p, byte *buf, uint type, uint session, uint len)
+{
+  buf[0] = p->version;
+  buf[1] = type;
+  put_u16(buf + 2, session);
+  put_u32(buf + 4, len);
+  return buf + RPKI_HEADER_LENGTH;
+}
+
+static void
+rpki_send(struct rpki_proto *p, uint len)
+{
+  p->stats.tx_pdus++;
+  sk_send(p->sk, len);
+}
+
+/**
+ * rpki_send_query - ask the cache for data
+ * @p: RPKI instance
+ *
+ * Sends a Serial Query for changes since our serial number, or a Reset
+ * Query when we have no valid data from the cache. If the TX buffer is
+ * busy, the query is sent from rpki_tx().
+ */
+void
+rpki_send_query(struct rpki_proto *p)
+{
+  sock *sk = p->sk;
+  byte *buf = sk->tbuf;
+
+  p->state = RPKI_CS_SYNC;
+  p->deltas_count = 0;
+  tm_stop(p->refresh_timer);
+  tm_start(p->retry_timer, p->retry_time);
+
+  p->query_pending = !sk_send_buffer_empty(sk);
+  if (p->query_pending)
+    return;
+
+  if (p->have_data)
+    {
+      RPKI_TRACE(D_PACKETS, "Sending Serial Query (session %u, serial %u)", p->session_id, p->serial);
+      rpki_put_header(p, buf, RPKI_SERIAL_QUERY, p->session_id, 12);
+      put_u32(buf + 8, p->serial);
+      p->reset = 0;
+      p->stats.serial_queries++;
+      rpki_send(p, 12);
+    }
+  else
+    {
+      RPKI_TRACE(D_PACKETS, "Sending Reset Query");
+      rpki_put_header(p, buf, RPKI_RESET_QUERY, 0, RPKI_HEADER_LENGTH);
+      p->reset = 1;
+      p->stats.reset_queries++;
+      rpki_send(p, RPKI_HEADER_LENGTH);
+    }
+}
+
+void
+rpki_tx(sock *sk)
+{
+  struct rpki_proto *p = sk->data;
+
+  if (p->query_pending)
+    rpki_send_query(p);
+}
+
+/*
+ * Report an error in a PDU from the cache, which may be included in the
+ * report, and close the connection.
+ */
+static void
+rpki_error(struct rpki_proto *p, uint code, byte *pdu, uint pdu_len, const char *text)
+{
+  sock *sk = p->sk;
+  byte *pos = sk->tbuf;
+  uint text_len = strlen(text);
+  uint len;
+
+  log(L_ERR "%s: %s: %s", p->p.name, rpki_error_name(code), text);
+  p->last_error = code;
+
+  /* Errors are not reported back, the cache would report ours again */
+  if (pdu && (pdu[1] == RPKI_ERROR_REPORT))
+    pdu_len = 0;
+
+  pdu_len = MIN(pdu_len, RPKI_TX_BUFFER_SIZE - RPKI_HEADER_LENGTH - 8 - text_len);
+  len = RPKI_HEADER_LENGTH + 4 + pdu_len + 4 + text_len;
+
+  if (sk_send_buffer_empty(sk))
+    {
+      pos = rpki_put_header(p, pos, RPKI_ERROR_REPORT, code, len);
+      put_u32(pos, pdu_len);
+      memcpy(pos + 4, pdu, pdu_len);
+      pos += 4 + pdu_len;
+      put_u32(pos, text_len);
+      memcpy(pos + 4, text, text_len);
+      rpki_send(p, len);
+    }
+
+  /* The socket may be already closed by sk_send() */
+  if (p->sk)
+    rpki_disconnect(p, p->retry_time);
+}
+
+/**
+ * rpki_error_delta - report an invalid entry of a response
+ * @p: RPKI instance
+ * @code: error code
+ * @d: entry
+ * @text: error message
+ *
+ * Like rpki_error(), but the erroneous PDU is encoded again from @d, as
+ * entries are checked when the response is complete.
+ */
+void
+rpki_error_delta(struct rpki_proto *p, uint code, struct rpki_delta *d, const char *text)
+{
+#ifdef IPV6
+  uint type = RPKI_IPV6_PREFIX, len = 32;
+#else
+  uint type = RPKI_IPV4_PREFIX, len = 20;
+#endif
+  byte pdu[32];
+
+  rpki_put_header(p, pdu, type, 0, len);
+  pdu[8] = d->announce ? RPKI_FLAG_ANNOUNCE : 0;
+  pdu[9] = d->pxlen;
+  pdu[10] = d->maxlen;
+  pdu[11] = 0;
+  put_ipa(pdu + 12, d->prefix);
+  put_u32(pdu + 12 + sizeof(ip_addr), d->asn);
+
+  rpki_error(p, code, pdu, len, text);
+}
+
+static void
+rpki_rx_error_report(struct rpki_proto *p, byte *pkt, uint len)
+{
+  uint code = get_u16(pkt + 2);
+  uint pdu_len, text_len;
+  char text[128];
+
+  text[0] = 0;
+  pdu_len = get_u32(pkt + 8);
+  if ((pdu_len <= len - 16) && ((text_len = get_u32(pkt + 12 + pdu_len)) <= len - 16 - pdu_len))
+    {
+      text_len = MIN(text_len, sizeof(text) - 1);
+      memcpy(text, pkt + 16 + pdu_len, text_len);
+      text[text_len] = 0;
+    }
+
+  p->last_error = code;
+  p->stats.errors++;
+
+  if (code == RPKI_ERR_NO_DATA)
+    log(L_WARN "%s: Cache has no data yet", p->p.name);
+  else
+    log(L_ERR "%s: Error from cache: %s%s%s", p->p.name,
+	rpki_error_name(code), text[0] ? ": " : "", text);
+
+  rpki_disconnect(p, p->retry_time);
+}
+
+static void
+rpki_rx_prefix(struct rpki_proto *p, byte *pkt, uint type)
+{
+  uint flags = pkt[8];
+  uint pxlen = pkt[9];
+  uint maxlen = pkt[10];
+  uint bits = (type == RPKI_IPV4_PREFIX) ? 32 : 128;
+  uint len = (type == RPKI_IPV4_PREFIX) ? 20 : 32;
+  ip_addr prefix;
+  u32 asn;
+
+  if ((pxlen > maxlen) || (maxlen > bits))
+    {
+      rpki_error(p, RPKI_ERR_CORRUPT, pkt, len, "Invalid prefix length");
+      return;
+    }
+
+  /* A response to Reset Query starts from no entries at all */
+  if (p->reset && !(flags & RPKI_FLAG_ANNOUNCE))
+    {
+      rpki_error(p, RPKI_ERR_UNKNOWN_WITHDRAW, pkt, len, "Withdrawal in response to Reset Query");
+      return;
+    }
+
+  /* ROA tables hold only prefixes of our address family */
+#ifdef IPV6
+  if (type != RPKI_IPV6_PREFIX)
+#else
+  if (type != RPKI_IPV4_PREFIX)
+#endif
+    {
+      p->stats.ignored++;
+      return;
+    }
+
+  prefix = get_ipa(pkt + 12);
+  asn = get_u32(pkt + 12 + sizeof(ip_addr));
+  prefix = ipa_and(prefix, ipa_mkmask(pxlen));
+
+  rpki_add_delta(p, prefix, pxlen, maxlen, asn, flags & RPKI_FLAG_ANNOUNCE);
+}
+
+static void
+rpki_rx_end_of_data(struct rpki_proto *p, byte *pkt)
+{
+  struct rpki_config *cf = p->cf;
+  uint refresh, retry, expire;
+
+  p->serial = get_u32(pkt + 8);
+
+  /* Version 1 caches suggest their own intervals */
+  if (p->version > 0)
+    {
+      refresh = get_u32(pkt + 12);
+      retry = get_u32(pkt + 16);
+      expire = get_u32(pkt + 20);
+
+      if (!cf->refresh_time && (refresh >= 1) && (refresh <= 86400))
+	p->refresh_time = refresh;
+      if (!cf->retry_time && (retry >= 1) && (retry <= 7200))
+	p->retry_time = retry;
+      if (!cf->expire_time && (expire >= 600) && (expire <= 172800))
+	p->expire_time = expire;
+    }
+
+  rpki_end_of_data(p);
+}
+
+static uint
+rpki_pdu_length(struct rpki_proto *p, uint type)
+{
+  switch (type)
+    {
+    case RPKI_SERIAL_NOTIFY:
+      return 12;
+    case RPKI_CACHE_RESPONSE:
+    case RPKI_CACHE_RESET:
+      return RPKI_HEADER_LENGTH;
+    case RPKI_IPV4_PREFIX:
+      return 20;
+    case RPKI_IPV6_PREFIX:
+      return 32;
+    case RPKI_END_OF_DATA:
+      return p->version ? 24 : 12;
+    default:
+      return 0;				/* Variable length */
+    }
+}
+
+static void
+rpki_rx_pdu(struct rpki_proto *p, byte *pkt, uint len)
+{
+  uint version = pkt[0];
+  uint type = pkt[1];
+  uint session = get_u16(pkt + 2);
+  uint plen;
+
+  p->stats.rx_pdus++;
+  DBG("RPKI: Got PDU type %u, length %u\n", type, len);
+
+  if (version != p->version)
+    {
+      if (p->version_fixed || (version > p->version))
+	{
+	  rpki_error(p, p->version_fixed ? RPKI_ERR_UNEXPECTED_VERSION : RPKI_ERR_VERSION,
+		     pkt, len, "Unexpected version of PDU");
+	  return;
+	}
+
+      /* The cache does not support our version, try again with its own */
+      log(L_INFO "%s: Cache uses protocol version %u", p->p.name, version);
+      p->version = version;
+      if (type == RPKI_ERROR_REPORT)
+	{
+	  rpki_disconnect(p, 0);
+	  return;
+	}
+    }
+
+  if (type == RPKI_ERROR_REPORT)
+    {
+      if (len < 16)
+	rpki_error(p, RPKI_ERR_CORRUPT, pkt, len, "Invalid PDU length");
+      else
+	rpki_rx_error_report(p, pkt, len);
+      return;
+    }
+
+  p->version_fixed = 1;
+
+  plen = rpki_pdu_length(p, type);
+  if (plen && (len != plen))
+    {
+      rpki_error(p, RPKI_ERR_CORRUPT, pkt, len, "Invalid PDU length");
+      return;
+    }
+
+  switch (type)
+    {
+    case RPKI_SERIAL_NOTIFY:
+      RPKI_TRACE(D_PACKETS, "Got Serial Notify (serial %u)", get_u32(pkt + 8));
+      if ((p->state == RPKI_CS_ESTABLISHED) && (get_u32(pkt + 8) != p->serial))
+	rpki_send_query(p);
+      return;
+
+    case RPKI_CACHE_RESPONSE:
+      RPKI_TRACE(D_PACKETS, "Got Cache Response (session %u)", session);
+      if (p->state != RPKI_CS_SYNC)
+	break;
+
+      if (!p->reset && (session != p->session_id))
+	{
+	  /* Serials of the new session are unrelated to ours */
+	  log(L_WARN "%s: Cache session changed", p->p.name);
+	  p->have_data = 0;
+	  rpki_disconnect(p, 0);
+	  return;
+	}
+
+      p->session_id = session;
+      p->state = RPKI_CS_RESPONSE;
+      return;
+
+    case RPKI_IPV4_PREFIX:
+    case RPKI_IPV6_PREFIX:
+      if (p->state != RPKI_CS_RESPONSE)
+	break;
+
+      rpki_rx_prefix(p, pkt, type);
+      return;
+
+    case RPKI_ROUTER_KEY:
+      /* BGPsec router keys are not used */
+      if ((p->version == 0) || (p->state != RPKI_CS_RESPONSE))
+	break;
+      return;
+
+    case RPKI_END_OF_DATA:
+      RPKI_TRACE(D_PACKETS, "Got End of Data (session %u, serial %u)", session, get_u32(pkt + 8));
+      if (p->state != RPKI_CS_RESPONSE)
+	break;
+
+      if (session != p->session_id)
+	{
+	  rpki_error(p, RPKI_ERR_CORRUPT, pkt, len, "Session ID changed in response");
+	  return;
+	}
+
+      rpki_rx_end_of_data(p, pkt);
+      return;
+
+    case RPKI_CACHE_RESET:
+      RPKI_TRACE(D_PACKETS, "Got Cache Reset");
+      if ((p->state != RPKI_CS_SYNC) || p->reset)
+	break;
+
+      rpki_cache_reset(p);
+      return;
+
+    default:
+      rpki_error(p, RPKI_ERR_PDU_TYPE, pkt, len, "Unknown PDU type");
+      return;
+    }
+
+  rpki_error(p, RPKI_ERR_CORRUPT, pkt, len, "Unexpected PDU");
+}
+
+/**
+ * rpki_rx - handle received data
+ * @sk: socket
+ * @size: number of bytes received
+ *
+ * Splits the received data to PDUs and processes them. An incomplete PDU
+ * is moved to the beginning of the buffer and waits for the rest.
+ */
+int
+rpki_rx(sock *sk, int size)
+{
+  struct rpki_proto *p = sk->data;
+  byte *pkt = sk->rbuf;
+  byte *end = pkt + size;
+  uint len;
+
+  while (end >= pkt + RPKI_HEADER_LENGTH)
+    {
+      len = get_u32(pkt + 4);
+      if ((len < RPKI_HEADER_LENGTH) || (len > RPKI_MAX_PDU_LENGTH))
+	{
+	  rpki_error(p, RPKI_ERR_CORRUPT, pkt, RPKI_HEADER_LENGTH, "Invalid PDU length");
+	  return 0;
+	}
+
+      if (end < pkt + len)
+	break;
+
+      rpki_rx_pdu(p, pkt, len);
+
+      /* The socket was closed and freed */
+      if (p->sk != sk)
+	return 0;
+
+      pkt += len;
+    }
+
+  if (pkt != sk->rbuf)
+    {
+      memmove(sk->rbuf, pkt, end - pkt);
+      sk->rpos = sk->rbuf + (end - pkt);
+    }
+
+  return 0;
+}
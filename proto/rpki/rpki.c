@@ -0,0 +1,596 @@
+/*
+ *	BIRD -- The Resource Public Key Infrastructure (RPKI) to Router Protocol
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: RPKI to Router Protocol
+ *
+ * The RPKI protocol implements the router side of the RPKI-RTR protocol
+ * (RFC 6810, RFC 8210). It connects to an RPKI cache, which validates
+ * the RPKI data for us, downloads ROA entries from it and keeps them in a
+ * ROA table, where they are used by roa_check() in filters.
+ *
+ * After the TCP connection is established, a Reset Query asks the cache
+ * for all its entries. Later, Serial Queries ask just for changes since
+ * the serial number of the last update, either periodically when the
+ * refresh timer fires or when the cache announces new data by a Serial
+ * Notify. Entries of a response are collected by rpki_add_delta() and
+ * applied to the ROA table at once by rpki_end_of_data(). A response to
+ * Reset Query is compared with the entries we already have and just the
+ * differences are applied, so a reconnection does not make the ROA table
+ * revalidate routes for entries which have not changed. Dependent routes
+ * are revalidated by the ROA table itself.
+ *
+ * A withdrawal of an entry we do not have is answered by an Error Report
+ * and the connection is closed. The next connection starts with a Reset
+ * Query, which brings entries applied before the error in line with the
+ * cache again.
+ *
+ * Each protocol instance has its own ROA source, so a reset of one cache
+ * does not touch entries of other caches or those added by the CLI. When
+ * the connection fails, the entries are kept until the expire timer
+ * fires, as the cache is likely to come back with the same data.
+ *
+ * Version 1 of the protocol is tried first. When the cache does not
+ * support it, the connection is reopened with version 0. Only the plain
+ * TCP transport is supported, the cache should be run on a trusted
+ * network.
+ */
+
+#undef LOCAL_DEBUG
+
+#include <stdlib.h>
+
+#include "rpki.h"
+
+static u32 rpki_src_map[256 / 32];	/* ROA sources in use */
+
+static byte
+rpki_alloc_src(void)
+{
+  uint i;
+
+  for (i = ROA_SRC_RPKI; i < 256; i++)
+    if (!BIT32_TEST(rpki_src_map, i))
+      {
+	BIT32_SET(rpki_src_map, i);
+	return i;
+      }
+
+  return 0;
+}
+
+static void
+rpki_free_src(byte src)
+{
+  if (src)
+    BIT32_CLR(rpki_src_map, src);
+}
+
+/* NULL if the ROA table was removed by reconfiguration */
+static inline struct roa_table *
+rpki_table(struct rpki_proto *p)
+{
+  return p->cf->roa->table;
+}
+
+static void
+rpki_flush(struct rpki_proto *p)
+{
+  struct roa_table *t = rpki_table(p);
+
+  if (t && p->src)
+    roa_flush(t, p->src);
+
+  p->have_data = 0;
+  p->last_update = 0;
+  tm_stop(p->expire_timer);
+}
+
+static void
+rpki_close(struct rpki_proto *p)
+{
+  rfree(p->sk);
+  p->sk = NULL;
+  p->state = RPKI_CS_IDLE;
+  p->query_pending = 0;
+  p->deltas_count = 0;
+  tm_stop(p->refresh_timer);
+}
+
+/**
+ * rpki_disconnect - close the connection to the cache
+ * @p: RPKI instance
+ * @delay: seconds before the next connection attempt
+ *
+ * Entries received from the cache are kept in the ROA table, until the
+ * expire timer fires or a new connection brings newer data.
+ */
+void
+rpki_disconnect(struct rpki_proto *p, uint delay)
+{
+  rpki_close(p);
+  tm_start(p->retry_timer, delay);
+}
+
+static void
+rpki_connected(sock *sk)
+{
+  struct rpki_proto *p = sk->data;
+
+  RPKI_TRACE(D_EVENTS, "Connected");
+  sk->rx_hook = rpki_rx;
+  sk->tx_hook = rpki_tx;
+  rpki_send_query(p);
+}
+
+static void
+rpki_sock_err(sock *sk, int err)
+{
+  struct rpki_proto *p = sk->data;
+
+  if (err)
+    RPKI_TRACE(D_EVENTS, "Connection lost (%M)", err);
+  else
+    RPKI_TRACE(D_EVENTS, "Connection closed");
+
+  rpki_disconnect(p, p->retry_time);
+}
+
+/**
+ * rpki_connect - open a connection to the cache
+ * @p: RPKI instance
+ */
+void
+rpki_connect(struct rpki_proto *p)
+{
+  sock *s;
+
+  if (p->sk)
+    rpki_close(p);
+
+  s = sk_new(p->p.pool);
+  s->type = SK_TCP_ACTIVE;
+  s->saddr = p->cf->source_addr;
+  s->daddr = p->cf->remote_ip;
+  s->dport = p->cf->remote_port;
+  s->rbsize = RPKI_RX_BUFFER_SIZE;
+  s->tbsize = RPKI_TX_BUFFER_SIZE;
+  s->tos = IP_PREC_INTERNET_CONTROL;
+  s->tx_hook = rpki_connected;
+  s->err_hook = rpki_sock_err;
+  s->data = p;
+
+  p->sk = s;
+  p->state = RPKI_CS_CONNECT;
+  RPKI_TRACE(D_EVENTS, "Connecting to %I port %u", s->daddr, s->dport);
+
+  if (sk_open(s) < 0)
+    {
+      RPKI_TRACE(D_EVENTS, "Cannot open socket");
+      rpki_disconnect(p, p->retry_time);
+      return;
+    }
+
+  /* Also the timeout of the connection and of each response */
+  tm_start(p->retry_timer, p->retry_time);
+}
+
+static void
+rpki_retry_timeout(timer *tm)
+{
+  struct rpki_proto *p = tm->data;
+
+  if (p->state != RPKI_CS_IDLE)
+    RPKI_TRACE(D_EVENTS, "Cache not responding");
+
+  rpki_connect(p);
+}
+
+static void
+rpki_refresh_timeout(timer *tm)
+{
+  struct rpki_proto *p = tm->data;
+
+  if (p->state == RPKI_CS_ESTABLISHED)
+    rpki_send_query(p);
+}
+
+static void
+rpki_expire_timeout(timer *tm)
+{
+  struct rpki_proto *p = tm->data;
+
+  log(L_WARN "%s: Data from cache expired", p->p.name);
+  rpki_flush(p);
+}
+
+/**
+ * rpki_add_delta - queue a change of a ROA entry
+ * @p: RPKI instance
+ * @prefix: prefix of the ROA entry
+ * @pxlen: prefix length of the ROA entry
+ * @maxlen: max length field of the ROA entry
+ * @asn: AS number field of the ROA entry
+ * @announce: 1 for an announcement, 0 for a withdrawal
+ *
+ * The change is applied with others of the same response when the End
+ * of Data PDU arrives.
+ */
+void
+rpki_add_delta(struct rpki_proto *p, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, int announce)
+{
+  struct rpki_delta *d;
+
+  if (p->deltas_count == p->deltas_size)
+    {
+      p->deltas_size = p->deltas_size ? 2 * p->deltas_size : 256;
+      if (p->deltas)
+	p->deltas = mb_realloc(p->deltas, p->deltas_size * sizeof(struct rpki_delta));
+      else
+	p->deltas = mb_alloc(p->p.pool, p->deltas_size * sizeof(struct rpki_delta));
+    }
+
+  d = &p->deltas[p->deltas_count++];
+  d->prefix = prefix;
+  d->pxlen = pxlen;
+  d->maxlen = maxlen;
+  d->asn = asn;
+  d->announce = announce;
+}
+
+static int
+rpki_delta_cmp(const void *x, const void *y)
+{
+  const struct rpki_delta *a = x, *b = y;
+
+  return ipa_compare(a->prefix, b->prefix) ? :
+    ((int) a->pxlen - (int) b->pxlen) ? :
+    ((int) a->maxlen - (int) b->maxlen) ? :
+    ((a->asn > b->asn) - (a->asn < b->asn));
+}
+
+/*
+ * Make entries of @p in @t equal to the announcements of a response to
+ * Reset Query. Entries missing in the response are deleted and the new
+ * ones are added, the others are left alone. Returns the number of the
+ * deleted entries.
+ */
+static uint
+rpki_resync(struct rpki_proto *p, struct roa_table *t)
+{
+  struct rpki_delta *gone = NULL, key;
+  uint i, num = 0, size = 0;
+
+  qsort(p->deltas, p->deltas_count, sizeof(struct rpki_delta), rpki_delta_cmp);
+
+  /* Entries cannot be deleted during the walk */
+  FIB_WALK(&t->fib, fn)
+    {
+      struct roa_node *n = (struct roa_node *) fn;
+      struct roa_item *it;
+
+      for (it = n->items; it; it = it->next)
+	{
+	  if (it->src != p->src)
+	    continue;
+
+	  key = (struct rpki_delta) { .prefix = n->n.prefix, .pxlen = n->n.pxlen,
+				      .maxlen = it->maxlen, .asn = it->asn };
+	  if (bsearch(&key, p->deltas, p->deltas_count, sizeof(struct rpki_delta), rpki_delta_cmp))
+	    continue;
+
+	  if (num == size)
+	    {
+	      size = size ? 2 * size : 64;
+	      if (gone)
+		gone = mb_realloc(gone, size * sizeof(struct rpki_delta));
+	      else
+		gone = mb_alloc(p->p.pool, size * sizeof(struct rpki_delta));
+	    }
+
+	  gone[num++] = key;
+	}
+    }
+  FIB_WALK_END;
+
+  for (i = 0; i < num; i++)
+    roa_delete_item(t, gone[i].prefix, gone[i].pxlen, gone[i].maxlen, gone[i].asn, p->src);
+
+  /* Entries we already have are not added again */
+  for (i = 0; i < p->deltas_count; i++)
+    roa_add_item(t, p->deltas[i].prefix, p->deltas[i].pxlen, p->deltas[i].maxlen,
+		 p->deltas[i].asn, p->src);
+
+  mb_free(gone);
+  return num;
+}
+
+/**
+ * rpki_end_of_data - finish a response of the cache
+ * @p: RPKI instance
+ *
+ * Applies the queued changes to the ROA table. After a Reset Query, the
+ * response replaces all previous entries of @p. A withdrawal of an entry
+ * which is not in the table is reported to the cache and the connection
+ * is closed. Otherwise the instance waits for the next refresh.
+ */
+void
+rpki_end_of_data(struct rpki_proto *p)
+{
+  struct roa_table *t = rpki_table(p);
+  struct rpki_delta *d;
+  uint i, ann = 0, wdr = 0;
+
+  if (p->reset)
+    {
+      /* Withdrawals were refused by rpki_rx_prefix() */
+      ann = p->deltas_count;
+      if (t)
+	wdr = rpki_resync(p, t);
+    }
+  else
+    for (i = 0; i < p->deltas_count; i++)
+      {
+	d = &p->deltas[i];
+
+	if (d->announce)
+	  ann++;
+	else
+	  wdr++;
+
+	if (!t)
+	  continue;
+
+	if (d->announce)
+	  roa_add_item(t, d->prefix, d->pxlen, d->maxlen, d->asn, p->src);
+	else if (!roa_delete_item(t, d->prefix, d->pxlen, d->maxlen, d->asn, p->src))
+	  {
+	    /* Our serial is no longer valid, start again with Reset Query */
+	    p->have_data = 0;
+	    rpki_error_delta(p, RPKI_ERR_UNKNOWN_WITHDRAW, d, "No such record");
+	    return;
+	  }
+      }
+
+  RPKI_TRACE(D_EVENTS, "%s serial %u: %u announced, %u withdrawn",
+	     p->reset ? "Reset to" : "Updated to", p->serial, ann, wdr);
+
+  p->stats.announced += ann;
+  p->stats.withdrawn += wdr;
+
+  /* Do not keep a large array for small updates */
+  p->deltas_count = 0;
+  if (p->deltas_size > 4096)
+    {
+      mb_free(p->deltas);
+      p->deltas = NULL;
+      p->deltas_size = 0;
+    }
+
+  p->reset = 0;
+  p->have_data = 1;
+  p->last_update = now;
+  p->state = RPKI_CS_ESTABLISHED;
+
+  tm_stop(p->retry_timer);
+  tm_start(p->refresh_timer, p->refresh_time);
+  tm_start(p->expire_timer, p->expire_time);
+
+  if (p->p.proto_state == PS_START)
+    proto_notify_state(&p->p, PS_UP);
+}
+
+/**
+ * rpki_cache_reset - handle Cache Reset PDU
+ * @p: RPKI instance
+ *
+ * The cache cannot answer the Serial Query, all entries are requested
+ * again. The current entries stay in the table until the new ones come.
+ */
+void
+rpki_cache_reset(struct rpki_proto *p)
+{
+  RPKI_TRACE(D_EVENTS, "Cache reset");
+  p->have_data = 0;
+  rpki_send_query(p);
+}
+
+static void
+rpki_set_times(struct rpki_proto *p, struct rpki_config *cf)
+{
+  p->refresh_time = cf->refresh_time ?: RPKI_DEFAULT_REFRESH;
+  p->retry_time = cf->retry_time ?: RPKI_DEFAULT_RETRY;
+  p->expire_time = cf->expire_time ?: RPKI_DEFAULT_EXPIRE;
+}
+
+static struct proto *
+rpki_init(struct proto_config *C)
+{
+  struct proto *P = proto_new(C, sizeof(struct rpki_proto));
+  struct rpki_proto *p = (struct rpki_proto *) P;
+
+  p->cf = (struct rpki_config *) C;
+
+  return P;
+}
+
+static int
+rpki_start(struct proto *P)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+
+  p->sk = NULL;
+  p->state = RPKI_CS_IDLE;
+  p->version = RPKI_MAX_VERSION;
+  p->version_fixed = 0;
+  p->have_data = 0;
+  p->reset = 0;
+  p->query_pending = 0;
+  p->last_error = 0xff;
+  p->last_update = 0;
+  p->deltas = NULL;
+  p->deltas_count = p->deltas_size = 0;
+  memset(&p->stats, 0, sizeof(struct rpki_stats));
+  rpki_set_times(p, p->cf);
+
+  p->retry_timer = tm_new_set(P->pool, rpki_retry_timeout, p, 0, 0);
+  p->refresh_timer = tm_new_set(P->pool, rpki_refresh_timeout, p, 0, 0);
+  p->expire_timer = tm_new_set(P->pool, rpki_expire_timeout, p, 0, 0);
+
+  /* Stay idle without a source, entries of others could be touched */
+  p->src = rpki_alloc_src();
+  if (!p->src)
+    {
+      log(L_ERR "%s: Too many RPKI protocols", p->p.name);
+      return PS_START;
+    }
+
+  rpki_connect(p);
+  return PS_START;
+}
+
+static int
+rpki_shutdown(struct proto *P)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+
+  if (p->src)
+    {
+      rpki_flush(p);
+      rpki_free_src(p->src);
+      p->src = 0;
+    }
+
+  /* Socket, timers and the array of changes are freed with the pool */
+  return PS_DOWN;
+}
+
+static void
+rpki_postconfig(struct proto_config *C)
+{
+  struct rpki_config *c = (struct rpki_config *) C;
+
+  /* Do not check templates at all */
+  if (c->c.class == SYM_TEMPLATE)
+    return;
+
+  if (!c->roa)
+    {
+      if (EMPTY_LIST(new_config->roa_tables))
+	cf_error("ROA table not specified");
+      c->roa = HEAD(new_config->roa_tables);
+    }
+
+  if (ipa_zero(c->remote_ip))
+    cf_error("Cache address not specified");
+
+  if (c->expire_time && (c->expire_time < c->refresh_time))
+    cf_error("Expire time must not be shorter than refresh time");
+}
+
+static int
+rpki_reconfigure(struct proto *P, struct proto_config *C)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+  struct rpki_config *old = p->cf;
+  struct rpki_config *new = (struct rpki_config *) C;
+
+  if (!ipa_equal(old->remote_ip, new->remote_ip) ||
+      !ipa_equal(old->source_addr, new->source_addr) ||
+      (old->remote_port != new->remote_port) ||
+      (old->roa->table != new->roa->table) || !new->roa->table)
+    return 0;
+
+  p->cf = new;
+  rpki_set_times(p, new);
+
+  if (tm_active(p->refresh_timer))
+    tm_start(p->refresh_timer, p->refresh_time);
+
+  return 1;
+}
+
+static void
+rpki_copy_config(struct proto_config *dest, struct proto_config *src)
+{
+  /* Just a shallow copy */
+  proto_copy_rest(dest, src, sizeof(struct rpki_config));
+}
+
+static const char *rpki_state_names[] = {
+  [RPKI_CS_IDLE] = "Idle",
+  [RPKI_CS_CONNECT] = "Connect",
+  [RPKI_CS_SYNC] = "Sync",
+  [RPKI_CS_RESPONSE] = "Sync",
+  [RPKI_CS_ESTABLISHED] = "Established"
+};
+
+static void
+rpki_get_status(struct proto *P, byte *buf)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+
+  if (P->proto_state == PS_DOWN)
+    buf[0] = 0;
+  else if ((p->state != RPKI_CS_ESTABLISHED) && (p->last_error != 0xff))
+    bsprintf(buf, "%-14s%s", rpki_state_names[p->state], rpki_error_name(p->last_error));
+  else
+    bsprintf(buf, "%s", rpki_state_names[p->state]);
+}
+
+static void
+rpki_show_proto_info(struct proto *P)
+{
+  struct rpki_proto *p = (struct rpki_proto *) P;
+  struct rpki_stats *s = &p->stats;
+
+  proto_show_basic_info(P);
+
+  cli_msg(-1006, "  Cache:            %I port %u", p->cf->remote_ip, p->cf->remote_port);
+  cli_msg(-1006, "  ROA table:        %s", p->cf->roa->name);
+
+  if (P->proto_state == PS_DOWN)
+    return;
+
+  cli_msg(-1006, "  Cache state:      %s", rpki_state_names[p->state]);
+  cli_msg(-1006, "  Protocol version: %u", p->version);
+
+  if (p->have_data)
+    {
+      cli_msg(-1006, "  Session ID:       %u", p->session_id);
+      cli_msg(-1006, "  Serial number:    %u", p->serial);
+      cli_msg(-1006, "  Last update:      %d s ago", (int) (now - p->last_update));
+    }
+
+  if (tm_active(p->refresh_timer))
+    cli_msg(-1006, "  Refresh timer:    %d/%u", (int) (p->refresh_timer->expires - now), p->refresh_time);
+  if (tm_active(p->retry_timer))
+    cli_msg(-1006, "  Retry timer:      %d/%u", (int) (p->retry_timer->expires - now), p->retry_time);
+  if (tm_active(p->expire_timer))
+    cli_msg(-1006, "  Expire timer:     %d/%u", (int) (p->expire_timer->expires - now), p->expire_time);
+
+  cli_msg(-1006, "  Statistics:       %u received, %u sent PDUs", s->rx_pdus, s->tx_pdus);
+  cli_msg(-1006, "                    %u reset, %u serial queries", s->reset_queries, s->serial_queries);
+  cli_msg(-1006, "                    %u announced, %u withdrawn, %u ignored entries",
+	  s->announced, s->withdrawn, s->ignored);
+
+  if (p->last_error != 0xff)
+    cli_msg(-1006, "  Last error:       %s", rpki_error_name(p->last_error));
+}
+
+struct protocol proto_rpki = {
+  .name =		"RPKI",
+  .template =		"rpki%d",
+  .config_size =	sizeof(struct rpki_config),
+  .postconfig =		rpki_postconfig,
+  .init =		rpki_init,
+  .start =		rpki_start,
+  .shutdown =		rpki_shutdown,
+  .reconfigure =	rpki_reconfigure,
+  .copy_config =	rpki_copy_config,
+  .get_status =		rpki_get_status,
+  .show_proto_info =	rpki_show_proto_info
+};
@@ -0,0 +1,150 @@
+/*
+ *	BIRD -- The Resource Public Key Infrastructure (RPKI) to Router Protocol
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_RPKI_H_
+#define _BIRD_RPKI_H_
+
+#include "nest/bird.h"
+
+#include "lib/ip.h"
+#include "lib/lists.h"
+#include "lib/socket.h"
+#include "lib/timer.h"
+#include "lib/resource.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "nest/cli.h"
+#include "conf/conf.h"
+#include "lib/string.h"
+
+#define RPKI_PORT		323
+#define RPKI_MAX_VERSION	1	/* RFC 8210 */
+
+#define RPKI_DEFAULT_REFRESH	3600
+#define RPKI_DEFAULT_RETRY	600
+#define RPKI_DEFAULT_EXPIRE	7200
+
+#define RPKI_RX_BUFFER_SIZE	4096
+#define RPKI_TX_BUFFER_SIZE	1024
+
+/* PDU types */
+#define RPKI_SERIAL_NOTIFY	0
+#define RPKI_SERIAL_QUERY	1
+#define RPKI_RESET_QUERY	2
+#define RPKI_CACHE_RESPONSE	3
+#define RPKI_IPV4_PREFIX	4
+#define RPKI_IPV6_PREFIX	6
+#define RPKI_END_OF_DATA	7
+#define RPKI_CACHE_RESET	8
+#define RPKI_ROUTER_KEY		9
+#define RPKI_ERROR_REPORT	10
+
+#define RPKI_HEADER_LENGTH	8
+#define RPKI_MAX_PDU_LENGTH	RPKI_RX_BUFFER_SIZE
+
+/* Error codes of Error Report PDU */
+#define RPKI_ERR_CORRUPT	0
+#define RPKI_ERR_INTERNAL	1
+#define RPKI_ERR_NO_DATA	2
+#define RPKI_ERR_INVALID	3
+#define RPKI_ERR_VERSION	4
+#define RPKI_ERR_PDU_TYPE	5
+#define RPKI_ERR_UNKNOWN_WITHDRAW 6
+#define RPKI_ERR_DUP_ANNOUNCE	7
+#define RPKI_ERR_UNEXPECTED_VERSION 8
+
+/* Flags of prefix PDUs */
+#define RPKI_FLAG_ANNOUNCE	1
+
+/* Cache connection states */
+#define RPKI_CS_IDLE		0	/* Waiting before the next connection attempt */
+#define RPKI_CS_CONNECT		1	/* Connection being established */
+#define RPKI_CS_SYNC		2	/* Query sent, waiting for Cache Response */
+#define RPKI_CS_RESPONSE	3	/* Receiving data of the response */
+#define RPKI_CS_ESTABLISHED	4	/* Synchronized, waiting for refresh */
+
+struct rpki_config {
+  struct proto_config c;
+  struct roa_table_config *roa;		/* ROA table to be filled */
+  ip_addr remote_ip;			/* Address of the cache */
+  ip_addr source_addr;			/* Local address, or IPA_NONE */
+  uint remote_port;
+  uint refresh_time;			/* Intervals, 0 if given by the cache */
+  uint retry_time;
+  uint expire_time;
+};
+
+struct rpki_delta {
+  ip_addr prefix;
+  u32 asn;
+  byte pxlen;
+  byte maxlen;
+  byte announce;
+};
+
+struct rpki_stats {
+  u32 rx_pdus;				/* Received PDUs */
+  u32 tx_pdus;				/* Sent PDUs */
+  u32 announced;			/* ROA entries announced by the cache */
+  u32 withdrawn;			/* ROA entries withdrawn by the cache */
+  u32 ignored;				/* Entries of other address family */
+  u32 reset_queries;
+  u32 serial_queries;
+  u32 errors;				/* Error reports received */
+};
+
+struct rpki_proto {
+  struct proto p;
+  struct rpki_config *cf;
+  sock *sk;
+  timer *retry_timer;			/* Next connection attempt */
+  timer *refresh_timer;			/* Next Serial Query */
+  timer *expire_timer;			/* Data of the cache become stale */
+
+  byte state;				/* Cache connection state, RPKI_CS_* */
+  byte version;				/* Protocol version used */
+  byte version_fixed;			/* Version was agreed with the cache */
+  byte src;				/* Source of our ROA entries (ROA_SRC_*) */
+  byte have_data;			/* Session ID and serial are valid */
+  byte reset;				/* Current response replaces all entries */
+  byte query_pending;			/* Query waits for the TX buffer */
+  byte last_error;			/* Last error code sent or received, or 0xff */
+
+  u16 session_id;
+  u32 serial;
+  uint refresh_time;			/* Intervals in use */
+  uint retry_time;
+  uint expire_time;
+  bird_clock_t last_update;		/* Last End of Data, or 0 */
+
+  struct rpki_delta *deltas;		/* Entries of the current response */
+  uint deltas_count;
+  uint deltas_size;
+
+  struct rpki_stats stats;
+};
+
+#define RPKI_TRACE(flags, msg, args...) do { if (p->p.debug & flags) \
+	log(L_TRACE "%s: " msg, p->p.name , ## args ); } while(0)
+
+
+/* rpki.c */
+extern struct protocol proto_rpki;
+
+void rpki_connect(struct rpki_proto *p);
+void rpki_disconnect(struct rpki_proto *p, uint delay);
+void rpki_add_delta(struct rpki_proto *p, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, int announce);
+void rpki_end_of_data(struct rpki_proto *p);
+void rpki_cache_reset(struct rpki_proto *p);
+
+/* packets.c */
+int rpki_rx(sock *sk, int size);
+void rpki_tx(sock *sk);
+void rpki_send_query(struct rpki_proto *p);
+void rpki_error_delta(struct rpki_proto *p, uint code, struct rpki_delta *d, const char *text);
+const char *rpki_error_name(uint code);
+
+#endif
@@ -0,0 +1,292 @@
+/*
+ *	BIRD -- Tests of the RPKI to Router Protocol
+ *
+ *	Run by `make check'. A minimal cache listens on a loopback port and
+ *	answers the queries of an RPKI instance with prepared responses.
+ *	Checks incremental updates, the Error Report for a withdrawal of an
+ *	unknown entry and that a reconnection changes only entries which
+ *	differ from those kept.
+ */
+
+#include "rpki.h"
+#include "lib/unaligned.h"
+#include "sysdep/unix/unix.h"
+#include "lib/test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SESSION 42
+
+static struct config cfg;
+static struct roa_table_config roa_cf = { .name = "rpki" };
+static struct rpki_config rpki_cf;
+static struct rpki_proto proto;
+static struct roa_table *roa;
+static int listen_fd;
+
+/*
+ *	The cache
+ */
+
+static byte pdus[1024];
+static uint pdus_len;
+
+static void
+put_header(uint type, uint session, uint len)
+{
+  byte *pos = pdus + pdus_len;
+
+  pos[0] = RPKI_MAX_VERSION;
+  pos[1] = type;
+  put_u16(pos + 2, session);
+  put_u32(pos + 4, len);
+  pdus_len += len;
+}
+
+static void
+put_prefix(int announce, u32 prefix, uint pxlen, uint maxlen, u32 asn)
+{
+#ifdef IPV6
+  uint type = RPKI_IPV6_PREFIX, len = 32;
+#else
+  uint type = RPKI_IPV4_PREFIX, len = 20;
+#endif
+  byte *pos = pdus + pdus_len;
+
+  put_header(type, 0, len);
+  pos[8] = announce ? RPKI_FLAG_ANNOUNCE : 0;
+  pos[9] = pxlen;
+  pos[10] = maxlen;
+  pos[11] = 0;
+  put_ipa(pos + 12, ipa_from_u32(prefix));
+  put_u32(pos + 12 + sizeof(ip_addr), asn);
+}
+
+static void
+put_end_of_data(u32 serial)
+{
+  byte *pos = pdus + pdus_len;
+
+  put_header(RPKI_END_OF_DATA, SESSION, 24);
+  put_u32(pos + 8, serial);
+  put_u32(pos + 12, 3600);
+  put_u32(pos + 16, 600);
+  put_u32(pos + 20, 7200);
+}
+
+/* Reads one PDU sent by the router, returns its type */
+static int
+cache_read(int fd, byte *pdu)
+{
+  uint len;
+
+  if ((read(fd, pdu, RPKI_HEADER_LENGTH) != RPKI_HEADER_LENGTH) ||
+      ((len = get_u32(pdu + 4)) < RPKI_HEADER_LENGTH) || (len > 256) ||
+      (read(fd, pdu + RPKI_HEADER_LENGTH, len - RPKI_HEADER_LENGTH) != (int) (len - RPKI_HEADER_LENGTH)))
+    return -1;
+
+  return pdu[1];
+}
+
+/* Sends the prepared PDUs and lets the router receive them, as sk_read() does */
+static void
+cache_send(int fd)
+{
+  sock *sk = proto.sk;
+  int n;
+
+  CHECK(write(fd, pdus, pdus_len) == (int) pdus_len);
+  pdus_len = 0;
+
+  n = read(sk->fd, sk->rpos, sk->rbuf + sk->rbsize - sk->rpos);
+  CHECK(n > 0);
+  if (n > 0)
+    {
+      sk->rpos += n;
+      sk->rx_hook(sk, sk->rpos - sk->rbuf);
+    }
+}
+
+/* Accepts the connection of the router and finishes it like sk_tcp_connected() */
+static int
+cache_accept(void)
+{
+  sock *sk;
+  int fd;
+
+  fd = accept(listen_fd, NULL, NULL);
+  CHECK(fd >= 0);
+
+  sk = proto.sk;
+  sk->type = SK_TCP;
+  sk->rbuf = sk->rbuf_alloc = xmalloc(sk->rbsize);
+  sk->tbuf = sk->tbuf_alloc = xmalloc(sk->tbsize);
+  sk->rpos = sk->rbuf;
+  sk->tpos = sk->ttx = sk->tbuf;
+  sk->tx_hook(sk);
+
+  return fd;
+}
+
+/*
+ *	Checks of the ROA table
+ */
+
+static int
+has(u32 prefix, uint pxlen, uint maxlen, u32 asn)
+{
+  struct roa_node *n = fib_find(&roa->fib, &(ip_addr) { ipa_from_u32(prefix) }, pxlen);
+  struct roa_item *it;
+
+  for (it = n ? n->items : NULL; it; it = it->next)
+    if ((it->maxlen == maxlen) && (it->asn == asn) && (it->src == proto.src))
+      return 1;
+
+  return 0;
+}
+
+/* Number of ROA changes since the last call */
+static uint
+changes(void)
+{
+  uint n = roa->changes_count;
+
+  while (!EMPTY_LIST(global_event_list))
+    ev_run_list(&global_event_list);
+
+  return n;
+}
+
+static void
+t_rpki(void)
+{
+  byte pdu[256];
+  int fd;
+
+  /* Reset Query gets all entries */
+  fd = cache_accept();
+  CHECK(cache_read(fd, pdu) == RPKI_RESET_QUERY);
+
+  put_header(RPKI_CACHE_RESPONSE, SESSION, RPKI_HEADER_LENGTH);
+  put_prefix(1, 0x0a010000, 16, 24, 65001);
+  put_prefix(1, 0x0a020000, 16, 24, 65002);
+  put_prefix(1, 0x0a030000, 16, 16, 65003);
+  put_end_of_data(1);
+  cache_send(fd);
+
+  CHECK(proto.state == RPKI_CS_ESTABLISHED);
+  CHECK(has(0x0a010000, 16, 24, 65001) && has(0x0a020000, 16, 24, 65002) && has(0x0a030000, 16, 16, 65003));
+  CHECK(changes() == 3);
+
+  /* Serial Query gets changes */
+  rpki_send_query(&proto);
+  CHECK(cache_read(fd, pdu) == RPKI_SERIAL_QUERY);
+  CHECK(get_u32(pdu + 8) == 1);
+
+  put_header(RPKI_CACHE_RESPONSE, SESSION, RPKI_HEADER_LENGTH);
+  put_prefix(0, 0x0a010000, 16, 24, 65001);
+  put_prefix(1, 0x0a040000, 16, 24, 65004);
+  put_end_of_data(2);
+  cache_send(fd);
+
+  CHECK(!has(0x0a010000, 16, 24, 65001) && has(0x0a040000, 16, 24, 65004));
+  CHECK(changes() == 2);
+
+  /* Withdrawal of an unknown entry is reported and the session dropped */
+  rpki_send_query(&proto);
+  CHECK(cache_read(fd, pdu) == RPKI_SERIAL_QUERY);
+
+  put_header(RPKI_CACHE_RESPONSE, SESSION, RPKI_HEADER_LENGTH);
+  put_prefix(0, 0x0a050000, 16, 24, 65005);
+  put_end_of_data(3);
+  cache_send(fd);
+
+  CHECK(cache_read(fd, pdu) == RPKI_ERROR_REPORT);
+  CHECK(get_u16(pdu + 2) == RPKI_ERR_UNKNOWN_WITHDRAW);
+  CHECK(get_u32(pdu + 8) == get_u32(pdu + RPKI_HEADER_LENGTH + 4 + 4));
+  CHECK((proto.sk == NULL) && !proto.have_data);
+  CHECK(has(0x0a020000, 16, 24, 65002));
+  close(fd);
+
+  /* After reconnection, just the differences are applied */
+  rpki_connect(&proto);
+  fd = cache_accept();
+  CHECK(cache_read(fd, pdu) == RPKI_RESET_QUERY);
+
+  put_header(RPKI_CACHE_RESPONSE, SESSION, RPKI_HEADER_LENGTH);
+  put_prefix(1, 0x0a020000, 16, 24, 65002);
+  put_prefix(1, 0x0a040000, 16, 24, 65004);
+  put_prefix(1, 0x0a060000, 16, 24, 65006);
+  put_end_of_data(4);
+  cache_send(fd);
+
+  CHECK(proto.state == RPKI_CS_ESTABLISHED);
+  CHECK(has(0x0a020000, 16, 24, 65002) && has(0x0a040000, 16, 24, 65004) && has(0x0a060000, 16, 24, 65006));
+  CHECK(!has(0x0a030000, 16, 16, 65003));
+  CHECK(roa->items == 3);
+  CHECK(changes() == 2);
+
+  /* Withdrawals in a response to Reset Query are refused */
+  proto.have_data = 0;
+  rpki_send_query(&proto);
+  CHECK(cache_read(fd, pdu) == RPKI_RESET_QUERY);
+
+  put_header(RPKI_CACHE_RESPONSE, SESSION, RPKI_HEADER_LENGTH);
+  put_prefix(0, 0x0a020000, 16, 24, 65002);
+  cache_send(fd);
+
+  CHECK(cache_read(fd, pdu) == RPKI_ERROR_REPORT);
+  CHECK(get_u16(pdu + 2) == RPKI_ERR_UNKNOWN_WITHDRAW);
+  CHECK(proto.sk == NULL);
+  CHECK(roa->items == 3);
+  close(fd);
+}
+
+int
+main(int argc UNUSED, char **argv)
+{
+  struct sockaddr_in sin = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  socklen_t sin_len = sizeof(sin);
+
+  test_init();
+  roa_init();
+  protos_build();
+
+  config = new_config = &cfg;
+  cfg_mem = lp_new(&root_pool, 4080);
+
+  roa_preconfig(&cfg);
+  add_tail(&cfg.roa_tables, &roa_cf.n);
+  roa_commit(&cfg, NULL);
+  roa = roa_cf.table;
+
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if ((listen_fd < 0) || (bind(listen_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) ||
+      (listen(listen_fd, 1) < 0) || (getsockname(listen_fd, (struct sockaddr *) &sin, &sin_len) < 0))
+    {
+      /* No loopback to listen on, nothing to test */
+      printf("%s: OK, skipped\n", argv[0]);
+      return 0;
+    }
+
+  rpki_cf.c.protocol = &proto_rpki;
+  rpki_cf.roa = &roa_cf;
+  rpki_cf.remote_ip = ipa_from_u32(INADDR_LOOPBACK);
+  rpki_cf.remote_port = ntohs(sin.sin_port);
+
+  proto.p.name = "rpki";
+  proto.p.proto = &proto_rpki;
+  proto.p.pool = rp_new(&root_pool, "RPKI");
+  proto.cf = &rpki_cf;
+  proto_rpki.start(&proto.p);
+  proto.p.proto_state = PS_UP;
+
+  t_rpki();
+
+  return test_done(argv[0]);
+}
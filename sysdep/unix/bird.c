@@ -0,0 +1,19 @@
+/*
+ *	BIRD Internet Routing Daemon -- Unix Entry Point
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/*
+ *	Kept apart from main.c, so test programs linked with the daemon
+ *	bring their own main() and this one is not taken from the library.
+ */
+
+#include "nest/bird.h"
+#include "unix.h"
+
+int
+main(int argc, char **argv)
+{
+  return unix_main(argc, argv);
+}
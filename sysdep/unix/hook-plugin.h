@@ -0,0 +1,86 @@
+/*
+ * hook-plugin.h
+ *
+ * Interface of in-process hook plugins. A hook configured as
+ *
+ *	hook <event> plugin "/path/lib.so" symbol "fn";
+ *
+ * loads the shared object once and calls
+ *
+ *	int fn (const struct hook_plugin_event *ev);
+ *
+ * in the daemon's main loop for every event instead of running a
+ * program. The function returns the HOOK_STATUS_* bits a script would
+ * return as its exit code (0 to accept, 2 to reject, 4 to request a
+ * reconfiguration). It must not block and must not keep any pointer
+ * from @ev after it returns, the event only lives during the call.
+ *
+ * This file does not depend on any other BIRD header, so that plugins
+ * can be built outside of the tree. Addresses are in network byte order,
+ * IPv4 addresses take the first four bytes.
+ */
+
+#ifndef SYSDEP_UNIX_HOOK_PLUGIN_H_
+#define SYSDEP_UNIX_HOOK_PLUGIN_H_
+
+#include <stdint.h>
+
+#define HOOK_PLUGIN_ABI		1	/* Bumped on any incompatible change */
+
+#define HOOK_PLUGIN_AF_IPV4	4
+#define HOOK_PLUGIN_AF_IPV6	6
+
+/* State of a BGP protocol, the variables set by bgp_build_hook_envvars() */
+struct hook_plugin_bgp
+{
+  uint8_t af;			/* HOOK_PLUGIN_AF_* of the addresses */
+  uint8_t remote_ip[16];	/* REMOTE_IP */
+  uint8_t source_ip[16];	/* CFG_SOURCE_IP */
+  uint16_t remote_port;		/* REMOTE_PORT */
+  uint32_t remote_as;		/* REMOTE_AS */
+  uint32_t local_id;		/* LOCAL_ID */
+  uint32_t remote_id;		/* REMOTE_ID */
+  uint32_t last_error_code;	/* LAST_ERROR_CODE */
+  uint32_t startup_delay;	/* STARTUP_DELAY */
+  uint8_t last_error_class;	/* LAST_ERROR_CLASS */
+  uint8_t proto_state;		/* PROTO_STATE */
+  uint8_t core_state;		/* CORE_STATE */
+  uint8_t start_state;		/* START_STATE */
+  uint8_t load_state;		/* LOAD_STATE */
+  uint8_t feed_state;		/* FEED_STATE */
+  uint8_t down_code;		/* DOWN_CODE */
+  uint8_t is_internal;		/* IS_INTERNAL */
+  uint8_t as4_session;		/* AS4_SESSION */
+  uint8_t gr_ready;		/* GR_READY */
+  uint8_t gr_active;		/* GR_ACTIVE */
+  uint8_t rr_client;		/* RR_CLIENT */
+  uint8_t rs_client;		/* RS_CLIENT */
+};
+
+/* A route, for the route update, withdraw, import and export hooks */
+struct hook_plugin_route
+{
+  uint8_t prefix[16];		/* PREFIX */
+  uint8_t pxlen;		/* PREFIX_LEN */
+  uint8_t has_attrs;		/* Zero for withdrawals, the rest is unset then */
+  uint32_t path_id;		/* PATH_ID */
+  uint8_t next_hop[16];		/* BGP_NEXT_HOP */
+  uint8_t from[16];		/* BGP_FROM */
+  const uint8_t *as_path;	/* BGP_PATH, AS_PATH attribute with 4-byte ASNs */
+  uint32_t as_path_len;
+};
+
+struct hook_plugin_event
+{
+  uint32_t abi;			/* HOOK_PLUGIN_ABI */
+  uint32_t index;		/* EVENT_INDEX */
+  const char *event;		/* EVENT */
+  const char *protocol;		/* Protocol name, "global" for global hooks */
+  const struct hook_plugin_bgp *bgp;		/* NULL for global hooks */
+  const struct hook_plugin_route *route;	/* NULL unless a route event */
+};
+
+typedef int
+(*hook_plugin_fn) (const struct hook_plugin_event *ev);
+
+#endif /* SYSDEP_UNIX_HOOK_PLUGIN_H_ */
@@ -7,6 +7,10 @@
 
 #include "nest/bird.h"
 #include "nest/protocol.h"
+#include "lib/socket.h"
+#include "lib/timer.h"
+#include "lib/bitops.h"
+#include "nest/cli.h"
 
 #include "sysdep/unix/unix.h"
 #include "sysdep/unix/hook.h"
@@ -14,92 +18,1207 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+extern char **environ;
+
 static const char *hook_strings[MAX_HOOKS] =
   { [HOOK_CONN_INBOUND_UNEXPECTED ] = "HOOK_CONN_INBOUND_UNEXPECTED", [HOOK_LOAD
       ] = "HOOK_LOAD", [HOOK_POST_CONFIGURE] = "HOOK_POST_CONFIGURE",
       [HOOK_PRE_CONFIGURE] = "HOOK_PRE_CONFIGURE", [HOOK_SHUTDOWN
 	  ] = "HOOK_SHUTDOWN" };
 
-static int
-prep_for_exec (void)
+/*
+ *	Hook environment
+ *
+ * Variables for a hook invocation are collected in an arena reused by
+ * all invocations, the daemon's own environment is never modified. The
+ * child gets them through execve(), followed by the variables set by
+ * hook_setenv_conf_generic() and then the inherited environment, so the
+ * event variables take precedence.
+ */
+
+struct hook_env
+{
+  char *buf;			/* NUL-terminated KEY=VALUE strings */
+  uint len, size;
+  uint count;			/* Number of strings in buf */
+};
+
+static struct hook_env hook_env_event;	/* Variables of the current event */
+static struct hook_env hook_env_conf;	/* Configuration variables */
+static struct hook_env *hook_env_cur = &hook_env_event;
+
+static char **hook_envp;
+static uint hook_envp_size;
+
+static void
+hook_env_add (struct hook_env *env, const char *name, const char *value)
+{
+  uint nl = strlen (name), vl = strlen (value), l = nl + vl + 2;
+
+  if (env->len + l > env->size)
+    {
+      env->size = MAX(env->len + l, MAX(2 * env->size, 4096));
+      env->buf = xrealloc (env->buf, env->size);
+    }
+
+  char *pos = env->buf + env->len;
+  memcpy (pos, name, nl);
+  pos[nl] = '=';
+  memcpy (pos + nl + 1, value, vl + 1);
+
+  env->len += l;
+  env->count++;
+}
+
+static inline void
+hook_env_flush (struct hook_env *env)
+{
+  env->len = 0;
+  env->count = 0;
+}
+
+void
+hook_setenv (const char *name, const char *value)
+{
+  hook_env_add (hook_env_cur, name, value);
+}
+
+static char **
+hook_env_fill (struct hook_env *env, char **v)
+{
+  char *pos = env->buf, *end = env->buf + env->len;
+
+  while (pos < end)
+    {
+      *v++ = pos;
+      pos += strlen (pos) + 1;
+    }
+
+  return v;
+}
+
+/*
+ * Builds the envp vector passed to execve() from the event variables in
+ * @event, if any, and the base environment.
+ */
+static char **
+hook_env_vector (struct hook_env *event)
+{
+  uint n = (event ? event->count : 0) + hook_env_conf.count + 1;
+  char **e, **v;
+
+  for (e = environ; *e != NULL; e++)
+    n++;
+
+  if (n > hook_envp_size)
+    {
+      hook_envp_size = MAX(n, 2 * hook_envp_size);
+      hook_envp = xrealloc (hook_envp, hook_envp_size * sizeof(char *));
+    }
+
+  v = hook_envp;
+
+  if (event)
+    v = hook_env_fill (event, v);
+
+  v = hook_env_fill (&hook_env_conf, v);
+
+  for (e = environ; *e != NULL; e++)
+    *v++ = *e;
+
+  *v = NULL;
+
+  return hook_envp;
+}
+
+/* Collects the variables of event @index */
+static void
+hook_env_build (u32 index, struct hook_execv_data *data)
+{
+  hook_env_flush (&hook_env_event);
+
+  if (data->pre != NULL)
+    data->pre (index, data->data);
+
+  if (data->add != NULL)
+    data->add (index, data->add_data);
+}
+
+/*
+ *	Hook statistics
+ */
+
+static inline btime
+hook_clock (void)
+{
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) < 0)
+    return 0;
+
+  return ((btime) ts.tv_sec S) + (ts.tv_nsec / 1000);
+}
+
+static void
+hook_stats_spawn (struct hook_stats *s, btime t)
+{
+  if (s == NULL)
+    return;
+
+  s->spawns++;
+  s->spawn_time += t;
+  s->spawn_max = MAX(s->spawn_max, t);
+}
+
+/* Records the exit code (or reply status) of a hook, @t is its wall time if known */
+static void
+hook_stats_exit (struct hook_stats *s, int status, btime t)
+{
+  if (s == NULL)
+    return;
+
+  s->exits[((uint) status < HOOK_STATS_EXITS - 1) ? status : HOOK_STATS_EXITS - 1]++;
+
+  if (t < 0)
+    return;
+
+  u32 ms = MIN(t TO_MS, 0xffffffff);
+  uint b = ms ? MIN(u32_log2 (ms) + 1, HOOK_STATS_HIST - 1) : 0;
+
+  s->completions++;
+  s->wall_time += t;
+  s->wall_max = MAX(s->wall_max, t);
+  s->hist[b]++;
+}
+
+static void
+hook_check_status (int r, u32 flags, const char *protocol,
+		   const char *hook_string)
+{
+  if ((r & HOOK_STATUS_RECONFIGURE) && !(flags & HOOK_F_NORECONF))
+    {
+      log (L_DEBUG "%s: %s: external process requesting reconfigure..",
+	   protocol, hook_string);
+      async_config ();
+    }
+}
+
+/*
+ *	Hook processes
+ *
+ * Hook programs are started with posix_spawn(), which does not copy the
+ * page tables of the daemon the way fork() does. At most `hook limit'
+ * asynchronous hooks run at once, further invocations wait in a queue of
+ * at most `hook queue' entries. An asynchronous hook configured with
+ * `rate <n>' drops its invocations above n per second. Finished children
+ * are reaped from the main loop, woken up by SIGCHLD through a pipe.
+ */
+
+struct hook_child
+{
+  node n;
+  pid_t pid;
+  const char *hook_string;
+  struct hook_stats *stats;
+  btime started;
+  timer *kill_timer;		/* Stopped worker, killed if it does not exit */
+  char protocol[0];
+};
+
+struct hook_queued
+{
+  node n;
+  char *exec;
+  char *protocol;
+  const char *hook_string;
+  struct hook_stats *stats;
+  struct hook_env env;		/* Copy of the event variables */
+};
+
+static pool *hook_pool;
+static list hook_worker_list;
+static list hook_child_list;	/* Running asynchronous hooks */
+static list hook_queue;		/* Asynchronous hooks waiting to run */
+static uint hook_child_count, hook_queue_count;
+static int hook_sigchld_fd[2] =
+  { -1, -1 };
+
+static struct tbf hook_rl_drop = TBF_DEFAULT_LOG_LIMITS;
+
+static void hook_reap (void);
+
+static void
+hook_sigchld (int sig UNUSED)
+{
+  int e = errno;
+
+  if (write (hook_sigchld_fd[1], "", 1) < 0)
+    ;
+
+  errno = e;
+}
+
+static int
+hook_sigchld_rx (sock *sk, int size UNUSED)
+{
+  byte buf[64];
+
+  while (read (sk->fd, buf, sizeof(buf)) > 0)
+    ;
+
+  hook_reap ();
+  return 0;
+}
+
+static void
+hook_init (void)
+{
+  struct sigaction sa;
+
+  if (hook_pool != NULL)
+    return;
+
+  hook_pool = rp_new (&root_pool, "Hooks");
+  init_list (&hook_worker_list);
+  init_list (&hook_child_list);
+  init_list (&hook_queue);
+
+  if (pipe (hook_sigchld_fd) < 0)
+    {
+      ERRNO_PRINT("%s: pipe failed [%s]", "hook")
+      return;
+    }
+
+  int i;
+  for (i = 0; i < 2; i++)
+    {
+      fcntl (hook_sigchld_fd[i], F_SETFD, FD_CLOEXEC);
+      fcntl (hook_sigchld_fd[i], F_SETFL, O_NONBLOCK);
+    }
+
+  sock *sk = sk_new (hook_pool);
+  sk->type = SK_MAGIC;
+  sk->rx_hook = hook_sigchld_rx;
+  sk->fd = hook_sigchld_fd[0];
+
+  if (sk_open (sk) < 0)
+    {
+      log (L_ERR "hook: cannot register SIGCHLD pipe");
+      rfree (sk);
+      return;
+    }
+
+  memset (&sa, 0, sizeof(sa));
+  sa.sa_handler = hook_sigchld;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction (SIGCHLD, &sa, NULL);
+}
+
+static inline uint
+hook_proc_limit (void)
+{
+  return config ? config->hook_proc_limit : HOOK_PROC_LIMIT;
+}
+
+static inline uint
+hook_queue_limit (void)
+{
+  return config ? config->hook_queue_limit : HOOK_QUEUE_LIMIT;
+}
+
+/*
+ * Starts @exec with stdin redirected from /dev/null (or to @fd, also
+ * used as stdout, if not negative). Returns the pid or -1 with errno set.
+ */
+static pid_t
+hook_spawn (const char *exec, char **argv, char **envp, int fd)
+{
+  posix_spawn_file_actions_t fa;
+  pid_t pid;
+  int e;
+
+  const char *argv0[] =
+    { [0] = exec, [1] = NULL };
+
+  if (argv == NULL)
+    argv = (char **) argv0;
+
+  posix_spawn_file_actions_init (&fa);
+
+  if (fd < 0)
+    posix_spawn_file_actions_addopen (&fa, STDIN_FILENO, "/dev/null",
+				      O_RDONLY, 0);
+  else
+    {
+      posix_spawn_file_actions_adddup2 (&fa, fd, STDIN_FILENO);
+      posix_spawn_file_actions_adddup2 (&fa, fd, STDOUT_FILENO);
+    }
+
+  e = posix_spawn (&pid, exec, &fa, NULL, argv, envp);
+  posix_spawn_file_actions_destroy (&fa);
+
+  if (e)
+    {
+      errno = e;
+      return -1;
+    }
+
+  return pid;
+}
+
+static int
+hook_start_child (const char *exec, const char *protocol,
+		  const char *hook_string, struct hook_stats *stats,
+		  struct hook_env *env, char **argv)
+{
+  btime t = hook_clock ();
+  pid_t pid = hook_spawn (exec, argv, hook_env_vector (env), -1);
+
+  if (pid < 0)
+    {
+      ERRNO_PRINT("%s: spawn failed [%s]", hook_string)
+      if (stats != NULL)
+	stats->failures++;
+      return 1;
+    }
+
+  hook_stats_spawn (stats, hook_clock () - t);
+
+  struct hook_child *c = mb_alloc (hook_pool, sizeof(struct hook_child)
+				   + strlen (protocol) + 1);
+  c->pid = pid;
+  c->hook_string = hook_string;
+  c->stats = stats;
+  c->started = t;
+  c->kill_timer = NULL;
+  strcpy (c->protocol, protocol);
+  add_tail (&hook_child_list, &c->n);
+  hook_child_count++;
+
+  log (L_DEBUG "%s: %s: %u started '%s' in background", protocol,
+       hook_string, pid, exec);
+
+  return 0;
+}
+
+static void
+hook_run_queue (void)
+{
+  while (!EMPTY_LIST(hook_queue) && (hook_child_count < hook_proc_limit ()))
+    {
+      struct hook_queued *q = HEAD(hook_queue);
+
+      rem_node (&q->n);
+      hook_queue_count--;
+
+      hook_start_child (q->exec, q->protocol, q->hook_string, q->stats,
+			&q->env, NULL);
+      mb_free (q);
+    }
+}
+
+/* Collects our own children only, others are waited for by their owners */
+static void
+hook_reap (void)
+{
+  struct hook_child *c, *c2;
+  pid_t pid;
+  int status;
+
+  WALK_LIST_DELSAFE(c, c2, hook_child_list)
+    {
+      while (((pid = waitpid (c->pid, &status, WNOHANG)) < 0) && (errno == EINTR))
+	;
+
+      if (pid == 0)
+	continue;
+
+      if (pid > 0)
+	{
+	  log (L_DEBUG "%s: %s: %u exited with status: %d", c->protocol,
+	       c->hook_string, pid, WEXITSTATUS(status));
+
+	  hook_stats_exit (c->stats, WEXITSTATUS(status),
+			   hook_clock () - c->started);
+	}
+      else
+	log (L_WARN "%s: %s: %u is gone: %m", c->protocol, c->hook_string,
+	     c->pid);
+
+      rem_node (&c->n);
+
+      if (c->kill_timer != NULL)
+	rfree (c->kill_timer);
+      else
+	hook_child_count--;
+
+      mb_free (c);
+    }
+
+  hook_run_queue ();
+}
+
+static int
+hook_run_async (const char *exec, struct hook_execv_data *data)
+{
+  struct hook_stats *s = data->stats;
+
+  if (data->rate != NULL)
+    {
+      if (tbf_limit (data->rate))
+	{
+	  log_rl (&hook_rl_drop, L_WARN "%s: %s: rate limit exceeded, event dropped",
+		  data->protocol, data->hook_string);
+	  if (s != NULL)
+	    s->dropped++;
+	  return 0;
+	}
+    }
+
+  hook_init ();
+
+  if (EMPTY_LIST(hook_queue) && (hook_child_count < hook_proc_limit ()))
+    {
+      hook_start_child (exec, data->protocol, data->hook_string, s,
+			&hook_env_event, data->argv);
+      return 0;
+    }
+
+  if (hook_queue_count >= hook_queue_limit ())
+    {
+      if (s != NULL)
+	s->dropped++;
+      log_rl (&hook_rl_drop, L_WARN "%s: %s: too many hooks waiting, event dropped",
+	      data->protocol, data->hook_string);
+      return 0;
+    }
+
+  /* Queued invocations always get the default argv */
+  uint el = strlen (exec) + 1, pl = strlen (data->protocol) + 1;
+  struct hook_queued *q = mb_alloc (hook_pool, sizeof(struct hook_queued)
+				    + el + pl + hook_env_event.len);
+
+  q->exec = (char *) (q + 1);
+  q->protocol = q->exec + el;
+  q->hook_string = data->hook_string;
+  q->stats = s;
+  q->env.buf = q->protocol + pl;
+  q->env.len = q->env.size = hook_env_event.len;
+  q->env.count = hook_env_event.count;
+
+  memcpy (q->exec, exec, el);
+  memcpy (q->protocol, data->protocol, pl);
+  memcpy (q->env.buf, hook_env_event.buf, hook_env_event.len);
+
+  add_tail (&hook_queue, &q->n);
+  hook_queue_count++;
+
+  if (s != NULL)
+    {
+      s->queued++;
+      s->queue_max = MAX(s->queue_max, hook_queue_count);
+    }
+
+  log (L_DEBUG "%s: %s: queued '%s' (%u running)", data->protocol,
+       data->hook_string, exec, hook_child_count);
+
+  return 0;
+}
+
+/*
+ *	Persistent hook workers
+ */
+
+struct hook_worker
+{
+  resource r;
+  node n;			/* Node in hook_worker_list */
+  sock *sk;			/* Our end of the stream, NULL if not running */
+  pid_t pid;
+  char *exec;
+  char *protocol;
+  const char *hook_string;
+  u32 flags;			/* HOOK_F_* of the hook being served */
+  u32 index;			/* EVENT_INDEX of the records queued last */
+  u32 seq;			/* Sequence number of the last record sent */
+  bird_clock_t last_spawn;
+  struct hook_reply reply;	/* Reply being received */
+  uint rpos;
+  byte *tbuf;			/* Records not yet written to the worker */
+  uint tlen, tsize;
+  uint tout;			/* Leading part of tbuf being written by sk */
+  hook_reply_hook reply_hook;	/* Receives replies to deferred records */
+  void *reply_data;
+  struct hook_stats *stats;
+};
+
+static struct hook_worker *hook_glob_workers[MAX_HOOKS];
+static struct tbf hook_glob_rate[MAX_HOOKS];
+static struct hook_stats hook_glob_stats[MAX_HOOKS];
+
+static void
+hook_worker_kill_timer (timer *tm)
+{
+  struct hook_child *c = tm->data;
+
+  log (L_WARN "%s: %s: worker %u did not exit, killing it", c->protocol,
+       c->hook_string, c->pid);
+  kill (c->pid, SIGKILL);
+}
+
+/*
+ * Terminates the worker process @pid. It is collected by hook_reap() like
+ * asynchronous hooks, so that no zombie is left behind, and killed if it
+ * does not exit within HOOK_WORKER_STOP_WAIT seconds after SIGTERM.
+ */
+static void
+hook_worker_kill (struct hook_worker *w, pid_t pid)
+{
+  struct hook_child *c = mb_alloc (hook_pool, sizeof(struct hook_child)
+				   + strlen (w->protocol) + 1);
+  c->pid = pid;
+  c->hook_string = w->hook_string;
+  c->stats = NULL;
+  c->started = hook_clock ();
+  strcpy (c->protocol, w->protocol);
+  add_tail (&hook_child_list, &c->n);
+
+  c->kill_timer = tm_new_set (hook_pool, hook_worker_kill_timer, c, 0, 0);
+  tm_start (c->kill_timer, HOOK_WORKER_STOP_WAIT);
+
+  kill (pid, SIGTERM);
+
+  /* It may have exited before it was listed */
+  hook_reap ();
+}
+
+static void
+hook_worker_stop (struct hook_worker *w)
+{
+  if (w->sk != NULL)
+    {
+      rfree (w->sk);
+      w->sk = NULL;
+    }
+
+  if (w->pid > 0)
+    {
+      hook_worker_kill (w, w->pid);
+      w->pid = 0;
+    }
+
+  w->rpos = 0;
+  w->tlen = 0;
+  w->tout = 0;
+}
+
+static void
+hook_worker_free (resource *r)
+{
+  struct hook_worker *w = (struct hook_worker *) r;
+
+  hook_worker_stop (w);
+  rem_node (&w->n);
+  mb_free (w->exec);
+  mb_free (w->protocol);
+  xfree (w->tbuf);
+}
+
+static void
+hook_worker_dump (resource *r)
+{
+  struct hook_worker *w = (struct hook_worker *) r;
+
+  debug ("(%s %s pid %d seq %u queued %u) '%s'\n", w->protocol,
+	 w->hook_string, (int) w->pid, w->seq, w->tlen, w->exec);
+}
+
+static struct resclass hook_worker_class =
+  { "Hook worker", sizeof(struct hook_worker), hook_worker_free,
+      hook_worker_dump, NULL, NULL };
+
+static inline int
+hook_worker_tx_busy (struct hook_worker *w)
+{
+  return w->sk->ttx != w->sk->tpos;
+}
+
+/*
+ * Waits for a reply of a synchronous hook. Records still being written
+ * are sent meanwhile, the worker cannot answer before getting them.
+ */
+static int
+hook_worker_poll (struct hook_worker *w)
+{
+  struct pollfd pfd =
+    { .fd = w->sk->fd, .events = POLLIN };
+  int r;
+
+  if (hook_worker_tx_busy (w))
+    pfd.events |= POLLOUT;
+
+  while ((r = poll (&pfd, 1, HOOK_WORKER_TIMEOUT)) < 0 && errno == EINTR)
+    ;
+
+  if ((r > 0) && (pfd.revents & POLLOUT))
+    {
+      sk_write (w->sk);
+
+      if (w->sk == NULL)
+	return -1;
+    }
+
+  return r;
+}
+
+/*
+ * Reads one reply from the worker. Returns 1 when a complete reply is
+ * in @w->reply, 0 if none is available yet and -1 if the worker is gone.
+ * With @wait set, blocks up to HOOK_WORKER_TIMEOUT for more data.
+ */
+static int
+hook_worker_read (struct hook_worker *w, int wait)
+{
+  byte *buf = (byte *) &w->reply;
+
+  while (w->rpos < sizeof(struct hook_reply))
+    {
+      int c = read (w->sk->fd, buf + w->rpos, sizeof(struct hook_reply) - w->rpos);
+
+      if (c > 0)
+	{
+	  w->rpos += c;
+	  continue;
+	}
+
+      if (c == 0)
+	return -1;
+
+      if (errno == EINTR)
+	continue;
+
+      if (errno != EAGAIN)
+	return -1;
+
+      if (!wait)
+	return 0;
+
+      c = hook_worker_poll (w);
+
+      if (c <= 0)
+	return c;
+    }
+
+  w->rpos = 0;
+  w->reply.status &= 0xff;
+  return 1;
+}
+
+/* Drops the records written out, keeps those queued meanwhile */
+static void
+hook_worker_sent (struct hook_worker *w)
+{
+  memmove (w->tbuf, w->tbuf + w->tout, w->tlen - w->tout);
+  w->tlen -= w->tout;
+  w->tout = 0;
+}
+
+static void
+hook_worker_tx (sock *sk)
+{
+  hook_worker_sent (sk->data);
+}
+
+static void
+hook_worker_err (sock *sk, int err UNUSED)
+{
+  struct hook_worker *w = sk->data;
+
+  log (L_ERR "%s: %s: failed sending events to worker %d", w->protocol,
+       w->hook_string, (int) w->pid);
+  hook_worker_stop (w);
+}
+
+/*
+ * Writes out all queued records. What the worker does not take at once
+ * is left in @w->tbuf for the socket, which sends it when the worker is
+ * ready and calls hook_worker_tx(). On failure the worker is stopped and
+ * the records are lost, their replies never arrive.
+ */
+int
+hook_worker_flush (struct hook_worker *w)
 {
-  const char inputfile[] = "/dev/null";
+  sock *sk = w->sk;
+
+  if (sk == NULL)
+    return -1;
+
+  if (w->tout == w->tlen)
+    return 0;
 
-  if (close (STDIN_FILENO) < 0)
+  w->tout = w->tlen;
+
+  /* Still writing, the new records follow */
+  if (hook_worker_tx_busy (w))
     {
-      return 1;
+      sk->tpos = w->tbuf + w->tout;
+      return 0;
     }
-  else
+
+  sk->tbuf = w->tbuf;
+
+  int r = sk_send (sk, w->tout);
+
+  if (r < 0)
+    return -1;
+
+  if (r > 0)
+    hook_worker_sent (w);
+
+  return 0;
+}
+
+static void
+hook_worker_dispatch (struct hook_worker *w)
+{
+  hook_check_status (w->reply.status, w->flags, w->protocol, w->hook_string);
+  hook_stats_exit (w->stats, w->reply.status, -1);
+
+  if (w->reply_hook != NULL)
+    w->reply_hook (w->reply_data, w->index, w->reply.seq, w->reply.status);
+}
+
+static int
+hook_worker_rx (sock *sk, int size UNUSED)
+{
+  struct hook_worker *w = sk->data;
+  int r;
+
+  while ((r = hook_worker_read (w, 0)) > 0)
+    hook_worker_dispatch (w);
+
+  if (r < 0)
     {
-      if (open (inputfile, O_RDONLY
-#if defined O_LARGEFILE
-		| O_LARGEFILE
-#endif
-		) < 0)
-	{
-	  log (L_ERR "ERROR: could not open %s", inputfile);
-	}
+      log (L_WARN "%s: %s: worker %d exited", w->protocol, w->hook_string,
+	   (int) w->pid);
+      hook_worker_stop (w);
     }
 
   return 0;
 }
 
-int
-do_execv (const char *exec, u32 index, struct hook_execv_data *data)
+static int
+hook_worker_start (struct hook_worker *w)
 {
+  int fd[2];
   pid_t c_pid;
 
-  if (data->pre != NULL)
+  w->last_spawn = now;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fd) < 0)
     {
-      data->pre (index, data->data);
+      ERRNO_PRINT("%s: socketpair failed [%s]", w->hook_string)
+      return -1;
     }
 
-  if (data->add != NULL)
+  fcntl (fd[0], F_SETFD, FD_CLOEXEC);
+  fcntl (fd[1], F_SETFD, FD_CLOEXEC);
+
+  btime t = hook_clock ();
+
+  if ((c_pid = hook_spawn (w->exec, NULL, hook_env_vector (NULL), fd[1])) < 0)
+    {
+      ERRNO_PRINT("%s: spawn failed [%s]", w->hook_string)
+      close (fd[0]);
+      close (fd[1]);
+      return -1;
+    }
+
+  hook_stats_spawn (w->stats, hook_clock () - t);
+
+  close (fd[1]);
+
+  sock *sk = sk_new (hook_pool);
+  sk->type = SK_MAGIC;
+  sk->rx_hook = hook_worker_rx;
+  sk->tx_hook = hook_worker_tx;
+  sk->err_hook = hook_worker_err;
+  sk->data = w;
+  sk->fd = fd[0];
+
+  if (sk_open (sk) < 0)
     {
-      data->add (index, data->add_data);
+      log (L_ERR "%s: %s: cannot register worker socket", w->protocol,
+	   w->hook_string);
+      rfree (sk);
+      hook_worker_kill (w, c_pid);
+      return -1;
     }
 
-  if ((c_pid = fork ()) == (pid_t) -1)
+  w->sk = sk;
+  w->pid = c_pid;
+  w->rpos = 0;
+
+  log (L_DEBUG "%s: %s: %u started persistent worker '%s'", w->protocol,
+       w->hook_string, c_pid, w->exec);
+
+  return 0;
+}
+
+static struct hook_worker *
+hook_worker_get (const char *exec, struct hook_execv_data *data)
+{
+  struct hook_worker *w = *data->worker;
+
+  if (w != NULL && strcmp (w->exec, exec))
+    hook_worker_release (data->worker);
+
+  if (*data->worker == NULL)
     {
-      ERRNO_PRINT("%s: fork failed [%s]", data->hook_string)
-      return 1;
+      hook_init ();
+
+      w = ralloc (hook_pool, &hook_worker_class);
+      w->exec = mb_alloc (hook_pool, strlen (exec) + 1);
+      strcpy (w->exec, exec);
+      w->protocol = mb_alloc (hook_pool, strlen (data->protocol) + 1);
+      strcpy (w->protocol, data->protocol);
+      w->hook_string = data->hook_string;
+      w->last_spawn = now - HOOK_WORKER_RESPAWN;
+      add_tail (&hook_worker_list, &w->n);
+      *data->worker = w;
+    }
+
+  w->flags = data->flags;
+  w->stats = data->stats;
+
+  if (w->sk == NULL)
+    {
+      if ((now - w->last_spawn) < HOOK_WORKER_RESPAWN)
+	goto fail;
+
+      if (hook_worker_start (w) < 0)
+	goto fail;
+    }
+
+  return w;
+
+fail:
+  if (w->stats != NULL)
+    w->stats->failures++;
+  return NULL;
+}
+
+void
+hook_worker_release (struct hook_worker **wp)
+{
+  if (*wp != NULL)
+    {
+      rfree (*wp);
+      *wp = NULL;
     }
+}
+
+static u32
+hook_worker_next_seq (struct hook_worker *w)
+{
+  /* Zero is never used, so that it can stand for `no record' */
+  if (!++w->seq)
+    ++w->seq;
+
+  return w->seq;
+}
+
+/* Appends a record with the event variables to the transmit buffer */
+static void
+hook_frame_build (struct hook_worker *w, u32 seq, u32 index, u32 flags)
+{
+  struct hook_frame *f;
+  uint len = hook_env_event.len + hook_env_conf.len, size;
 
-  if (0 == c_pid)
+  size = sizeof(struct hook_frame) + len;
+
+  if (w->tlen + size > w->tsize)
     {
-      if (prep_for_exec ())
+      sock *sk = w->sk;
+      int busy = sk && hook_worker_tx_busy (w);
+      uint ttx = busy ? sk->ttx - w->tbuf : 0;
+
+      w->tsize = MAX(w->tlen + size, MAX(2 * w->tsize, 4096));
+      w->tbuf = xrealloc (w->tbuf, w->tsize);
+
+      /* The socket is writing from the old buffer */
+      if (busy)
 	{
-	  _exit (1);
+	  sk->tbuf = w->tbuf;
+	  sk->ttx = w->tbuf + ttx;
+	  sk->tpos = w->tbuf + w->tout;
 	}
-      else
+    }
+
+  f = (struct hook_frame *) (w->tbuf + w->tlen);
+  f->len = len;
+  f->seq = seq;
+  f->index = index;
+  f->flags = flags;
+
+  byte *pos = w->tbuf + w->tlen + sizeof(struct hook_frame);
+
+  memcpy (pos, hook_env_event.buf, hook_env_event.len);
+  memcpy (pos + hook_env_event.len, hook_env_conf.buf, hook_env_conf.len);
+
+  w->tlen += size;
+}
+
+static int
+hook_worker_run (const char *exec, u32 index, struct hook_execv_data *data)
+{
+  struct hook_worker *w = hook_worker_get (exec, data);
+
+  if (w == NULL)
+    return 1;
+
+  struct hook_stats *s = data->stats;
+  int async = data->flags & F_EXECV_FORK;
+  u32 seq = hook_worker_next_seq (w);
+  btime t = hook_clock ();
+
+  if (s != NULL)
+    s->invocations++;
+
+  hook_frame_build (w, seq, index, async ? HOOK_FRAME_F_ASYNC : 0);
+
+  if (hook_worker_flush (w) < 0)
+    goto fail;
+
+  if (async)
+    return 0;
+
+  for (;;)
+    {
+      int r = hook_worker_read (w, 1);
+
+      if (r < 0)
 	{
-	  if (data->argv == NULL)
-	    {
-	      const char *argv[] =
-		{ [0] = exec, [1] = NULL };
-	      execv (exec, (char**) argv);
-	    }
-	  else
-	    {
-	      execv (exec, data->argv);
-	    }
-	  ERRNO_PRINT("%s: execv failed [%s]", data->hook_string)
-	  _exit (1);
+	  log (L_ERR "%s: %s: worker %d exited", data->protocol,
+	       data->hook_string, (int) w->pid);
+	  hook_worker_stop (w);
+	  goto fail;
+	}
+
+      if (r == 0)
+	{
+	  log (L_WARN "%s: %s: worker %d did not answer within %d ms",
+	       data->protocol, data->hook_string, (int) w->pid,
+	       HOOK_WORKER_TIMEOUT);
+	  goto fail;
 	}
+
+      if (w->reply.seq == seq)
+	break;
+
+      /* Late reply to an earlier record */
+      hook_worker_dispatch (w);
+    }
+
+  t = hook_clock () - t;
+
+  if (s != NULL)
+    s->blocked_time += t;
+
+  hook_stats_exit (s, w->reply.status, t);
+
+  log (L_DEBUG "%s: %s: worker %d returned status: %d", data->protocol,
+       data->hook_string, (int) w->pid, w->reply.status);
+
+  hook_check_status (w->reply.status, data->flags, data->protocol,
+		     data->hook_string);
+
+  return w->reply.status;
+
+fail:
+  if (s != NULL)
+    {
+      s->failures++;
+      s->blocked_time += hook_clock () - t;
+    }
+  return 1;
+}
+
+/*
+ * Queues a record for the persistent worker of the hook without sending
+ * it. The reply is passed to @data->reply once it arrives. Returns the
+ * sequence number of the record or 0 if the worker is not available.
+ */
+u32
+hook_worker_queue (const char *exec, u32 index, struct hook_execv_data *data)
+{
+  hook_env_build (index, data);
+
+  struct hook_worker *w = hook_worker_get (exec, data);
+
+  if (w == NULL)
+    return 0;
+
+  w->index = index;
+  w->reply_hook = data->reply;
+  w->reply_data = data->reply_data;
+
+  if (data->stats != NULL)
+    data->stats->invocations++;
+
+  u32 seq = hook_worker_next_seq (w);
+
+  hook_frame_build (w, seq, index, 0);
+
+  return seq;
+}
+
+/*
+ *	In-process plugins
+ *
+ * Shared objects are opened on first use and never closed, so that a
+ * function pointer stays valid across reconfigurations. A library or
+ * symbol which failed to load is remembered too and is not retried
+ * until the daemon is restarted.
+ */
+
+struct hook_plugin
+{
+  node n;
+  char *path;
+  char *symbol;
+  hook_plugin_fn fn;		/* NULL if loading failed */
+};
+
+static list hook_plugin_list;
+
+static struct hook_plugin *
+hook_plugin_get (const char *path, const char *symbol)
+{
+  struct hook_plugin *pl;
+
+  if (hook_plugin_list.head == NULL)
+    init_list (&hook_plugin_list);
+
+  WALK_LIST(pl, hook_plugin_list)
+    if (!strcmp (pl->path, path) && !strcmp (pl->symbol, symbol))
+      return pl;
+
+  pl = xmalloc (sizeof(struct hook_plugin));
+  pl->path = xmalloc (strlen (path) + 1);
+  strcpy (pl->path, path);
+  pl->symbol = xmalloc (strlen (symbol) + 1);
+  strcpy (pl->symbol, symbol);
+  pl->fn = NULL;
+  add_tail (&hook_plugin_list, &pl->n);
+
+  void *handle = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+
+  if (handle == NULL)
+    {
+      log (L_ERR "hook: cannot load plugin '%s': %s", path, dlerror ());
+      return pl;
+    }
+
+  dlerror ();
+  pl->fn = (hook_plugin_fn) dlsym (handle, symbol);
+
+  if (pl->fn == NULL)
+    log (L_ERR "hook: plugin '%s' has no function '%s'", path, symbol);
+  else
+    log (L_DEBUG "hook: loaded plugin '%s', function '%s'", path, symbol);
+
+  return pl;
+}
+
+/* Loads the plugin in advance, returns nonzero if it is not usable */
+int
+hook_plugin_check (const char *path, const char *symbol)
+{
+  return hook_plugin_get (path, symbol)->fn == NULL;
+}
+
+int
+hook_plugin_run (const char *path, const char *symbol, u32 index,
+		 struct hook_execv_data *data, const struct hook_plugin_bgp *bgp,
+		 const struct hook_plugin_route *route)
+{
+  struct hook_stats *s = data->stats;
+  hook_plugin_fn fn = hook_plugin_get (path, symbol)->fn;
+
+  if (s != NULL)
+    s->invocations++;
+
+  if (fn == NULL)
+    {
+      if (s != NULL)
+	s->failures++;
+      return 1;
+    }
+
+  struct hook_plugin_event ev =
+    { .abi = HOOK_PLUGIN_ABI, .index = index, .event = data->hook_string,
+	.protocol = data->protocol, .bgp = bgp, .route = route };
+
+  btime t = hook_clock ();
+  int r = fn (&ev) & 0xff;
+  t = hook_clock () - t;
+
+  if (s != NULL)
+    s->blocked_time += t;
+
+  hook_stats_exit (s, r, t);
+  hook_check_status (r, data->flags, data->protocol, data->hook_string);
+
+  return r;
+}
+
+int
+do_execv (const char *exec, u32 index, struct hook_execv_data *data)
+{
+  pid_t c_pid;
+
+  hook_env_build (index, data);
+
+  if ((data->flags & HOOK_F_COPROC) && data->worker != NULL)
+    {
+      return hook_worker_run (exec, index, data);
     }
 
+  struct hook_stats *s = data->stats;
+
+  if (s != NULL)
+    s->invocations++;
+
   if (data->flags & F_EXECV_FORK)
     {
-      log (L_DEBUG "%s: %s: forked %s to background", data->protocol,
-	   data->hook_string, exec);
-      return 0;
+      return hook_run_async (exec, data);
+    }
+
+  btime t = hook_clock ();
+
+  if ((c_pid = hook_spawn (exec, data->argv, hook_env_vector (&hook_env_event),
+			   -1)) < 0)
+    {
+      ERRNO_PRINT("%s: spawn failed [%s]", data->hook_string)
+      if (s != NULL)
+	s->failures++;
+      return 1;
     }
   else
     {
+      btime ts = hook_clock ();
+      hook_stats_spawn (s, ts - t);
+
       log (L_DEBUG "%s: %s: %u executing '%s'", data->protocol,
 	   data->hook_string, c_pid, exec);
 
@@ -112,21 +1231,24 @@ do_execv (const char *exec, u32 index, struct hook_execv_data *data)
 	      ERRNO_PRINT(
 		  "hook: %s: failed waiting for child process to finish [%s]",
 		  data->hook_string)
+	      if (s != NULL)
+		s->failures++;
 	      return 1;
 	    }
 	}
 
       int r = WEXITSTATUS(status);
+      btime te = hook_clock ();
+
+      if (s != NULL)
+	s->blocked_time += te - ts;
+
+      hook_stats_exit (s, r, te - t);
 
       log (L_DEBUG "%s: %s: %u exited with status: %d", data->protocol,
 	   data->hook_string, c_pid, r);
 
-      if ((r & HOOK_STATUS_RECONFIGURE) && !(data->flags & HOOK_F_NORECONF))
-	{
-	  log (L_DEBUG "%s: %s: external process requesting reconfigure..",
-	       data->protocol, data->hook_string);
-	  async_config ();
-	}
+      hook_check_status (r, data->flags, data->protocol, data->hook_string);
 
       return r;
     }
@@ -147,10 +1269,10 @@ build_hook_envvars (u32 index, void *C)
 {
   struct config *c = (struct config *) C;
   char b[MAX_ENV_SIZE];
-  setenv ("EVENT", GET_HS(index), 1);
+  hook_setenv ("EVENT", GET_HS(index));
   SETENV_INT("%u", b, "EVENT_INDEX", index);
-  setenv ("ERR_MSG", c->err_msg ? c->err_msg : "", 1);
-  setenv ("ERR_FILE_NAME", c->err_file_name ? c->err_file_name : "", 1);
+  hook_setenv ("ERR_MSG", c->err_msg ? c->err_msg : "");
+  hook_setenv ("ERR_FILE_NAME", c->err_file_name ? c->err_file_name : "");
 }
 
 int
@@ -165,6 +1287,11 @@ hook_run (u32 index, void *C, execv_callback add, void *add_data)
 
   struct glob_hook *h = &c->hooks[index];
 
+  if (!(h->ac & HOOK_F_COPROC))
+    {
+      hook_worker_release (&hook_glob_workers[index]);
+    }
+
   if (h->exec != NULL)
     {
       struct hook_execv_data data = hook_execv_mkdata (h->ac,
@@ -175,6 +1302,12 @@ hook_run (u32 index, void *C, execv_callback add, void *add_data)
 
       data.add = add;
       data.add_data = add_data;
+      data.worker = &hook_glob_workers[index];
+      data.rate = hook_rate_limit (&hook_glob_rate[index], h);
+      data.stats = &hook_glob_stats[index];
+
+      if (h->ac & HOOK_F_PLUGIN)
+	return hook_plugin_run (h->exec, h->symbol, index, &data, NULL, NULL);
 
       return do_execv (h->exec, index, &data);
     }
@@ -191,6 +1324,9 @@ hook_setenv_conf_generic (void *c)
 
   char b[MAX_ENV_SIZE];
 
+  hook_env_flush (&hook_env_conf);
+  hook_env_cur = &hook_env_conf;
+
   SETENV_INT("%d", b, "HOOK_STATUS_NONE", HOOK_STATUS_NONE);
   SETENV_INT("%d", b, "HOOK_STATUS_BAD", HOOK_STATUS_BAD);
   SETENV_INT("%d", b, "HOOK_STATUS_RECONFIGURE", HOOK_STATUS_RECONFIGURE);
@@ -208,24 +1344,26 @@ hook_setenv_conf_generic (void *c)
       SETENV_INT("%u", b, "GR_WAIT", (unsigned int )cfg->gr_wait);
 
       /*
-       setenv ("ERR_MSG", cfg->err_msg ? cfg->err_msg : "", 1);
-       setenv ("ERR_FILE_NAME", cfg->err_file_name ? cfg->err_file_name : "", 1);
+       hook_setenv ("ERR_MSG", cfg->err_msg ? cfg->err_msg : "");
+       hook_setenv ("ERR_FILE_NAME", cfg->err_file_name ? cfg->err_file_name : "");
        */
 
-      setenv ("SYSLOG_NAME", cfg->syslog_name ? cfg->syslog_name : "", 1);
-      setenv ("PATH_CONFIG_NAME", cfg->file_name ? cfg->file_name : "", 1);
+      hook_setenv ("SYSLOG_NAME", cfg->syslog_name ? cfg->syslog_name : "");
+      hook_setenv ("PATH_CONFIG_NAME", cfg->file_name ? cfg->file_name : "");
     }
+
+  hook_env_cur = &hook_env_event;
 }
 
 
 int
-filter_hook_dispatcher (u32 index, void *P, void *RT)
+filter_hook_dispatcher (u32 index, void *P, void *RT, u32 flags)
 {
   struct proto *p = (struct proto*) P;
 
   if (IS_PROTO_BGP(p))
     {
-      return bgp_hook_filter (index, P, RT);
+      return bgp_hook_filter (index, P, RT, flags);
     }
   else
     {
@@ -233,3 +1371,98 @@ filter_hook_dispatcher (u32 index, void *P, void *RT)
     }
 }
 
+
+/*
+ * Called before @n counters starting at @s are freed. Running and queued
+ * hooks which would account to them are left uncounted.
+ */
+void
+hook_stats_release (struct hook_stats *s, uint n)
+{
+  struct hook_child *c;
+  struct hook_queued *q;
+
+  if (hook_pool == NULL)
+    return;
+
+  WALK_LIST(c, hook_child_list)
+    if (c->stats >= s && c->stats < s + n)
+      c->stats = NULL;
+
+  WALK_LIST(q, hook_queue)
+    if (q->stats >= s && q->stats < s + n)
+      q->stats = NULL;
+}
+
+#define HOOK_MS(t)	(uint) ((t) / 1000), (uint) ((t) % 1000)
+
+void
+hook_show_stats (const char *hook_string, const char *exec,
+		 struct hook_stats *s)
+{
+  byte buf[512], *pos;
+  uint i;
+
+  cli_msg (-1021, "  %s: %s", hook_string, exec ? exec : "(not configured)");
+  cli_msg (-1021, "    Invocations:    %u (%u failed, %u dropped, %u queued, max queue %u)",
+	   s->invocations, s->failures, s->dropped, s->queued, s->queue_max);
+
+  pos = buf;
+  for (i = 0; i < HOOK_STATS_EXITS - 1; i++)
+    if (s->exits[i])
+      pos += bsprintf (pos, " %u: %u", i, s->exits[i]);
+  if (s->exits[i])
+    pos += bsprintf (pos, " other: %u", s->exits[i]);
+  *pos = 0;
+  cli_msg (-1021, "    Exit codes:    %s", (pos != buf) ? (char *) buf : " -");
+
+  if (s->spawns)
+    cli_msg (-1021, "    Spawn time:     avg %u.%03u ms, max %u.%03u ms",
+	     HOOK_MS(s->spawn_time / s->spawns), HOOK_MS(s->spawn_max));
+
+  if (s->completions)
+    cli_msg (-1021, "    Wall time:      avg %u.%03u ms, max %u.%03u ms",
+	     HOOK_MS(s->wall_time / s->completions), HOOK_MS(s->wall_max));
+
+  cli_msg (-1021, "    Blocked loop:   %u.%03u ms", HOOK_MS(s->blocked_time));
+
+  if (s->completions)
+    {
+      pos = buf;
+      for (i = 0; i < HOOK_STATS_HIST - 1; i++)
+	if (s->hist[i])
+	  pos += bsprintf (pos, " <%u: %u", 1 << i, s->hist[i]);
+      if (s->hist[i])
+	pos += bsprintf (pos, " >=%u: %u", 1 << (i - 1), s->hist[i]);
+      *pos = 0;
+      cli_msg (-1021, "    Wall time [ms]:%s", buf);
+    }
+}
+
+static void
+hook_show_proto (struct proto *p, uint arg UNUSED, int cnt UNUSED)
+{
+  if (IS_PROTO_BGP(p))
+    bgp_show_hooks (p);
+}
+
+void
+hook_show_cmd (struct proto_spec *ps)
+{
+  /* Without a protocol, the global hooks are shown as well */
+  if (ps->patt && !ps->ptr)
+    {
+      uint i;
+
+      cli_msg (-1021, "global:");
+      cli_msg (-1021, "  Processes:        %u running (limit %u), %u queued (limit %u)",
+	       hook_child_count, hook_proc_limit (), hook_queue_count,
+	       hook_queue_limit ());
+
+      for (i = 1; i < MAX_HOOKS; i++)
+	if (config->hooks[i].exec || hook_glob_stats[i].invocations)
+	  hook_show_stats (GET_HS(i), config->hooks[i].exec, &hook_glob_stats[i]);
+    }
+
+  proto_apply_cmd (*ps, hook_show_proto, 0, 0);
+}
@@ -19,7 +19,9 @@
 struct glob_hook
 {
   unsigned int ac;
-  char *exec;
+  char *exec;			/* Program, or shared object of a plugin */
+  char *symbol;			/* Function of a plugin, NULL for programs */
+  u32 rate;			/* Asynchronous invocations per second, 0 = unlimited */
 };
 
 struct glob_hook_config
@@ -32,6 +34,13 @@ struct glob_hook_config
 typedef void
 (*execv_callback) (u32 index, void *d);
 
+struct hook_worker;
+struct hook_stats;
+struct proto_spec;
+
+typedef void
+(*hook_reply_hook) (void *data, u32 index, u32 seq, int status);
+
 struct hook_execv_data
 {
   execv_callback pre, add;
@@ -40,17 +49,27 @@ struct hook_execv_data
   const char *protocol;
   char **argv;
   u32 flags;
+  struct hook_worker **worker;	/* Slot holding the persistent worker, if any */
+  hook_reply_hook reply;	/* Receives replies to queued records */
+  void *reply_data;
+  struct tbf *rate;		/* Rate limit of asynchronous invocations */
+  struct hook_stats *stats;	/* Counters of the hook, if kept */
 };
 
 void
 hook_setenv_conf_generic (void *C);
+void
+hook_setenv (const char *name, const char *value);
 
 #define HOOK_F_ASYNC		(u32)1 << 1
 #define HOOK_F_NORECONF		(u32)1 << 2
+#define HOOK_F_COPROC		(u32)1 << 3
+#define HOOK_F_PLUGIN		(u32)1 << 4
 
 #define HOOK_STATUS_NONE	(int)0
 #define HOOK_STATUS_BAD		(int)1 << 1
 #define HOOK_STATUS_RECONFIGURE	(int)1 << 2
+#define HOOK_STATUS_DEFERRED	(int)1 << 8	/* Internal, the verdict will be delivered later */
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -59,16 +78,16 @@ hook_setenv_conf_generic (void *C);
 #define GET_HS(a) hook_strings[a]
 #define ERRNO_STRING char __b[1024];strerror_r(errno,__b,1024);
 #define ERRNO_PRINT(m,e){ERRNO_STRING;log(L_ERR m,e,__b,errno);}
-#define SETENV_INT(a,b,c,d){snprintf(b,sizeof(b),a,d);setenv(c,b,1);}
+#define SETENV_INT(a,b,c,d){snprintf(b,sizeof(b),a,d);hook_setenv(c,b);}
 
 #ifdef IPV6
-#define SETENV_IPTOSTR(a,c){u16*ip=(u16*)c;snprintf(b, sizeof(b),"%x:%x:%x:%x:%x:%x:%x:%x",ip[1],ip[0],ip[3],ip[2],ip[5],ip[4],ip[7],ip[6]);setenv(a,b,1);}
+#define SETENV_IPTOSTR(a,c){u16*ip=(u16*)c;snprintf(b, sizeof(b),"%x:%x:%x:%x:%x:%x:%x:%x",ip[1],ip[0],ip[3],ip[2],ip[5],ip[4],ip[7],ip[6]);hook_setenv(a,b);}
 #else
-#define SETENV_IPTOSTR(a,c){u8*ip=(u8*)c;snprintf(b, sizeof(b),"%hhu.%hhu.%hhu.%hhu",ip[3],ip[2],ip[1],ip[0]);setenv(a,b,1);}
+#define SETENV_IPTOSTR(a,c){u8*ip=(u8*)c;snprintf(b, sizeof(b),"%hhu.%hhu.%hhu.%hhu",ip[3],ip[2],ip[1],ip[0]);hook_setenv(a,b);}
 #endif
 
-#define HOOK_PARSEOPT(a,b,c,d){if(c){d->hc.hooks[a].ac|=c;}d->hc.hooks[a].exec=b;}
-#define HOOK_PARSEOPT2(a,b,c,d){if(c){d->hooks[a].ac|=c;}d->hooks[a].exec=b;}
+#define HOOK_PARSEOPT(a,b,s,r,c,d){if(c){d->hc.hooks[a].ac|=c;}d->hc.hooks[a].exec=b;d->hc.hooks[a].symbol=s;d->hc.hooks[a].rate=r;}
+#define HOOK_PARSEOPT2(a,b,s,r,c,d){if(c){d->hooks[a].ac|=c;}d->hooks[a].exec=b;d->hooks[a].symbol=s;d->hooks[a].rate=r;}
 
 #define F_EXECV_FORK	(u32)1 << 1
 
@@ -81,6 +100,118 @@ hook_execv_mkdata (u32 ac, void *pre, void *data, const char *hs,
 int
 hook_run (u32 index, void *C, execv_callback add, void* add_data);
 
+/* Token bucket @f limiting @h to its `rate', NULL if unlimited */
+static inline struct tbf *
+hook_rate_limit (struct tbf *f, struct glob_hook *h)
+{
+  if (!h->rate)
+    return NULL;
+
+  f->rate = f->burst = MIN_(h->rate, 0xffff);
+  return f;
+}
+
+/*
+ * Persistent hook workers
+ *
+ * A hook configured as `persistent' is served by a single long-lived
+ * process, started on first use, instead of a fork+exec per event. The
+ * worker reads one record per event on its stdin and writes one reply
+ * per record to its stdout. A record is a struct hook_frame followed by
+ * @len bytes of NUL-terminated KEY=VALUE strings, i.e. the variables a
+ * script would be given for the event. The environment inherited from
+ * the daemon is passed only once, when the worker is started. A reply
+ * carries the sequence number of the record and the HOOK_STATUS_* bits a
+ * script would return as its exit code. All fields are in host byte
+ * order.
+ */
+
+struct hook_frame
+{
+  u32 len;			/* Length of the variable block following the header */
+  u32 seq;			/* Sequence number, echoed back in the reply */
+  u32 index;			/* EVENT_INDEX */
+  u32 flags;			/* HOOK_FRAME_F_* */
+};
+
+#define HOOK_FRAME_F_ASYNC	0x1	/* Asynchronous hook, the daemon does not wait for the reply */
+
+struct hook_reply
+{
+  u32 seq;
+  s32 status;
+};
+
+#define HOOK_PROC_LIMIT		32	/* Default maximum of running asynchronous hooks */
+#define HOOK_QUEUE_LIMIT	1024	/* Default maximum of waiting asynchronous hooks */
+
+#define HOOK_WORKER_TIMEOUT	5000	/* How long to wait for a synchronous reply [ms] */
+#define HOOK_WORKER_RESPAWN	1	/* Minimum delay between worker restarts [s] */
+#define HOOK_WORKER_STOP_WAIT	1	/* How long a stopped worker may take to exit [s] */
+
+void
+hook_worker_release (struct hook_worker **wp);
+u32
+hook_worker_queue (const char *exec, u32 index, struct hook_execv_data *data);
+int
+hook_worker_flush (struct hook_worker *w);
+
+/*
+ * In-process plugins, see hook-plugin.h
+ */
+
+#include <string.h>
+#include "sysdep/unix/hook-plugin.h"
+
+int
+hook_plugin_check (const char *path, const char *symbol);
+int
+hook_plugin_run (const char *path, const char *symbol, u32 index,
+		 struct hook_execv_data *data, const struct hook_plugin_bgp *bgp,
+		 const struct hook_plugin_route *route);
+
+static inline void
+hook_plugin_ip (uint8_t *dst, ip_addr a)
+{
+  ipa_hton(a);
+  memcpy (dst, &a, sizeof(a));
+}
+
+/*
+ * Hook statistics
+ *
+ * Kept for each global hook and for each hook of a BGP protocol and
+ * shown by `show hooks'. Times are in microseconds. The main loop is
+ * blocked while a synchronous hook runs or while a persistent worker is
+ * waited for.
+ */
+
+#define HOOK_STATS_EXITS	8	/* Exit codes 0-6 and the rest */
+#define HOOK_STATS_HIST		12	/* Wall time buckets <1, <2, <4 .. <1024 and >=1024 ms */
+
+struct hook_stats
+{
+  u32 invocations;		/* Events passed to the hook */
+  u32 failures;			/* Spawn failures, lost workers and timeouts */
+  u32 dropped;			/* Asynchronous events over the rate or queue limit */
+  u32 queued;			/* Asynchronous events which had to wait */
+  u32 queue_max;		/* Longest queue seen by the hook */
+  u32 spawns, completions;
+  u32 exits[HOOK_STATS_EXITS];
+  u32 hist[HOOK_STATS_HIST];
+  btime spawn_time, spawn_max;	/* Spent in posix_spawn() */
+  btime wall_time, wall_max;	/* From spawn until exit */
+  btime blocked_time;		/* Main loop waiting for the hook */
+};
+
+void
+hook_stats_release (struct hook_stats *s, uint n);
+void
+hook_show_stats (const char *hook_string, const char *exec,
+		 struct hook_stats *s);
+void
+hook_show_cmd (struct proto_spec *ps);
+
 #include <stdlib.h>
 
 #ifndef WEXITSTATUS
@@ -98,11 +229,17 @@ hook_run (u32 index, void *C, execv_callback add, void* add_data);
 #define BGP_HOOK_IMPORT			0x18
 #define BGP_HOOK_EXPORT			0x19
 
+#define HOOK_FILTER_F_SILENT		0x1	/* Checking an old route, no event should be generated */
+#define HOOK_FILTER_F_KEEP		0x2	/* The route stays exported in place of a deferred one */
+
 typedef int
-generic_hook_filter (u32 index, void *P, void *RT);
+generic_hook_filter (u32 index, void *P, void *RT, u32 flags);
 
 generic_hook_filter filter_hook_dispatcher, bgp_hook_filter;
 
+void
+bgp_show_hooks (void *P);
+
 
 #define IS_PROTO_BGP(p)	(p->proto->name[0] == 0x42 && p->proto->name[1] == 0x47)
 
@@ -760,11 +760,11 @@ parse_args(int argc, char **argv)
 }
 
 /*
- *	Hic Est main()
+ *	Hic Est main(), called from bird.c
  */
 
 int
-main(int argc, char **argv)
+unix_main(int argc, char **argv)
 {
 #ifdef HAVE_LIBDMALLOC
   if (!getenv("DMALLOC_OPTIONS"))